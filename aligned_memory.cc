@@ -0,0 +1,160 @@
+// aligned_memory.cc
+// Cache line aligned allocations, backed by huge pages when large.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <new>
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "aligned_memory.h"
+
+using namespace std;
+
+// The NUMA node the calling thread's large allocations go to, or -1.
+static thread_local int allocation_node = -1;
+
+// Counts the nodes from the list of those online, given as ranges such as
+// "0-3,6".
+static int count_numa_nodes()
+{
+  FILE* file = fopen("/sys/devices/system/node/online", "r");
+  if (!file)
+    return 1;
+  int highest = 0;
+  int node;
+  while (fscanf(file, "%d", &node) == 1) {
+    if (node > highest)
+      highest = node;
+    if (fgetc(file) == EOF)
+      break;
+  }
+  fclose(file);
+  return highest + 1;
+}
+
+int numa_nodes()
+{
+  static const int nodes = count_numa_nodes();
+  return nodes;
+}
+
+int set_allocation_node(int node)
+{
+  const int previous = allocation_node;
+  allocation_node = node;
+  return previous;
+}
+
+// Prefers the node set for the calling thread, if any, for the pages of
+// [memory, memory + size) not yet touched.
+static void place(void* memory, size_t size)
+{
+  if (allocation_node >= 0 && allocation_node < 64) {
+    const unsigned long nodes = 1UL << allocation_node;
+    syscall(SYS_mbind, memory, size, MPOL_PREFERRED, &nodes,
+        sizeof(nodes) * 8, 0);
+  }
+}
+
+// Maps size bytes, a multiple of a huge page, starting on a huge page.
+static char* map_huge_aligned(size_t size, int protection, int flags)
+{
+  // mmap only aligns to a base page, so map a huge page more than needed
+  // and unmap the slack on either side of the first huge page boundary.
+  void* map = mmap(0, size + HUGE_PAGE_SIZE, protection,
+      MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+  if (map == MAP_FAILED)
+    throw bad_alloc();
+  char* const start = static_cast<char*>(map);
+  char* const memory = reinterpret_cast<char*>(
+      (reinterpret_cast<uintptr_t>(start) + HUGE_PAGE_SIZE - 1)
+      / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE);
+  if (memory > start)
+    munmap(start, memory - start);
+  munmap(memory + size, start + HUGE_PAGE_SIZE - memory);
+  return memory;
+}
+
+void* allocate_aligned(size_t bytes)
+{
+  if (bytes < HUGE_PAGE_SIZE) {
+    // aligned_alloc wants a multiple of the alignment.
+    const size_t lines = (bytes + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE;
+    void* memory = aligned_alloc(CACHE_LINE_SIZE,
+        (lines > 0 ? lines : 1) * CACHE_LINE_SIZE);
+    if (!memory)
+      throw bad_alloc();
+    return memory;
+  }
+
+  const size_t size = (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE
+      * HUGE_PAGE_SIZE;
+  char* const memory = map_huge_aligned(size, PROT_READ | PROT_WRITE, 0);
+
+  // Only advice: without transparent huge pages the memory is still good,
+  // and so it is on another node. Nothing has been touched yet, so every
+  // page is placed as asked.
+  madvise(memory, size, MADV_HUGEPAGE);
+  place(memory, size);
+  return memory;
+}
+
+void free_aligned(void* memory, size_t bytes)
+{
+  if (bytes < HUGE_PAGE_SIZE) {
+    free(memory);
+    return;
+  }
+  const size_t size = (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE
+      * HUGE_PAGE_SIZE;
+  munmap(memory, size);
+}
+
+void trim_aligned(void* memory, size_t bytes, size_t keep)
+{
+  if (bytes < HUGE_PAGE_SIZE)
+    return;
+  const size_t size = (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE
+      * HUGE_PAGE_SIZE;
+  const size_t from = (keep + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE
+      * HUGE_PAGE_SIZE;
+  if (from < size)
+    madvise(static_cast<char*>(memory) + from, size - from, MADV_DONTNEED);
+}
+
+void* reserve_memory(size_t bytes)
+{
+  // Reserved address space takes no memory, and none is accounted for it
+  // until it is committed.
+  const size_t size = (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE
+      * HUGE_PAGE_SIZE;
+  return map_huge_aligned(size, PROT_NONE, MAP_NORESERVE);
+}
+
+void commit_memory(void* reservation, size_t from, size_t to)
+{
+  char* const memory = static_cast<char*>(reservation) + from;
+  if (mprotect(memory, to - from, PROT_READ | PROT_WRITE) != 0)
+    throw bad_alloc();
+  madvise(memory, to - from, MADV_HUGEPAGE);
+  place(memory, to - from);
+}
+
+void decommit_memory(void* reservation, size_t from, size_t to)
+{
+  // Dropping the pages first means they read as zero once committed again.
+  char* const memory = static_cast<char*>(reservation) + from;
+  madvise(memory, to - from, MADV_DONTNEED);
+  mprotect(memory, to - from, PROT_NONE);
+}
+
+void release_memory(void* reservation, size_t bytes)
+{
+  const size_t size = (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE
+      * HUGE_PAGE_SIZE;
+  munmap(reservation, size);
+}
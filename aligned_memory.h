@@ -0,0 +1,139 @@
+#ifndef ALIGNED_MEMORY_H
+#define ALIGNED_MEMORY_H
+
+#include <stddef.h>
+#include <new>
+
+/**
+ * Aligned Memory
+ * Allocations that start on a cache line, so that arrays cut into segments
+ * of whole lines keep every segment on lines of its own. Allocations of at
+ * least a huge page are mapped on their own, aligned to a huge page and
+ * advised to the kernel for transparent huge pages, which cuts the TLB
+ * misses of a scan over them by the ratio of the page sizes. Those may
+ * also be placed on a NUMA node of the caller's choosing; see numa_scope.
+ *
+ * An array that is to grow in place can instead reserve address space for
+ * the most it may ever hold and commit it a huge page at a time as it
+ * grows, so that growing never moves what is already there.
+ */
+
+/**
+ * The size of a cache line in bytes.
+ */
+static const size_t CACHE_LINE_SIZE = 64;
+
+/**
+ * The size of a huge page in bytes, and the smallest allocation backed by
+ * huge pages.
+ */
+static const size_t HUGE_PAGE_SIZE = 2 << 20;
+
+/**
+ * Returns bytes bytes of memory starting on a cache line, or a huge page if
+ * bytes is HUGE_PAGE_SIZE or more. Throws std::bad_alloc if there is none.
+ */
+void* allocate_aligned(size_t bytes);
+
+/**
+ * Frees memory returned by allocate_aligned, given the same bytes.
+ */
+void free_aligned(void* memory, size_t bytes);
+
+/**
+ * Hands the pages of an allocation of bytes made by allocate_aligned that
+ * lie wholly past its first keep bytes back to the kernel. They stay
+ * usable, and read as zero when next touched. Does nothing for allocations
+ * smaller than a huge page.
+ */
+void trim_aligned(void* memory, size_t bytes, size_t keep);
+
+/**
+ * Reserves bytes of address space, rounded up to a huge page and starting
+ * on one, none of which may be touched until committed. Throws
+ * std::bad_alloc if there is not enough address space.
+ */
+void* reserve_memory(size_t bytes);
+
+/**
+ * Makes bytes [from, to) of a reservation usable, as zeroed memory that is
+ * backed as it is touched and placed as allocate_aligned would place it.
+ * Both must be multiples of HUGE_PAGE_SIZE. Throws std::bad_alloc if the
+ * kernel refuses.
+ */
+void commit_memory(void* reservation, size_t from, size_t to);
+
+/**
+ * Hands the memory behind bytes [from, to) of a reservation back to the
+ * kernel, leaving them reserved but unusable again. Both must be
+ * multiples of HUGE_PAGE_SIZE.
+ */
+void decommit_memory(void* reservation, size_t from, size_t to);
+
+/**
+ * Frees a reservation of the given bytes, committed or not.
+ */
+void release_memory(void* reservation, size_t bytes);
+
+/**
+ * Returns the number of NUMA nodes of the machine, at least 1.
+ */
+int numa_nodes();
+
+/**
+ * Makes allocate_aligned prefer the given NUMA node for the allocations of
+ * at least a huge page that the calling thread makes from then on, or
+ * leaves their placement to the kernel if node is negative. Returns the
+ * node preferred before.
+ */
+int set_allocation_node(int node);
+
+/**
+ * Prefers a NUMA node for the large allocations of the calling thread for
+ * as long as it lives, as set_allocation_node does.
+ */
+class numa_scope {
+  private:
+    int _previous;
+
+    numa_scope(const numa_scope&);
+    numa_scope& operator=(const numa_scope&);
+
+  public:
+    explicit numa_scope(int node) : _previous(set_allocation_node(node)) {}
+    ~numa_scope() {
+      set_allocation_node(_previous);
+    }
+};
+
+/**
+ * An allocator for standard containers that allocates with
+ * allocate_aligned.
+ */
+template <class T>
+struct aligned_allocator {
+  typedef T value_type;
+
+  aligned_allocator() {}
+  template <class U> aligned_allocator(const aligned_allocator<U>&) {}
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(allocate_aligned(n * sizeof(T)));
+  }
+
+  void deallocate(T* memory, size_t n) {
+    free_aligned(memory, n * sizeof(T));
+  }
+};
+
+template <class T, class U>
+bool operator==(const aligned_allocator<T>&, const aligned_allocator<U>&) {
+  return true;
+}
+
+template <class T, class U>
+bool operator!=(const aligned_allocator<T>&, const aligned_allocator<U>&) {
+  return false;
+}
+
+#endif // ALIGNED_MEMORY_H
@@ -0,0 +1,114 @@
+// bitmap.cc
+// Word-packed bitmap with range counting and searching.
+
+#include <stdint.h>
+#include "bitmap.h"
+
+using namespace std;
+
+bitmap::bitmap()
+  : _size(0)
+{
+}
+
+void bitmap::resize(uint32_t size)
+{
+  // Clear the bits past the current end in the last word, since they are
+  // about to become part of the bitmap.
+  if (size > _size && _size % WORD_BITS != 0)
+    _words[_size / WORD_BITS] &= ~(~uint64_t(0) << (_size % WORD_BITS));
+  _words.resize(words(size), 0);
+  _size = size;
+  if (_size % WORD_BITS != 0)
+    _words.back() &= ~(~uint64_t(0) << (_size % WORD_BITS));
+}
+
+void bitmap::reserve(uint32_t size) {
+  _words.reserve(words(size));
+}
+
+void bitmap::attach(uint64_t* data, uint32_t size)
+{
+  _words.attach(data, words(size));
+  _size = size;
+  if (_size % WORD_BITS != 0)
+    _words.back() &= ~(~uint64_t(0) << (_size % WORD_BITS));
+}
+
+uint32_t bitmap::size() const {
+  return _size;
+}
+
+void bitmap::set_range(uint32_t first, uint32_t last)
+{
+  if (first >= last)
+    return;
+  for (uint32_t w = first / WORD_BITS; w <= (last - 1) / WORD_BITS; ++w)
+    _words[w] |= range_mask(w, first, last);
+}
+
+void bitmap::clear_range(uint32_t first, uint32_t last)
+{
+  if (first >= last)
+    return;
+  for (uint32_t w = first / WORD_BITS; w <= (last - 1) / WORD_BITS; ++w)
+    _words[w] &= ~range_mask(w, first, last);
+}
+
+uint32_t bitmap::popcount(uint32_t first, uint32_t last) const
+{
+  if (first >= last)
+    return 0;
+  uint32_t count = 0;
+  for (uint32_t w = first / WORD_BITS; w <= (last - 1) / WORD_BITS; ++w)
+    count += __builtin_popcountll(_words[w] & range_mask(w, first, last));
+  return count;
+}
+
+uint32_t bitmap::find_next_set(uint32_t first, uint32_t last) const
+{
+  if (first >= last)
+    return last;
+  for (uint32_t w = first / WORD_BITS; w <= (last - 1) / WORD_BITS; ++w) {
+    const uint64_t bits = _words[w] & range_mask(w, first, last);
+    if (bits != 0)
+      return w * WORD_BITS + __builtin_ctzll(bits);
+  }
+  return last;
+}
+
+uint32_t bitmap::find_next_clear(uint32_t first, uint32_t last) const
+{
+  if (first >= last)
+    return last;
+  for (uint32_t w = first / WORD_BITS; w <= (last - 1) / WORD_BITS; ++w) {
+    const uint64_t bits = ~_words[w] & range_mask(w, first, last);
+    if (bits != 0)
+      return w * WORD_BITS + __builtin_ctzll(bits);
+  }
+  return last;
+}
+
+uint32_t bitmap::find_prev_set(uint32_t first, uint32_t last) const
+{
+  if (first >= last)
+    return last;
+  for (uint32_t w = (last - 1) / WORD_BITS + 1; w-- > first / WORD_BITS; ) {
+    const uint64_t bits = _words[w] & range_mask(w, first, last);
+    if (bits != 0)
+      return w * WORD_BITS + WORD_BITS - 1 - __builtin_clzll(bits);
+  }
+  return last;
+}
+
+uint32_t bitmap::find_prev_clear(uint32_t first, uint32_t last) const
+{
+  if (first >= last)
+    return last;
+  for (uint32_t w = (last - 1) / WORD_BITS + 1; w-- > first / WORD_BITS; ) {
+    const uint64_t bits = ~_words[w] & range_mask(w, first, last);
+    if (bits != 0)
+      return w * WORD_BITS + WORD_BITS - 1 - __builtin_clzll(bits);
+  }
+  return last;
+}
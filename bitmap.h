@@ -0,0 +1,161 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdint.h>
+#include "buffer.h"
+
+/**
+ * Bitmap
+ * A fixed-size sequence of bits packed into 64-bit words. Besides testing
+ * and setting single bits, it counts and searches ranges of bits whole words
+ * at a time, with popcount for counting and count-trailing/leading-zeros for
+ * finding the next or previous set bit. Ranges are half-open: [first, last).
+ */
+class bitmap {
+  public:
+    static const uint32_t WORD_BITS = 64;
+
+  private:
+    // The bits, least significant bit first. Bits past size() are clear.
+    buffer<uint64_t> _words;
+
+    // The number of bits in the bitmap.
+    uint32_t _size;
+
+  public:
+    /**
+     * Constructs an empty bitmap.
+     */
+    bitmap();
+
+    /**
+     * Changes the number of bits in the bitmap. Bits added are clear.
+     */
+    void resize(uint32_t size);
+
+    /**
+     * Reserves address space for the bitmap to grow in place up to the given
+     * number of bits; see buffer::reserve.
+     */
+    void reserve(uint32_t size);
+
+    /**
+     * Makes the bitmap hold the given number of bits in the words at data
+     * from now on, as for a mapped file. The words past the last one in use
+     * must be clear; the bits past size in the last one are cleared here.
+     */
+    void attach(uint64_t* data, uint32_t size);
+
+    /**
+     * Returns the number of bits in the bitmap.
+     */
+    uint32_t size() const;
+
+    /**
+     * Returns the words holding the bits, and the number of words needed
+     * for a bitmap of the given size.
+     */
+    const uint64_t* data() const { return _words.data(); }
+    static uint32_t words(uint32_t size) {
+      return (size + WORD_BITS - 1) / WORD_BITS;
+    }
+
+    /**
+     * Returns whether bit n is set.
+     */
+    bool test(uint32_t n) const {
+      return (_words[n / WORD_BITS] >> (n % WORD_BITS)) & 1;
+    }
+
+    /** Sets bit n. */
+    void set(uint32_t n) {
+      _words[n / WORD_BITS] |= uint64_t(1) << (n % WORD_BITS);
+    }
+
+    /**
+     * Sets bit n with an atomic or, so that threads may set bits of the
+     * same word at once.
+     */
+    void set_atomic(uint32_t n) {
+      uint64_t& word = _words[n / WORD_BITS];
+      const uint64_t bit = uint64_t(1) << (n % WORD_BITS);
+      if (!(__atomic_load_n(&word, __ATOMIC_RELAXED) & bit))
+        __atomic_fetch_or(&word, bit, __ATOMIC_RELAXED);
+    }
+
+    /** Clears bit n. */
+    void clear(uint32_t n) {
+      _words[n / WORD_BITS] &= ~(uint64_t(1) << (n % WORD_BITS));
+    }
+
+    /**
+     * Replaces word w, i.e. bits [64w, 64w + 64), with bits. The bits past
+     * size() must be clear.
+     */
+    void set_word(uint32_t w, uint64_t bits) {
+      _words[w] = bits;
+    }
+
+    /**
+     * Returns the count bits starting at bit first as the low bits of a
+     * word. The bits must all lie within one word.
+     */
+    uint64_t word_bits(uint32_t first, uint32_t count) const {
+      const uint64_t bits = _words[first / WORD_BITS] >> (first % WORD_BITS);
+      return count == WORD_BITS ? bits : bits & ~(~uint64_t(0) << count);
+    }
+
+    /**
+     * Replaces the count bits starting at bit first with the low bits of
+     * bits. The bits must all lie within one word.
+     */
+    void set_bits(uint32_t first, uint32_t count, uint64_t bits) {
+      const uint64_t mask = (count == WORD_BITS ? ~uint64_t(0) :
+          ~(~uint64_t(0) << count)) << (first % WORD_BITS);
+      uint64_t& word = _words[first / WORD_BITS];
+      word = (word & ~mask) | ((bits << (first % WORD_BITS)) & mask);
+    }
+
+    /**
+     * Sets or clears every bit in [first, last).
+     */
+    void set_range(uint32_t first, uint32_t last);
+    void clear_range(uint32_t first, uint32_t last);
+
+    /**
+     * Returns the number of set bits in [first, last).
+     */
+    uint32_t popcount(uint32_t first, uint32_t last) const;
+
+    /**
+     * Returns the first set (or clear) bit in [first, last), or last if there
+     * is none.
+     */
+    uint32_t find_next_set(uint32_t first, uint32_t last) const;
+    uint32_t find_next_clear(uint32_t first, uint32_t last) const;
+
+    /**
+     * Returns the last set (or clear) bit in [first, last), or last if there
+     * is none.
+     */
+    uint32_t find_prev_set(uint32_t first, uint32_t last) const;
+    uint32_t find_prev_clear(uint32_t first, uint32_t last) const;
+
+  private:
+    /**
+     * Returns a mask of the bits of word w that fall within [first, last).
+     */
+    static inline uint64_t range_mask(uint32_t w, uint32_t first,
+        uint32_t last)
+    {
+      const uint32_t lo = w * WORD_BITS;
+      uint64_t mask = ~uint64_t(0);
+      if (first > lo)
+        mask &= ~uint64_t(0) << (first - lo);
+      if (last < lo + WORD_BITS)
+        mask &= ~(~uint64_t(0) << (last - lo));
+      return mask;
+    }
+};
+
+#endif // BITMAP_H
@@ -0,0 +1,206 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include "aligned_memory.h"
+
+/**
+ * Buffer
+ * A fixed-size array that either owns its elements, held in a vector, or
+ * is attached to memory owned by someone else, such as a mapped file. An
+ * attached buffer never allocates or frees: changing its size means
+ * attaching it again to memory of the new size. Owned elements start on a
+ * cache line, and on a huge page once they fill one.
+ *
+ * An owned buffer may also reserve address space for the most elements it
+ * will hold, after which it grows and shrinks in place up to that many,
+ * committing and decommitting huge pages at its end as it goes.
+ */
+template <class T>
+class buffer {
+  private:
+    // The elements of an owned buffer. Empty while attached.
+    std::vector<T, aligned_allocator<T> > _owned;
+
+    // The elements, in _owned or in the attached memory.
+    T* _data;
+
+    // The number of elements.
+    uint32_t _size;
+
+    // Whether _data points at memory owned by someone else.
+    bool _attached;
+
+    // With address space reserved, the elements always start at _data, with
+    // room for _reserved of them, of which the pages of the first
+    // _committed bytes are usable. _reserved is zero otherwise.
+    uint32_t _reserved;
+    size_t _committed;
+
+    // Returns the bytes of n elements, rounded up to a huge page.
+    static size_t huge_pages(uint32_t n) {
+      return (size_t(n) * sizeof(T) + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE *
+        HUGE_PAGE_SIZE;
+    }
+
+    // Resizes within the reservation, committing the pages of elements
+    // added, and decommitting those no element is left on.
+    void resize_reserved(uint32_t size, const T& value) {
+      if (size > _size) {
+        const size_t bytes = huge_pages(size);
+        if (bytes > _committed) {
+          commit_memory(_data, _committed, bytes);
+          _committed = bytes;
+        }
+        std::uninitialized_fill(_data + _size, _data + size, value);
+      } else {
+        for (uint32_t n = size; n < _size; ++n)
+          _data[n].~T();
+        const size_t bytes = huge_pages(size);
+        if (bytes < _committed) {
+          decommit_memory(_data, bytes, _committed);
+          _committed = bytes;
+        }
+      }
+      _size = size;
+    }
+
+    // Frees the reservation along with the elements in it.
+    void release() {
+      for (uint32_t n = 0; n < _size; ++n)
+        _data[n].~T();
+      release_memory(_data, size_t(_reserved) * sizeof(T));
+      _data = 0;
+      _size = 0;
+      _reserved = 0;
+      _committed = 0;
+    }
+
+  public:
+    buffer()
+      : _data(0), _size(0), _attached(false), _reserved(0), _committed(0)
+    {
+    }
+
+    ~buffer() {
+      if (_reserved > 0)
+        release();
+    }
+
+    uint32_t size() const { return _size; }
+    bool attached() const { return _attached; }
+
+    T* data() { return _data; }
+    const T* data() const { return _data; }
+
+    T& operator[](uint32_t n) { return _data[n]; }
+    const T& operator[](uint32_t n) const { return _data[n]; }
+
+    T& back() { return _data[_size - 1]; }
+
+    /**
+     * Changes the number of elements, releasing memory when shrinking.
+     * Elements added are copies of value. An attached buffer is copied into
+     * memory of its own first. Shrinking moves nothing: the elements past
+     * size are dropped in place and the huge pages they leave are handed
+     * back, the vector keeping its capacity to grow into again.
+     */
+    void resize(uint32_t size, const T& value = T()) {
+      if (_reserved > 0) {
+        if (size <= _reserved) {
+          resize_reserved(size, value);
+          return;
+        }
+        // Past the reservation the buffer goes back to a vector.
+        _owned.assign(_data, _data + _size);
+        release();
+      }
+      if (_attached) {
+        _owned.assign(_data, _data + std::min(size, _size));
+        _attached = false;
+      }
+      if (size < _owned.size()) {
+        _owned.erase(_owned.begin() + size, _owned.end());
+        trim_aligned(_owned.data(), _owned.capacity() * sizeof(T),
+            size_t(size) * sizeof(T));
+      } else {
+        _owned.resize(size, value);
+      }
+      _data = _owned.data();
+      _size = size;
+    }
+
+    /**
+     * Sets every element to value. An owned buffer is resized to size first;
+     * an attached one must hold size elements already.
+     */
+    void assign(uint32_t size, const T& value) {
+      if (_attached) {
+        std::fill(_data, _data + _size, value);
+        return;
+      }
+      if (_reserved > 0 && size <= _reserved) {
+        std::fill(_data, _data + std::min(size, _size), value);
+        resize_reserved(size, value);
+        return;
+      }
+      if (_reserved > 0)
+        release();
+      _owned.assign(size, value);
+      _data = _owned.data();
+      _size = size;
+    }
+
+    /**
+     * Makes the buffer use the size elements at data from now on, freeing
+     * any it owned.
+     */
+    void attach(T* data, uint32_t size) {
+      if (_reserved > 0)
+        release();
+      std::vector<T, aligned_allocator<T> >().swap(_owned);
+      _data = data;
+      _size = size;
+      _attached = true;
+    }
+
+    /**
+     * Moves the elements of an owned buffer into address space reserved for
+     * size elements, in which it grows and shrinks in place from then on.
+     * Does nothing for an attached buffer, or one with room for size
+     * elements reserved already.
+     */
+    void reserve(uint32_t size) {
+      if (_attached || size <= _reserved || size <= _size)
+        return;
+      T* const data = static_cast<T*>(reserve_memory(size_t(size) *
+            sizeof(T)));
+      const size_t bytes = huge_pages(_size);
+      commit_memory(data, 0, bytes);
+      std::uninitialized_copy(std::make_move_iterator(_data),
+          std::make_move_iterator(_data + _size), data);
+      const uint32_t n = _size;
+      if (_reserved > 0)
+        release();
+      std::vector<T, aligned_allocator<T> >().swap(_owned);
+      _data = data;
+      _size = n;
+      _reserved = size;
+      _committed = bytes;
+    }
+
+    /**
+     * Returns the number of elements the buffer can hold in place, or zero
+     * if it has no address space reserved.
+     */
+    uint32_t reserved() const { return _reserved; }
+
+  private:
+    buffer(const buffer&);
+    buffer& operator=(const buffer&);
+};
+
+#endif // BUFFER_H
@@ -0,0 +1,151 @@
+// mapped_file.cc
+// A file mapped shared into memory that grows and shrinks in place.
+
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "mapped_file.h"
+
+using namespace std;
+
+mapped_file::mapped_file()
+  : _fd(-1), _data(0), _size(0), _private(false)
+{
+}
+
+mapped_file::~mapped_file()
+{
+  if (_data)
+    munmap(_data, _size);
+  if (_fd >= 0)
+    ::close(_fd);
+}
+
+bool mapped_file::open(const char* path, bool copy_on_write)
+{
+  if (_fd >= 0)
+    return false;
+  const int fd = ::open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    ::close(fd);
+    return false;
+  }
+
+  // An empty file cannot be mapped, so its mapping is made when it first
+  // grows.
+  char* data = 0;
+  if (st.st_size > 0) {
+    void* map = mmap(0, st.st_size, PROT_READ | PROT_WRITE,
+        copy_on_write ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+      ::close(fd);
+      return false;
+    }
+    data = static_cast<char*>(map);
+  }
+  _fd = fd;
+  _data = data;
+  _size = st.st_size;
+  _private = copy_on_write;
+  return true;
+}
+
+bool mapped_file::resize(size_t size)
+{
+  if (_fd < 0 || size == _size)
+    return _fd >= 0;
+
+  // A copy-on-write mapping may lie over less than the whole file, which
+  // is then only grown past its own end.
+  size_t file_size = _size;
+  if (_private) {
+    struct stat st;
+    if (fstat(_fd, &st) != 0)
+      return false;
+    file_size = st.st_size > off_t(_size) ? st.st_size : _size;
+  }
+
+  // Grow the file before the mapping and shrink it after, so that no page
+  // of the mapping is ever past the end of the file.
+  if (size > file_size && ftruncate(_fd, size) != 0)
+    return false;
+  void* map;
+  if (size == 0)
+    map = munmap(_data, _size) == 0 ? 0 : MAP_FAILED;
+  else if (!_data)
+    map = mmap(0, size, PROT_READ | PROT_WRITE,
+        _private ? MAP_PRIVATE : MAP_SHARED, _fd, 0);
+  else
+    map = mremap(_data, _size, size, MREMAP_MAYMOVE);
+  if (map == MAP_FAILED) {
+    // The mapping is as it was, so the file goes back to its old size. Were
+    // that to fail, the bytes past the mapping would only go to waste.
+    if (size > file_size) {
+      const int restored = ftruncate(_fd, file_size);
+      (void)restored;
+    }
+    return false;
+  }
+
+  // Whatever the file held past the old mapping, the bytes added read as
+  // zero.
+  const bool shrinking = size < _size;
+  if (file_size > _size && size > _size)
+    memset(static_cast<char*>(map) + _size, 0,
+        (size < file_size ? size : file_size) - _size);
+  _data = static_cast<char*>(map);
+  _size = size;
+  return !shrinking || _private || ftruncate(_fd, size) == 0;
+}
+
+bool mapped_file::sync(size_t offset, size_t length)
+{
+  if (!_data || length == 0)
+    return true;
+
+  // msync wants a page aligned start.
+  const size_t page = sysconf(_SC_PAGESIZE);
+  const size_t first = offset / page * page;
+  return msync(_data + first, offset + length - first, MS_SYNC) == 0;
+}
+
+bool mapped_file::write_back(size_t offset, size_t length)
+{
+  const char* data = _data + offset;
+  while (length > 0) {
+    const ssize_t n = pwrite(_fd, data, length, data - _data);
+    if (n < 0)
+      return false;
+    data += n;
+    length -= n;
+  }
+  return true;
+}
+
+bool mapped_file::flush()
+{
+  return _fd >= 0 && fdatasync(_fd) == 0;
+}
+
+bool mapped_file::trim()
+{
+  return _fd >= 0 && ftruncate(_fd, _size) == 0;
+}
+
+void mapped_file::discard(size_t offset, size_t length)
+{
+  // Only whole pages can be dropped; the page holding the end of the
+  // mapping counts as whole, as nothing past the end is read.
+  const size_t page = sysconf(_SC_PAGESIZE);
+  const size_t first = (offset + page - 1) / page * page;
+  const size_t end = offset + length >= _size ? _size :
+    (offset + length) / page * page;
+  if (first < end)
+    madvise(_data + first, end - first, MADV_DONTNEED);
+}
@@ -0,0 +1,110 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <stddef.h>
+
+/**
+ * Mapped File
+ * A file mapped read-write and shared into memory, so that writes to the
+ * mapping are writes to the file. Mapping a file costs the same whatever
+ * its size: its pages are read in on first touch. Growing and shrinking the
+ * file resize the mapping with mremap, which may move it, but never copies
+ * its contents.
+ *
+ * A file may also be mapped copy-on-write, for a caller that wants to
+ * choose when its writes reach the file. Writes to the mapping then stay in
+ * memory until written back, and shrinking the mapping leaves the file as
+ * long as it was until trimmed.
+ */
+class mapped_file {
+  private:
+    // The file descriptor, or -1 while no file is open.
+    int _fd;
+
+    // The mapping, or null while the file is empty.
+    char* _data;
+
+    // The size of the mapping in bytes, and of the file too unless the
+    // mapping is copy-on-write.
+    size_t _size;
+
+    // Whether the mapping is copy-on-write.
+    bool _private;
+
+  public:
+    mapped_file();
+
+    /**
+     * Unmaps and closes the file. Writes not yet synced are left to the
+     * kernel to write back.
+     */
+    ~mapped_file();
+
+    /**
+     * Opens the file at path, creating it empty if there is none, and maps
+     * it whole, copy-on-write if copy_on_write is set. Returns false if it
+     * cannot be opened or mapped.
+     */
+    bool open(const char* path, bool copy_on_write = false);
+
+    /**
+     * Returns the start of the mapping. It moves whenever the file grows.
+     */
+    char* data() const {
+      return _data;
+    }
+
+    /**
+     * Returns the size of the file in bytes.
+     */
+    size_t size() const {
+      return _size;
+    }
+
+    /**
+     * Changes the size of the file and of the mapping. Bytes added read as
+     * zero. Returns false if the file or the mapping could not be resized,
+     * in which case both are left as they were. A copy-on-write mapping
+     * that shrinks leaves the file as it is.
+     */
+    bool resize(size_t size);
+
+    /**
+     * Writes the mapped pages of bytes [offset, offset + length) to the file
+     * and waits for them to get there. Returns false on a write error. Only
+     * for a shared mapping.
+     */
+    bool sync(size_t offset, size_t length);
+
+    /**
+     * For a copy-on-write mapping: writes bytes [offset, offset + length)
+     * of the mapping to the file, without waiting for them to get there.
+     * Returns false on a write error.
+     */
+    bool write_back(size_t offset, size_t length);
+
+    /**
+     * Waits for every write to the file to get there. Returns false on a
+     * write error.
+     */
+    bool flush();
+
+    /**
+     * Cuts the file down to the size of the mapping. Returns false on a
+     * write error.
+     */
+    bool trim();
+
+    /**
+     * For a copy-on-write mapping: drops the copies of the pages wholly
+     * within bytes [offset, offset + length), which read as the file again
+     * from then on. They must have been written back first.
+     */
+    void discard(size_t offset, size_t length);
+
+  private:
+    mapped_file(const mapped_file&);
+    mapped_file& operator=(const mapped_file&);
+};
+
+#endif // MAPPED_FILE_H
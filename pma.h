@@ -2,6 +2,35 @@
 #ifndef PMA_H
 #define PMA_H
 
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <cstddef>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "bitmap.h"
+#include "buffer.h"
+#include "mapped_file.h"
+#include "pma_policy.h"
+#include "pma_storage.h"
+#include "segment_index.h"
+#include "segment_kernels.h"
+#include "seqlock.h"
+#include "thread_pool.h"
+#include "window_locks.h"
+#include "write_ahead_log.h"
+
 /** 
  * PMA  Packed-Memory Array
  * A cache-oblivious solution for maintaining a dynamic set of elements in 
@@ -14,13 +43,24 @@
  * where nodes of the tree are windows. The root node is the window containing 
  * all segments and a leaf node is a window containing a single segment. The
  * tree is implicitly rather than explicitly maintained.
+ *
+ * Elements are keys of type Key ordered by Compare, each carrying a value of
+ * type Value. With the default pma_no_value the pma is a plain sorted set.
+ * Layout selects how keys and values are arranged in memory, either as an
+ * array of structs (aos_layout), as a struct of arrays (soa_layout), or as
+ * one with the keys compressed (delta_layout); see pma_storage.h. Policy
+ * sets the density thresholds, the factor the array grows and shrinks by,
+ * and the segment size; see pma_policy.h.
  */
+template <class Key, class Value = pma_no_value,
+          class Compare = std::less<Key>, class Layout = aos_layout,
+          class Policy = pma_policy<> >
 class pma {
   public:
     // The initial number of elements in the packed-memory array to maintain.
     // Should be a power of two.
     static const int INITIAL_CAPACITY = 4;
-    static const int SCALE_FACTOR = 2;
+    static const int SCALE_FACTOR = Policy::SCALE_FACTOR;
 
     // Constant minimium and maximum densities.
     //
@@ -30,12 +70,328 @@ class pma {
     // density of keys within a window of 2^h segments. As node height
     // increases the udts decrease and ldts increase.
     //           D_min = p_0 <...< p_h < t_h <...< t_0 = D_max
-    static const double LEAF_LOWER_DENSITY = 0.1;
-    static const double ROOT_LOWER_DENSITY = 0.2;
-    static const double ROOT_UPPER_DENSITY = 0.5;
-    static const double LEAF_UPPER_DENSITY = 1.0;
+    static constexpr double LEAF_LOWER_DENSITY = Policy::LEAF_LOWER_DENSITY;
+    static constexpr double ROOT_LOWER_DENSITY = Policy::ROOT_LOWER_DENSITY;
+    static constexpr double ROOT_UPPER_DENSITY = Policy::ROOT_UPPER_DENSITY;
+    static constexpr double LEAF_UPPER_DENSITY = Policy::LEAF_UPPER_DENSITY;
+
+    static_assert(0 < LEAF_LOWER_DENSITY &&
+                  LEAF_LOWER_DENSITY <= ROOT_LOWER_DENSITY &&
+                  ROOT_LOWER_DENSITY < ROOT_UPPER_DENSITY &&
+                  ROOT_UPPER_DENSITY <= LEAF_UPPER_DENSITY &&
+                  LEAF_UPPER_DENSITY <= 1,
+                  "the density thresholds are out of order");
+    static_assert(SCALE_FACTOR >= 2 && (SCALE_FACTOR & (SCALE_FACTOR - 1)) == 0,
+                  "the scale factor must be a power of two");
+    static_assert(SCALE_FACTOR * ROOT_LOWER_DENSITY < ROOT_UPPER_DENSITY,
+                  "a shrink would leave the root above its upper threshold");
+
+    // The maximum number of window rebuilds that may be in flight at once
+    // when rebalancing incrementally. Scheduling another rebuild while the
+    // queue is full finishes the oldest one first.
+    static const int MAX_PENDING_REBUILDS = 4;
+
+    // With background rebalancing, the number of elements a full segment
+    // takes into its overflow buffer before an insert rebalances it itself,
+    // or the segment size if that is smaller.
+    static const uint32_t OVERFLOW_SIZE = 8;
+
+    // With background rebalancing, the array is grown once the root reaches
+    // this density, halfway between the density a grown array would then
+    // sit at its lower threshold and ROOT_UPPER_DENSITY.
+    static constexpr double BACKGROUND_GROWTH_DENSITY =
+      (SCALE_FACTOR * ROOT_LOWER_DENSITY + ROOT_UPPER_DENSITY) / 2;
+
+    // The algorithms available for redistributing the elements of a window.
+    // NAIVE compacts the elements to the left and then spreads them out, so 
+    // each element may move twice. ONE_PHASE moves each element straight to
+    // its target. ADAPTIVE moves elements in one pass as well, but rather
+    // than spacing them evenly it hands out the gaps of a window in
+    // proportion to the recent inserts into each part of it, after Bender
+    // and Hu's adaptive packed-memory array.
+    enum rebalance_algorithm_t { NAIVE, ONE_PHASE, ADAPTIVE };
+
+    // With ADAPTIVE, a recent insert into a segment weighs as much as this
+    // many segments' worth of baseline when a window's gaps are handed out.
+    static const uint32_t HEAT_WEIGHT = 16;
+
+    // With a thread pool set, windows of at least this many array positions
+    // are rebalanced, and arrays of at least this capacity grown, across the
+    // pool. Each task of such a rebalance or resize covers PARALLEL_GRAIN
+    // array positions.
+    static const uint32_t PARALLEL_THRESHOLD = 1 << 16;
+    static const uint32_t PARALLEL_GRAIN = 1 << 12;
+
+    // The file format of a persistent pma: the header, padded to
+    // FILE_HEADER_SIZE bytes, followed by the storage, the free index
+    // bitmap, the count tree, and the separators and shape of the segment
+    // index, each laid out as in memory and starting on a cache line. A
+    // file written under another FILE_VERSION is refused.
+    static const uint64_t FILE_MAGIC = 0x656c69662d616d70;  // "pma-file"
+    static const uint32_t FILE_VERSION = 1;
+    static const uint32_t FILE_HEADER_SIZE = 4096;
+
+    // The records of the write-ahead log of a logged pma: an insert, with
+    // its key and value, and an erase, with its key; the start of a
+    // checkpoint, with the size of the file, each stretch of the file it
+    // writes, with its offset, in pieces of at most LOG_IMAGE_BYTES, and its
+    // end. A checkpoint writes the file in whole pages of FILE_PAGE_SIZE
+    // bytes.
+    static const uint32_t LOG_INSERT = 1;
+    static const uint32_t LOG_ERASE = 2;
+    static const uint32_t LOG_CHECKPOINT = 3;
+    static const uint32_t LOG_IMAGE = 4;
+    static const uint32_t LOG_CHECKPOINT_END = 5;
+    static const uint32_t LOG_IMAGE_BYTES = 1 << 20;
+    static const uint32_t FILE_PAGE_SIZE = 4096;
+
+    // lookup_many descends the segment index for this many queries at once
+    // and prefetches all of their segments before searching any of them.
+    static const uint32_t LOOKUP_BATCH = 16;
+
+    // Points at the storage of an array position: the slot itself with
+    // aos_layout, or the key with soa_layout or, unpacked, delta_layout.
+    typedef typename pma_storage<Key, Value, Layout>::const_pointer
+      const_pointer;
+
+    // What the keys are read as: references to them in place, or with
+    // delta_layout, copies of them unpacked.
+    typedef typename pma_storage<Key, Value, Layout>::key_reference
+      key_reference;
+    typedef typename pma_storage<Key, Value, Layout>::const_key_reference
+      const_key_reference;
+
+    /**
+     * A bidirectional iterator over the elements in sorted order. Free
+     * array positions are skipped a bitmap word at a time. Keys may not be
+     * modified through an iterator, since that could break the order. Any
+     * insert invalidates every iterator. With delta_layout an iterator
+     * yields copies of the keys, and has no operator->.
+     */
+    class const_iterator {
+      public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef Key value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const Key* pointer;
+        typedef const_key_reference reference;
+
+        const_iterator() : _pma(0), _index(0) {}
+
+        reference operator*() const { return _pma->_storage.key(_index); }
+        // A template, so that a pma of delta_layout, whose keys are copies,
+        // can still be instantiated whole.
+        template <class P = pointer>
+        P operator->() const { return &_pma->_storage.key(_index); }
+
+        /** Returns the value of the element. */
+        const Value& value() const { return _pma->_storage.value(_index); }
+
+        /** Returns the array position of the element. */
+        uint32_t index() const { return _index; }
+
+        const_iterator& operator++() {
+          _index = _pma->next_occupied(_index + 1, _pma->capacity());
+          return *this;
+        }
+        const_iterator operator++(int) {
+          const_iterator it = *this;
+          ++*this;
+          return it;
+        }
+        const_iterator& operator--() {
+          _index = _pma->_free_index_bitmap.find_prev_set(0, _index);
+          return *this;
+        }
+        const_iterator operator--(int) {
+          const_iterator it = *this;
+          --*this;
+          return it;
+        }
+
+        bool operator==(const const_iterator& other) const {
+          return _index == other._index;
+        }
+        bool operator!=(const const_iterator& other) const {
+          return _index != other._index;
+        }
+
+      private:
+        friend class pma;
+        const_iterator(const pma* p, uint32_t index) : _pma(p), _index(index) {}
+
+        const pma* _pma;
+        uint32_t _index;
+    };
+    typedef const_iterator iterator;
+
+    /**
+     * The part of one segment that falls inside a range. Bit i of mask is
+     * set if array position index + i holds an element of the range, and
+     * data points at the storage of position index, so data[i] is that
+     * element's slot (aos_layout) or key (soa_layout). With delta_layout
+     * data points at the keys of the segment unpacked into the iterator,
+     * valid until it moves on. Segments never span more than 64 array
+     * positions, so the mask always fits.
+     */
+    struct segment_span {
+      const_pointer data;
+      uint64_t mask;
+      uint32_t index;
+    };
+
+    /**
+     * Walks the nonempty segments overlapping a range of array positions,
+     * yielding a segment_span for each.
+     */
+    class span_iterator {
+      public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef segment_span value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const segment_span* pointer;
+        typedef segment_span reference;
+
+        span_iterator() : _pma(0), _segment(0), _first(0), _last(0) {}
+
+        segment_span operator*() const {
+          const uint32_t size = _pma->_segment_size;
+          const uint32_t lo = std::max(_first, _segment) - _segment;
+          const uint32_t hi = std::min(_last, _segment + size) - _segment;
+          segment_span span;
+          span.data = _pma->_storage.data(_segment, size, _buffer);
+          span.mask = _pma->_free_index_bitmap.word_bits(_segment, size) &
+            (~uint64_t(0) << lo) & (~uint64_t(0) >> (64 - hi));
+          span.index = _segment;
+          return span;
+        }
+
+        span_iterator& operator++() {
+          const uint32_t size = _pma->_segment_size;
+          const uint32_t next =
+            _pma->next_occupied(_segment + size, _last);
+          _segment = next == _last ? end_segment() : next - next % size;
+          return *this;
+        }
+        span_iterator operator++(int) {
+          span_iterator it = *this;
+          ++*this;
+          return it;
+        }
+
+        bool operator==(const span_iterator& other) const {
+          return _segment == other._segment;
+        }
+        bool operator!=(const span_iterator& other) const {
+          return _segment != other._segment;
+        }
+
+      private:
+        friend class pma;
+        span_iterator(const pma* p, uint32_t first, uint32_t last, bool end)
+          : _pma(p), _segment(0), _first(first), _last(last)
+        {
+          const uint32_t size = _pma->_segment_size;
+          const uint32_t next = end ? last : _pma->next_occupied(first, last);
+          _segment = next == last ? end_segment() : next - next % size;
+        }
+
+        // The segment past the one holding the last position of the range.
+        uint32_t end_segment() const {
+          const uint32_t size = _pma->_segment_size;
+          return (_last + size - 1) / size * size;
+        }
+
+        const pma* _pma;
+        uint32_t _segment;   // The index that starts the current segment.
+        uint32_t _first;     // The first array position of the range.
+        uint32_t _last;      // One past the last array position of the range.
+
+        // The keys of the current segment, if unpacked.
+        mutable typename pma_storage<Key, Value, Layout>::span_buffer _buffer;
+    };
+
+    /**
+     * The segment spans of a range, as returned by pma::range.
+     */
+    class span_range {
+      public:
+        span_iterator begin() const { return _begin; }
+        span_iterator end() const { return _end; }
+        bool empty() const { return _begin == _end; }
+
+      private:
+        friend class pma;
+        span_range(const span_iterator& b, const span_iterator& e)
+          : _begin(b), _end(e) {}
+
+        span_iterator _begin;
+        span_iterator _end;
+    };
+
+    /**
+     * The buckets of the histograms in stats_t, one for each height of the
+     * implicit tree, and for each power of two a window length may be.
+     */
+    static const int STATS_BUCKETS = 33;
+
+    /**
+     * A snapshot of the shape of a pma and of the work it has done, as
+     * returned by pma::stats. Only the shape, storage_bytes and
+     * element_moves are kept by every pma; the other counters stay zero
+     * unless Policy::STATS is set.
+     */
+    struct stats_t {
+      uint32_t capacity;
+      uint32_t size;
+      uint32_t segment_size;
+      int segments;
+      int height;
+
+      // The bytes the slots take up, with delta_layout the bases, masks and
+      // exceptions of its runs included.
+      uint64_t storage_bytes;
+
+      // The same as pma::element_moves.
+      uint64_t element_moves;
+
+      // Inserts that found a free position where the new element belongs,
+      // that shifted elements within the segment to make room for it, and
+      // that rebalanced or grew the array before or after placing it. The
+      // first two count every insert; the last counts some of them again.
+      uint64_t free_slot_inserts;
+      uint64_t shifted_inserts;
+      uint64_t rebalancing_inserts;
+
+      // Inserts that found their segment full and left the new element in
+      // its overflow buffer, for the background rebalancer to merge in.
+      uint64_t overflow_inserts;
+
+      // The windows rebalanced, whether at once or by the incremental
+      // rebuilder, by height and by log2 of their length.
+      uint64_t rebalances;
+      uint64_t rebalance_heights[STATS_BUCKETS];
+      uint64_t rebalance_lengths[STATS_BUCKETS];
+
+      // The times the capacity grew and shrank, and the time spent laying
+      // out the arrays for the new capacity.
+      uint64_t resizes;
+      uint64_t shrinks;
+      uint64_t resize_nanoseconds;
+
+      // The checkpoints of a logged pma, and the bytes of the file they
+      // wrote, the header included.
+      uint64_t checkpoints;
+      uint64_t checkpoint_bytes;
+    };
 
   private:
+    // Whether a segment is searched with the vector kernels: its keys are
+    // numbers ordered by <, lying next to each other.
+    static const bool VECTOR_SEARCH = vector_key<Key>::value &&
+      std::is_same<Compare, std::less<Key> >::value &&
+      pma_storage<Key, Value, Layout>::CONTIGUOUS_KEYS;
+
     // The height of the root i.e the height of the tree.  
     int _implicit_tree_height;
     
@@ -46,33 +402,355 @@ class pma {
     uint32_t _size;
 
     // A given bit in the bitmap is set if the corresponding index in the pma
-    // is free, and clear if the corresponding index in the pma is in use.
-    std::vector<bool> _free_index_bitmap;
+    // is in use, and clear if the corresponding index in the pma is free.
+    bitmap _free_index_bitmap;
+
+    // With a write-ahead log, a bit for each segment, set once the segment
+    // is written to and cleared by the next checkpoint.
+    bitmap _dirty_segments;
 
     // The allocated storage space for the elements of the pma.
-    std::vector<int> _storage;
+    pma_storage<Key, Value, Layout> _storage;
+
+    // The order the segment index stores its nodes in.
+    typedef typename std::conditional<Policy::VEB_INDEX, veb_order,
+            eytzinger_order>::type index_order;
+
+    // The separator of each segment: its smallest element, or for an empty
+    // segment the separator of the next nonempty one. Empty segments past
+    // the last nonempty one repeat its separator.
+    segment_index<Key, Compare, index_order> _segment_index;
+
+    // One past the last nonempty segment, or zero if the pma is empty.
+    uint32_t _occupied_segments;
+
+    // Whether a shrinking rebuild is in flight. Its compact sweep opens a
+    // run of empty segments that grows to half the array, and keeping their
+    // borrowed separators current would cost a pass over the run per move.
+    // The segment index is left stale instead, searches descend the count
+    // tree, and the index is rebuilt once the shrink completes.
+    bool _shrinking;
+
+    // The number of elements in each node of the implicit tree, in heap
+    // order: the root at 1, the children of node k at 2k and 2k+1, and so the
+    // segment s at number_of_segments() + s. Index 0 is unused.
+    buffer<uint32_t> _count_tree;
+
+    // The maximum number of element moves a single operation may spend on
+    // rebalancing before returning. Zero means windows are rebalanced to
+    // completion as soon as they fall out of threshold.
+    uint32_t _max_rebalance_moves;
+
+    // The algorithm used to redistribute the elements of a window.
+    rebalance_algorithm_t _rebalance_algorithm;
+
+    // The insert predictor of the ADAPTIVE algorithm: a saturating count of
+    // the recent inserts into each segment. A rebalance reads the counts of
+    // its window to place the gaps, then halves them so that the prediction
+    // follows the workload as it moves.
+    std::vector<uint8_t> _insert_heat;
+
+    // The index planned for each element, by rank, of the window being
+    // rebalanced by the ADAPTIVE algorithm.
+    std::vector<uint32_t> _planned_index;
+
+    // A window rebuild that is carried out a few moves at a time. The rebuild
+    // runs as a pair of sweeps: the compact sweep moves elements left, the 
+    // spread sweep moves them right to their evenly spaced target. With the
+    // NAIVE algorithm the compact sweep packs the elements together, with
+    // ONE_PHASE it stops each one at its target so nothing moves twice. Every
+    // move keeps the occupied slots in sorted order, so the pma may be read
+    // at any point between two steps.
+    //
+    // A shrinking rebuild gathers the elements of the whole array into its
+    // lower part, i.e. its span is the capacity and its length the capacity
+    // after the shrink. The array is cut down once the rebuild completes.
+    struct rebuild_task {
+      enum phase_t { COMPACT, SPREAD };
+      uint32_t window;   // The index that starts the window.
+      uint32_t length;   // The number of array positions spread over.
+      uint32_t span;     // The number of array positions gathered from.
+      phase_t  phase;    // The sweep currently in progress.
+      uint32_t cursor;   // The next index the sweep examines.
+      uint32_t rank;     // The rank within the window of the next element.
+      uint32_t count;    // The number of elements in the window.
+      bool     shrink;   // Whether the array is cut down to length after.
+    };
+
+    // The window rebuilds in flight, oldest first. Windows in the queue are
+    // pairwise disjoint.
+    std::deque<rebuild_task> _rebuilds;
+
+    // Orders the keys.
+    Compare _compare;
+
+    // The number of times an element already in the pma has been moved to
+    // another array position.
+    uint64_t _element_moves;
+
+    // The counters of stats() beyond the shape and element moves, kept
+    // only when Policy::STATS is set.
+    stats_t _stats;
+
+    // With concurrent readers enabled, the version of each segment and the
+    // epoch that keeps readers out while the buffers are replaced. The epoch
+    // is null otherwise, and the writer then skips every version update.
+    std::unique_ptr<reader_epoch> _reader_epoch;
+    segment_versions _versions;
+
+    // The largest segment size: one word of the free index bitmap, so that
+    // the occupancy of a segment can always be read as one word.
+    static const uint32_t MAX_SEGMENT_SIZE = bitmap::WORD_BITS;
+
+    // For each height of the tree, the number of elements a window of that
+    // height holds at its upper density threshold and at its lower one,
+    // rounded up. A window is within its upper threshold while it holds
+    // fewer than _upper_count[h] elements, and within its lower threshold
+    // while it holds at least _lower_count[h]. They are worked out by
+    // compute_geometry, so that the checks of every insert and erase
+    // compare integers. Above the leaves, _upper_count[h] is also kept low
+    // enough that a window spread out leaves no segment full.
+    static const int MAX_HEIGHT = 32;
+    uint32_t _upper_count[MAX_HEIGHT + 1];
+    uint32_t _lower_count[MAX_HEIGHT + 1];
+
+    // A copy of the elements of one segment, its overflow buffer included,
+    // taken by a concurrent reader under the version of the segment.
+    struct segment_copy {
+      uint32_t version;
+      uint32_t count;
+      Key      keys[MAX_SEGMENT_SIZE + OVERFLOW_SIZE];
+      Value    values[MAX_SEGMENT_SIZE + OVERFLOW_SIZE];
+    };
+
+    // The elements a full segment holds beyond its array positions, sorted.
+    // They lie between the first element of the segment and that of the next
+    // nonempty one, except in segment 0, which may hold smaller ones. Only a
+    // full segment ever has any, and they are counted in the count tree as
+    // if they were in the segment. They are changed under the lock and the
+    // version of their segment, and merged into the array by a rebalance of
+    // any window that covers it.
+    struct overflow_buffer {
+      uint32_t count;
+      Key      keys[OVERFLOW_SIZE];
+      Value    values[OVERFLOW_SIZE];
+    };
+
+    // What background rebalancing shares between the inserting threads and
+    // the rebalancer: the overflow buffer of each segment, and the segments
+    // over their upper threshold waiting to be rebalanced, in the order they
+    // got there, each queued at most once. The queue is guarded by mutex,
+    // and cleared by every resize, which leaves no window over threshold.
+    struct background_rebalancer {
+      std::thread thread;
+      std::vector<overflow_buffer> overflow;
+      std::mutex mutex;
+      std::condition_variable wake;
+      std::condition_variable idle;
+      std::deque<uint32_t> queue;
+      std::vector<uint8_t> queued;
+      bool busy;
+      bool stop;
+
+      // The root count at which the array is grown, and whether an insert
+      // has found the root there.
+      uint32_t growth_count;
+      std::atomic<bool> grow;
+    };
+
+    // Null unless background rebalancing is enabled.
+    std::unique_ptr<background_rebalancer> _background;
+
+    // What concurrent inserts share: the locks over the array, the epoch
+    // that keeps them out while a resize replaces the buffers, and the
+    // mutexes that let one of them resize at a time and one of them change
+    // the segment index at a time.
+    struct insert_sync {
+      window_locks locks;
+      reader_epoch epoch;
+      std::mutex   resize_mutex;
+      std::mutex   index_mutex;
+    };
+
+    // Null unless concurrent inserts are enabled. The counters that every
+    // insert touches, such as the size and the upper nodes of the count
+    // tree, are then updated atomically.
+    std::unique_ptr<insert_sync> _insert_sync;
+
+    // The threads that large rebalances and resizes are spread over, or
+    // null to run them on the calling thread alone.
+    std::unique_ptr<thread_pool> _thread_pool;
+
+    // The header of a persistent pma's file. The geometry and size are
+    // brought up to date by every resize and sync. The count tree and the
+    // segment index are only trusted on open if the file was closed cleanly;
+    // otherwise they are rebuilt from the bitmap.
+    struct file_header {
+      uint64_t magic;
+      uint32_t version;
+      uint32_t key_size;
+      uint32_t slot_size;
+      uint32_t layout;
+      uint32_t capacity;
+      int32_t  implicit_tree_height;
+      uint32_t segment_size;
+      uint32_t size;
+      uint32_t occupied_segments;
+      uint32_t clean;
+      uint32_t veb_index;
+    };
+
+    // Where each array starts in the file for a given capacity, and where
+    // the file ends.
+    struct file_layout {
+      size_t storage;
+      size_t bitmap;
+      size_t count_tree;
+      size_t index;
+      size_t shape;
+      size_t end;
+    };
+
+    // The file the arrays live in, or null while the pma is in memory.
+    std::unique_ptr<mapped_file> _file;
+
+    // The write-ahead log of a logged pma, or null. The inserts and erases
+    // it replays on open are not logged again.
+    std::unique_ptr<write_ahead_log> _log;
+    bool _replaying;
 
   public:
     /** 
      * Default constructor: 
      * Constructs an empty packed-memory array, with no content and a 
-     * size of zero. 
+     * size of zero. Keys are ordered by compare.
      */
-    pma();
+    explicit pma(const Compare& compare = Compare());
 
     /**
      * Destructs the packed-memory array. This calls each of the contained 
      * element's destructors, and deallocates all the storage capacity allocated 
-     * by the vector.
+     * by the vector. A persistent pma is synced and its file marked clean
+     * first, unless a rebuild is still in flight.
      */
     ~pma();
 
     /**
-     * Returns a reference to the element at position n in the packed-memory 
+     * Keeps the packed-memory array in the file at path from then on. If the
+     * file holds a pma, its contents replace the current ones: the file is
+     * mapped as it is, and its pages are read in as they are first touched,
+     * so opening takes about the same time whatever the size. Only a file
+     * that was not closed cleanly has its count tree and segment index
+     * rebuilt. An empty or missing file is written out from the current
+     * contents instead. Every resize then grows or shrinks the file in
+     * place. Returns false, leaving the pma as it was, if the file cannot
+     * be mapped, holds a pma of other key or slot sizes or layout, or the
+     * keys and values are not trivially copyable. A pma of delta_layout
+     * is never kept in a file. No reads or inserts may run alongside.
+     *
+     * With a log_path, the pma is logged: the file is mapped copy-on-write
+     * and only changes at a checkpoint, that is a sync, while every insert
+     * and erase in between is appended to the write-ahead log at log_path,
+     * and is sure to survive a crash once committed. A checkpoint first logs
+     * the pages it is about to write, then writes them, so a crash halfway
+     * through one leaves the file to be finished from the log. It writes
+     * only the pages of the segments written to since the last checkpoint,
+     * besides the header, and empties the log. On open, the last checkpoint
+     * in the log is finished if need be and the inserts and erases logged
+     * after it are replayed, after which the pma is checkpointed.
+     */
+    bool open(const char* path, const char* log_path = 0);
+
+    /**
+     * Writes the header of a persistent pma and every change to the file,
+     * and waits for them to get there. Returns false on a write error or if
+     * the pma is not persistent. A logged pma is checkpointed instead, at a
+     * cost that grows with the segments written to since the last one; the
+     * overflow buffers are merged in first. The count tree and segment
+     * index are only written when the pma is destroyed. No other call may
+     * run alongside.
+     */
+    bool sync();
+
+    /**
+     * Waits until every insert and erase of a logged pma so far is in the
+     * log on disk. Any number of threads may commit at once, and those that
+     * do share one write and fdatasync of the log. Changes other than
+     * inserts and erases, such as through value, reach the file at the next
+     * checkpoint only. Returns false on a write error or if the pma is not
+     * logged.
+     */
+    bool commit();
+
+    /**
+     * Returns whether open has been called successfully.
+     */
+    bool persistent() const;
+
+    /**
+     * Returns a reference to the key at position n in the packed-memory 
+     * array. Changing a key in a way that alters its order is not allowed.
+     */
+    key_reference operator[] (uint32_t n);
+    const_key_reference operator[] (uint32_t n) const;
+
+    /**
+     * Returns a reference to the value at position n in the packed-memory 
      * array.
      */
-    int& operator[] (uint32_t& n);
-    const int& operator[] (uint32_t& n) const;
+    Value& value(uint32_t n);
+    const Value& value(uint32_t n) const;
+
+    /**
+     * Returns an iterator to the smallest element, or end() if the pma is
+     * empty.
+     */
+    const_iterator begin() const;
+
+    /**
+     * Returns the iterator past the largest element.
+     */
+    const_iterator end() const;
+
+    /**
+     * Returns an iterator to x, or end() if x is not in the pma. The segment
+     * of x is found like that of an insert and searched without branching
+     * on its keys: with the vector kernels for numeric keys, or else by a
+     * binary search over all of its positions that reads a free position as
+     * a copy of the element before it.
+     */
+    const_iterator find(const Key& x) const;
+
+    /**
+     * Returns whether x is in the pma.
+     */
+    bool contains(const Key& x) const;
+
+    /**
+     * Returns an iterator to the smallest element not less than x, or to the
+     * smallest element greater than x, or end() if there is none.
+     */
+    const_iterator lower_bound(const Key& x) const;
+    const_iterator upper_bound(const Key& x) const;
+
+    /**
+     * Looks up the count keys and sets positions[i] to the array position of
+     * keys[i], or to capacity() if it is not in the pma. Each LOOKUP_BATCH
+     * queries descend the segment index in step, and their segments are
+     * prefetched before any of them is searched, so that the cache misses
+     * of the whole batch overlap rather than coming one after another.
+     */
+    void lookup_many(const Key* keys, uint32_t count, uint32_t* positions)
+      const;
+
+    /**
+     * Returns the segment spans covering the elements in [lo, hi). Each span
+     * exposes the storage of one segment in place together with a mask of
+     * the positions inside the range, so a caller may scan the segment with
+     * a tight loop over its array positions instead of chasing an iterator.
+     * The spans are invalidated by any insert.
+     */
+    span_range range(const Key& lo, const Key& hi) const;
 
     /**
      * Returns the size of the allocated storage space for the elements of the 
@@ -83,6 +761,19 @@ class pma {
      */
     uint32_t capacity() const;
 
+    /**
+     * Performs up to moves steps of the window rebuilds in flight, oldest
+     * first. Every modifying operation calls this with the configured move
+     * budget, but it may also be called directly to make progress while the
+     * pma is otherwise idle.
+     */
+    void advance_rebuilds(uint32_t moves);
+
+    /**
+     * Runs every window rebuild in flight to completion.
+     */
+    void finish_rebuilds();
+
     /**
      * Scans the window of the packed-memory array starting at index window
      * through index window+length and clears the storage contents and free
@@ -93,9 +784,27 @@ class pma {
     /**
      * Removes from the packed-memory array a single element (x). This 
      * effectively reduces the pma size by the number of elements removed, 
-     * calling each element's destructor before.
+     * calling each element's destructor before. The slot is simply freed;
+     * if that leaves the segment below its lower density threshold, the
+     * rebalance algorithm is started. Returns false if x is not in the pma.
+     * A shrink that an erase sets off is spread over the move budget, but
+     * the erase that completes it still cuts the array down in one go, and
+     * without a reserved capacity that copies the surviving elements; see
+     * shrink.
      */
-    void erase(const int& x);
+    bool erase(const Key& x);
+
+    /**
+     * Returns the number of times an element already in the pma has been
+     * moved to another array position, whether by shifting within a segment,
+     * rebalancing, or resizing. Placing a new element does not count.
+     */
+    uint64_t element_moves() const;
+
+    /**
+     * Returns the shape of the pma and the counters it keeps.
+     */
+    stats_t stats() const;
 
     /**
      * Returns whether index at position indexno in the free_index_bitmap is set.
@@ -107,9 +816,51 @@ class pma {
      * effectively increases the pma size, which causes an automatic reallocation 
      * of the allocated storage space if, and only if, the new pma size surpasses 
      * the current pma ROOT_UPPER_DENSITY. Rebalances of the pma may also be
-     * triggered as a result of an insertion.
+     * triggered as a result of an insertion. Within its segment, x is placed
+     * by shifting the elements between its position and the closest free 
+     * index over by one. Inserting a key equivalent to one already in the 
+     * pma has no effect and returns false.
+     */
+    bool insert(const Key& x, const Value& value = Value());
+
+    /**
+     * Inserts the keys in [first, last), each with a default constructed
+     * value, and returns the number of keys added. The batch is sorted and
+     * each key is assigned the segment it would be inserted into. For every
+     * group of keys bound for the same segment, the smallest enclosing
+     * window that stays within threshold with the group's keys and all other
+     * batch keys that fall inside it is chosen, and windows covered by a
+     * larger chosen window are dropped. The keys are then merged into each
+     * remaining window in a single pass that also spreads it out, except
+     * that a lone segment has its keys shifted in as insert would. If even
+     * the root cannot take the batch, the pma grows once, straight to a
+     * capacity large enough for it, and the whole array is merged.
+     */
+    template <class InputIterator>
+    uint32_t insert_batch(InputIterator first, InputIterator last);
+
+    /**
+     * Replaces the contents with the keys in [first, last), each with a
+     * default constructed value. The keys must be sorted and distinct. The
+     * capacity is picked up front as the smallest power of two, at least
+     * INITIAL_CAPACITY, that the keys fill to less than target_density,
+     * which is first clamped to [ROOT_LOWER_DENSITY, ROOT_UPPER_DENSITY], and
+     * the keys are spread out evenly over the whole array in one streaming
+     * pass that writes every array position once and fills in the count
+     * tree and segment index as it goes. Nothing is rebalanced or moved.
+     * With a thread pool set, random access keys, and a capacity of at least
+     * PARALLEL_THRESHOLD, the pass is split into runs of PARALLEL_GRAIN
+     * positions laid out across the pool. No other call may run alongside.
+     */
+    template <class ForwardIterator>
+    void from_sorted(ForwardIterator first, ForwardIterator last,
+        double target_density = ROOT_UPPER_DENSITY);
+
+    /**
+     * Returns the free index in the given segment closest to indexno. Ties go
+     * to the right. The segment must not be full.
      */
-    void insert(const int& x);
+    uint32_t nearest_free_index(const uint32_t& segment, uint32_t indexno) const;
 
     /**
      * Computes the lower density threshold for a window at a given height in
@@ -126,43 +877,246 @@ class pma {
      */
     int number_of_segments() const;
 
+    /**
+     * Returns the number of window rebuilds that have been scheduled but not
+     * yet completed.
+     */
+    uint32_t pending_rebuilds() const;
+
+    /**
+     * Lets any number of threads call read_predecessor and read_range while
+     * a single thread calls everything else. Every change to a segment then
+     * bumps its version, and every resize waits for the reads under way to
+     * leave the old buffers. Call this before the readers start; it cannot
+     * be undone. Keys and values must be trivially copyable.
+     */
+    void enable_concurrent_readers();
+
+    /**
+     * Returns whether enable_concurrent_readers has been called.
+     */
+    bool concurrent_readers() const;
+
+    /**
+     * Lets any number of threads call insert at once. Other modifying calls
+     * may not run alongside them, but concurrent readers may. An insert
+     * locks only the bitmap word holding its segment, once it has checked
+     * under the lock that x belongs there. A rebalance climbs the implicit
+     * tree from that word, taking the locks of each larger window in turn,
+     * and a resize shuts every other insert out until it is done. Windows
+     * are rebalanced to completion, so the move budget is set to zero and
+     * the rebuilds in flight are finished first. Call this before the
+     * inserting threads start; it cannot be undone.
+     */
+    void enable_concurrent_inserts();
+
+    /**
+     * Returns whether enable_concurrent_inserts has been called.
+     */
+    bool concurrent_inserts() const;
+
+    /**
+     * Takes rebalancing off the path of concurrent inserts, which it enables
+     * if need be, and hands it to a thread of its own. An insert that takes
+     * its segment over the upper threshold queues the segment and returns.
+     * An insert into a full segment leaves the new element in the segment's
+     * overflow buffer, where concurrent readers see it, and only if that is
+     * full too rebalances the segment itself. The rebalancer climbs from
+     * each queued segment as an insert would, merging in the overflow
+     * buffers of the window, and grows the array ahead of time once the root
+     * reaches BACKGROUND_GROWTH_DENSITY. A resize still shuts inserts out
+     * while it runs. Calls other than insert, read_predecessor and
+     * read_range must wait_for_rebalances first. Call this before the
+     * inserting threads start; it cannot be undone.
+     */
+    void enable_background_rebalancing();
+
+    /**
+     * Returns whether enable_background_rebalancing has been called.
+     */
+    bool background_rebalancing() const;
+
+    /**
+     * Waits until the background rebalancer has nothing left to do, which
+     * leaves every overflow buffer empty. No insert may run alongside.
+     */
+    void wait_for_rebalances();
+
+    /**
+     * For a concurrent reader: sets key to the largest key less than x and
+     * returns true, or returns false if there is none. The segments are
+     * copied under their versions, starting from the one the segment index
+     * points at and walking to a neighbour for as long as the copy shows the
+     * answer lies further on. Each step checks that the segment left behind
+     * has not changed, and a walk that finds it changed starts over. While a
+     * shrink is in flight the index lags behind and the walks get longer.
+     */
+    bool read_predecessor(const Key& x, Key& key) const;
+
+    /**
+     * For a concurrent reader: calls visit(key, value) for each element in
+     * [lo, hi), in order. Segments are copied one at a time as in
+     * read_predecessor, and each one is only visited once the one before it
+     * is known not to have changed since it was copied. Otherwise the scan 
+     * resumes just past the last key visited, so no key is visited twice.
+     */
+    template <class Visitor>
+    void read_range(const Key& lo, const Key& hi, Visitor visit) const;
+
     /**
      * Returns the index in the given segment of the packed-memory array to 
-     * insert x into.
+     * insert x into. Numeric keys are compared with x a vector at a time and
+     * the result masked with the segment's bitmap word, with no branch per
+     * array position.
      * @param segment The index that starts the segment
      * @param x       The value of the element to be inserted.
      */
-    uint32_t position_to_insert(const uint32_t& segment, const int& x) const;
+    uint32_t position_to_insert(const uint32_t& segment, const Key& x) const;
 
     /**
      * Returns the index in the packed-memory array that holds the immediate
-     * predecessor of x. Returns 0 if the pma is empty.
+     * predecessor of x, i.e. the largest element less than x. Returns 
+     * capacity() if no element is less than x.
      */
-    uint32_t predecessor(const int& x) const;
+    uint32_t predecessor(const Key& x) const;
 
     /**
      * Returns the index in the packed-memory array that starts the segment
-     * (leaf node) to insert x into.
+     * (leaf node) to insert x into. This is the segment holding the largest
+     * element not greater than x, found by searching the segment index.
+     */
+    uint32_t segment_to_insert(const Key& x) const;    
+
+    /**
+     * Bounds the number of element moves any single operation spends on
+     * rebalancing. A window larger than moves is not rebalanced in one go;
+     * instead a rebuild of it is queued and advanced by at most moves steps
+     * per subsequent operation. Passing zero (the default) restores eager
+     * rebalancing, where each window is rebuilt to completion immediately.
+     * Growing the array is not bounded by the budget; see resize.
+     */
+    void set_max_rebalance_moves(uint32_t moves);
+
+    /**
+     * Reserves address space for the storage and free index bitmap to grow
+     * in place up to the given capacity. Growing then commits pages at the
+     * end of the arrays instead of copying them into larger ones, which
+     * leaves the memory in use at the new arrays rather than old and new
+     * together, and a shrink hands the pages past its new end straight back.
+     * Past the reserved capacity the arrays are copied again as before. Does
+     * nothing for a persistent pma, whose arrays grow within the file.
      */
-    uint32_t segment_to_insert(const int& x) const;    
+    void reserve_capacity(uint32_t capacity);
+    uint32_t reserved_capacity() const;
+    uint32_t max_rebalance_moves() const;
 
     /**
      * We rebalance a node u_h of height h if u_h is within threshold, but we
      * detect that a child node u_h-1 is outside of threshold. Rebalances are
      * triggered by inserts or deletes that push one descendent node at each
      * height above its upper threshold t_i or below its lower threshold p_i.
+     * A segment below its lower threshold climbs to the closest ancestor at
+     * or above its own lower threshold, any other segment to the closest
+     * ancestor below its upper threshold. If the root itself is out of
+     * threshold, the pma is grown or shrunk instead.
      * @param segment The index that starts the segment out of balance.
      */
     void rebalance(const uint32_t& segment);
+
+    /**
+     * Rebalances a window of the given height at once with the current
+     * algorithm, between the trace points of the policy.
+     */
+    void rebalance_window(const uint32_t& window, const uint32_t& length,
+        int height);
+
+    /**
+     * Packs the elements of a window to its left end and then spreads them
+     * out evenly from right to left, so each element may move twice. Both
+     * passes work a bitmap word at a time, with the vector compress and
+     * expand kernels when the slots are trivially copyable.
+     */
     void naive_rebalance(const uint32_t& window, const uint32_t& length);    
+
+    /**
+     * Evenly spaces out the elements of a window in a single pass. Elements
+     * whose target lies to their left are moved as soon as they are reached,
+     * proceeding from left to right. A run of elements whose targets lie to
+     * their right is moved once the end of the run is found, proceeding from
+     * right to left. Either way each element moves at most once, straight to
+     * its target, and the free index bitmap of the window is rewritten once
+     * at the end instead of being flipped on every move.
+     */
     void one_phase_rebalance(const uint32_t& window, const uint32_t& length);
+
+    /**
+     * Spaces out the elements of a window in a single pass like 
+     * one_phase_rebalance, but with the gaps handed out unevenly. Going down
+     * the implicit tree from the window, the free space of each node is split
+     * between its children in proportion to their predicted inserts, so that
+     * gaps are left where inserts are headed. A child only ever receives up
+     * to its upper density threshold, which keeps any one region from being
+     * packed so tightly that it must be rebalanced again at once.
+     */
+    void adaptive_rebalance(const uint32_t& window, const uint32_t& length);
+
+    /**
+     * Runs rebalances of windows of PARALLEL_THRESHOLD array positions or
+     * more, and resizes of arrays that large, on the given number of
+     * threads, the calling one included. One thread, the default, runs
+     * everything on the calling thread. A parallel rebalance counts the
+     * elements of each part of the window, turns the counts into offsets
+     * with a prefix sum, and has every thread pack its parts into a scratch
+     * copy at those offsets; the threads then fill in the window, each a
+     * part of it, from the ranks whose targets land there. It applies to
+     * ONE_PHASE and ADAPTIVE; NAIVE is left as the plain two-phase
+     * algorithm, and incremental rebuilds stay on the calling thread.
+     */
+    void set_rebalance_threads(uint32_t threads);
+    uint32_t rebalance_threads() const;
+
+    /**
+     * Selects the algorithm used to redistribute the elements of a window,
+     * both for immediate rebalances and for incremental rebuilds. The
+     * elements may move while an incremental rebuild is under way, so it
+     * cannot follow a plan made up front, and with ADAPTIVE it spaces them
+     * out evenly as ONE_PHASE does.
+     */
+    void set_rebalance_algorithm(rebalance_algorithm_t algorithm);
+    rebalance_algorithm_t rebalance_algorithm() const;
     
     /**
      * When the packed-memory array becomes too full or too empty we recopy the
      * elements into a new pma that is a constant factor larger or smaller.
+     * Growing moves each old segment j, gaps included, to index
+     * SCALE_FACTOR * j of the old segment size. Every window above the
+     * leaves then sits at no more than 1 / SCALE_FACTOR of its previous
+     * density, so no rebalance pass is needed afterwards. Within a reserved
+     * capacity the array grows where it is and the segments are spread
+     * in place, highest first, so no element is copied more than once.
+     * The elements of any overflow buffers are merged into the grown array.
+     *
+     * A resize is not spread over the move budget. It runs to completion
+     * inside the operation that calls for it: every old segment but the
+     * first is moved, and the count tree and segment index are laid out
+     * afresh, an O(N) step. A reserved capacity saves the copy into larger
+     * arrays, but not the spread or the reindex.
      */
     void resize();
 
+    /**
+     * Shrinks the packed-memory array by SCALE_FACTOR, unless that would take
+     * it below INITIAL_CAPACITY. The elements are first spread out over the
+     * lower part of the array by a rebuild like any other, so with a move
+     * budget set the work is spread over the operations that follow. Once
+     * the rebuild completes, the array is cut down in place: no element is
+     * moved again, and the pages past the new capacity are handed back. The
+     * count tree and segment index are then laid out afresh inside the
+     * operation that completes the rebuild, which takes time in the number
+     * of segments rather than of elements.
+     */
+    void shrink();
+
     /**
      * Returns the number of indexes that are contained within a single 
      * segment.
@@ -213,6 +1167,23 @@ class pma {
      */
     uint32_t window_size(const uint32_t& window, const uint32_t length) const;
 
+    /**
+     * Returns the number of elements in the node of height h starting at
+     * index window. Unlike window_size this is a lookup in the count tree.
+     */
+    uint32_t window_count(const uint32_t& window, int height) const;
+
+    /**
+     * Returns the element counts at the density thresholds of a node of
+     * height h: an insert rebalances a node that reaches upper_count(h)
+     * elements, and an erase one that falls below lower_count(h). They are
+     * the density thresholds times window_capacity(h), rounded up, with
+     * upper_count(h) above the leaves kept low enough that spreading out
+     * the node leaves no segment full.
+     */
+    uint32_t upper_count(int height) const;
+    uint32_t lower_count(int height) const;
+
     /**
      * Returns whether a node of height h has children that are inside their
      * density thresholds.
@@ -220,6 +1191,457 @@ class pma {
     bool within_balance() const;    
 
   private:
+    /**
+     * position_to_insert by a branchless binary search over the positions of
+     * the segment, or ranking x among all of its keys with the vector
+     * kernels.
+     */
+    uint32_t position_to_insert(const uint32_t& segment, const Key& x,
+        std::false_type) const;
+    uint32_t position_to_insert(const uint32_t& segment, const Key& x,
+        std::true_type) const;
+
+    /**
+     * Returns whether position i of the segment starting at the given index
+     * holds an element not greater than x, reading a free position as the
+     * closest element before it and as less than x if there is none. The
+     * occupied positions of the segment are given as a bitmap word.
+     */
+    bool reads_not_above(uint32_t segment, uint64_t occupied, uint32_t i,
+        const Key& x) const;
+
+    /**
+     * Derives the segment size and tree height from the given capacity, and
+     * the element counts at the density thresholds of each height. The
+     * segment size is a power of two so that the number of segments is a
+     * power of two as well.
+     */
+    void compute_geometry(uint32_t capacity);
+
+    /**
+     * Returns the segment size of a pma with the given capacity: the one the
+     * policy picks, rounded up to whole cache lines if the policy is
+     * LINE_ALIGNED, capped at the capacity and at MAX_SEGMENT_SIZE.
+     */
+    static uint32_t segment_size_for(uint32_t capacity);
+
+    /**
+     * Changes the capacity of the free index bitmap and storage. The
+     * elements below both capacities stay where they are; the count tree and
+     * segment index must be laid out afresh by reindex. A persistent pma
+     * resizes its file, unless that fails, and it then carries on in memory.
+     */
+    void resize_arrays(uint32_t capacity);
+
+    /**
+     * Resizes the file from the arrays laid out for capacity laid_out to
+     * those for capacity, moving the bitmap and the storage over to the new
+     * layout, and points every array at its place in the file. Returns
+     * false, with nothing changed, if the file cannot grow.
+     */
+    bool map_arrays(uint32_t capacity, uint32_t laid_out);
+
+    /**
+     * Copies the arrays out of the file into memory and closes it.
+     */
+    void close_file();
+
+    /**
+     * Returns where the arrays start in the file for a given capacity.
+     */
+    static file_layout layout_file(uint32_t capacity);
+
+    /**
+     * Brings the file header up to date, marking the file clean or not.
+     */
+    void write_header(bool clean);
+
+    /**
+     * Checkpoints a logged pma, with the count tree and segment index and
+     * the file marked clean if clean is set.
+     */
+    bool checkpoint(bool clean);
+
+    /**
+     * Writes the pages of the last checkpoint the log holds whole to the
+     * file, should a crash have cut it short, and sets tail to the end of
+     * that checkpoint in the log, or to 0 if there is none.
+     */
+    static bool recover_file(mapped_file& file, const write_ahead_log& log,
+        uint64_t& tail);
+
+    /**
+     * Inserts and erases what the log holds past tail.
+     */
+    void replay(const write_ahead_log& log, uint64_t tail);
+
+    /**
+     * Appends an insert of x with the given value, or an erase of x, to
+     * the write-ahead log, if the pma is logged.
+     */
+    void log_change(uint32_t type, const Key& x,
+        const Value& value = Value());
+
+    /**
+     * Returns whether the header of a file of the given size describes a
+     * pma this one can map.
+     */
+    static bool valid_header(const file_header& header, size_t file_size);
+
+    /**
+     * Places x at index pos of the given segment, which must not be full, by
+     * shifting the elements between pos and the nearest free index over by
+     * one.
+     */
+    void insert_at(const uint32_t& segment, uint32_t pos, const Key& x,
+        const Value& value);
+
+    /**
+     * Lays out the count tree and the segment index afresh for the current
+     * capacity, from the free index bitmap and storage.
+     */
+    void reindex();
+
+    /**
+     * Lays out the count sorted keys starting at first evenly over the whole
+     * array for from_sorted, across the thread pool when the keys allow
+     * random access and the array is large enough.
+     */
+    template <class ForwardIterator>
+    void load_sorted(ForwardIterator first, uint32_t count,
+        std::forward_iterator_tag);
+    template <class RandomAccessIterator>
+    void load_sorted(RandomAccessIterator first, uint32_t count,
+        std::random_access_iterator_tag);
+
+    /**
+     * Writes array positions [window, window + length), whole bitmap words,
+     * for from_sorted: the keys of rank rank onwards, starting at it, as far
+     * as they land inside, and a cleared slot everywhere else. The leaf
+     * counts and separators of the segments inside are filled in as well.
+     */
+    template <class ForwardIterator>
+    void load_window(ForwardIterator it, uint32_t rank, uint32_t window,
+        uint32_t length, uint32_t count);
+
+    /**
+     * Merges the sorted keys in [first, last) with the elements of the
+     * given window, spreading the result out evenly over the window, and
+     * returns the number of keys added. The keys come with the values from
+     * first_value on, or default constructed ones if it is null. Keys
+     * already in the window are skipped. The window must have room for the
+     * rest. The overflow buffers of the window are emptied, so any elements
+     * they hold must be among the keys. The merged elements are staged in
+     * keys and values, which are passed in so that a batch can reuse them
+     * from one window to the next.
+     */
+    uint32_t merge_window(const uint32_t& window, const uint32_t& length,
+        const Key* first, const Key* last, const Value* first_value,
+        std::vector<Key>& keys, std::vector<Value>& values);
+
+    /**
+     * Returns the first index in [indexno, end) that is in use, or end if
+     * they are all free.
+     */
+    uint32_t next_occupied(uint32_t indexno, uint32_t end) const;
+
+    /**
+     * Returns the last index in [first, end) that is in use, or end if they
+     * are all free. Runs of empty segments are skipped through the count
+     * tree, so this is O(logn) however long the run.
+     */
+    uint32_t prev_occupied(uint32_t first, uint32_t end) const;
+
+    /**
+     * Returns the index of the smallest element not less than x, or
+     * capacity() if there is none.
+     */
+    uint32_t lower_bound_index(const Key& x) const;
+
+    /**
+     * Copies the elements of a segment for a concurrent reader, retrying
+     * until the copy is consistent.
+     */
+    void read_segment(uint32_t segment, segment_copy& copy) const;
+
+    /**
+     * Finds, for a concurrent reader, the segment holding the largest
+     * element less than x, or segment 0 if there is none, and copies it.
+     * Returns false if a segment changed under the walk.
+     */
+    bool read_locate(const Key& x, uint32_t& segment, segment_copy& copy) const;
+
+    /**
+     * Marks the segments overlapping indexes [first, end) as being written
+     * while concurrent readers are enabled, or as stable again.
+     */
+    void begin_write(uint32_t first, uint32_t end);
+    void end_write(uint32_t first, uint32_t end);
+
+    /**
+     * Shuts concurrent readers out while the buffers are replaced, and lets
+     * them back in with a version for each of the new segments.
+     */
+    void begin_resize();
+    void end_resize();
+
+    /**
+     * Inserts x for one of several concurrent inserting threads.
+     */
+    bool locked_insert(const Key& x, const Value& value);
+
+    /**
+     * Leaves x in the overflow buffer of the given full segment, which has
+     * room, for a concurrent insert holding its lock. Returns false, with
+     * nothing changed, if x is in the segment or its buffer already.
+     */
+    bool overflow_insert(const uint32_t& segment, const Key& x,
+        const Value& value);
+
+    /**
+     * Appends the elements of the overflow buffers of the given window to
+     * keys and values, in order.
+     */
+    void collect_overflow(const uint32_t& window, const uint32_t& length,
+        std::vector<Key>& keys, std::vector<Value>& values) const;
+
+    /**
+     * Queues the given segment for the background rebalancer, unless it is
+     * queued already.
+     */
+    void queue_rebalance(const uint32_t& segment);
+
+    /**
+     * Rebalances a window of the given height by merging the elements of its
+     * overflow buffers into it, and returns true, or returns false if they
+     * are all empty.
+     */
+    bool merge_overflow(const uint32_t& window, const uint32_t& length,
+        int height);
+
+    /**
+     * Empties the queue of the background rebalancer and its overflow
+     * buffers, and lays them out for the current capacity.
+     */
+    void reset_background();
+
+    /**
+     * The loop of the background rebalancer, and the work it does each time
+     * it is woken: rebalancing the queued segments, then growing the array
+     * if an insert found the root at its growth count.
+     */
+    void background_loop();
+    void background_rebalance();
+
+    /**
+     * Finds the segment to insert x into and locks it, returning the index
+     * that starts it. The locked array positions are [first, last).
+     */
+    uint32_t lock_segment(const Key& x, uint32_t& first, uint32_t& last);
+
+    /**
+     * Rebalances the closest ancestor of the given segment that is within
+     * its upper density threshold, for a concurrent insert holding the locks
+     * of positions [first, last). The locks held on return, which cover the
+     * window rebalanced, are written back. Returns false, with nothing
+     * rebalanced, if the root itself is over its threshold.
+     */
+    bool locked_rebalance(const uint32_t& segment, uint32_t& first,
+        uint32_t& last);
+
+    /**
+     * Grows the array for a concurrent insert, with every other insert shut
+     * out, unless the capacity has already moved on from old_capacity.
+     */
+    void locked_resize(uint32_t old_capacity);
+
+    /**
+     * Returns the nonempty segment closest to the given one on its right or
+     * its left, by the count tree, or number_of_segments() if there is none.
+     * While concurrent inserts run the answer is only a guess, to be checked
+     * under the locks.
+     */
+    uint32_t next_nonempty_segment(uint32_t segment) const;
+    uint32_t prev_nonempty_segment(uint32_t segment) const;
+
+    /**
+     * Adds delta to a counter that concurrent inserts share, atomically if
+     * they are enabled.
+     */
+    template <class T>
+    void shared_add(T& counter, T delta);
+
+    /**
+     * Adds delta to one of the counters in _stats if Policy::STATS is set.
+     */
+    void count_stat(uint64_t& counter, uint64_t delta);
+
+    /**
+     * Counts a window of the given height and length taken up for
+     * rebalancing.
+     */
+    void note_rebalance(int height, uint32_t length);
+
+    /**
+     * Returns the time now if Policy::STATS is set, for timing a resize.
+     */
+    std::chrono::steady_clock::time_point stats_clock() const;
+
+    /**
+     * Counts a change in capacity started at the given time, and traces its
+     * end.
+     */
+    void note_resize(std::chrono::steady_clock::time_point start, bool shrink);
+
+    /**
+     * Returns the count of a node of the implicit tree.
+     */
+    uint32_t node_count(uint32_t node) const;
+
+    /**
+     * Recomputes the separators of the segments in the given window, along
+     * with those of the empty segments that borrow from it.
+     */
+    void index_window(const uint32_t& window, const uint32_t& length);
+
+    /**
+     * Moves the count elements of a window to their targets in one pass.
+     * With planned null, the targets are evenly spaced; otherwise planned
+     * gives the target of each element by rank.
+     */
+    void place_window(const uint32_t& window, const uint32_t& length,
+        uint32_t count, const uint32_t* planned);
+
+    /**
+     * Moves the count elements of a window to their targets as place_window
+     * does, but across the thread pool and by way of a scratch copy. Returns
+     * the number of elements that changed position.
+     */
+    uint64_t parallel_place_window(const uint32_t& window,
+        const uint32_t& length, uint32_t count, const uint32_t* planned);
+
+    /**
+     * Moves the old segments of a growing array to SCALE_FACTOR times their
+     * indexes across the thread pool, as resize does. The old array above
+     * 1 / SCALE_FACTOR of its capacity goes first, then the same part of
+     * what is left, and so on, so that each part only lands on space the
+     * previous one has vacated. Stops once the rest is below
+     * PARALLEL_THRESHOLD and returns its length, leaving it to be spread by
+     * the calling thread.
+     */
+    uint32_t parallel_spread(uint32_t old_capacity, uint32_t old_segment_size);
+
+    /**
+     * Plans the indexes of the count elements of the given window for the
+     * ADAPTIVE algorithm, appending them to planned by rank.
+     */
+    void plan_window(const uint32_t& window, const uint32_t& length,
+        uint32_t count, std::vector<uint32_t>& planned);
+
+    /**
+     * Returns the predicted share of future inserts that land in the given
+     * window, relative to the other windows of the same length.
+     */
+    uint64_t insert_weight(const uint32_t& window, const uint32_t& length) const;
+
+    /**
+     * Returns the last nonempty segment whose first element is less than x,
+     * or not greater than x if inclusive, found through the count tree
+     * rather than the segment index. Returns number_of_segments() if there
+     * is none.
+     */
+    uint32_t search_count_tree(const Key& x, bool inclusive) const;
+
+    /**
+     * Returns the index of the first element under the given node of the
+     * implicit tree, which must hold at least one.
+     */
+    uint32_t first_under(uint32_t node) const;
+
+    /**
+     * Adds delta to the count of every node of the implicit tree on the path
+     * from the segment holding indexno up to the root.
+     */
+    void count_add(uint32_t indexno, int delta);
+
+    /**
+     * Recounts the nodes of the implicit tree inside the given window and
+     * above it, after its elements have been redistributed. With concurrent
+     * inserts the nodes above are left alone: a rebalance does not change
+     * the count of its window, and other inserts may be adding to them.
+     */
+    void count_window(const uint32_t& window, const uint32_t& length);
+
+    /**
+     * Moves the element held at index from into the free index to.
+     */
+    void move_element(uint32_t from, uint32_t to);
+
+    /**
+     * Keeps the rebuilds in flight consistent after an element has been 
+     * placed into the free index indexno.
+     */
+    void note_insert(uint32_t indexno);
+
+    /**
+     * Returns whether a window rebuild in flight covers indexno.
+     */
+    bool rebuild_pending(uint32_t indexno) const;
+
+    /**
+     * Runs the window rebuild in flight whose window contains indexno to
+     * completion. Returns false if no rebuild covers indexno.
+     */
+    bool finish_rebuild(uint32_t indexno);
+
+    /**
+     * Drops the rebuilds in flight whose windows lie inside the given window.
+     */
+    void cancel_rebuilds(const uint32_t& window, const uint32_t& length);
+
+    /**
+     * Queues a rebuild of the given window holding count elements, merging it
+     * with any rebuilds in flight that it contains or that contain it.
+     */
+    void schedule_rebuild(const uint32_t& window, const uint32_t& length,
+        const uint32_t& count);
+
+    /**
+     * Keeps the rebuilds in flight consistent after the element at indexno
+     * has been removed.
+     */
+    void note_erase(uint32_t indexno);
+
+    /**
+     * Performs a single step of the given rebuild. Returns true when the 
+     * rebuild has completed, after cutting down the array for a shrinking
+     * rebuild.
+     */
+    bool step_rebuild(rebuild_task& task);
+
+    /**
+     * Performs a single step of one of the sweeps of the given rebuild.
+     * Returns true when both sweeps are done.
+     */
+    bool sweep_rebuild(rebuild_task& task);
+
+    /**
+     * Cuts the array down to the length of the given shrinking rebuild,
+     * provided every element has made it below that length.
+     */
+    void finish_shrink(const rebuild_task& task);
+
+    /**
+     * Adapts the key ordering to the equality test std::unique expects.
+     */
+    struct equivalent {
+      Compare compare;
+      explicit equivalent(const Compare& c) : compare(c) {}
+      bool operator()(const Key& a, const Key& b) const {
+        return !compare(a, b) && !compare(b, a);
+      }
+    };
+
     /**
      * Computes the next highest power of 2 of 32-bit value v.
      * From Bit Twiddling Hacks by Sean Eron Anderson
@@ -237,10 +1659,44 @@ class pma {
       return v;
     }
 
+    /**
+     * Returns the index that the element of the given rank is spread to when
+     * count elements are evenly spaced out over a window, or the planned
+     * index of that rank when there is a plan.
+     */
+    static inline uint32_t target_index(const uint32_t* planned,
+        uint32_t window, uint32_t length, uint32_t count, uint32_t rank)
+    {
+      return planned ? planned[rank] : spread_index(window, length, count, rank);
+    }
+
+    /**
+     * Returns the index that the element of the given rank is spread to when
+     * count elements are evenly spaced out over a window.
+     */
+    static inline uint32_t spread_index(uint32_t window, uint32_t length,
+        uint32_t count, uint32_t rank)
+    {
+      return window + static_cast<uint64_t>(rank) * length / count;
+    }
+
     /** Is v a power of 2? */
     static inline bool is_power_of_2(uint32_t v) {
       return v & (v - 1);
     }
 };
 
+#define PMA_TEMPLATE \
+  template <class Key, class Value, class Compare, class Layout, class Policy>
+#define PMA_CLASS pma<Key, Value, Compare, Layout, Policy>
+#include "pma.tcc"
+#undef PMA_CLASS
+#undef PMA_TEMPLATE
+
+// Instantiated in pma.cc.
+extern template class pma<int>;
+extern template class pma<int, int, std::less<int>, aos_layout>;
+extern template class pma<int, int, std::less<int>, soa_layout>;
+extern template class pma<int, int, std::less<int>, delta_layout<> >;
+
 #endif // PMA_H
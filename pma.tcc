@@ -0,0 +1,2869 @@
+// pma.tcc
+// Packed-Memory Array
+// Written by Michael Corley
+// Stony Brook University
+// Cse638 Spring 2012
+//
+// Member definitions of the pma class template, included by pma.h.
+PMA_TEMPLATE
+PMA_CLASS::pma(const Compare& compare)
+  : _size(0),
+    _segment_index(compare),
+    _occupied_segments(0),
+    _shrinking(false),
+    _max_rebalance_moves(0),
+    _rebalance_algorithm(ONE_PHASE),
+    _compare(compare),
+    _element_moves(0),
+    _stats(),
+    _replaying(false)
+{
+  compute_geometry(INITIAL_CAPACITY);
+  _free_index_bitmap.resize(INITIAL_CAPACITY);
+  _storage.resize(INITIAL_CAPACITY);  
+  _count_tree.assign(2 * number_of_segments(), 0);
+  _segment_index.reset(number_of_segments());
+  _insert_heat.assign(number_of_segments(), 0);
+}
+
+PMA_TEMPLATE
+PMA_CLASS::~pma() {
+  // The rebalancer finishes what is queued before it stops.
+  if (_background) {
+    {
+      std::lock_guard<std::mutex> waking(_background->mutex);
+      _background->stop = true;
+    }
+    _background->wake.notify_one();
+    _background->thread.join();
+  }
+
+  // The derived arrays are only consistent between rebuilds.
+  if (_log) {
+    checkpoint(_rebuilds.empty());
+  } else if (_file) {
+    write_header(_rebuilds.empty());
+    _file->sync(0, _file->size());
+  }
+}
+
+PMA_TEMPLATE
+bool PMA_CLASS::open(const char* path, const char* log_path)
+{
+  if (_file || !pma_storage<Key, Value, Layout>::MAPPABLE ||
+      !std::is_trivially_copyable<Key>::value ||
+      !std::is_trivially_copyable<Value>::value)
+    return false;
+  std::unique_ptr<mapped_file> file(new mapped_file);
+  if (!file->open(path, log_path != 0))
+    return false;
+
+  // A logged file is first brought up to its last checkpoint.
+  std::unique_ptr<write_ahead_log> log;
+  uint64_t tail = 0;
+  if (log_path) {
+    log.reset(new write_ahead_log);
+    if (!log->open(log_path) || !recover_file(*file, *log, tail))
+      return false;
+  }
+
+  if (file->size() == 0) {
+    // The file is laid out for the current capacity and the arrays copied
+    // over, after which they live in the file.
+    finish_rebuilds();
+    const file_layout layout = layout_file(capacity());
+    if (!file->resize(layout.end))
+      return false;
+    _storage.copy_to(file->data() + layout.storage);
+    std::memcpy(file->data() + layout.bitmap, _free_index_bitmap.data(),
+        bitmap::words(capacity()) * sizeof(uint64_t));
+    begin_resize();
+    _file.swap(file);
+    _log.swap(log);
+    _dirty_segments.resize(number_of_segments());
+    _dirty_segments.set_range(0, number_of_segments());
+    map_arrays(capacity(), capacity());
+    reindex();
+    end_resize();
+    return sync();
+  }
+
+  if (file->size() < sizeof(file_header))
+    return false;
+  const file_header header = *reinterpret_cast<file_header*>(file->data());
+  if (!valid_header(header, file->size()))
+    return false;
+
+  // Everything is taken from the file as it is, except that after a crash
+  // the size and the derived arrays are recomputed from the bitmap.
+  _rebuilds.clear();
+  _shrinking = false;
+  begin_resize();
+  _file.swap(file);
+  map_arrays(header.capacity, header.capacity);
+  compute_geometry(header.capacity);
+  _insert_heat.assign(number_of_segments(), 0);
+  if (header.clean) {
+    _size = header.size;
+    _occupied_segments = header.occupied_segments;
+  } else {
+    _size = _free_index_bitmap.popcount(0, capacity());
+    reindex();
+  }
+  end_resize();
+  if (!log)
+    return true;
+
+  // Only what the replay writes to goes into the checkpoint after it.
+  _log.swap(log);
+  _dirty_segments.resize(number_of_segments());
+  _dirty_segments.clear_range(0, number_of_segments());
+  replay(*_log, tail);
+  return sync();
+}
+
+PMA_TEMPLATE
+bool PMA_CLASS::sync()
+{
+  if (_log)
+    return checkpoint(false);
+  if (!_file)
+    return false;
+  write_header(false);
+  return _file->sync(0, _file->size());
+}
+
+PMA_TEMPLATE
+bool PMA_CLASS::commit()
+{
+  return _log && _log->commit(_log->appended());
+}
+
+PMA_TEMPLATE
+bool PMA_CLASS::persistent() const {
+  return _file != 0;
+}
+
+PMA_TEMPLATE
+typename PMA_CLASS::key_reference PMA_CLASS::operator[] (uint32_t n) {
+  return _storage.key(n);
+}
+
+PMA_TEMPLATE
+typename PMA_CLASS::const_key_reference PMA_CLASS::operator[] (uint32_t n)
+  const
+{
+  return _storage.key(n);
+}
+
+PMA_TEMPLATE
+typename PMA_CLASS::const_iterator PMA_CLASS::begin() const {
+  return const_iterator(this, next_occupied(0, capacity()));
+}
+
+PMA_TEMPLATE
+typename PMA_CLASS::const_iterator PMA_CLASS::end() const {
+  return const_iterator(this, capacity());
+}
+
+PMA_TEMPLATE
+typename PMA_CLASS::const_iterator PMA_CLASS::find(const Key& x) const
+{
+  const uint32_t segment = segment_to_insert(x);
+  const uint32_t pos = position_to_insert(segment, x);
+  return const_iterator(this, pos > segment &&
+      !_compare(_storage.key(pos - 1), x) ? pos - 1 : capacity());
+}
+
+PMA_TEMPLATE
+bool PMA_CLASS::contains(const Key& x) const
+{
+  return find(x) != end();
+}
+
+PMA_TEMPLATE
+typename PMA_CLASS::const_iterator PMA_CLASS::lower_bound(const Key& x)
+  const
+{
+  // The segment of x holds the largest element not greater than x, if there
+  // is one; anything greater comes after it.
+  const uint32_t segment = segment_to_insert(x);
+  const uint32_t pos = position_to_insert(segment, x);
+  if (pos > segment && !_compare(_storage.key(pos - 1), x))
+    return const_iterator(this, pos - 1);
+  return const_iterator(this, next_occupied(pos, capacity()));
+}
+
+PMA_TEMPLATE
+typename PMA_CLASS::const_iterator PMA_CLASS::upper_bound(const Key& x)
+  const
+{
+  const uint32_t segment = segment_to_insert(x);
+  const uint32_t pos = position_to_insert(segment, x);
+  return const_iterator(this, next_occupied(pos, capacity()));
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::lookup_many(const Key* keys, uint32_t count,
+    uint32_t* positions) const
+{
+  uint32_t segments[LOOKUP_BATCH];
+  for (uint32_t first = 0; first < count; first += LOOKUP_BATCH) {
+    const uint32_t n = count - first < LOOKUP_BATCH ? count - first :
+      LOOKUP_BATCH;
+    if (_shrinking || _occupied_segments == 0) {
+      for (uint32_t k = 0; k < n; ++k)
+        segments[k] = segment_to_insert(keys[first + k]);
+    } else {
+      _segment_index.upper_bound_many(keys + first, n, segments);
+      for (uint32_t k = 0; k < n; ++k)
+        segments[k] = segments[k] == 0 ? 0 :
+          std::min(segments[k] - 1, _occupied_segments - 1) * _segment_size;
+    }
+
+    // Every segment of the batch is on its way into the cache before the
+    // first of them is searched.
+    for (uint32_t k = 0; k < n; ++k) {
+      _storage.prefetch(segments[k], _segment_size);
+      __builtin_prefetch(_free_index_bitmap.data() +
+          segments[k] / bitmap::WORD_BITS);
+    }
+    for (uint32_t k = 0; k < n; ++k) {
+      const Key& x = keys[first + k];
+      const uint32_t pos = position_to_insert(segments[k], x);
+      positions[first + k] = pos > segments[k] &&
+        !_compare(_storage.key(pos - 1), x) ? pos - 1 : capacity();
+    }
+  }
+}
+
+PMA_TEMPLATE
+typename PMA_CLASS::span_range PMA_CLASS::range(const Key& lo, const Key& hi)
+  const
+{
+  const uint32_t first = lower_bound_index(lo);
+  const uint32_t last = std::max(first, lower_bound_index(hi));
+  return span_range(span_iterator(this, first, last, false),
+      span_iterator(this, first, last, true));
+}
+
+PMA_TEMPLATE
+uint32_t PMA_CLASS::lower_bound_index(const Key& x) const
+{
+  const uint32_t pred = predecessor(x);
+  return next_occupied(pred == capacity() ? 0 : pred + 1, capacity());
+}
+
+PMA_TEMPLATE
+Value& PMA_CLASS::value(uint32_t n) {
+  return _storage.value(n);
+}
+
+PMA_TEMPLATE
+const Value& PMA_CLASS::value(uint32_t n) const {
+  return _storage.value(n);
+}
+
+PMA_TEMPLATE
+bool PMA_CLASS::insert(const Key& x, const Value& value)
+{
+  if (_insert_sync)
+    return locked_insert(x, value);
+  advance_rebuilds(_max_rebalance_moves);
+
+  // A full segment has no room to shift into, so rebalance until it does.
+  bool rebalanced = false;
+  uint32_t segment = segment_to_insert(x);
+  while (window_count(segment, 0) == _segment_size) {
+    rebalance(segment);
+    rebalanced = true;
+    segment = segment_to_insert(x);
+  }
+
+  const uint32_t pos = position_to_insert(segment, x);
+  if (pos > segment && !_compare(_storage.key(pos - 1), x))
+    return false;
+  insert_at(segment, pos, x, value);
+  log_change(LOG_INSERT, x, value);
+
+  // If segment density exceeds its upper density threshold from
+  // inserting x, start the rebalance algorithm.
+  if (window_count(segment, 0) >= _upper_count[0]) {
+    rebalance(segment);
+    rebalanced = true;
+  }
+  if (rebalanced)
+    count_stat(_stats.rebalancing_inserts, 1);
+  return true;
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::insert_at(const uint32_t& segment, uint32_t pos, const Key& x,
+    const Value& value)
+{
+  // Rearrange the elements within the leaf (segment) to make room for x by
+  // shifting them one index toward the closest free index on either side.
+  const uint32_t free_index = nearest_free_index(segment, pos);
+  begin_write(segment, segment + _segment_size);
+  if (free_index >= pos) {
+    _storage.move_range(pos + 1, pos, free_index - pos);
+    _storage.assign(pos, x, value);
+    shared_add(_element_moves, uint64_t(free_index - pos));
+  } else {
+    _storage.move_range(free_index, free_index + 1, pos - 1 - free_index);
+    _storage.assign(pos - 1, x, value);
+    shared_add(_element_moves, uint64_t(pos - 1 - free_index));
+  }
+  if (free_index == pos)
+    count_stat(_stats.free_slot_inserts, 1);
+  else
+    count_stat(_stats.shifted_inserts, 1);
+  _free_index_bitmap.set(free_index);
+  end_write(segment, segment + _segment_size);
+  shared_add(_size, 1u);
+  count_add(free_index, 1);
+  note_insert(free_index);
+  uint8_t& heat = _insert_heat[segment / _segment_size];
+  if (heat < UINT8_MAX)
+    heat++;
+
+  // x becomes the separator of its segment if it is now the first element.
+  const uint32_t slot = free_index >= pos ? pos : pos - 1;
+  if (next_occupied(segment, slot) == slot)
+    index_window(segment, _segment_size);
+}
+
+PMA_TEMPLATE
+template <class InputIterator>
+uint32_t PMA_CLASS::insert_batch(InputIterator first, InputIterator last)
+{
+  // The windows are chosen from the counts as they stand, so settle every
+  // rebuild in flight first.
+  finish_rebuilds();
+
+  std::vector<Key> batch(first, last);
+  std::sort(batch.begin(), batch.end(), _compare);
+  batch.erase(std::unique(batch.begin(), batch.end(), equivalent(_compare)),
+      batch.end());
+  if (batch.empty())
+    return 0;
+
+  // Keys already present are logged too, as replaying them changes nothing.
+  for (uint32_t k = 0; k < batch.size(); ++k)
+    log_change(LOG_INSERT, batch[k]);
+
+  // Note the segment each key is bound for. Since the batch is sorted, so
+  // are the segments. Keys that are already present are only weeded out
+  // once they reach their segment, so until then the counts below may be
+  // overestimates, which merely err toward larger windows.
+  std::vector<uint32_t> segments(batch.size());
+  for (uint32_t k = 0; k < batch.size(); ++k)
+    segments[k] = segment_to_insert(batch[k]) / _segment_size;
+
+  // Climb from the segment of each group of keys to the closest ancestor
+  // that stays within threshold once every batch key inside it has been
+  // added. Windows at the same height are aligned, so any two chosen
+  // windows are either nested or disjoint, and only the outermost are kept.
+  std::vector<std::pair<uint32_t, uint32_t> > windows;
+  bool grow = false;
+  for (uint32_t b = 0; b < batch.size() && !grow; ) {
+    uint32_t window = segments[b] * _segment_size;
+    uint32_t length = _segment_size;
+    uint32_t end_b = b;
+    for (int height = 0; ; ++height) {
+      if (height > _implicit_tree_height) {
+        grow = true;
+        break;
+      }
+      if (height > 0) {
+        length <<= 1;
+        window -= window % length;
+      }
+      const uint32_t first_segment = window / _segment_size;
+      const uint32_t last_segment = (window + length) / _segment_size;
+      const uint32_t begin_b = std::lower_bound(segments.begin(),
+          segments.begin() + b, first_segment) - segments.begin();
+      end_b = std::lower_bound(segments.begin() + b, segments.end(),
+          last_segment) - segments.begin();
+      if (window_count(window, height) + end_b - begin_b <
+          _upper_count[height])
+        break;
+    }
+    if (grow)
+      break;
+
+    while (!windows.empty() && window <= windows.back().first)
+      windows.pop_back();
+    windows.push_back(std::make_pair(window, length));
+    b = end_b;
+  }
+
+  if (grow) {
+    // Drop the keys already present to learn how many are really new, then
+    // grow once to the first capacity whose root can take them all, leaving
+    // the elements where they are, and merge the batch into the whole array.
+    uint32_t n = 0;
+    for (uint32_t k = 0; k < batch.size(); ++k) {
+      const uint32_t segment = segments[k] * _segment_size;
+      const uint32_t pos = position_to_insert(segment, batch[k]);
+      if (pos > segment && !_compare(_storage.key(pos - 1), batch[k]))
+        continue;
+      if (n != k)
+        batch[n] = std::move(batch[k]);
+      n++;
+    }
+    batch.erase(batch.begin() + n, batch.end());
+
+    // The root's count threshold at each capacity is the one
+    // compute_geometry would set, so a batch grows the array at the same
+    // count as single inserts do.
+    uint32_t new_capacity = capacity();
+    while (_size + n >= std::ceil(ROOT_UPPER_DENSITY * new_capacity))
+      new_capacity *= SCALE_FACTOR;
+    if (new_capacity != capacity()) {
+      _rebuilds.clear();
+      const std::chrono::steady_clock::time_point start = stats_clock();
+      Policy::trace(TRACE_RESIZE_BEGIN, 0, capacity());
+      begin_resize();
+      resize_arrays(new_capacity);
+      compute_geometry(new_capacity);
+      reindex();
+      end_resize();
+      note_resize(start, false);
+    }
+    windows.assign(1, std::make_pair(0u, new_capacity));
+    segments.assign(n, 0);
+  }
+
+  std::vector<Key> keys;
+  std::vector<Value> values;
+  uint32_t added = 0;
+  for (uint32_t w = 0; w < windows.size(); ++w) {
+    const uint32_t window = windows[w].first;
+    const uint32_t length = windows[w].second;
+    const uint32_t lo = std::lower_bound(segments.begin(), segments.end(),
+        window / _segment_size) - segments.begin();
+    const uint32_t hi = std::lower_bound(segments.begin(), segments.end(),
+        (window + length) / _segment_size) - segments.begin();
+
+    // A segment that can take its keys has them shifted in one at a time
+    // as insert would, which moves far fewer elements than a merge of the
+    // whole segment when only a few keys land in it.
+    if (length == _segment_size) {
+      for (uint32_t k = lo; k < hi; ++k) {
+        const uint32_t pos = position_to_insert(window, batch[k]);
+        if (pos > window && !_compare(_storage.key(pos - 1), batch[k]))
+          continue;
+        insert_at(window, pos, batch[k], Value());
+        added++;
+      }
+      continue;
+    }
+    const uint32_t merged = merge_window(window, length, batch.data() + lo,
+        batch.data() + hi, 0, keys, values);
+    shared_add(_size, merged);
+    added += merged;
+  }
+  return added;
+}
+
+PMA_TEMPLATE
+template <class ForwardIterator>
+void PMA_CLASS::from_sorted(ForwardIterator first, ForwardIterator last,
+    double target_density)
+{
+  // A density at or above the root's upper threshold would build an array
+  // over it, and one at or below zero would never stop growing.
+  if (!(target_density >= ROOT_LOWER_DENSITY))
+    target_density = ROOT_LOWER_DENSITY;
+  else if (target_density > ROOT_UPPER_DENSITY)
+    target_density = ROOT_UPPER_DENSITY;
+  const uint32_t count = std::distance(first, last);
+  uint32_t new_capacity = INITIAL_CAPACITY;
+  while (count >= target_density * new_capacity &&
+         new_capacity <= UINT32_MAX / SCALE_FACTOR)
+    new_capacity *= SCALE_FACTOR;
+
+  // The old contents go along with any rebuilds in flight, and every array
+  // is laid out afresh for the new capacity.
+  _rebuilds.clear();
+  _shrinking = false;
+  begin_resize();
+  resize_arrays(new_capacity);
+  compute_geometry(new_capacity);
+  const uint32_t segments = number_of_segments();
+  _count_tree.assign(2 * segments, 0);
+  _segment_index.reset(segments);
+  _insert_heat.assign(segments, 0);
+  _size = count;
+  load_sorted(first, count,
+      typename std::iterator_traits<ForwardIterator>::iterator_category());
+
+  // The pass filled in the leaves of the count tree and the separators of
+  // the nonempty segments. Sum up the rest of the tree, and hand each empty
+  // segment the separator of the next nonempty one, or of the last one past
+  // the end, which keeps the separators sorted as index_window needs.
+  for (uint32_t node = segments; node-- > 1; )
+    _count_tree[node] = _count_tree[2 * node] + _count_tree[2 * node + 1];
+  _occupied_segments = 0;
+  bool carry = false;
+  Key next = Key();
+  for (uint32_t seg = segments; seg-- > 0; ) {
+    if (_count_tree[segments + seg] > 0) {
+      if (!carry)
+        _occupied_segments = seg + 1;
+      next = _segment_index.key(seg);
+      carry = true;
+    } else if (carry) {
+      _segment_index.set_key(seg, next);
+    }
+  }
+  if (_occupied_segments > 0) {
+    const Key tail = _segment_index.key(_occupied_segments - 1);
+    for (uint32_t seg = _occupied_segments; seg < segments; ++seg)
+      _segment_index.set_key(seg, tail);
+  }
+  end_resize();
+
+  // A logged pma has no record to replay this from, so checkpoint it.
+  if (_log)
+    sync();
+}
+
+PMA_TEMPLATE
+template <class ForwardIterator>
+void PMA_CLASS::load_sorted(ForwardIterator first, uint32_t count,
+    std::forward_iterator_tag)
+{
+  load_window(first, 0, 0, capacity(), count);
+}
+
+PMA_TEMPLATE
+template <class RandomAccessIterator>
+void PMA_CLASS::load_sorted(RandomAccessIterator first, uint32_t count,
+    std::random_access_iterator_tag)
+{
+  const uint32_t length = capacity();
+  if (!_thread_pool || length < PARALLEL_THRESHOLD) {
+    load_window(first, 0, 0, length, count);
+    return;
+  }
+
+  // Each run starts at the first rank spread to it, so the runs can be
+  // laid out independently. A run is a whole number of bitmap words and of
+  // segments, so no two runs write the same word, leaf, or separator.
+  _thread_pool->run(length / PARALLEL_GRAIN, [&](uint32_t t) {
+    const uint32_t window = t * PARALLEL_GRAIN;
+    const uint32_t rank =
+      (static_cast<uint64_t>(window) * count + length - 1) / length;
+    load_window(first + rank, rank, window, PARALLEL_GRAIN, count);
+  });
+}
+
+PMA_TEMPLATE
+template <class ForwardIterator>
+void PMA_CLASS::load_window(ForwardIterator it, uint32_t rank,
+    uint32_t window, uint32_t length, uint32_t count)
+{
+  const uint32_t capacity = this->capacity();
+  const uint32_t segments = number_of_segments();
+  const uint32_t end = window + length;
+  uint32_t next = rank < count ?
+    spread_index(0, capacity, count, rank) : capacity;
+  for (uint32_t w = window; w < end; w += bitmap::WORD_BITS) {
+    const uint32_t word_end = std::min(w + bitmap::WORD_BITS, end);
+    uint64_t bits = 0;
+    for (uint32_t i = w; i < word_end; ++i) {
+      if (i != next) {
+        _storage.clear(i, i + 1);
+        continue;
+      }
+      _storage.assign(i, *it, Value());
+      bits |= uint64_t(1) << (i - w);
+      const uint32_t seg = i / _segment_size;
+      if (_count_tree[segments + seg]++ == 0)
+        _segment_index.set_key(seg, *it);
+      ++it;
+      next = ++rank < count ? spread_index(0, capacity, count, rank) : capacity;
+    }
+    _free_index_bitmap.set_word(w / bitmap::WORD_BITS, bits);
+  }
+}
+
+PMA_TEMPLATE
+uint32_t PMA_CLASS::merge_window(const uint32_t& window,
+    const uint32_t& length, const Key* first, const Key* last,
+    const Value* first_value, std::vector<Key>& keys,
+    std::vector<Value>& values)
+{
+  // Merge into the buffers in one pass over the window, then write the
+  // elements back out evenly spaced. A batch key equivalent to an element
+  // of the window is skipped.
+  const uint32_t end = window + length;
+  keys.clear();
+  values.clear();
+  begin_write(window, end);
+  uint32_t merged = 0;
+  uint32_t i = next_occupied(window, end);
+  while (i < end || first != last) {
+    if (first == last || (i < end && _compare(_storage.key(i), *first))) {
+      keys.push_back(std::move(_storage.key(i)));
+      values.push_back(std::move(_storage.value(i)));
+      i = next_occupied(i + 1, end);
+    } else if (i < end && !_compare(*first, _storage.key(i))) {
+      ++first;
+      if (first_value)
+        ++first_value;
+    } else {
+      keys.push_back(*first++);
+      values.push_back(first_value ? *first_value++ : Value());
+      merged++;
+    }
+  }
+
+  const uint32_t size = keys.size();
+  if (_background) {
+    for (uint32_t seg = window / _segment_size; seg < end / _segment_size;
+         ++seg)
+      __atomic_store_n(&_background->overflow[seg].count, 0u,
+          __ATOMIC_RELAXED);
+  }
+  _free_index_bitmap.clear_range(window, end);
+  for (uint32_t rank = 0; rank < size; ++rank) {
+    const uint32_t target = spread_index(window, length, size, rank);
+    _storage.assign(target, keys[rank], values[rank]);
+    _free_index_bitmap.set(target);
+  }
+  end_write(window, end);
+  shared_add(_element_moves, uint64_t(size - merged));
+  count_window(window, length);
+  index_window(window, length);
+  return merged;
+}
+
+PMA_TEMPLATE
+bool PMA_CLASS::erase(const Key& x)
+{
+  advance_rebuilds(_max_rebalance_moves);
+
+  const uint32_t segment = segment_to_insert(x);
+  const uint32_t pos = position_to_insert(segment, x);
+  if (pos == segment || _compare(_storage.key(pos - 1), x))
+    return false;
+
+  const uint32_t indexno = pos - 1;
+  const bool first = next_occupied(segment, indexno) == indexno;
+  begin_write(indexno, pos);
+  _storage.clear(indexno, pos);
+  _free_index_bitmap.clear(indexno);
+  end_write(indexno, pos);
+  _size--;
+  count_add(indexno, -1);
+  note_erase(indexno);
+  log_change(LOG_ERASE, x);
+
+  // The segment needs a new separator if x was its first element.
+  if (first)
+    index_window(segment, _segment_size);
+
+  // If segment density falls below its lower density threshold from
+  // erasing x, start the rebalance algorithm.
+  if (window_count(segment, 0) < _lower_count[0])
+    rebalance(segment);
+  return true;
+}
+
+PMA_TEMPLATE
+uint32_t PMA_CLASS::nearest_free_index(const uint32_t& segment, uint32_t indexno) const
+{
+  const uint32_t end = segment + _segment_size;
+  const uint32_t right = _free_index_bitmap.find_next_clear(indexno, end);
+  const uint32_t left = _free_index_bitmap.find_prev_clear(segment, indexno);
+
+  if (left == indexno)
+    return right;
+  if (right == end || indexno - 1 - left < right - indexno)
+    return left;
+  return right;
+}
+
+PMA_TEMPLATE
+uint32_t PMA_CLASS::segment_to_insert(const Key& x) const
+{
+  if (_shrinking) {
+    const uint32_t seg = search_count_tree(x, true);
+    return seg == static_cast<uint32_t>(number_of_segments()) ?
+      0 : seg * _segment_size;
+  }
+
+  // O(logn) steps to narrow down a segment to scan. Empty segments carry the
+  // separator of the next nonempty one, so the last segment whose separator
+  // does not exceed x is nonempty unless it lies past the last element.
+  // Concurrent inserts change the index meanwhile, so the last nonempty
+  // segment is loaded atomically, like the separators.
+  const uint32_t occupied =
+    __atomic_load_n(&_occupied_segments, __ATOMIC_RELAXED);
+  if (occupied == 0)
+    return 0;
+  uint32_t seg = _segment_index.upper_bound(x);
+  if (seg == 0)
+    return 0;
+  seg = std::min(seg - 1, occupied - 1);
+  return seg * _segment_size;
+}
+
+PMA_TEMPLATE
+uint32_t PMA_CLASS::predecessor(const Key& x) const
+{
+  uint32_t seg;
+  if (_shrinking) {
+    seg = search_count_tree(x, false);
+    if (seg == static_cast<uint32_t>(number_of_segments()))
+      return capacity();
+  } else {
+    if (_occupied_segments == 0)
+      return capacity();
+    seg = _segment_index.lower_bound(x);
+    if (seg == 0)
+      return capacity();
+    seg = std::min(seg - 1, _occupied_segments - 1);
+  }
+
+  // The segment holds an element less than x, namely its first one.
+  uint32_t i = (seg + 1) * _segment_size;
+  while (index_is_free(--i) || !_compare(_storage.key(i), x))
+    ;
+  return i;
+}
+
+PMA_TEMPLATE
+uint32_t PMA_CLASS::search_count_tree(const Key& x, bool inclusive) const
+{
+  // Go right whenever the first element under the right child qualifies.
+  // Finding that element is a descent of its own, so a search is O(log^2 n)
+  // rather than O(log n), but only while a shrink is in flight.
+  const uint32_t segments = number_of_segments();
+  if (_count_tree[1] == 0)
+    return segments;
+  uint32_t node = 1;
+  while (node < segments) {
+    const uint32_t right = 2 * node + 1;
+    if (_count_tree[right] > 0) {
+      const Key& first = _storage.key(first_under(right));
+      if (inclusive ? !_compare(x, first) : _compare(first, x)) {
+        node = right;
+        continue;
+      }
+    }
+    node = 2 * node;
+    if (_count_tree[node] == 0)
+      return segments;
+  }
+  const Key& first = _storage.key(first_under(node));
+  if (!(inclusive ? !_compare(x, first) : _compare(first, x)))
+    return segments;
+  return node - segments;
+}
+
+PMA_TEMPLATE
+uint32_t PMA_CLASS::first_under(uint32_t node) const
+{
+  const uint32_t segments = number_of_segments();
+  while (node < segments)
+    node = _count_tree[2 * node] > 0 ? 2 * node : 2 * node + 1;
+  const uint32_t seg = (node - segments) * _segment_size;
+  return next_occupied(seg, seg + _segment_size);
+}
+
+PMA_TEMPLATE
+uint32_t PMA_CLASS::position_to_insert(const uint32_t& segment, const Key& x) const
+{
+  return position_to_insert(segment, x,
+      std::integral_constant<bool, VECTOR_SEARCH>());
+}
+
+PMA_TEMPLATE
+uint32_t PMA_CLASS::position_to_insert(const uint32_t& segment, const Key& x,
+    std::false_type) const
+{
+  // Locate the index just past the last element in the segment that does
+  // not exceed x. A free position reads as a copy of the closest element
+  // before it, or as less than anything before the first element, so the
+  // keys read are sorted across every position of the segment and a binary
+  // search over them steps without branching on the comparisons. No free
+  // position is ever read itself.
+  //
+  // The gaps are filled in only as read, through the segment's bitmap
+  // word, and not with duplicate keys in the storage. Stored copies would
+  // have to be rewritten by every insert, erase and move that changes the
+  // element before a run of gaps, which breaks the one write per moved
+  // element that rebalancing and the move budget count on. Free slots of
+  // delta_layout hold no key that could be read back, and concurrent
+  // readers would see the copies change under them. A segment's occupancy
+  // is one bitmap word, so a probe costs two bit operations more.
+  const uint64_t occupied = _free_index_bitmap.word_bits(segment,
+      _segment_size);
+  if (occupied == 0)
+    return segment;
+
+  // Find the first position that reads greater than x.
+  uint32_t base = 0;
+  for (uint32_t n = _segment_size; n > 1; n -= n / 2)
+    base = reads_not_above(segment, occupied, base + n / 2, x) ?
+      base + n / 2 : base;
+  const uint32_t end = base + reads_not_above(segment, occupied, base, x);
+  const uint64_t lower = end == bitmap::WORD_BITS ? occupied :
+    occupied & ((uint64_t(1) << end) - 1);
+  return lower ? segment + 64 - __builtin_clzll(lower) : segment;
+}
+
+PMA_TEMPLATE
+bool PMA_CLASS::reads_not_above(uint32_t segment, uint64_t occupied,
+    uint32_t i, const Key& x) const
+{
+  // The closest element at or before i, or the first element if there is
+  // none, which is then not compared.
+  const uint64_t before = occupied & (~uint64_t(0) >> (63 - i));
+  const uint32_t at = 63 - __builtin_clzll(before | (occupied & -occupied));
+  return (before == 0) | !_compare(x, _storage.key(segment + at));
+}
+
+PMA_TEMPLATE
+uint32_t PMA_CLASS::position_to_insert(const uint32_t& segment, const Key& x,
+    std::true_type) const
+{
+  // The elements not exceeding x are the occupied positions whose keys x is
+  // not less than, and they come before all the others.
+  typename pma_storage<Key, Value, Layout>::span_buffer buffer;
+  const uint64_t lower = _free_index_bitmap.word_bits(segment, _segment_size) &
+    ~key_greater_mask(_storage.keys(segment, _segment_size, buffer),
+        _segment_size, x);
+  return lower ? segment + 64 - __builtin_clzll(lower) : segment;
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::rebalance(const uint32_t& segment)
+{
+  const bool sparse = window_count(segment, 0) < _lower_count[0];
+
+  // A rebuild in flight over this segment is already redistributing its
+  // elements. A segment that is too full has to wait for it to finish, but
+  // one that is too sparse can leave the rebuild to run its course.
+  if (sparse ? rebuild_pending(segment) : finish_rebuild(segment))
+    return;
+
+  uint32_t window = segment;
+  uint32_t length = _segment_size;
+
+  // Find closest ancenstor whose density is within the permitted 
+  // threshold.
+  uint32_t sz = 0;
+  int height;
+  for (height = 1; ; ++height) {
+    // This ancestor is also out of balance!
+    if (height > _implicit_tree_height) {
+      if (sparse)
+        shrink();
+      else
+        resize();
+      return;
+    }
+
+    length <<= 1;
+    window -= window % length;
+
+    sz = window_count(window, height);
+    if (sparse ? sz >= _lower_count[height] :
+        sz < _upper_count[height]) // Within permitted threshold
+      break;
+  }
+
+  // Small windows, or every window when no move budget is set, are rebuilt
+  // immediately. Larger ones are handed to the incremental rebuilder.
+  if (_max_rebalance_moves == 0 || length <= _max_rebalance_moves) {
+    cancel_rebuilds(window, length);
+    rebalance_window(window, length, height);
+  } else {
+    note_rebalance(height, length);
+    schedule_rebuild(window, length, sz);
+  }
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::rebalance_window(const uint32_t& window, const uint32_t& length,
+    int height)
+{
+  note_rebalance(height, length);
+  Policy::trace(TRACE_REBALANCE_BEGIN, window, length);
+  if (_rebalance_algorithm == ADAPTIVE)
+    adaptive_rebalance(window, length);
+  else if (_rebalance_algorithm == ONE_PHASE)
+    one_phase_rebalance(window, length);
+  else
+    naive_rebalance(window, length);
+  Policy::trace(TRACE_REBALANCE_END, window, length);
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::clear_window(const uint32_t& window, const uint32_t& length)
+{
+  begin_write(window, window + length);
+  _storage.clear(window, window + length);
+  _free_index_bitmap.clear_range(window, window + length);
+  end_write(window, window + length);
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::naive_rebalance(const uint32_t& window, const uint32_t& length)
+{
+  // We rebalance a node as follows:
+  //    1.) Compress all the elements to the left part of the node without 
+  //        adding empty spaces.
+  //    2.) Evenly space out those elements, proceeding from right to left.
+  // This rebalance algorithm requires two phases, and each phase needs to scan
+  // the whole node.
+  const uint32_t size = window_size(window, length);
+  if (size == 0)
+    return;
+
+  // Windows start on a multiple of their power of two length, so a chunk
+  // of the window never straddles two bitmap words.
+  const uint32_t end = window + length;
+  const uint32_t chunk = length < bitmap::WORD_BITS ? length :
+    bitmap::WORD_BITS;
+  uint64_t moves = 0;
+  begin_write(window, end);
+  uint32_t next_index = window;
+  for (uint32_t first = window; first < end; first += chunk) {
+    const uint64_t bits = _free_index_bitmap.word_bits(first, chunk);
+    const uint32_t count = __builtin_popcountll(bits);
+    if (count == 0)
+      continue;
+
+    // The elements before the first gap of the window stay where they are.
+    const uint32_t staying = next_index != first ? 0 :
+      ~bits ? __builtin_ctzll(~bits) : bitmap::WORD_BITS;
+    if (staying < count) {
+      _storage.compress(next_index, first, chunk, bits);
+      moves += count - staying;
+    }
+    next_index += count;
+  }
+
+  // The targets of the ranks grow faster than the ranks, so each chunk
+  // takes the ranks below those of the chunks after it.
+  uint32_t rank = size;
+  for (uint32_t first = end; first > window; ) {
+    first -= chunk;
+    uint64_t bits = 0;
+    const uint32_t last_rank = rank;
+    for (; rank > 0; --rank) {
+      const uint32_t target = spread_index(window, length, size, rank - 1);
+      if (target < first)
+        break;
+      bits |= uint64_t(1) << (target - first);
+      moves += target != window + rank - 1;
+    }
+    if (rank < last_rank &&
+        spread_index(window, length, size, last_rank - 1) !=
+        window + last_rank - 1)
+      _storage.expand(first, chunk, window + rank, bits);
+    _free_index_bitmap.set_bits(first, chunk, bits);
+  }
+  shared_add(_element_moves, moves);
+  end_write(window, end);
+  count_window(window, length);
+  index_window(window, length);
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::one_phase_rebalance(const uint32_t& window, const uint32_t& length)
+{
+  const uint32_t size = window_size(window, length);
+  if (size == 0)
+    return;
+  place_window(window, length, size, 0);
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::adaptive_rebalance(const uint32_t& window, const uint32_t& length)
+{
+  const uint32_t size = window_size(window, length);
+  if (size == 0)
+    return;
+
+  // Concurrent inserts may be rebalancing other windows at the same time,
+  // so each plans into a vector of its own.
+  std::vector<uint32_t> own;
+  std::vector<uint32_t>& planned = _insert_sync ? own : _planned_index;
+  planned.clear();
+  plan_window(window, length, size, planned);
+  for (uint32_t seg = window / _segment_size;
+       seg < (window + length) / _segment_size; ++seg)
+    _insert_heat[seg] >>= 1;
+  place_window(window, length, size, &planned[0]);
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::plan_window(const uint32_t& window, const uint32_t& length,
+    uint32_t count, std::vector<uint32_t>& planned)
+{
+  if (length == _segment_size) {
+    for (uint32_t rank = 0; rank < count; ++rank)
+      planned.push_back(spread_index(window, length, count, rank));
+    return;
+  }
+
+  // Split the free space between the children by their predicted inserts,
+  // then keep each child below its upper count threshold, so that the next
+  // insert into it does not rebalance it again.
+  const uint32_t half = length / 2;
+  const int height = std::log2(half / _segment_size);
+  const uint32_t room = std::min(half, _upper_count[height] - 1);
+  const uint64_t left_weight = insert_weight(window, half);
+  const uint64_t right_weight = insert_weight(window + half, half);
+  const uint64_t left_free = (length - count) * left_weight /
+    (left_weight + right_weight);
+  uint32_t left = half - std::min<uint64_t>(left_free, half);
+  const uint32_t least = count > room ? count - room : 0;
+  const uint32_t most = std::min(count, room);
+  if (least > most)
+    left = count / 2;
+  else
+    left = std::min(std::max(left, least), most);
+  plan_window(window, half, left, planned);
+  plan_window(window + half, half, count - left, planned);
+}
+
+PMA_TEMPLATE
+uint64_t PMA_CLASS::insert_weight(const uint32_t& window, const uint32_t& length) const
+{
+  // Every segment carries a baseline weight of one, so that a window with
+  // no recent inserts still gets a share of the gaps.
+  const uint32_t first = window / _segment_size;
+  const uint32_t last = (window + length) / _segment_size;
+  uint64_t weight = last - first;
+  for (uint32_t seg = first; seg < last; ++seg)
+    weight += static_cast<uint64_t>(HEAT_WEIGHT) * _insert_heat[seg];
+  return weight;
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::place_window(const uint32_t& window, const uint32_t& length,
+    uint32_t size, const uint32_t* planned)
+{
+  // The free index bitmap keeps describing the original layout until the
+  // end, so it is scanned to find each element where it started. A value is
+  // only ever written over a slot that is free or whose element has already
+  // been moved out.
+  const uint32_t end = window + length;
+  begin_write(window, end);
+  if (_thread_pool && length >= PARALLEL_THRESHOLD) {
+    shared_add(_element_moves,
+        parallel_place_window(window, length, size, planned));
+    end_write(window, end);
+    count_window(window, length);
+    index_window(window, length);
+    return;
+  }
+
+  uint32_t rank = 0;
+  uint32_t i = window;
+  while (rank < size) {
+    i = _free_index_bitmap.find_next_set(i, end);
+    uint32_t target = target_index(planned, window, length, size, rank);
+    if (target <= i) {
+      if (target != i) {
+        _storage.move(i, target);
+        shared_add(_element_moves, uint64_t(1));
+      }
+      ++rank;
+      ++i;
+      continue;
+    }
+
+    // Find the end of this run of elements that move right, then move them
+    // starting from its last element.
+    const uint32_t first_rank = rank;
+    uint32_t last = i;
+    for (++rank, ++i; rank < size; ++rank, ++i) {
+      i = _free_index_bitmap.find_next_set(i, end);
+      if (target_index(planned, window, length, size, rank) <= i)
+        break;
+      last = i;
+    }
+    for (uint32_t r = rank, j = last + 1; r-- > first_rank; ) {
+      j = _free_index_bitmap.find_prev_set(window, j);
+      _storage.move(j, target_index(planned, window, length, size, r));
+      shared_add(_element_moves, uint64_t(1));
+    }
+    i = last + 1;
+  }
+
+  _free_index_bitmap.clear_range(window, end);
+  for (rank = 0; rank < size; ++rank)
+    _free_index_bitmap.set(target_index(planned, window, length, size, rank));
+  end_write(window, end);
+  count_window(window, length);
+  index_window(window, length);
+}
+
+PMA_TEMPLATE
+uint64_t PMA_CLASS::parallel_place_window(const uint32_t& window,
+    const uint32_t& length, uint32_t size, const uint32_t* planned)
+{
+  // Each task covers a run of PARALLEL_GRAIN positions, a whole number of
+  // bitmap words, so no two tasks write the same word. The elements in the
+  // runs are counted and the counts summed into the rank of the first
+  // element of each run, then every task packs its run into the scratch
+  // copy starting at that rank.
+  const uint32_t tasks = length / PARALLEL_GRAIN;
+  std::vector<uint32_t> rank(tasks + 1, 0);
+  _thread_pool->run(tasks, [&](uint32_t t) {
+    const uint32_t first = window + t * PARALLEL_GRAIN;
+    rank[t + 1] = _free_index_bitmap.popcount(first, first + PARALLEL_GRAIN);
+  });
+  for (uint32_t t = 0; t < tasks; ++t)
+    rank[t + 1] += rank[t];
+
+  std::unique_ptr<Key[]> keys(new Key[size]);
+  std::unique_ptr<Value[]> values(new Value[size]);
+  std::unique_ptr<uint32_t[]> from(new uint32_t[size]);
+  _thread_pool->run(tasks, [&](uint32_t t) {
+    const uint32_t first = window + t * PARALLEL_GRAIN;
+    const uint32_t last = first + PARALLEL_GRAIN;
+    uint32_t r = rank[t];
+    for (uint32_t i = _free_index_bitmap.find_next_set(first, last); i < last;
+         i = _free_index_bitmap.find_next_set(i + 1, last), ++r) {
+      keys[r] = std::move(_storage.key(i));
+      values[r] = std::move(_storage.value(i));
+      from[r] = i;
+    }
+  });
+
+  // Every task then fills its run from the ranks whose targets land in it,
+  // the first of which follows from the targets being sorted by rank.
+  std::vector<uint64_t> moves(tasks, 0);
+  _thread_pool->run(tasks, [&](uint32_t t) {
+    const uint32_t first = window + t * PARALLEL_GRAIN;
+    const uint32_t last = first + PARALLEL_GRAIN;
+    uint32_t r = planned ?
+      std::lower_bound(planned, planned + size, first) - planned :
+      (static_cast<uint64_t>(first - window) * size + length - 1) / length;
+    _free_index_bitmap.clear_range(first, last);
+    for (; r < size; ++r) {
+      const uint32_t target = target_index(planned, window, length, size, r);
+      if (target >= last)
+        break;
+      _storage.assign(target, std::move(keys[r]), std::move(values[r]));
+      _free_index_bitmap.set(target);
+      moves[t] += target != from[r];
+    }
+  });
+
+  uint64_t moved = 0;
+  for (uint32_t t = 0; t < tasks; ++t)
+    moved += moves[t];
+  return moved;
+}
+
+PMA_TEMPLATE
+uint32_t PMA_CLASS::parallel_spread(uint32_t old_capacity,
+    uint32_t old_segment_size)
+{
+  // The old segments in [part, SCALE_FACTOR * part) land in
+  // [SCALE_FACTOR * part, SCALE_FACTOR^2 * part), which the previous round
+  // has emptied, or which lies past the old array. A task moves a run of
+  // PARALLEL_GRAIN positions to a run SCALE_FACTOR times as far along, so
+  // runs of different tasks never share a bitmap word.
+  std::vector<uint64_t> moves(old_capacity / PARALLEL_GRAIN, 0);
+  uint32_t part = old_capacity / SCALE_FACTOR;
+  for (; part >= PARALLEL_THRESHOLD; part /= SCALE_FACTOR) {
+    const uint32_t tasks = (SCALE_FACTOR - 1) * part / PARALLEL_GRAIN;
+    _thread_pool->run(tasks, [&](uint32_t t) {
+      const uint32_t first = part + t * PARALLEL_GRAIN;
+      for (uint32_t seg = first; seg < first + PARALLEL_GRAIN;
+           seg += old_segment_size) {
+        const uint32_t to = seg * SCALE_FACTOR;
+        const uint32_t end = seg + old_segment_size;
+        for (uint32_t i = _free_index_bitmap.find_next_set(seg, end); i < end;
+             i = _free_index_bitmap.find_next_set(i + 1, end)) {
+          _storage.move(i, to + i - seg);
+          _free_index_bitmap.set(to + i - seg);
+          _free_index_bitmap.clear(i);
+          moves[t]++;
+        }
+      }
+    });
+  }
+
+  uint64_t moved = 0;
+  for (size_t t = 0; t < moves.size(); ++t)
+    moved += moves[t];
+  shared_add(_element_moves, moved);
+  return SCALE_FACTOR * part;
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::resize()
+{
+  // Every window rebuild in flight is made obsolete by the new layout.
+  _rebuilds.clear();
+  _shrinking = false;
+  const std::chrono::steady_clock::time_point start = stats_clock();
+  Policy::trace(TRACE_RESIZE_BEGIN, 0, capacity());
+  begin_resize();
+
+  const uint32_t old_capacity = capacity();
+  const uint32_t old_segment_size = _segment_size;
+  const uint32_t new_capacity = old_capacity * SCALE_FACTOR;
+
+  // The elements of the overflow buffers are set aside, to be merged into
+  // the grown array. They may be more than the old array has room for.
+  std::vector<Key> overflow_keys;
+  std::vector<Value> overflow_values;
+  collect_overflow(0, old_capacity, overflow_keys, overflow_values);
+  resize_arrays(new_capacity);
+
+  // Spread the old segments out, highest first, so that each one is moved
+  // before anything is written over it.
+  uint32_t unmoved = old_capacity;
+  if (_thread_pool && old_capacity >= PARALLEL_THRESHOLD)
+    unmoved = parallel_spread(old_capacity, old_segment_size);
+  for (uint32_t seg = unmoved - old_segment_size; seg > 0;
+       seg -= old_segment_size) {
+    const uint32_t to = seg * SCALE_FACTOR;
+    const uint32_t end = seg + old_segment_size;
+    for (uint32_t i = _free_index_bitmap.find_next_set(seg, end); i < end;
+         i = _free_index_bitmap.find_next_set(i + 1, end))
+      move_element(i, to + i - seg);
+  }
+  std::vector<uint8_t> heat;
+  heat.swap(_insert_heat);
+  compute_geometry(new_capacity);
+  reindex();
+
+  // Each old segment now starts at twice its old index, and its predicted
+  // inserts go along with it.
+  for (uint32_t seg = 0; seg < heat.size(); ++seg)
+    _insert_heat[seg * old_segment_size * SCALE_FACTOR / _segment_size] =
+      heat[seg];
+
+  // Readers are still shut out, but the merge bumps the versions of the
+  // new segments and empties their overflow buffers, so those are laid out
+  // for them first.
+  if (!overflow_keys.empty()) {
+    reset_background();
+    if (_reader_epoch)
+      _versions.reset(number_of_segments());
+    std::vector<Key> keys;
+    std::vector<Value> values;
+    merge_window(0, new_capacity, overflow_keys.data(),
+        overflow_keys.data() + overflow_keys.size(), overflow_values.data(),
+        keys, values);
+  }
+  end_resize();
+  note_resize(start, false);
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::shrink()
+{
+  const uint32_t new_capacity = capacity() / SCALE_FACTOR;
+  if (new_capacity < INITIAL_CAPACITY)
+    return;
+
+  // The shrinking rebuild covers every window, so it replaces any rebuilds
+  // in flight.
+  _rebuilds.clear();
+  rebuild_task task;
+  task.window = 0;
+  task.length = new_capacity;
+  task.span = capacity();
+  task.phase = rebuild_task::COMPACT;
+  task.cursor = 0;
+  task.rank = 0;
+  task.count = _size;
+  task.shrink = true;
+  _rebuilds.push_back(task);
+  _shrinking = true;
+
+  if (_max_rebalance_moves == 0 || capacity() <= _max_rebalance_moves)
+    finish_rebuilds();
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::finish_shrink(const rebuild_task& task)
+{
+  // Inserts landing while the rebuild ran may in rare cases have kept an
+  // element above the new capacity, in which case the array stays as is and
+  // may be shrunk again later.
+  _shrinking = false;
+  if (next_occupied(task.length, capacity()) != capacity()) {
+    reindex();
+    return;
+  }
+  const std::chrono::steady_clock::time_point start = stats_clock();
+  Policy::trace(TRACE_RESIZE_BEGIN, 0, capacity());
+  begin_resize();
+  resize_arrays(task.length);
+  compute_geometry(task.length);
+  reindex();
+  end_resize();
+  note_resize(start, true);
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::resize_arrays(uint32_t capacity)
+{
+  if (_file && map_arrays(capacity, this->capacity()))
+    return;
+  if (_file)
+    close_file();
+  _free_index_bitmap.resize(capacity);
+  _storage.resize(capacity);
+}
+
+PMA_TEMPLATE
+bool PMA_CLASS::map_arrays(uint32_t capacity, uint32_t laid_out)
+{
+  const file_layout from = layout_file(laid_out);
+  const file_layout to = layout_file(capacity);
+  const size_t old_words = bitmap::words(laid_out) * sizeof(uint64_t);
+  const size_t new_words = bitmap::words(capacity) * sizeof(uint64_t);
+
+  // The arrays only ever move away from the header as the file grows and
+  // towards it as the file shrinks. The bitmap is moved out of the way of
+  // the growing storage first, or after the shrinking storage has left its
+  // new place. The count tree and segment index are laid out afresh anyway.
+  if (capacity >= laid_out) {
+    if (!_file->resize(to.end))
+      return false;
+    char* base = _file->data();
+    std::memmove(base + to.bitmap, base + from.bitmap, old_words);
+    std::memset(base + to.bitmap + old_words, 0, new_words - old_words);
+    _storage.attach(base + to.storage, capacity, laid_out);
+    _storage.clear(laid_out, capacity);
+  } else {
+    // Shrinking a mapping never moves it, and should that fail the file
+    // merely stays larger than it needs to be.
+    char* base = _file->data();
+    _storage.attach(base + to.storage, capacity, laid_out);
+    std::memmove(base + to.bitmap, base + from.bitmap, new_words);
+    _file->resize(to.end);
+  }
+
+  char* base = _file->data();
+  const uint32_t segments = capacity / segment_size_for(capacity);
+  _free_index_bitmap.attach(reinterpret_cast<uint64_t*>(base + to.bitmap),
+      capacity);
+  _count_tree.attach(reinterpret_cast<uint32_t*>(base + to.count_tree),
+      2 * segments);
+  _segment_index.attach(reinterpret_cast<Key*>(base + to.index),
+      reinterpret_cast<uint32_t*>(base + to.shape), segments);
+  return true;
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::close_file()
+{
+  _free_index_bitmap.resize(_free_index_bitmap.size());
+  _storage.resize(capacity());
+  _count_tree.resize(_count_tree.size());
+  _segment_index.detach();
+  _file.reset();
+  _log.reset();
+  _dirty_segments.resize(0);
+}
+
+PMA_TEMPLATE
+typename PMA_CLASS::file_layout PMA_CLASS::layout_file(uint32_t capacity)
+{
+  const size_t line = 64;
+  const uint32_t segments = capacity / segment_size_for(capacity);
+  file_layout layout;
+  layout.storage = FILE_HEADER_SIZE;
+  layout.bitmap = (layout.storage + pma_storage<Key, Value, Layout>::bytes(
+        capacity) + line - 1) / line * line;
+  layout.count_tree = (layout.bitmap + bitmap::words(capacity) *
+      sizeof(uint64_t) + line - 1) / line * line;
+  layout.index = (layout.count_tree + 2 * segments * sizeof(uint32_t) +
+      line - 1) / line * line;
+  layout.shape = (layout.index + segment_index<Key, Compare, index_order>::
+      key_slots(segments) * sizeof(Key) + line - 1) / line * line;
+  layout.end = layout.shape + segment_index<Key, Compare, index_order>::
+    shape_size(segments) * sizeof(uint32_t);
+  return layout;
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::write_header(bool clean)
+{
+  file_header& header = *reinterpret_cast<file_header*>(_file->data());
+  header.magic = FILE_MAGIC;
+  header.version = FILE_VERSION;
+  header.key_size = sizeof(Key);
+  header.slot_size = pma_storage<Key, Value, Layout>::bytes(1);
+  header.layout = std::is_same<Layout, soa_layout>::value;
+  header.capacity = capacity();
+  header.implicit_tree_height = _implicit_tree_height;
+  header.segment_size = _segment_size;
+  header.size = _size;
+  header.occupied_segments = _occupied_segments;
+  header.clean = clean;
+  header.veb_index = Policy::VEB_INDEX;
+}
+
+PMA_TEMPLATE
+bool PMA_CLASS::valid_header(const file_header& header, size_t file_size)
+{
+  const uint32_t capacity = header.capacity;
+  if (header.magic != FILE_MAGIC || header.version != FILE_VERSION ||
+      header.key_size != sizeof(Key) ||
+      header.slot_size != pma_storage<Key, Value, Layout>::bytes(1) ||
+      header.layout != std::is_same<Layout, soa_layout>::value ||
+      header.veb_index != Policy::VEB_INDEX)
+    return false;
+  if (capacity < uint32_t(INITIAL_CAPACITY) ||
+      (capacity & (capacity - 1)) != 0 ||
+      header.segment_size != segment_size_for(capacity) ||
+      header.implicit_tree_height < 0 || header.implicit_tree_height > 31 ||
+      (header.segment_size << header.implicit_tree_height) != capacity)
+    return false;
+  return header.size <= capacity && header.occupied_segments <=
+    capacity / header.segment_size && layout_file(capacity).end <= file_size;
+}
+
+PMA_TEMPLATE
+bool PMA_CLASS::checkpoint(bool clean)
+{
+  // The overflow buffers are not in the file.
+  wait_for_rebalances();
+  write_header(clean);
+
+  // The pages to write: the header, and those holding the slots and bitmap
+  // words of each dirty segment, or every derived array on top when clean,
+  // in order and merged where they meet.
+  const file_layout layout = layout_file(capacity());
+  const uint32_t segments = number_of_segments();
+  std::vector<std::pair<size_t, size_t> > ranges;
+  ranges.push_back(std::make_pair(size_t(0), size_t(FILE_HEADER_SIZE)));
+  for (uint32_t seg = _dirty_segments.find_next_set(0, segments);
+       seg < segments; seg = _dirty_segments.find_next_set(seg + 1, segments))
+  {
+    const uint32_t first = seg * _segment_size;
+    const uint32_t last = first + _segment_size;
+    size_t starts[2];
+    size_t ends[2];
+    const uint32_t extents = pma_storage<Key, Value, Layout>::extents(
+        capacity(), first, last, starts, ends);
+    for (uint32_t k = 0; k < extents; ++k)
+      ranges.push_back(std::make_pair(layout.storage + starts[k],
+            layout.storage + ends[k]));
+    ranges.push_back(std::make_pair(
+          layout.bitmap + first / bitmap::WORD_BITS * sizeof(uint64_t),
+          layout.bitmap + bitmap::words(last) * sizeof(uint64_t)));
+  }
+  if (clean)
+    ranges.push_back(std::make_pair(layout.count_tree, layout.end));
+  std::sort(ranges.begin(), ranges.end());
+  std::vector<std::pair<size_t, size_t> > pages;
+  for (size_t r = 0; r < ranges.size(); ++r) {
+    const size_t first = ranges[r].first / FILE_PAGE_SIZE * FILE_PAGE_SIZE;
+    size_t end = (ranges[r].second + FILE_PAGE_SIZE - 1) / FILE_PAGE_SIZE *
+      FILE_PAGE_SIZE;
+    if (end > layout.end)
+      end = layout.end;
+    if (!pages.empty() && first <= pages.back().second) {
+      if (end > pages.back().second)
+        pages.back().second = end;
+    } else {
+      pages.push_back(std::make_pair(first, end));
+    }
+  }
+
+  // The pages go to the log first, so that a crash while they are written
+  // to the file leaves them to be written again on open.
+  const uint64_t file_size = layout.end;
+  _log->append(LOG_CHECKPOINT, &file_size, sizeof(file_size));
+  std::vector<char> image;
+  uint64_t bytes = 0;
+  for (size_t p = 0; p < pages.size(); ++p) {
+    for (size_t offset = pages[p].first; offset < pages[p].second;
+         offset += LOG_IMAGE_BYTES) {
+      const size_t length = pages[p].second - offset < LOG_IMAGE_BYTES ?
+        pages[p].second - offset : LOG_IMAGE_BYTES;
+      const uint64_t position = offset;
+      image.resize(sizeof(position) + length);
+      std::memcpy(image.data(), &position, sizeof(position));
+      std::memcpy(image.data() + sizeof(position), _file->data() + offset,
+          length);
+      _log->append(LOG_IMAGE, image.data(), image.size());
+    }
+    bytes += pages[p].second - pages[p].first;
+  }
+  if (!_log->commit(_log->append(LOG_CHECKPOINT_END, 0, 0)))
+    return false;
+
+  bool written = true;
+  for (size_t p = 0; p < pages.size() && written; ++p)
+    written = _file->write_back(pages[p].first,
+        pages[p].second - pages[p].first);
+  if (!written || !_file->flush() || !_file->trim())
+    return false;
+
+  // The pages written read as the file again, which frees the memory their
+  // copies took up, and the log starts over.
+  for (size_t p = 0; p < pages.size(); ++p)
+    _file->discard(pages[p].first, pages[p].second - pages[p].first);
+  _dirty_segments.clear_range(0, segments);
+  count_stat(_stats.checkpoints, 1);
+  count_stat(_stats.checkpoint_bytes, bytes);
+  return _log->reset();
+}
+
+PMA_TEMPLATE
+bool PMA_CLASS::recover_file(mapped_file& file, const write_ahead_log& log,
+    uint64_t& tail)
+{
+  // Find the last checkpoint that reached its end, if any.
+  uint64_t begin = 0;
+  uint64_t started = 0;
+  uint64_t file_size = 0;
+  uint64_t started_size = 0;
+  tail = 0;
+  const bool read = log.read([&](uint64_t lsn, uint32_t type,
+        const char* data, uint32_t length) {
+    if (type == LOG_CHECKPOINT && length == sizeof(started_size)) {
+      started = lsn;
+      std::memcpy(&started_size, data, sizeof(started_size));
+    } else if (type == LOG_CHECKPOINT_END && started > 0) {
+      begin = started;
+      file_size = started_size;
+      tail = lsn;
+    }
+  });
+  if (!read)
+    return false;
+  if (tail == 0)
+    return true;
+
+  // Its pages are written again, whether or not they got there before.
+  if (!file.resize(file_size))
+    return false;
+  bool written = true;
+  const bool reread = log.read([&](uint64_t lsn, uint32_t type,
+        const char* data, uint32_t length) {
+    uint64_t offset;
+    if (lsn <= begin || lsn >= tail || type != LOG_IMAGE ||
+        length < sizeof(offset) || !written)
+      return;
+    std::memcpy(&offset, data, sizeof(offset));
+    const size_t bytes = length - sizeof(offset);
+    if (offset > file_size || bytes > file_size - offset) {
+      written = false;
+      return;
+    }
+    std::memcpy(file.data() + offset, data + sizeof(offset), bytes);
+    written = file.write_back(offset, bytes);
+  });
+  return reread && written && file.flush() && file.trim();
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::replay(const write_ahead_log& log, uint64_t tail)
+{
+  _replaying = true;
+  log.read([&](uint64_t lsn, uint32_t type, const char* data,
+        uint32_t length) {
+    if (lsn <= tail)
+      return;
+    Key x = Key();
+    Value value = Value();
+    if (type == LOG_INSERT && length == sizeof(Key) +
+        (std::is_empty<Value>::value ? 0 : sizeof(Value))) {
+      std::memcpy(static_cast<void*>(&x), data, sizeof(Key));
+      if (!std::is_empty<Value>::value)
+        std::memcpy(static_cast<void*>(&value), data + sizeof(Key),
+            sizeof(Value));
+      insert(x, value);
+    } else if (type == LOG_ERASE && length == sizeof(Key)) {
+      std::memcpy(static_cast<void*>(&x), data, sizeof(Key));
+      erase(x);
+    }
+  });
+  _replaying = false;
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::log_change(uint32_t type, const Key& x, const Value& value)
+{
+  if (!_log || _replaying)
+    return;
+  char record[sizeof(Key) + sizeof(Value)];
+  uint32_t length = sizeof(Key);
+  std::memcpy(record, static_cast<const void*>(&x), sizeof(Key));
+  if (type == LOG_INSERT && !std::is_empty<Value>::value) {
+    std::memcpy(record + length, static_cast<const void*>(&value),
+        sizeof(Value));
+    length += sizeof(Value);
+  }
+  _log->append(type, record, length);
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::reindex()
+{
+  // The count tree and segment index are laid out afresh for the new number
+  // of segments.
+  _count_tree.assign(2 * number_of_segments(), 0);
+  count_window(0, capacity());
+  _segment_index.reset(number_of_segments());
+  _insert_heat.assign(number_of_segments(), 0);
+  _occupied_segments = 0;
+  index_window(0, capacity());
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::index_window(const uint32_t& window, const uint32_t& length)
+{
+  if (_shrinking)
+    return;
+
+  // Concurrent inserts take turns, since the separators borrowed by empty
+  // segments and the tail past the last nonempty one reach outside the
+  // window.
+  std::unique_lock<std::mutex> indexing;
+  if (_insert_sync)
+    indexing = std::unique_lock<std::mutex>(_insert_sync->index_mutex);
+  const uint32_t segments = number_of_segments();
+  const uint32_t first = window / _segment_size;
+  const uint32_t last = (window + length) / _segment_size;
+  const uint32_t occupied = _occupied_segments;
+
+  // Recompute the separators from right to left, carrying the next one into
+  // each empty segment.
+  bool carry = last < occupied;
+  Key next = carry ? _segment_index.key(last) : Key();
+  uint32_t highest = 0;
+  for (uint32_t seg = last; seg-- > first; ) {
+    const uint32_t end = (seg + 1) * _segment_size;
+    const uint32_t i = next_occupied(seg * _segment_size, end);
+    if (i != end) {
+      if (!carry)
+        highest = seg + 1;
+      next = _storage.key(i);
+      carry = true;
+    }
+    if (carry)
+      _segment_index.set_key(seg, next);
+  }
+
+  // The empty segments ahead of the window borrow from it. Those before the
+  // last nonempty segment all borrow the same separator, so the walk stops
+  // at the first that already holds it. A step of a rebuild moves no
+  // element past another, so it writes none of them.
+  if (carry) {
+    for (uint32_t seg = first; seg-- > 0 &&
+         window_count(seg * _segment_size, 0) == 0; ) {
+      if (seg < occupied && !_compare(_segment_index.key(seg), next) &&
+          !_compare(next, _segment_index.key(seg)))
+        break;
+      _segment_index.set_key(seg, next);
+    }
+  }
+
+  // Track the last nonempty segment. Concurrent inserts read it without the
+  // mutex, so it is stored atomically.
+  if (occupied > last)
+    return;
+  uint32_t tail = occupied;
+  if (highest != 0)
+    tail = highest;
+  else if (occupied > first) {
+    tail = first;
+    while (tail > 0 && window_count((tail - 1) * _segment_size, 0) == 0)
+      tail--;
+  }
+  __atomic_store_n(&_occupied_segments, tail, __ATOMIC_RELAXED);
+
+  // Searches never go past the last nonempty segment, so the empty segments
+  // beyond it need only keep the separators sorted. They are given the
+  // largest key, and raised only once the separator of the last nonempty
+  // segment passes the first of them, which takes a larger key inserted
+  // since. A step of a rebuild thus writes no separator past its window
+  // unless such keys came in after the last raise, and one raise then
+  // covers them all.
+  if (tail == 0 || tail == segments ||
+      !_compare(_segment_index.key(tail), _segment_index.key(tail - 1)))
+    return;
+  const Key largest = _storage.key(_free_index_bitmap.find_prev_set(
+      (tail - 1) * _segment_size, tail * _segment_size));
+  for (uint32_t seg = tail;
+       seg < segments && _compare(_segment_index.key(seg), largest); ++seg)
+    _segment_index.set_key(seg, largest);
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::set_max_rebalance_moves(uint32_t moves) {
+  _max_rebalance_moves = moves;
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::reserve_capacity(uint32_t capacity)
+{
+  if (_file)
+    return;
+  _storage.reserve(capacity);
+  _free_index_bitmap.reserve(capacity);
+}
+
+PMA_TEMPLATE
+uint32_t PMA_CLASS::reserved_capacity() const {
+  return _storage.reserved();
+}
+
+PMA_TEMPLATE
+uint32_t PMA_CLASS::max_rebalance_moves() const {
+  return _max_rebalance_moves;
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::set_rebalance_threads(uint32_t threads) {
+  _thread_pool.reset(threads > 1 ? new thread_pool(threads) : 0);
+}
+
+PMA_TEMPLATE
+uint32_t PMA_CLASS::rebalance_threads() const {
+  return _thread_pool ? _thread_pool->size() : 1;
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::set_rebalance_algorithm(rebalance_algorithm_t algorithm) {
+  _rebalance_algorithm = algorithm;
+}
+
+PMA_TEMPLATE
+typename PMA_CLASS::rebalance_algorithm_t PMA_CLASS::rebalance_algorithm() const {
+  return _rebalance_algorithm;
+}
+
+PMA_TEMPLATE
+uint64_t PMA_CLASS::element_moves() const {
+  return _element_moves;
+}
+
+PMA_TEMPLATE
+typename PMA_CLASS::stats_t PMA_CLASS::stats() const
+{
+  stats_t stats = _stats;
+  stats.capacity = capacity();
+  stats.size = size();
+  stats.segment_size = segment_size();
+  stats.segments = number_of_segments();
+  stats.height = tree_height();
+  stats.storage_bytes = _storage.memory();
+  stats.element_moves = _element_moves;
+  return stats;
+}
+
+PMA_TEMPLATE
+uint32_t PMA_CLASS::pending_rebuilds() const {
+  return _rebuilds.size();
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::advance_rebuilds(uint32_t moves)
+{
+  while (moves > 0 && !_rebuilds.empty()) {
+    if (step_rebuild(_rebuilds.front()))
+      _rebuilds.pop_front();
+    moves--;
+  }
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::finish_rebuilds()
+{
+  while (!_rebuilds.empty()) {
+    while (!step_rebuild(_rebuilds.front()))
+      ;
+    _rebuilds.pop_front();
+  }
+}
+
+PMA_TEMPLATE
+bool PMA_CLASS::finish_rebuild(uint32_t indexno)
+{
+  for (typename std::deque<rebuild_task>::iterator it = _rebuilds.begin();
+       it != _rebuilds.end(); ++it) {
+    if (indexno < it->window || indexno >= it->window + it->span)
+      continue;
+    while (!step_rebuild(*it))
+      ;
+    _rebuilds.erase(it);
+    return true;
+  }
+  return false;
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::cancel_rebuilds(const uint32_t& window, const uint32_t& length)
+{
+  // Abandoning a rebuild part way through is always safe since every step
+  // leaves the elements in sorted order.
+  for (typename std::deque<rebuild_task>::iterator it = _rebuilds.begin();
+       it != _rebuilds.end(); ) {
+    if (window <= it->window && it->window + it->span <= window + length)
+      it = _rebuilds.erase(it);
+    else
+      ++it;
+  }
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::schedule_rebuild(const uint32_t& window, const uint32_t& length,
+    const uint32_t& count)
+{
+  // Nodes of the implicit tree are either nested or disjoint, so a rebuild
+  // in flight either already covers this window or is subsumed by it.
+  for (typename std::deque<rebuild_task>::const_iterator it = _rebuilds.begin();
+       it != _rebuilds.end(); ++it) {
+    if (it->window <= window && window + length <= it->window + it->span)
+      return;
+  }
+  cancel_rebuilds(window, length);
+
+  if (_rebuilds.size() == MAX_PENDING_REBUILDS) {
+    while (!step_rebuild(_rebuilds.front()))
+      ;
+    _rebuilds.pop_front();
+  }
+
+  rebuild_task task;
+  task.window = window;
+  task.length = length;
+  task.span = length;
+  task.phase = rebuild_task::COMPACT;
+  task.cursor = window;
+  task.rank = 0;
+  task.count = count;
+  task.shrink = false;
+  _rebuilds.push_back(task);
+}
+
+PMA_TEMPLATE
+bool PMA_CLASS::step_rebuild(rebuild_task& task)
+{
+  if (!sweep_rebuild(task))
+    return false;
+  if (task.shrink)
+    finish_shrink(task);
+  return true;
+}
+
+PMA_TEMPLATE
+bool PMA_CLASS::sweep_rebuild(rebuild_task& task)
+{
+  if (task.phase == rebuild_task::COMPACT) {
+    // Slide the next element left until it meets its predecessor, or for a
+    // one phase rebuild until it reaches its target.
+    const uint32_t end = task.window + task.span;
+    const uint32_t i = _free_index_bitmap.find_next_set(task.cursor, end);
+    if (i == end) {
+      task.phase = rebuild_task::SPREAD;
+      task.cursor = task.window + task.length;
+      task.rank = task.count;
+      return task.count == 0;
+    }
+    // A shrink always stops elements at their targets, since packing them
+    // would leave the lower segments full while the rebuild is in flight.
+    uint32_t lowest = task.window;
+    if (_rebalance_algorithm != NAIVE || task.shrink)
+      lowest = std::max(lowest,
+          spread_index(task.window, task.length, task.count, task.rank));
+    const uint32_t prev = prev_occupied(lowest, i);
+    const uint32_t to = prev == i ? std::min(lowest, i) : prev + 1;
+    if (to != i) {
+      begin_write(to, i + 1);
+      move_element(i, to);
+      end_write(to, i + 1);
+      count_add(i, -1);
+      count_add(to, 1);
+      index_window(to - to % _segment_size,
+          i - i % _segment_size + _segment_size - (to - to % _segment_size));
+    }
+    task.cursor = i + 1;
+    task.rank++;
+    return false;
+  }
+
+  // Slide the previous element right toward its target, stopping short of
+  // its successor. While inserts land in the window the target is only a
+  // guide; the successor check is what keeps the elements sorted.
+  const uint32_t i = prev_occupied(task.window, task.cursor);
+  if (i == task.cursor || task.rank == 0)
+    return true;
+  --task.rank;
+  const uint32_t target =
+    spread_index(task.window, task.length, task.count, task.rank);
+  const uint32_t to = target <= i ? i :
+    _free_index_bitmap.find_next_set(i + 1, target + 1) - 1;
+  if (to != i) {
+    begin_write(i, to + 1);
+    move_element(i, to);
+    end_write(i, to + 1);
+    count_add(i, -1);
+    count_add(to, 1);
+    index_window(i - i % _segment_size,
+        to - to % _segment_size + _segment_size - (i - i % _segment_size));
+  }
+  task.cursor = i;
+  return task.rank == 0;
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::note_insert(uint32_t indexno)
+{
+  // The rank of a rebuild counts the elements ahead of its cursor, and only
+  // those need adjusting.
+  for (typename std::deque<rebuild_task>::iterator it = _rebuilds.begin();
+       it != _rebuilds.end(); ++it) {
+    if (indexno < it->window || indexno >= it->window + it->span)
+      continue;
+    it->count++;
+    if (indexno < it->cursor)
+      it->rank++;
+  }
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::note_erase(uint32_t indexno)
+{
+  for (typename std::deque<rebuild_task>::iterator it = _rebuilds.begin();
+       it != _rebuilds.end(); ++it) {
+    if (indexno < it->window || indexno >= it->window + it->span)
+      continue;
+    it->count--;
+    if (indexno < it->cursor)
+      it->rank--;
+  }
+}
+
+PMA_TEMPLATE
+bool PMA_CLASS::rebuild_pending(uint32_t indexno) const
+{
+  for (typename std::deque<rebuild_task>::const_iterator it =
+       _rebuilds.begin(); it != _rebuilds.end(); ++it) {
+    if (indexno >= it->window && indexno < it->window + it->span)
+      return true;
+  }
+  return false;
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::enable_concurrent_readers()
+{
+  if (_reader_epoch)
+    return;
+  _reader_epoch.reset(new reader_epoch());
+  _versions.reset(number_of_segments());
+}
+
+PMA_TEMPLATE
+bool PMA_CLASS::concurrent_readers() const {
+  return static_cast<bool>(_reader_epoch);
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::begin_write(uint32_t first, uint32_t end)
+{
+  // A resize writes to the arrays before and after the geometry changes,
+  // with every segment dirty by then.
+  if (_log && first < end)
+    for (uint32_t seg = first / _segment_size; seg <= (end - 1) /
+         _segment_size && seg < _dirty_segments.size(); ++seg)
+      _dirty_segments.set_atomic(seg);
+  if (_reader_epoch && first < end)
+    _versions.begin_write(first / _segment_size,
+        (end - 1) / _segment_size + 1);
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::end_write(uint32_t first, uint32_t end)
+{
+  if (_reader_epoch && first < end)
+    _versions.end_write(first / _segment_size, (end - 1) / _segment_size + 1);
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::begin_resize()
+{
+  if (_reader_epoch)
+    _reader_epoch->begin_exclusive();
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::end_resize()
+{
+  if (_file)
+    write_header(false);
+  if (_insert_sync)
+    _insert_sync->locks.reset(capacity());
+  if (_background)
+    reset_background();
+  if (!_reader_epoch)
+    return;
+  _versions.reset(number_of_segments());
+  _reader_epoch->end_exclusive();
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::enable_concurrent_inserts()
+{
+  if (_insert_sync)
+    return;
+  finish_rebuilds();
+  _max_rebalance_moves = 0;
+  _insert_sync.reset(new insert_sync());
+  _insert_sync->locks.reset(capacity());
+}
+
+PMA_TEMPLATE
+bool PMA_CLASS::concurrent_inserts() const {
+  return static_cast<bool>(_insert_sync);
+}
+
+PMA_TEMPLATE
+bool PMA_CLASS::locked_insert(const Key& x, const Value& value)
+{
+  window_locks& locks = _insert_sync->locks;
+  bool rebalanced = false;
+  for (;;) {
+    uint32_t old_capacity;
+    bool inserted = false;
+    {
+      reader_epoch::guard inserting(_insert_sync->epoch);
+      old_capacity = capacity();
+      uint32_t first;
+      uint32_t last;
+      const uint32_t segment = lock_segment(x, first, last);
+
+      // A full segment has no room to shift into, so x goes to its overflow
+      // buffer, or if there is no room there either, the segment is
+      // rebalanced and the segment of x looked for afresh. The count of a
+      // segment with an overflow buffer in use exceeds its size.
+      bool grow = false;
+      if (window_count(segment, 0) >= _segment_size) {
+        const uint32_t overflowed = _background ?
+          window_count(segment, 0) - _segment_size : OVERFLOW_SIZE;
+        if (overflowed < OVERFLOW_SIZE && overflowed < _segment_size) {
+          inserted = overflow_insert(segment, x, value);
+          if (inserted)
+            log_change(LOG_INSERT, x, value);
+          locks.unlock(first, last);
+          if (inserted)
+            queue_rebalance(segment);
+          return inserted;
+        }
+        grow = !locked_rebalance(segment, first, last);
+        rebalanced = true;
+      } else {
+        const uint32_t pos = position_to_insert(segment, x);
+        if (pos > segment && !_compare(_storage.key(pos - 1), x)) {
+          locks.unlock(first, last);
+          return false;
+        }
+        insert_at(segment, pos, x, value);
+        log_change(LOG_INSERT, x, value);
+        inserted = true;
+
+        // With background rebalancing, a segment over its threshold is left
+        // to the rebalancer, and so is a root at its growth count.
+        const bool over = window_count(segment, 0) >= _upper_count[0];
+        if (_background) {
+          if (over)
+            queue_rebalance(segment);
+          if (window_count(0, _implicit_tree_height) >=
+              _background->growth_count &&
+              !_background->grow.exchange(true)) {
+            { std::lock_guard<std::mutex> waking(_background->mutex); }
+            _background->wake.notify_one();
+          }
+        } else if (over) {
+          grow = !locked_rebalance(segment, first, last);
+          rebalanced = true;
+        }
+      }
+      locks.unlock(first, last);
+      if (inserted && !grow) {
+        if (rebalanced)
+          count_stat(_stats.rebalancing_inserts, 1);
+        return true;
+      }
+      if (!grow)
+        continue;
+    }
+
+    // Only now that this insert holds no locks and has left the epoch may
+    // it wait for the others to leave.
+    locked_resize(old_capacity);
+    if (inserted) {
+      count_stat(_stats.rebalancing_inserts, 1);
+      return true;
+    }
+  }
+}
+
+PMA_TEMPLATE
+uint32_t PMA_CLASS::lock_segment(const Key& x, uint32_t& first,
+    uint32_t& last)
+{
+  // Other inserts are changing the segment index, so the segment it points
+  // at, though read atomically, is only a first guess. Once its lock is
+  // held, a segment is the right one if it is segment 0 or its first
+  // element does not exceed x, and the next nonempty segment starts above
+  // x. Both hold for as long as the lock is: elements only ever enter a
+  // segment that already holds a smaller one, or one whose window is locked
+  // as a whole.
+  window_locks& locks = _insert_sync->locks;
+  const uint32_t segments = number_of_segments();
+  const uint32_t span = window_locks::span(capacity());
+  uint32_t seg = segment_to_insert(x) / _segment_size;
+  first = seg * _segment_size / span * span;
+  last = first + span;
+  locks.lock(first, last);
+  for (;;) {
+    const uint32_t start = seg * _segment_size;
+    const uint32_t end = start + _segment_size;
+    const bool empty = window_count(start, 0) == 0;
+    if (seg > 0 &&
+        (empty || _compare(x, _storage.key(next_occupied(start, end))))) {
+      // x lies to the left. The lock is let go before the one to the left
+      // is taken.
+      const uint32_t prev = prev_nonempty_segment(seg);
+      seg = prev == segments ? 0 : prev;
+      const uint32_t lock = seg * _segment_size / span * span;
+      if (lock != first) {
+        locks.unlock(first, last);
+        first = lock;
+        last = first + span;
+        locks.lock(first, last);
+      }
+      continue;
+    }
+    if (!empty && !_compare(
+          _storage.key(_free_index_bitmap.find_prev_set(start, end)), x))
+      return start;
+
+    // Every element here is less than x, so look at the next nonempty
+    // segment. Its lock lies to the right, so it may be waited for. The
+    // segments in between are empty for as long as both locks are held.
+    const uint32_t next = next_nonempty_segment(seg);
+    if (next == segments)
+      return start;
+    const uint32_t next_start = next * _segment_size;
+    const uint32_t lock = next_start / span * span;
+    if (lock != first)
+      locks.lock(lock, lock + span);
+    if (window_count(next_start, 0) == 0 ||
+        next_nonempty_segment(seg) != next) {
+      if (lock != first)
+        locks.unlock(lock, lock + span);
+      continue;
+    }
+    if (_compare(x, _storage.key(next_occupied(next_start,
+              next_start + _segment_size)))) {
+      if (lock != first)
+        locks.unlock(lock, lock + span);
+      return start;
+    }
+    if (lock != first) {
+      locks.unlock(first, last);
+      first = lock;
+      last = first + span;
+    }
+    seg = next;
+  }
+}
+
+PMA_TEMPLATE
+bool PMA_CLASS::locked_rebalance(const uint32_t& segment, uint32_t& first,
+    uint32_t& last)
+{
+  // Climb as rebalance does, growing the locked window along the way. The
+  // locks to the right may be waited for, those to the left only tried: if
+  // one is busy, every lock is let go, the whole window is locked in order,
+  // and the climb starts over, as another insert may have rebalanced the
+  // segment meanwhile.
+  window_locks& locks = _insert_sync->locks;
+  uint32_t window = segment;
+  uint32_t length = _segment_size;
+  int height;
+  for (height = 1; ; ++height) {
+    if (height > _implicit_tree_height)
+      return false;
+
+    length <<= 1;
+    window -= window % length;
+    if (window + length > last) {
+      locks.lock(last, window + length);
+      last = window + length;
+    }
+    if (window < first) {
+      if (!locks.try_lock(window, first)) {
+        locks.unlock(first, last);
+        first = window;
+        locks.lock(first, last);
+        if (window_count(segment, 0) < _upper_count[0])
+          return true;
+        window = segment;
+        length = _segment_size;
+        height = 0;
+        continue;
+      }
+      first = window;
+    }
+
+    if (window_count(window, height) < _upper_count[height])
+      break;
+  }
+
+  if (!merge_overflow(window, length, height))
+    rebalance_window(window, length, height);
+  return true;
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::locked_resize(uint32_t old_capacity)
+{
+  // Several inserts may find the root full at once, but only the first to
+  // get here grows the array.
+  std::lock_guard<std::mutex> resizing(_insert_sync->resize_mutex);
+  _insert_sync->epoch.begin_exclusive();
+  if (capacity() == old_capacity)
+    resize();
+  _insert_sync->epoch.end_exclusive();
+}
+
+PMA_TEMPLATE
+bool PMA_CLASS::overflow_insert(const uint32_t& segment, const Key& x,
+    const Value& value)
+{
+  const uint32_t pos = position_to_insert(segment, x);
+  if (pos > segment && !_compare(_storage.key(pos - 1), x))
+    return false;
+  overflow_buffer& overflow = _background->overflow[segment / _segment_size];
+  uint32_t k = overflow.count;
+  while (k > 0 && _compare(x, overflow.keys[k - 1]))
+    k--;
+  if (k > 0 && !_compare(overflow.keys[k - 1], x))
+    return false;
+
+  begin_write(segment, segment + _segment_size);
+  for (uint32_t j = overflow.count; j > k; --j) {
+    overflow.keys[j] = std::move(overflow.keys[j - 1]);
+    overflow.values[j] = std::move(overflow.values[j - 1]);
+  }
+  overflow.keys[k] = x;
+  overflow.values[k] = value;
+  __atomic_store_n(&overflow.count, overflow.count + 1, __ATOMIC_RELAXED);
+  end_write(segment, segment + _segment_size);
+  shared_add(_size, 1u);
+  count_add(segment, 1);
+  count_stat(_stats.overflow_inserts, 1);
+  return true;
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::queue_rebalance(const uint32_t& segment)
+{
+  const uint32_t seg = segment / _segment_size;
+  {
+    std::lock_guard<std::mutex> queuing(_background->mutex);
+    if (_background->queued[seg])
+      return;
+    _background->queued[seg] = 1;
+    _background->queue.push_back(seg);
+  }
+  _background->wake.notify_one();
+}
+
+PMA_TEMPLATE
+bool PMA_CLASS::merge_overflow(const uint32_t& window, const uint32_t& length,
+    int height)
+{
+  std::vector<Key> overflow_keys;
+  std::vector<Value> overflow_values;
+  collect_overflow(window, length, overflow_keys, overflow_values);
+  if (overflow_keys.empty())
+    return false;
+
+  // The elements of the buffers are counted already, by the count tree and
+  // the size alike.
+  note_rebalance(height, length);
+  Policy::trace(TRACE_REBALANCE_BEGIN, window, length);
+  std::vector<Key> keys;
+  std::vector<Value> values;
+  merge_window(window, length, overflow_keys.data(),
+      overflow_keys.data() + overflow_keys.size(), overflow_values.data(),
+      keys, values);
+  Policy::trace(TRACE_REBALANCE_END, window, length);
+  return true;
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::collect_overflow(const uint32_t& window,
+    const uint32_t& length, std::vector<Key>& keys,
+    std::vector<Value>& values) const
+{
+  if (!_background)
+    return;
+  for (uint32_t seg = window / _segment_size;
+       seg < (window + length) / _segment_size; ++seg) {
+    const overflow_buffer& overflow = _background->overflow[seg];
+    for (uint32_t k = 0; k < overflow.count; ++k) {
+      keys.push_back(overflow.keys[k]);
+      values.push_back(overflow.values[k]);
+    }
+  }
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::enable_background_rebalancing()
+{
+  if (_background)
+    return;
+  enable_concurrent_inserts();
+  _background.reset(new background_rebalancer());
+  _background->busy = false;
+  _background->stop = false;
+  _background->grow = false;
+  reset_background();
+  _background->thread = std::thread(&pma::background_loop, this);
+}
+
+PMA_TEMPLATE
+bool PMA_CLASS::background_rebalancing() const {
+  return static_cast<bool>(_background);
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::wait_for_rebalances()
+{
+  if (!_background)
+    return;
+  std::unique_lock<std::mutex> waiting(_background->mutex);
+  _background->idle.wait(waiting, [this] {
+    return !_background->busy && _background->queue.empty() &&
+      !_background->grow;
+  });
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::reset_background()
+{
+  // Runs while inserts are shut out, or before they start.
+  const uint32_t segments = number_of_segments();
+  {
+    std::lock_guard<std::mutex> queuing(_background->mutex);
+    _background->queue.clear();
+    _background->queued.assign(segments, 0);
+  }
+  overflow_buffer empty = overflow_buffer();
+  _background->overflow.assign(segments, empty);
+  _background->growth_count =
+    std::ceil(BACKGROUND_GROWTH_DENSITY * capacity());
+  _background->grow = false;
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::background_loop()
+{
+  std::unique_lock<std::mutex> waiting(_background->mutex);
+  for (;;) {
+    _background->busy = false;
+    _background->idle.notify_all();
+    _background->wake.wait(waiting, [this] {
+      return _background->stop || !_background->queue.empty() ||
+        _background->grow;
+    });
+    if (_background->queue.empty() && !_background->grow)
+      return;
+    _background->busy = true;
+    waiting.unlock();
+    background_rebalance();
+    waiting.lock();
+  }
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::background_rebalance()
+{
+  // Each segment is taken off the queue inside the epoch, so that no
+  // resize can renumber it before it is locked.
+  window_locks& locks = _insert_sync->locks;
+  for (;;) {
+    uint32_t old_capacity;
+    bool grow = false;
+    {
+      reader_epoch::guard rebalancing(_insert_sync->epoch);
+      uint32_t seg;
+      {
+        std::lock_guard<std::mutex> queuing(_background->mutex);
+        if (_background->queue.empty())
+          break;
+        seg = _background->queue.front();
+        _background->queue.pop_front();
+        _background->queued[seg] = 0;
+      }
+      old_capacity = capacity();
+      const uint32_t segment = seg * _segment_size;
+      const uint32_t span = window_locks::span(old_capacity);
+      uint32_t first = segment / span * span;
+      uint32_t last = first + span;
+      locks.lock(first, last);
+      if (window_count(segment, 0) >= _upper_count[0])
+        grow = !locked_rebalance(segment, first, last);
+      locks.unlock(first, last);
+    }
+    if (grow)
+      locked_resize(old_capacity);
+  }
+
+  // Grow ahead of the inserts if one found the root at its growth count.
+  // The resize clears the flag, as the growth count moves on.
+  if (!_background->grow)
+    return;
+  uint32_t old_capacity;
+  bool grow;
+  {
+    reader_epoch::guard growing(_insert_sync->epoch);
+    old_capacity = capacity();
+    grow = window_count(0, _implicit_tree_height) >=
+      _background->growth_count;
+  }
+  if (grow)
+    locked_resize(old_capacity);
+  else
+    _background->grow = false;
+}
+
+PMA_TEMPLATE
+uint32_t PMA_CLASS::next_nonempty_segment(uint32_t segment) const
+{
+  // Climb until a right sibling holds an element, then descend to the
+  // leftmost nonempty segment under it.
+  const uint32_t segments = number_of_segments();
+  uint32_t node = segments + segment;
+  while (node > 1 && (node % 2 == 1 || node_count(node + 1) == 0))
+    node >>= 1;
+  if (node <= 1)
+    return segments;
+  for (node++; node < segments; )
+    node = node_count(2 * node) > 0 ? 2 * node : 2 * node + 1;
+  return node - segments;
+}
+
+PMA_TEMPLATE
+uint32_t PMA_CLASS::prev_nonempty_segment(uint32_t segment) const
+{
+  const uint32_t segments = number_of_segments();
+  uint32_t node = segments + segment;
+  while (node > 1 && (node % 2 == 0 || node_count(node - 1) == 0))
+    node >>= 1;
+  if (node <= 1)
+    return segments;
+  for (node--; node < segments; )
+    node = node_count(2 * node + 1) > 0 ? 2 * node + 1 : 2 * node;
+  return node - segments;
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::read_segment(uint32_t segment, segment_copy& copy) const
+{
+  const uint32_t first = segment * _segment_size;
+  do {
+    copy.version = _versions.read_begin(segment);
+    copy.count = 0;
+    for (uint64_t bits = _free_index_bitmap.word_bits(first, _segment_size);
+         bits != 0; bits &= bits - 1) {
+      const uint32_t i = first + __builtin_ctzll(bits);
+      copy.keys[copy.count] = _storage.key(i);
+      copy.values[copy.count] = _storage.value(i);
+      copy.count++;
+    }
+
+    // Merge in the overflow buffer from the back. A torn count is caught by
+    // the version check, but must not overrun the copy meanwhile.
+    if (!_background)
+      continue;
+    const overflow_buffer& overflow = _background->overflow[segment];
+    uint32_t k = __atomic_load_n(&overflow.count, __ATOMIC_RELAXED);
+    if (k > OVERFLOW_SIZE)
+      k = OVERFLOW_SIZE;
+    uint32_t n = copy.count;
+    copy.count += k;
+    for (uint32_t out = copy.count; k > 0; ) {
+      --out;
+      if (n > 0 && _compare(overflow.keys[k - 1], copy.keys[n - 1])) {
+        --n;
+        copy.keys[out] = copy.keys[n];
+        copy.values[out] = copy.values[n];
+      } else {
+        --k;
+        copy.keys[out] = overflow.keys[k];
+        copy.values[out] = overflow.values[k];
+      }
+    }
+  } while (!_versions.unchanged(segment, copy.version));
+}
+
+PMA_TEMPLATE
+bool PMA_CLASS::read_locate(const Key& x, uint32_t& segment,
+    segment_copy& copy) const
+{
+  // The separators are read while the writer may be changing them, so the
+  // segment they point at is only a starting guess that the copies confirm.
+  const uint32_t segments = number_of_segments();
+  uint32_t seg = _segment_index.lower_bound(x);
+  seg = seg == 0 ? 0 : std::min(seg - 1, segments - 1);
+  read_segment(seg, copy);
+
+  // With no element less than x here, the answer lies to the left.
+  segment_copy next;
+  while (seg > 0 && (copy.count == 0 || !_compare(copy.keys[0], x))) {
+    read_segment(seg - 1, next);
+    if (!_versions.unchanged(seg, copy.version))
+      return false;
+    --seg;
+    copy = next;
+  }
+
+  // Otherwise it lies here, unless a later segment also starts below x.
+  uint32_t last = seg;
+  uint32_t last_version = copy.version;
+  if (copy.count > 0 && _compare(copy.keys[0], x)) {
+    while (last + 1 < segments) {
+      read_segment(last + 1, next);
+      if (!_versions.unchanged(last, last_version))
+        return false;
+      ++last;
+      last_version = next.version;
+      if (next.count == 0)
+        continue;
+      if (!_compare(next.keys[0], x))
+        break;
+      seg = last;
+      copy = next;
+    }
+  }
+  segment = seg;
+  return true;
+}
+
+PMA_TEMPLATE
+bool PMA_CLASS::read_predecessor(const Key& x, Key& key) const
+{
+  reader_epoch::guard guard(*_reader_epoch);
+  uint32_t segment;
+  segment_copy copy;
+  while (!read_locate(x, segment, copy))
+    ;
+  uint32_t n = copy.count;
+  while (n > 0 && !_compare(copy.keys[n - 1], x))
+    n--;
+  if (n == 0)
+    return false;
+  key = copy.keys[n - 1];
+  return true;
+}
+
+PMA_TEMPLATE
+template <class Visitor>
+void PMA_CLASS::read_range(const Key& lo, const Key& hi, Visitor visit) const
+{
+  reader_epoch::guard guard(*_reader_epoch);
+  const uint32_t segments = number_of_segments();
+  Key resume = lo;
+  bool resumed = false;
+  segment_copy copy;
+  segment_copy next;
+  for (;;) {
+    uint32_t segment;
+    if (!read_locate(resume, segment, copy))
+      continue;
+    for (;;) {
+      for (uint32_t k = 0; k < copy.count; ++k) {
+        if (resumed ? !_compare(resume, copy.keys[k]) :
+            _compare(copy.keys[k], lo))
+          continue;
+        if (!_compare(copy.keys[k], hi))
+          return;
+        visit(copy.keys[k], copy.values[k]);
+        resume = copy.keys[k];
+        resumed = true;
+      }
+      if (segment + 1 == segments)
+        return;
+      read_segment(segment + 1, next);
+      if (!_versions.unchanged(segment, copy.version))
+        break;
+      ++segment;
+      copy = next;
+    }
+  }
+}
+
+PMA_TEMPLATE
+uint32_t PMA_CLASS::next_occupied(uint32_t indexno, uint32_t end) const
+{
+  return _free_index_bitmap.find_next_set(indexno, end);
+}
+
+PMA_TEMPLATE
+uint32_t PMA_CLASS::prev_occupied(uint32_t first, uint32_t end) const
+{
+  if (first >= end)
+    return end;
+  const uint32_t last = (end - 1) - (end - 1) % _segment_size;
+  const uint32_t i = _free_index_bitmap.find_prev_set(std::max(first, last), end);
+  if (i != end || last <= first)
+    return i;
+
+  // Climb until a left sibling holds an element, then descend to the
+  // rightmost nonempty segment under it.
+  const uint32_t segments = number_of_segments();
+  uint32_t node = segments + last / _segment_size;
+  while (node > 1 && (node % 2 == 0 || _count_tree[node - 1] == 0))
+    node >>= 1;
+  if (node <= 1)
+    return end;
+  for (node--; node < segments; )
+    node = _count_tree[2 * node + 1] > 0 ? 2 * node + 1 : 2 * node;
+  const uint32_t seg = (node - segments) * _segment_size;
+  if (seg + _segment_size <= first)
+    return end;
+  const uint32_t j =
+    _free_index_bitmap.find_prev_set(std::max(first, seg), seg + _segment_size);
+  return j == seg + _segment_size ? end : j;
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::move_element(uint32_t from, uint32_t to)
+{
+  _storage.move(from, to);
+  shared_add(_element_moves, uint64_t(1));
+  _free_index_bitmap.set(to);
+  _free_index_bitmap.clear(from);
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::compute_geometry(uint32_t capacity)
+{
+  _segment_size = segment_size_for(capacity);
+  _implicit_tree_height = std::log2(capacity / _segment_size);
+
+  // Whatever changes the geometry may move anything in the file.
+  if (_log) {
+    _dirty_segments.resize(capacity / _segment_size);
+    _dirty_segments.set_range(0, capacity / _segment_size);
+  }
+
+  // A window's capacity is a power of two, so scaling a threshold by it is
+  // exact, and a count is below threshold * capacity exactly when it is
+  // below the rounded up product.
+  for (int height = 0; height <= _implicit_tree_height; ++height) {
+    const double positions = window_capacity(height);
+    _upper_count[height] = std::ceil(upper_density_threshold(height) *
+        positions);
+
+    // Spreading out a window leaves every segment short of full only while
+    // it holds at most segment_size - 1 elements per segment. Thresholds
+    // close to the leaves of a tall tree of small segments allow more, and
+    // an insert into a full segment would then rebalance it over and over.
+    const uint32_t room = ((_segment_size - 1) << height) + 1;
+    if (height > 0 && _upper_count[height] > room)
+      _upper_count[height] = room;
+    _lower_count[height] = std::ceil(lower_density_threshold(height) *
+        positions);
+  }
+}
+
+PMA_TEMPLATE
+uint32_t PMA_CLASS::segment_size_for(uint32_t capacity) {
+  uint32_t size = Policy::segment_size(capacity,
+      pma_storage<Key, Value, Layout>::bytes(1));
+  if (Policy::LINE_ALIGNED) {
+    const uint32_t line = pma_storage<Key, Value, Layout>::line_positions();
+    size = size > line ? size : line;
+  }
+  const uint32_t most =
+    capacity < MAX_SEGMENT_SIZE ? capacity : MAX_SEGMENT_SIZE;
+  return size < most ? size : most;
+}
+
+PMA_TEMPLATE
+uint32_t PMA_CLASS::capacity() const {
+  return _storage.capacity();
+}
+
+PMA_TEMPLATE
+uint32_t PMA_CLASS::size() const {
+  return _size;
+}
+
+PMA_TEMPLATE
+uint32_t PMA_CLASS::segment_size() const {
+  return _segment_size;
+}
+
+PMA_TEMPLATE
+int PMA_CLASS::tree_height() const {
+  return _implicit_tree_height;
+}
+
+PMA_TEMPLATE
+int PMA_CLASS::number_of_segments() const {
+  return _storage.capacity() / _segment_size;
+}
+
+PMA_TEMPLATE
+bool PMA_CLASS::index_is_free(uint32_t indexno) const {
+  return !_free_index_bitmap.test(indexno);
+}
+
+PMA_TEMPLATE
+double PMA_CLASS::upper_density_threshold(int height) const
+{
+  if (_implicit_tree_height == 0)
+    return ROOT_UPPER_DENSITY;
+  return ROOT_UPPER_DENSITY + (LEAF_UPPER_DENSITY - ROOT_UPPER_DENSITY) * 
+        (_implicit_tree_height - height) / _implicit_tree_height;
+}
+
+PMA_TEMPLATE
+double PMA_CLASS::lower_density_threshold(int height) const
+{
+  if (_implicit_tree_height == 0)
+    return ROOT_LOWER_DENSITY;
+  return ROOT_LOWER_DENSITY - (ROOT_LOWER_DENSITY - LEAF_LOWER_DENSITY) * 
+        (_implicit_tree_height - height) / _implicit_tree_height;
+}
+
+PMA_TEMPLATE
+uint32_t PMA_CLASS::window_capacity(int height) const {
+  return _segment_size << height;
+}
+
+PMA_TEMPLATE
+uint32_t PMA_CLASS::window_count(const uint32_t& window, int height) const {
+  return node_count((number_of_segments() + window / _segment_size) >> height);
+}
+
+PMA_TEMPLATE
+uint32_t PMA_CLASS::upper_count(int height) const {
+  return _upper_count[height];
+}
+
+PMA_TEMPLATE
+uint32_t PMA_CLASS::lower_count(int height) const {
+  return _lower_count[height];
+}
+
+PMA_TEMPLATE
+uint32_t PMA_CLASS::node_count(uint32_t node) const {
+  return __atomic_load_n(&_count_tree[node], __ATOMIC_RELAXED);
+}
+
+PMA_TEMPLATE
+template <class T>
+void PMA_CLASS::shared_add(T& counter, T delta)
+{
+  if (_insert_sync)
+    __atomic_fetch_add(&counter, delta, __ATOMIC_RELAXED);
+  else
+    counter += delta;
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::count_stat(uint64_t& counter, uint64_t delta)
+{
+  if (Policy::STATS)
+    shared_add(counter, delta);
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::note_rebalance(int height, uint32_t length)
+{
+  if (!Policy::STATS)
+    return;
+  shared_add(_stats.rebalances, uint64_t(1));
+  shared_add(_stats.rebalance_heights[height], uint64_t(1));
+  shared_add(_stats.rebalance_lengths[31 - __builtin_clz(length)],
+      uint64_t(1));
+}
+
+PMA_TEMPLATE
+std::chrono::steady_clock::time_point PMA_CLASS::stats_clock() const
+{
+  if (!Policy::STATS)
+    return std::chrono::steady_clock::time_point();
+  return std::chrono::steady_clock::now();
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::note_resize(std::chrono::steady_clock::time_point start,
+    bool shrink)
+{
+  Policy::trace(TRACE_RESIZE_END, 0, capacity());
+  if (!Policy::STATS)
+    return;
+  // Every resize runs with inserts shut out, so nothing races these.
+  if (shrink)
+    _stats.shrinks++;
+  else
+    _stats.resizes++;
+  _stats.resize_nanoseconds += std::chrono::duration_cast<
+    std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::count_add(uint32_t indexno, int delta)
+{
+  for (uint32_t node = number_of_segments() + indexno / _segment_size;
+       node > 0; node >>= 1)
+    shared_add(_count_tree[node], static_cast<uint32_t>(delta));
+}
+
+PMA_TEMPLATE
+void PMA_CLASS::count_window(const uint32_t& window, const uint32_t& length)
+{
+  // Recount the segments, then sum each level of nodes inside the window
+  // up to the node for the window itself, and the ancestors above it unless
+  // concurrent inserts are enabled. The counts are stored atomically, since
+  // concurrent inserts read the counts of other windows as they climb.
+  const uint32_t segments = number_of_segments();
+  uint32_t first = segments + window / _segment_size;
+  uint32_t last = segments + (window + length) / _segment_size;
+  for (uint32_t node = first; node < last; ++node) {
+    const uint32_t seg = (node - segments) * _segment_size;
+    __atomic_store_n(&_count_tree[node],
+        _free_index_bitmap.popcount(seg, seg + _segment_size),
+        __ATOMIC_RELAXED);
+  }
+  while (first > 1 && !(_insert_sync && last - first == 1)) {
+    first >>= 1;
+    last >>= 1;
+    for (uint32_t node = first; node < std::max(last, first + 1); ++node)
+      __atomic_store_n(&_count_tree[node],
+          _count_tree[2 * node] + _count_tree[2 * node + 1],
+          __ATOMIC_RELAXED);
+  }
+}
+
+PMA_TEMPLATE
+uint32_t PMA_CLASS::window_size(const uint32_t& window, const uint32_t length) const
+{
+  return _free_index_bitmap.popcount(window, window + length);
+}
@@ -0,0 +1,1137 @@
+// pma_bench.cc
+// Benchmarks for the packed-memory array, built on Google Benchmark.
+//
+// Insert workloads build a pma of N keys from empty and report inserts per
+// second, sampled per-insert latency percentiles and element moves per
+// insert. Erase workloads empty such a pma again. Lookups and scans run
+// against a pma of N keys built once per size. The miss benchmarks count
+// last-level cache and data TLB misses through perf_event_open, and are
+// skipped where the kernel does not allow that.
+// Run with --benchmark_filter to pick a subset; the largest sizes take a
+// while to build.
+
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <string>
+#include <vector>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <benchmark/benchmark.h>
+#include "pma.h"
+#include "sharded_pma.h"
+
+using namespace std;
+
+namespace {
+
+typedef uint64_t bench_key;
+
+enum workload_t { RANDOM, ASCENDING, DESCENDING, ZIPFIAN, HAMMER };
+
+// A fast 64-bit mixing function, used as a stateless random source.
+inline uint64_t splitmix64(uint64_t x)
+{
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+// Draws ranks in [0, n) with probability proportional to 1/(rank+1)^theta.
+class zipfian_generator {
+  private:
+    vector<double> _cdf;
+
+  public:
+    zipfian_generator(uint32_t n, double theta) : _cdf(n)
+    {
+      double sum = 0;
+      for (uint32_t i = 0; i < n; ++i)
+        _cdf[i] = sum += 1.0 / pow(i + 1.0, theta);
+      for (uint32_t i = 0; i < n; ++i)
+        _cdf[i] /= sum;
+    }
+
+    uint32_t operator()(uint64_t random) const {
+      const double u = (random >> 11) * (1.0 / 9007199254740992.0);
+      return lower_bound(_cdf.begin(), _cdf.end(), u) - _cdf.begin();
+    }
+};
+
+// Produces the keys of an insert workload.
+//   RANDOM      uniformly random keys.
+//   ASCENDING   keys in increasing order, so every insert appends.
+//   DESCENDING  keys in decreasing order, so every insert prepends.
+//   ZIPFIAN     keys clustered around 1024 hot spots whose popularity
+//               follows a Zipfian distribution (theta 0.99).
+//   HAMMER      the pma is first loaded with random keys, then every insert
+//               lands in the same gap between two of them.
+class key_stream {
+  private:
+    workload_t _workload;
+    uint64_t _count;
+    uint64_t _seed;
+    bench_key _spot;
+    zipfian_generator* _zipf;
+
+  public:
+    static const uint32_t ZIPF_CLUSTERS = 1024;
+
+    key_stream(workload_t workload, uint64_t seed)
+      : _workload(workload), _count(0), _seed(seed), _spot(0), _zipf(0)
+    {
+      if (workload == ZIPFIAN)
+        _zipf = new zipfian_generator(ZIPF_CLUSTERS, 0.99);
+    }
+
+    ~key_stream() {
+      delete _zipf;
+    }
+
+    // Keys loaded before a HAMMER run are multiples of 2^24, so the gap
+    // after any one of them has room for every hammered key.
+    bench_key preload_key(uint64_t i) const {
+      return (splitmix64(_seed ^ (i << 1)) >> 24) << 24;
+    }
+
+    void set_spot(bench_key spot) {
+      _spot = spot;
+    }
+
+    bench_key next()
+    {
+      const uint64_t i = _count++;
+      switch (_workload) {
+        case RANDOM:
+          return splitmix64(_seed + i);
+        case ASCENDING:
+          return i;
+        case DESCENDING:
+          return ~bench_key(0) - i;
+        case ZIPFIAN:
+          return (bench_key((*_zipf)(splitmix64(_seed + i))) << 40) |
+            splitmix64(_seed - i) >> 24;
+        case HAMMER:
+        default:
+          return _spot + 1 + i;
+      }
+    }
+};
+
+// Collects sampled operation latencies and reports their percentiles as
+// benchmark counters.
+class latency_sampler {
+  private:
+    vector<double> _samples;
+
+  public:
+    // One operation in SAMPLE_PERIOD is timed, which keeps the cost of
+    // reading the clock out of the throughput figures.
+    static const uint32_t SAMPLE_PERIOD = 64;
+
+    void record(chrono::steady_clock::time_point start) {
+      _samples.push_back(chrono::duration<double, nano>(
+            chrono::steady_clock::now() - start).count());
+    }
+
+    void report(benchmark::State& state)
+    {
+      if (_samples.empty())
+        return;
+      sort(_samples.begin(), _samples.end());
+      const double n = _samples.size() - 1;
+      state.counters["p50_ns"] = _samples[static_cast<size_t>(n * 0.50)];
+      state.counters["p99_ns"] = _samples[static_cast<size_t>(n * 0.99)];
+      state.counters["p999_ns"] = _samples[static_cast<size_t>(n * 0.999)];
+      state.counters["max_ns"] = _samples.back();
+    }
+};
+
+typedef pma<bench_key>::rebalance_algorithm_t algorithm_t;
+
+void BM_insert(benchmark::State& state, workload_t workload,
+    algorithm_t algorithm)
+{
+  const uint32_t n = state.range(0);
+  latency_sampler latency;
+  uint64_t moves = 0;
+  uint64_t seed = 1;
+  for (auto _ : state) {
+    state.PauseTiming();
+    pma<bench_key> p;
+    p.set_rebalance_algorithm(algorithm);
+    key_stream keys(workload, seed++);
+    if (workload == HAMMER) {
+      for (uint32_t i = 0; i < n; ++i)
+        p.insert(keys.preload_key(i));
+      keys.set_spot(keys.preload_key(n / 2));
+    }
+    const uint64_t moves_before = p.element_moves();
+    state.ResumeTiming();
+
+    for (uint32_t i = 0; i < n; ++i) {
+      const bench_key key = keys.next();
+      if (i % latency_sampler::SAMPLE_PERIOD == 0) {
+        const chrono::steady_clock::time_point start =
+          chrono::steady_clock::now();
+        p.insert(key);
+        latency.record(start);
+      } else {
+        p.insert(key);
+      }
+    }
+    moves += p.element_moves() - moves_before;
+
+    state.PauseTiming();
+    benchmark::DoNotOptimize(p.size());
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+  state.counters["moves_per_insert"] =
+    static_cast<double>(moves) / (state.iterations() * n);
+  latency.report(state);
+}
+
+void BM_kernel_insert(benchmark::State& state)
+{
+  // Inserts N random keys with NAIVE rebalancing, whose passes run on the
+  // compress and expand kernels, under the widest instruction set up to the
+  // given one. Reports the bytes of elements moved per second.
+  const uint32_t n = state.range(0);
+  const kernel_isa isa = select_kernels(static_cast<kernel_isa>(
+        state.range(1)));
+  uint64_t moves = 0;
+  uint64_t seed = 1;
+  for (auto _ : state) {
+    state.PauseTiming();
+    pma<bench_key> p;
+    p.set_rebalance_algorithm(pma<bench_key>::NAIVE);
+    key_stream keys(RANDOM, seed++);
+    state.ResumeTiming();
+
+    for (uint32_t i = 0; i < n; ++i)
+      p.insert(keys.next());
+    moves += p.element_moves();
+  }
+  select_kernels(AVX512_KERNELS);
+  const char* const names[] = { "scalar", "neon", "avx2", "avx512" };
+  state.SetLabel(names[isa]);
+  state.SetItemsProcessed(state.iterations() * n);
+  state.counters["moved_bytes_per_second"] = benchmark::Counter(
+      static_cast<double>(moves) * sizeof(bench_key),
+      benchmark::Counter::kIsRate);
+}
+
+void BM_insert_stats(benchmark::State& state, workload_t workload)
+{
+  // Inserts N keys into a pma that keeps stats, to show both what keeping
+  // them costs against BM_insert and where the work of the inserts goes.
+  typedef pma<bench_key, pma_no_value, less<bench_key>, aos_layout,
+          stats_policy<> > stats_pma;
+  const uint32_t n = state.range(0);
+  uint64_t seed = 1;
+  stats_pma::stats_t totals = stats_pma::stats_t();
+  for (auto _ : state) {
+    state.PauseTiming();
+    stats_pma p;
+    key_stream keys(workload, seed++);
+    state.ResumeTiming();
+
+    for (uint32_t i = 0; i < n; ++i)
+      p.insert(keys.next());
+
+    const stats_pma::stats_t stats = p.stats();
+    totals.shifted_inserts += stats.shifted_inserts;
+    totals.rebalancing_inserts += stats.rebalancing_inserts;
+    totals.rebalances += stats.rebalances;
+    totals.resizes += stats.resizes;
+    totals.resize_nanoseconds += stats.resize_nanoseconds;
+    for (int h = 0; h < stats_pma::STATS_BUCKETS; ++h)
+      totals.rebalance_heights[h] += stats.rebalance_heights[h];
+  }
+  const double inserts = static_cast<double>(state.iterations()) * n;
+  double height = 0;
+  for (int h = 0; h < stats_pma::STATS_BUCKETS; ++h)
+    height += static_cast<double>(h) * totals.rebalance_heights[h];
+  state.SetItemsProcessed(state.iterations() * n);
+  state.counters["shifted_fraction"] = totals.shifted_inserts / inserts;
+  state.counters["rebalancing_fraction"] =
+    totals.rebalancing_inserts / inserts;
+  state.counters["rebalances_per_insert"] = totals.rebalances / inserts;
+  state.counters["mean_rebalance_height"] =
+    totals.rebalances ? height / totals.rebalances : 0;
+  state.counters["resize_ms"] = totals.resize_nanoseconds / 1e6 /
+    state.iterations();
+  state.counters["resizes"] = static_cast<double>(totals.resizes) /
+    state.iterations();
+}
+
+void BM_reserved_insert(benchmark::State& state, workload_t workload)
+{
+  // As BM_insert_stats, into a pma that has reserved address space for all
+  // N keys up front, so that its resizes grow the arrays in place rather
+  // than copying them. Compare resize_ms against BM_insert_stats.
+  typedef pma<bench_key, pma_no_value, less<bench_key>, aos_layout,
+          stats_policy<> > stats_pma;
+  const uint32_t n = state.range(0);
+  uint64_t seed = 1;
+  uint64_t resize_nanoseconds = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    stats_pma p;
+    p.reserve_capacity(4 * n);
+    key_stream keys(workload, seed++);
+    state.ResumeTiming();
+
+    for (uint32_t i = 0; i < n; ++i)
+      p.insert(keys.next());
+
+    resize_nanoseconds += p.stats().resize_nanoseconds;
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+  state.counters["resize_ms"] = resize_nanoseconds / 1e6 /
+    state.iterations();
+}
+
+void BM_parallel_insert(benchmark::State& state, workload_t workload)
+{
+  // As BM_insert, with the large rebalances and resizes spread over a
+  // thread pool of the given size.
+  const uint32_t n = state.range(0);
+  const uint32_t threads = state.range(1);
+  uint64_t seed = 1;
+  for (auto _ : state) {
+    state.PauseTiming();
+    pma<bench_key> p;
+    p.set_rebalance_threads(threads);
+    key_stream keys(workload, seed++);
+    if (workload == HAMMER) {
+      for (uint32_t i = 0; i < n; ++i)
+        p.insert(keys.preload_key(i));
+      keys.set_spot(keys.preload_key(n / 2));
+    }
+    state.ResumeTiming();
+
+    for (uint32_t i = 0; i < n; ++i)
+      p.insert(keys.next());
+
+    state.PauseTiming();
+    benchmark::DoNotOptimize(p.size());
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+
+void BM_insert_batch(benchmark::State& state, workload_t workload)
+{
+  const uint32_t n = state.range(0);
+  const uint32_t batch_size = state.range(1);
+  uint64_t moves = 0;
+  uint64_t seed = 1;
+  vector<bench_key> batch(batch_size);
+  for (auto _ : state) {
+    state.PauseTiming();
+    pma<bench_key> p;
+    key_stream keys(workload, seed++);
+    if (workload == HAMMER) {
+      for (uint32_t i = 0; i < n; ++i)
+        p.insert(keys.preload_key(i));
+      keys.set_spot(keys.preload_key(n / 2));
+    }
+    const uint64_t moves_before = p.element_moves();
+    state.ResumeTiming();
+
+    for (uint32_t i = 0; i < n; i += batch_size) {
+      const uint32_t count = min(batch_size, n - i);
+      for (uint32_t k = 0; k < count; ++k)
+        batch[k] = keys.next();
+      p.insert_batch(batch.begin(), batch.begin() + count);
+    }
+    moves += p.element_moves() - moves_before;
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+  state.counters["moves_per_insert"] =
+    static_cast<double>(moves) / (state.iterations() * n);
+}
+
+// Builds a pma of N random keys, then erases them all, in random order or
+// from the smallest up. Besides the usual figures this reports the capacity
+// left once the pma falls to a tenth of its size, relative to its peak.
+void BM_erase(benchmark::State& state, workload_t workload)
+{
+  const uint32_t n = state.range(0);
+  latency_sampler latency;
+  uint64_t moves = 0;
+  uint64_t seed = 1;
+  double capacity_ratio = 0;
+  vector<bench_key> keys(n);
+  for (auto _ : state) {
+    state.PauseTiming();
+    pma<bench_key> p;
+    for (uint32_t i = 0; i < n; ++i) {
+      keys[i] = splitmix64(seed + i);
+      p.insert(keys[i]);
+    }
+    seed += n;
+    if (workload == ASCENDING)
+      sort(keys.begin(), keys.end());
+    const uint32_t peak = p.capacity();
+    const uint64_t moves_before = p.element_moves();
+    state.ResumeTiming();
+
+    for (uint32_t i = 0; i < n; ++i) {
+      if (i % latency_sampler::SAMPLE_PERIOD == 0) {
+        const chrono::steady_clock::time_point start =
+          chrono::steady_clock::now();
+        p.erase(keys[i]);
+        latency.record(start);
+      } else {
+        p.erase(keys[i]);
+      }
+      if (i == n - n / 10)
+        capacity_ratio += static_cast<double>(p.capacity()) / peak;
+    }
+    moves += p.element_moves() - moves_before;
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+  state.counters["moves_per_erase"] =
+    static_cast<double>(moves) / (state.iterations() * n);
+  state.counters["capacity_at_10pct"] = capacity_ratio / state.iterations();
+  latency.report(state);
+}
+
+// The pmas read by the lookup and scan benchmarks, one per size, holding
+// the keys 0, KEY_STRIDE, 2 * KEY_STRIDE, ... They are built on first use
+// and kept for the rest of the run.
+const int KEY_STRIDE = 8;
+
+const pma<int>& read_fixture(uint32_t n)
+{
+  static map<uint32_t, pma<int>*> fixtures;
+  pma<int>*& p = fixtures[n];
+  if (p == 0) {
+    p = new pma<int>;
+    vector<int> keys(n);
+    for (uint32_t i = 0; i < n; ++i)
+      keys[i] = i * KEY_STRIDE;
+    p->from_sorted(keys.begin(), keys.end());
+  }
+  return *p;
+}
+
+void BM_from_sorted(benchmark::State& state)
+{
+  // Bulk loads N sorted keys into a pma whose thread pool has the given
+  // size, and reports the bytes of the keys loaded per second.
+  const uint32_t n = state.range(0);
+  const uint32_t threads = state.range(1);
+  vector<bench_key> keys(n);
+  for (uint32_t i = 0; i < n; ++i)
+    keys[i] = static_cast<bench_key>(i) * KEY_STRIDE;
+  pma<bench_key> p;
+  p.set_rebalance_threads(threads);
+  for (auto _ : state) {
+    p.from_sorted(keys.begin(), keys.end());
+    benchmark::DoNotOptimize(p.size());
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+  state.SetBytesProcessed(state.iterations() * n * sizeof(bench_key));
+}
+
+void BM_lookup(benchmark::State& state)
+{
+  const uint32_t n = state.range(0);
+  const pma<int>& p = read_fixture(n);
+  latency_sampler latency;
+  uint64_t i = 0;
+  for (auto _ : state) {
+    // Alternate between hits and misses.
+    const int key = (splitmix64(i) % n) * KEY_STRIDE + (i & 1);
+    if (i % latency_sampler::SAMPLE_PERIOD == 0) {
+      const chrono::steady_clock::time_point start =
+        chrono::steady_clock::now();
+      benchmark::DoNotOptimize(p.predecessor(key + 1));
+      latency.record(start);
+    } else {
+      benchmark::DoNotOptimize(p.predecessor(key + 1));
+    }
+    ++i;
+  }
+  state.SetItemsProcessed(state.iterations());
+  latency.report(state);
+}
+
+void BM_find(benchmark::State& state)
+{
+  // Random point lookups, half of them hits, one at a time.
+  const uint32_t n = state.range(0);
+  const pma<int>& p = read_fixture(n);
+  uint64_t i = 0;
+  for (auto _ : state) {
+    const int key = (splitmix64(i) % n) * KEY_STRIDE + (i & 1);
+    benchmark::DoNotOptimize(p.contains(key));
+    ++i;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+void BM_lookup_many(benchmark::State& state)
+{
+  // The lookups of BM_find, handed to lookup_many 256 at a time so that
+  // the cache misses of each batch overlap.
+  const uint32_t n = state.range(0);
+  const uint32_t batch = 256;
+  const pma<int>& p = read_fixture(n);
+  const uint32_t rounds = 256;
+  vector<int> keys(batch * rounds);
+  for (uint32_t i = 0; i < keys.size(); ++i)
+    keys[i] = (splitmix64(i) % n) * KEY_STRIDE + (i & 1);
+  vector<uint32_t> positions(batch);
+  uint32_t round = 0;
+  for (auto _ : state) {
+    p.lookup_many(&keys[round * batch], batch, positions.data());
+    benchmark::DoNotOptimize(positions.data());
+    round = (round + 1) % rounds;
+  }
+  state.SetItemsProcessed(state.iterations() * batch);
+}
+
+void BM_scan_spans(benchmark::State& state)
+{
+  const uint32_t n = state.range(0);
+  const uint32_t length = min<uint32_t>(state.range(1), n);
+  const pma<int>& p = read_fixture(n);
+  const uint32_t segment_size = p.segment_size();
+  uint64_t i = 0;
+  for (auto _ : state) {
+    const int lo = (splitmix64(i++) % (n - length + 1)) * KEY_STRIDE;
+    int64_t sum = 0;
+    pma<int>::span_range spans = p.range(lo, lo + length * KEY_STRIDE);
+    for (pma<int>::span_iterator it = spans.begin(); it != spans.end();
+         ++it) {
+      const pma<int>::segment_span span = *it;
+      for (uint32_t j = 0; j < segment_size; ++j)
+        sum += (span.mask >> j & 1) ? span.data[j].key : 0;
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(state.iterations() * length);
+}
+
+void BM_scan_iterator(benchmark::State& state)
+{
+  // A full scan in order through the gap-skipping iterator.
+  const uint32_t n = state.range(0);
+  const pma<int>& p = read_fixture(n);
+  for (auto _ : state) {
+    int64_t sum = 0;
+    for (pma<int>::const_iterator it = p.begin(); it != p.end(); ++it)
+      sum += *it;
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+
+template <class Layout>
+void BM_layout_scan(benchmark::State& state)
+{
+  // A full scan in order of N keys stored in the given layout, reporting
+  // the bytes the slots take per key, so that the memory saved by
+  // delta_layout can be weighed against the time it takes to unpack.
+  const uint32_t n = state.range(0);
+  vector<bench_key> keys(n);
+  for (uint32_t i = 0; i < n; ++i)
+    keys[i] = static_cast<bench_key>(i) * KEY_STRIDE;
+  typedef pma<bench_key, pma_no_value, less<bench_key>, Layout> layout_pma;
+  layout_pma p;
+  p.from_sorted(keys.begin(), keys.end());
+  for (auto _ : state) {
+    uint64_t sum = 0;
+    for (typename layout_pma::const_iterator it = p.begin(); it != p.end();
+         ++it)
+      sum += *it;
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+  state.counters["bytes_per_key"] =
+    static_cast<double>(p.stats().storage_bytes) / n;
+}
+
+// Counts the last-level cache and data TLB read misses of the calling
+// thread in user space between start and stop, through perf_event_open.
+class miss_counters {
+  private:
+    int _llc;
+    int _dtlb;
+
+    static int open_counter(uint64_t cache)
+    {
+      perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.type = PERF_TYPE_HW_CACHE;
+      attr.size = sizeof(attr);
+      attr.config = cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+      attr.disabled = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    static uint64_t read_counter(int fd)
+    {
+      uint64_t count = 0;
+      if (read(fd, &count, sizeof(count)) != sizeof(count))
+        return 0;
+      return count;
+    }
+
+  public:
+    miss_counters()
+      : _llc(open_counter(PERF_COUNT_HW_CACHE_LL)),
+        _dtlb(open_counter(PERF_COUNT_HW_CACHE_DTLB)) {}
+
+    ~miss_counters() {
+      if (_llc >= 0)
+        close(_llc);
+      if (_dtlb >= 0)
+        close(_dtlb);
+    }
+
+    bool available() const {
+      return _llc >= 0 && _dtlb >= 0;
+    }
+
+    void start() {
+      ioctl(_llc, PERF_EVENT_IOC_RESET, 0);
+      ioctl(_dtlb, PERF_EVENT_IOC_RESET, 0);
+      ioctl(_llc, PERF_EVENT_IOC_ENABLE, 0);
+      ioctl(_dtlb, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    void stop() {
+      ioctl(_llc, PERF_EVENT_IOC_DISABLE, 0);
+      ioctl(_dtlb, PERF_EVENT_IOC_DISABLE, 0);
+    }
+
+    // Reports the misses counted per one of the given number of ops.
+    void report(benchmark::State& state, double ops, const string& op) const
+    {
+      state.counters["llc_misses_per_" + op] = read_counter(_llc) / ops;
+      state.counters["dtlb_misses_per_" + op] = read_counter(_dtlb) / ops;
+    }
+};
+
+// Yields the keys of the miss fixtures without holding them all in memory.
+class stride_iterator {
+  private:
+    bench_key _key;
+
+  public:
+    typedef forward_iterator_tag iterator_category;
+    typedef bench_key value_type;
+    typedef ptrdiff_t difference_type;
+    typedef const bench_key* pointer;
+    typedef const bench_key& reference;
+
+    explicit stride_iterator(uint64_t i) : _key(i * KEY_STRIDE) {}
+    reference operator*() const { return _key; }
+    stride_iterator& operator++() {
+      _key += KEY_STRIDE;
+      return *this;
+    }
+    stride_iterator operator++(int) {
+      stride_iterator it = *this;
+      _key += KEY_STRIDE;
+      return it;
+    }
+    bool operator==(const stride_iterator& other) const {
+      return _key == other._key;
+    }
+    bool operator!=(const stride_iterator& other) const {
+      return _key != other._key;
+    }
+};
+
+// Miss fixtures of at least this many keys are kept in a file under /tmp
+// rather than in memory, so that those past the size of RAM page in from
+// the file rather than failing to allocate.
+const uint64_t MAPPED_FIXTURE_SIZE = 100000000;
+
+// The pmas of the miss benchmarks, one per size and policy, holding the
+// keys 0, KEY_STRIDE, 2 * KEY_STRIDE, ...
+template <class Policy>
+const pma<bench_key, pma_no_value, less<bench_key>, aos_layout, Policy>&
+  miss_fixture(uint64_t n)
+{
+  typedef pma<bench_key, pma_no_value, less<bench_key>, aos_layout, Policy>
+    miss_pma;
+  static map<uint64_t, miss_pma*> fixtures;
+  miss_pma*& p = fixtures[n];
+  if (p == 0) {
+    p = new miss_pma;
+    if (n >= MAPPED_FIXTURE_SIZE) {
+      const string path = "/tmp/pma_bench_misses_" +
+        to_string(Policy::VEB_INDEX) + "_" + to_string(n) + ".pma";
+      unlink(path.c_str());
+      p->open(path.c_str());
+      unlink(path.c_str());
+    }
+    p->from_sorted(stride_iterator(0), stride_iterator(n));
+  }
+  return *p;
+}
+
+template <class Policy>
+void BM_lookup_misses(benchmark::State& state)
+{
+  // Random predecessor lookups, which descend the segment index and then
+  // search one segment. With a cache-oblivious index the misses per lookup
+  // should grow as log_B N for the block size B of each cache.
+  const uint64_t n = state.range(0);
+  miss_counters misses;
+  if (!misses.available()) {
+    state.SkipWithError("perf_event_open is not allowed");
+    return;
+  }
+  const pma<bench_key, pma_no_value, less<bench_key>, aos_layout, Policy>& p =
+    miss_fixture<Policy>(n);
+  uint64_t i = 0;
+  misses.start();
+  for (auto _ : state) {
+    const bench_key key = (splitmix64(i++) % n) * KEY_STRIDE;
+    benchmark::DoNotOptimize(p.predecessor(key + 1));
+  }
+  misses.stop();
+  state.SetItemsProcessed(state.iterations());
+  misses.report(state, static_cast<double>(state.iterations()), "lookup");
+}
+
+template <class Policy>
+void BM_scan_misses(benchmark::State& state)
+{
+  // Scans of the given length from random keys. Past the first segment the
+  // misses per scanned element should be about one per B elements.
+  const uint64_t n = state.range(0);
+  const uint64_t length = min<uint64_t>(state.range(1), n);
+  typedef pma<bench_key, pma_no_value, less<bench_key>, aos_layout, Policy>
+    miss_pma;
+  miss_counters misses;
+  if (!misses.available()) {
+    state.SkipWithError("perf_event_open is not allowed");
+    return;
+  }
+  const miss_pma& p = miss_fixture<Policy>(n);
+  const uint32_t segment_size = p.segment_size();
+  uint64_t i = 0;
+  misses.start();
+  for (auto _ : state) {
+    const bench_key lo = (splitmix64(i++) % (n - length + 1)) * KEY_STRIDE;
+    uint64_t sum = 0;
+    typename miss_pma::span_range spans =
+      p.range(lo, lo + length * KEY_STRIDE);
+    for (typename miss_pma::span_iterator it = spans.begin();
+         it != spans.end(); ++it) {
+      const typename miss_pma::segment_span span = *it;
+      for (uint32_t j = 0; j < segment_size; ++j)
+        sum += (span.mask >> j & 1) ? span.data[j].key : 0;
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  misses.stop();
+  state.SetItemsProcessed(state.iterations() * length);
+  misses.report(state, static_cast<double>(state.iterations()) * length,
+      "element");
+}
+
+// The pmas shared by the concurrent benchmark, one per size, holding the
+// same keys as the read fixtures with concurrent readers enabled.
+pma<int>& concurrent_fixture(uint32_t n)
+{
+  static map<uint32_t, pma<int>*> fixtures;
+  pma<int>*& p = fixtures[n];
+  if (p == 0) {
+    p = new pma<int>;
+    vector<int> keys(n);
+    for (uint32_t i = 0; i < n; ++i)
+      keys[i] = i * KEY_STRIDE;
+    p->from_sorted(keys.begin(), keys.end());
+    p->enable_concurrent_readers();
+  }
+  return *p;
+}
+
+void BM_concurrent_lookup(benchmark::State& state)
+{
+  // Thread 0 writes, inserting keys between the fixture's and erasing them
+  // again, while the other threads look up predecessors through
+  // read_predecessor. Only the readers count towards items processed.
+  const uint32_t n = state.range(0);
+  // The start of the loop waits for every thread, so shared is set by then.
+  static pma<int>* shared = 0;
+  if (state.thread_index() == 0)
+    shared = &concurrent_fixture(n);
+  uint64_t i = 0;
+  if (state.thread_index() == 0) {
+    vector<int> inserted;
+    for (auto _ : state) {
+      const int key = (splitmix64(i++) % n) * KEY_STRIDE + 1;
+      if (shared->insert(key))
+        inserted.push_back(key);
+      if (inserted.size() == n / 10) {
+        for (size_t j = 0; j < inserted.size(); ++j)
+          shared->erase(inserted[j]);
+        inserted.clear();
+      }
+    }
+    for (size_t j = 0; j < inserted.size(); ++j)
+      shared->erase(inserted[j]);
+  } else {
+    i = state.thread_index();
+    for (auto _ : state) {
+      int key;
+      benchmark::DoNotOptimize(shared->read_predecessor(
+            (splitmix64(i++) % n) * KEY_STRIDE + 2, key));
+      benchmark::DoNotOptimize(key);
+    }
+    state.SetItemsProcessed(state.iterations());
+  }
+}
+
+void BM_concurrent_insert(benchmark::State& state)
+{
+  // Every thread inserts uniformly random keys from a key range of its own
+  // into one shared pma, which grows for as long as the benchmark runs.
+  // The start and end of the loop wait for every thread, so the pma is in
+  // place before the first insert and outlives the last.
+  static pma<bench_key>* shared = 0;
+  if (state.thread_index() == 0) {
+    shared = new pma<bench_key>;
+    shared->enable_concurrent_inserts();
+  }
+  const bench_key range = ~bench_key(0) / state.threads();
+  const bench_key base = range * state.thread_index();
+  uint64_t i = static_cast<uint64_t>(state.thread_index()) << 48;
+  for (auto _ : state)
+    shared->insert(base + splitmix64(i++) % range);
+  state.SetItemsProcessed(state.iterations());
+  if (state.thread_index() == 0) {
+    state.counters["moves_per_insert"] = static_cast<double>(
+        shared->element_moves()) / shared->size();
+    delete shared;
+    shared = 0;
+  }
+}
+
+void BM_background_insert(benchmark::State& state, workload_t workload,
+    bool background)
+{
+  // Inserts N keys from one thread into a pma with concurrent inserts
+  // enabled, rebalancing either on the inserting thread or on the
+  // background rebalancer, and reports the sampled insert latencies. The
+  // rebalancer is waited for within the timing, so the throughputs compare.
+  const uint32_t n = state.range(0);
+  latency_sampler latency;
+  uint64_t overflowed = 0;
+  uint64_t seed = 1;
+  for (auto _ : state) {
+    state.PauseTiming();
+    pma<bench_key, pma_no_value, less<bench_key>, aos_layout,
+        stats_policy<> > p;
+    if (background)
+      p.enable_background_rebalancing();
+    else
+      p.enable_concurrent_inserts();
+    key_stream keys(workload, seed++);
+    state.ResumeTiming();
+
+    for (uint32_t i = 0; i < n; ++i) {
+      const bench_key key = keys.next();
+      if (i % latency_sampler::SAMPLE_PERIOD == 0) {
+        const chrono::steady_clock::time_point start =
+          chrono::steady_clock::now();
+        p.insert(key);
+        latency.record(start);
+      } else {
+        p.insert(key);
+      }
+    }
+    p.wait_for_rebalances();
+    overflowed += p.stats().overflow_inserts;
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+  state.counters["overflow_fraction"] =
+    static_cast<double>(overflowed) / (state.iterations() * n);
+  latency.report(state);
+}
+
+void BM_sharded_insert(benchmark::State& state)
+{
+  // As BM_concurrent_insert, into a sharded_pma of the given number of
+  // shards, balanced in the background. Threads contend only for the
+  // shards their keys land in, and each shard resizes on its own.
+  static sharded_pma<bench_key>* shared = 0;
+  if (state.thread_index() == 0) {
+    shared = new sharded_pma<bench_key>(state.range(0));
+    shared->enable_background_balancing();
+  }
+  const bench_key range = ~bench_key(0) / state.threads();
+  const bench_key base = range * state.thread_index();
+  uint64_t i = static_cast<uint64_t>(state.thread_index()) << 48;
+  for (auto _ : state)
+    shared->insert(base + splitmix64(i++) % range);
+  state.SetItemsProcessed(state.iterations());
+  if (state.thread_index() == 0) {
+    state.counters["shards"] = shared->shards();
+    delete shared;
+    shared = 0;
+  }
+}
+
+void BM_open(benchmark::State& state)
+{
+  // Reopens a file holding N keys, written once per size, and looks up a
+  // single key in it. Only the pages that lookup touches are read in, so
+  // the time should not grow with N.
+  const uint32_t n = state.range(0);
+  const string path = "/tmp/pma_bench_" + to_string(n) + ".pma";
+  {
+    unlink(path.c_str());
+    pma<int> p;
+    p.open(path.c_str());
+    vector<int> keys(n);
+    for (uint32_t i = 0; i < n; ++i)
+      keys[i] = i * KEY_STRIDE;
+    p.from_sorted(keys.begin(), keys.end());
+  }
+  uint64_t i = 0;
+  for (auto _ : state) {
+    pma<int> p;
+    if (!p.open(path.c_str())) {
+      state.SkipWithError("cannot open the file");
+      break;
+    }
+    benchmark::DoNotOptimize(
+        p.predecessor((splitmix64(i++) % n) * KEY_STRIDE));
+  }
+  unlink(path.c_str());
+}
+
+void BM_checkpoint(benchmark::State& state, bool logged)
+{
+  // Makes a file of N keys durable after each round of D random inserts:
+  // with a log, by a checkpoint of the segments the round wrote to, or
+  // without, by syncing the whole mapping. The bytes each checkpoint
+  // writes should follow D and not N.
+  const uint32_t n = state.range(0);
+  const uint32_t dirty = state.range(1);
+  const string path = "/tmp/pma_bench_checkpoint.pma";
+  const string log_path = path + ".log";
+  unlink(path.c_str());
+  unlink(log_path.c_str());
+  {
+    pma<int, pma_no_value, less<int>, aos_layout, stats_policy<> > p;
+    if (!(logged ? p.open(path.c_str(), log_path.c_str()) :
+          p.open(path.c_str()))) {
+      state.SkipWithError("cannot open the file");
+      return;
+    }
+    vector<int> keys(n);
+    for (uint32_t i = 0; i < n; ++i)
+      keys[i] = i * KEY_STRIDE;
+    p.from_sorted(keys.begin(), keys.end());
+    p.sync();
+    const uint64_t checkpoints = p.stats().checkpoints;
+    const uint64_t bytes = p.stats().checkpoint_bytes;
+    uint64_t i = 0;
+    for (auto _ : state) {
+      for (uint32_t k = 0; k < dirty; ++k)
+        p.insert((splitmix64(i++) % n) * KEY_STRIDE + 1 +
+            k % (KEY_STRIDE - 1));
+      p.sync();
+    }
+    state.SetItemsProcessed(state.iterations() * dirty);
+    if (logged)
+      state.counters["bytes_per_checkpoint"] = static_cast<double>(
+          p.stats().checkpoint_bytes - bytes) /
+        (p.stats().checkpoints - checkpoints);
+  }
+  unlink(path.c_str());
+  unlink(log_path.c_str());
+}
+
+void BM_commit(benchmark::State& state)
+{
+  // Every thread inserts random keys into one logged pma and commits each
+  // insert before the next. Threads committing at once share an fdatasync
+  // of the log, so the total throughput should grow with the threads.
+  static pma<bench_key>* shared = 0;
+  const string path = "/tmp/pma_bench_commit.pma";
+  const string log_path = path + ".log";
+  if (state.thread_index() == 0) {
+    unlink(path.c_str());
+    unlink(log_path.c_str());
+    shared = new pma<bench_key>;
+    shared->enable_concurrent_inserts();
+    shared->open(path.c_str(), log_path.c_str());
+  }
+  uint64_t i = static_cast<uint64_t>(state.thread_index()) << 48;
+  for (auto _ : state) {
+    shared->insert(splitmix64(i++));
+    shared->commit();
+  }
+  state.SetItemsProcessed(state.iterations());
+  if (state.thread_index() == 0) {
+    delete shared;
+    shared = 0;
+    unlink(path.c_str());
+    unlink(log_path.c_str());
+  }
+}
+
+void insert_sizes(benchmark::internal::Benchmark* b) {
+  b->RangeMultiplier(10)->Range(1000, 10000000)->Unit(benchmark::kMillisecond);
+}
+
+void read_sizes(benchmark::internal::Benchmark* b) {
+  b->RangeMultiplier(10)->Range(1000, 100000000);
+}
+
+void scan_sizes(benchmark::internal::Benchmark* b)
+{
+  for (int64_t n = 1000; n <= 100000000; n *= 10)
+    for (int64_t length = 10; length <= 100000; length *= 100)
+      b->Args({n, length});
+}
+
+void layout_sizes(benchmark::internal::Benchmark* b) {
+  b->RangeMultiplier(10)->Range(1000, 10000000);
+}
+
+void checkpoint_sizes(benchmark::internal::Benchmark* b)
+{
+  for (int64_t n = 100000; n <= 10000000; n *= 10)
+    for (int64_t dirty = 1; dirty <= 1000; dirty *= 10)
+      b->Args({n, dirty});
+  b->Unit(benchmark::kMicrosecond);
+}
+
+void miss_sizes(benchmark::internal::Benchmark* b)
+{
+  // From a pma that fits in L1 to one that, at 16 GB, is past the RAM of
+  // most machines.
+  for (int64_t n = 1000; n <= 1000000000; n *= 10)
+    b->Arg(n);
+}
+
+void scan_miss_sizes(benchmark::internal::Benchmark* b)
+{
+  for (int64_t n = 1000; n <= 1000000000; n *= 10)
+    b->Args({n, 1000});
+}
+
+void kernel_sizes(benchmark::internal::Benchmark* b)
+{
+  for (int64_t n = 100000; n <= 10000000; n *= 10)
+    for (int64_t isa = SCALAR_KERNELS; isa <= AVX512_KERNELS; ++isa)
+      b->Args({n, isa});
+  b->Unit(benchmark::kMillisecond);
+}
+
+void parallel_sizes(benchmark::internal::Benchmark* b)
+{
+  for (int64_t threads = 1; threads <= 64; threads *= 4)
+    b->Args({1000000, threads});
+  b->Unit(benchmark::kMillisecond)->UseRealTime();
+}
+
+void load_sizes(benchmark::internal::Benchmark* b)
+{
+  for (int64_t n = 1000000; n <= 100000000; n *= 10)
+    for (int64_t threads = 1; threads <= 16; threads *= 4)
+      b->Args({n, threads});
+  b->Unit(benchmark::kMillisecond)->UseRealTime();
+}
+
+void batch_sizes(benchmark::internal::Benchmark* b)
+{
+  for (int64_t n = 100000; n <= 10000000; n *= 10)
+    for (int64_t batch = 1000; batch <= 1000000; batch *= 10)
+      b->Args({n, batch});
+  b->Unit(benchmark::kMillisecond);
+}
+
+} // namespace
+
+const algorithm_t ONE_PHASE = pma<bench_key>::ONE_PHASE;
+const algorithm_t ADAPTIVE = pma<bench_key>::ADAPTIVE;
+
+BENCHMARK_CAPTURE(BM_insert, random, RANDOM, ONE_PHASE)->Apply(insert_sizes);
+BENCHMARK_CAPTURE(BM_insert, ascending, ASCENDING, ONE_PHASE)
+  ->Apply(insert_sizes);
+BENCHMARK_CAPTURE(BM_insert, descending, DESCENDING, ONE_PHASE)
+  ->Apply(insert_sizes);
+BENCHMARK_CAPTURE(BM_insert, zipfian, ZIPFIAN, ONE_PHASE)->Apply(insert_sizes);
+BENCHMARK_CAPTURE(BM_insert, hammer, HAMMER, ONE_PHASE)->Apply(insert_sizes);
+BENCHMARK_CAPTURE(BM_insert, adaptive_random, RANDOM, ADAPTIVE)
+  ->Apply(insert_sizes);
+BENCHMARK_CAPTURE(BM_insert, adaptive_ascending, ASCENDING, ADAPTIVE)
+  ->Apply(insert_sizes);
+BENCHMARK_CAPTURE(BM_insert, adaptive_hammer, HAMMER, ADAPTIVE)
+  ->Apply(insert_sizes);
+BENCHMARK(BM_kernel_insert)->Apply(kernel_sizes);
+BENCHMARK_CAPTURE(BM_insert_stats, random, RANDOM)->Apply(insert_sizes);
+BENCHMARK_CAPTURE(BM_insert_stats, ascending, ASCENDING)
+  ->Apply(insert_sizes);
+BENCHMARK_CAPTURE(BM_reserved_insert, random, RANDOM)->Apply(insert_sizes);
+BENCHMARK_CAPTURE(BM_reserved_insert, ascending, ASCENDING)
+  ->Apply(insert_sizes);
+BENCHMARK_CAPTURE(BM_parallel_insert, ascending, ASCENDING)
+    ->Apply(parallel_sizes);
+BENCHMARK_CAPTURE(BM_parallel_insert, hammer, HAMMER)->Apply(parallel_sizes);
+BENCHMARK_CAPTURE(BM_insert_batch, random, RANDOM)->Apply(batch_sizes);
+BENCHMARK_CAPTURE(BM_insert_batch, ascending, ASCENDING)->Apply(batch_sizes);
+BENCHMARK(BM_from_sorted)->Apply(load_sizes);
+BENCHMARK_CAPTURE(BM_erase, random, RANDOM)->Apply(insert_sizes);
+BENCHMARK_CAPTURE(BM_erase, ascending, ASCENDING)->Apply(insert_sizes);
+BENCHMARK(BM_lookup)->Apply(read_sizes);
+BENCHMARK(BM_find)->Apply(read_sizes);
+BENCHMARK(BM_lookup_many)->Apply(read_sizes);
+BENCHMARK(BM_scan_spans)->Apply(scan_sizes);
+BENCHMARK(BM_scan_iterator)->Apply(read_sizes);
+BENCHMARK_TEMPLATE(BM_layout_scan, aos_layout)->Apply(layout_sizes);
+BENCHMARK_TEMPLATE(BM_layout_scan, soa_layout)->Apply(layout_sizes);
+BENCHMARK_TEMPLATE(BM_layout_scan, delta_layout<uint8_t>)
+  ->Apply(layout_sizes);
+BENCHMARK_TEMPLATE(BM_layout_scan, delta_layout<uint16_t>)
+  ->Apply(layout_sizes);
+BENCHMARK_TEMPLATE(BM_lookup_misses, pma_policy<>)->Apply(miss_sizes);
+BENCHMARK_TEMPLATE(BM_lookup_misses, veb_policy<>)->Apply(miss_sizes);
+BENCHMARK_TEMPLATE(BM_scan_misses, pma_policy<>)->Apply(scan_miss_sizes);
+BENCHMARK_TEMPLATE(BM_scan_misses, veb_policy<>)->Apply(scan_miss_sizes);
+BENCHMARK(BM_open)->RangeMultiplier(10)->Range(1000, 10000000);
+BENCHMARK_CAPTURE(BM_checkpoint, logged, true)->Apply(checkpoint_sizes);
+BENCHMARK_CAPTURE(BM_checkpoint, whole_file, false)->Apply(checkpoint_sizes);
+BENCHMARK(BM_commit)->ThreadRange(1, 16)->UseRealTime();
+BENCHMARK(BM_concurrent_insert)->ThreadRange(1, 16)->UseRealTime();
+BENCHMARK_CAPTURE(BM_background_insert, foreground_random, RANDOM, false)
+  ->Apply(insert_sizes);
+BENCHMARK_CAPTURE(BM_background_insert, background_random, RANDOM, true)
+  ->Apply(insert_sizes);
+BENCHMARK_CAPTURE(BM_background_insert, foreground_ascending, ASCENDING,
+    false)->Apply(insert_sizes);
+BENCHMARK_CAPTURE(BM_background_insert, background_ascending, ASCENDING,
+    true)->Apply(insert_sizes);
+BENCHMARK(BM_sharded_insert)->ArgName("shards")->Arg(4)->Arg(16)
+    ->ThreadRange(1, 16)->UseRealTime();
+BENCHMARK(BM_concurrent_lookup)->Arg(1000000)->ThreadRange(2, 8)
+    ->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,140 @@
+#ifndef PMA_POLICY_H
+#define PMA_POLICY_H
+
+#include <stdint.h>
+#include <cmath>
+
+/**
+ * PMA Policy
+ * The tuning of a packed-memory array, given to it as a template parameter:
+ * the density thresholds of the leaves and the root, the factor the array
+ * grows and shrinks by, the size of its segments, and its instrumentation.
+ *
+ *   LEAF_LOWER_DENSITY <= ROOT_LOWER_DENSITY < ROOT_UPPER_DENSITY
+ *                      <= LEAF_UPPER_DENSITY
+ *
+ * bound the density of the segments and of the whole array, and the
+ * thresholds of the heights in between are interpolated. SCALE_FACTOR is a
+ * power of two, and SCALE_FACTOR * ROOT_LOWER_DENSITY must stay below
+ * ROOT_UPPER_DENSITY, or a shrink would leave the array too full.
+ *
+ * segment_size(capacity, slot_bytes) returns the number of array positions
+ * per segment of an array of the given capacity, whose slots each take
+ * slot_bytes bytes. It must be a power of two that never decreases as the
+ * capacity grows. The pma caps it at the capacity and at one word of the
+ * free index bitmap, i.e. 64 positions.
+ *
+ * With LINE_ALIGNED set, the pma rounds the segment size up to the fewest
+ * positions whose slots fill whole cache lines, so that every segment
+ * starts on a line and no two segments share one.
+ *
+ * With VEB_INDEX set, the segment index is stored in van Emde Boas order
+ * rather than breadth-first; see segment_index.h.
+ *
+ * With STATS set, the pma keeps the counters that stats() reports beyond
+ * its shape and element moves. Otherwise the code that would keep them
+ * compiles away.
+ *
+ * trace(point, window, length) is called at each pma_trace_point. The
+ * default does nothing and compiles away; a policy may hide it to log, time
+ * or fire a USDT probe.
+ *
+ * A policy with other densities can derive from pma_policy and hide the
+ * constants and functions it changes.
+ */
+
+/**
+ * The points at which a pma calls the trace hook of its policy, with the
+ * window or, for a resize, the whole array, just before and just after
+ * each rebalance and each change in capacity. A rebalance run a step at a
+ * time by the incremental rebuilder is not traced.
+ */
+enum pma_trace_point {
+  TRACE_REBALANCE_BEGIN,
+  TRACE_REBALANCE_END,
+  TRACE_RESIZE_BEGIN,
+  TRACE_RESIZE_END
+};
+
+/**
+ * Segments of the closest power of two at or above log2(capacity)
+ * positions, as in the analysis of the packed-memory array.
+ */
+struct log_segments {
+  static uint32_t segment_size(uint32_t capacity, uint32_t) {
+    uint32_t v = static_cast<uint32_t>(std::log2(capacity)) - 1;
+    v |= v >> 1;
+    v |= v >> 2;
+    v |= v >> 4;
+    v |= v >> 8;
+    v |= v >> 16;
+    return v + 1;
+  }
+};
+
+/**
+ * Segments of a fixed Bytes bytes, rounded down to a power of two
+ * positions, whatever the capacity. With 64 each segment takes a cache
+ * line, with 4096 a page, as far as the cap on the segment size allows.
+ */
+template <uint32_t Bytes>
+struct byte_segments {
+  static uint32_t segment_size(uint32_t, uint32_t slot_bytes) {
+    uint32_t positions = 1;
+    while (2 * positions * slot_bytes <= Bytes)
+      positions *= 2;
+    return positions;
+  }
+};
+
+typedef byte_segments<64> cache_line_segments;
+typedef byte_segments<4096> page_segments;
+
+/**
+ * The default tuning, with segments sized by Segments.
+ */
+template <class Segments = log_segments>
+struct pma_policy {
+  static constexpr double LEAF_LOWER_DENSITY = 0.1;
+  static constexpr double ROOT_LOWER_DENSITY = 0.2;
+  static constexpr double ROOT_UPPER_DENSITY = 0.5;
+  static constexpr double LEAF_UPPER_DENSITY = 1.0;
+  static const uint32_t SCALE_FACTOR = 2;
+  static const bool LINE_ALIGNED = false;
+  static const bool VEB_INDEX = false;
+  static const bool STATS = false;
+
+  static uint32_t segment_size(uint32_t capacity, uint32_t slot_bytes) {
+    return Segments::segment_size(capacity, slot_bytes);
+  }
+
+  static void trace(pma_trace_point, uint32_t, uint32_t) {}
+};
+
+/**
+ * The default tuning, with segments sized by Segments and rounded up to
+ * whole cache lines.
+ */
+template <class Segments = log_segments>
+struct line_aligned_policy : pma_policy<Segments> {
+  static const bool LINE_ALIGNED = true;
+};
+
+/**
+ * The default tuning, with segments sized by Segments and the segment index
+ * in van Emde Boas order.
+ */
+template <class Segments = log_segments>
+struct veb_policy : pma_policy<Segments> {
+  static const bool VEB_INDEX = true;
+};
+
+/**
+ * The default tuning, with segments sized by Segments, keeping stats.
+ */
+template <class Segments = log_segments>
+struct stats_policy : pma_policy<Segments> {
+  static const bool STATS = true;
+};
+
+#endif // PMA_POLICY_H
@@ -0,0 +1,819 @@
+// pma_replay.cc
+// Replays a trace of operations against the packed-memory array and reports
+// throughput, latency percentiles and memory use as JSON.
+//
+// A trace is a text file of one operation per line, keys being unsigned
+// 64-bit integers:
+//   i <key>       insert key
+//   e <key>       erase key
+//   l <key>       look up key
+//   s <lo> <hi>   scan the keys in [lo, hi)
+// Lines starting with anything else are skipped. replay --generate=N writes
+// a synthetic trace of N operations to standard output.
+//
+// Each run replays the first N operations of the trace, for each N in
+// --sizes, from an empty structure, in each of the modes in --modes over
+// each thread count in --threads:
+//   single    one thread replays everything into a pma, in order.
+//   readers   one thread replays the inserts and erases in order into a pma
+//             with concurrent readers enabled, while the others share out
+//             the lookups and scans through read_predecessor and read_range.
+//             Needs at least two threads.
+//   sharded   the threads share out every operation, round robin, against
+//             a sharded_pma.
+// One operation in SAMPLE_PERIOD is timed for the latency percentiles, and
+// the resident set size is sampled every --rss-interval-ms milliseconds.
+//
+// Each run is repeated --repeat times, in passes that replay every run
+// once, each repetition in a child process of its own so that none starts
+// out with what an earlier one left resident. The report gives the figures
+// of the last repetition, and the median, least and greatest over all of
+// them of the p99 latency and of the peak resident set size.
+//
+// Given --baseline, a report written earlier by replay, every run is also
+// compared with the one of the same name there. A run regresses in the p99
+// latency or the peak resident set size if its median exceeds the
+// baseline's by more than --tolerance, a fraction, and even its least
+// exceeds the baseline's greatest, so that a shift within the spread of
+// repetitions is not taken for one. Regressions are listed under
+// "regressions", and replay exits with status 1. The p99 latency is only
+// compared for runs marked "p99_gated", those whose every repetition timed
+// at least MIN_GATED_SAMPLES operations; below that it rests on too few
+// samples to tell a regression from noise.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "pma.h"
+#include "sharded_pma.h"
+
+using namespace std;
+
+namespace {
+
+typedef uint64_t replay_key;
+
+enum op_type { INSERT, ERASE, LOOKUP, SCAN };
+
+struct operation {
+  op_type type;
+  replay_key key;
+
+  // The end of the range of a scan.
+  replay_key end;
+};
+
+// One operation in this many is timed, which keeps the cost of reading the
+// clock out of the throughput figures.
+const uint32_t SAMPLE_PERIOD = 64;
+
+// The p99 latency of a run is only held against the baseline if each
+// repetition timed this many operations, so that at least ten of them lie
+// beyond it.
+const size_t MIN_GATED_SAMPLES = 1000;
+
+// A fast 64-bit mixing function, used as a stateless random source.
+inline uint64_t splitmix64(uint64_t x)
+{
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+bool load_trace(const char* path, vector<operation>& ops)
+{
+  FILE* file = fopen(path, "r");
+  if (file == 0)
+    return false;
+  char line[256];
+  while (fgets(line, sizeof(line), file)) {
+    operation op;
+    char* end;
+    switch (line[0]) {
+      case 'i': op.type = INSERT; break;
+      case 'e': op.type = ERASE; break;
+      case 'l': op.type = LOOKUP; break;
+      case 's': op.type = SCAN; break;
+      default: continue;
+    }
+    op.key = strtoull(line + 1, &end, 10);
+    op.end = op.type == SCAN ? strtoull(end, 0, 10) : 0;
+    ops.push_back(op);
+  }
+  fclose(file);
+  return true;
+}
+
+void generate_trace(uint64_t n)
+{
+  // Half inserts, a tenth erases of keys inserted earlier, and lookups and
+  // short scans around the keys in between. The keys cluster around 256
+  // hot spots, so that some segments take far more inserts than others.
+  vector<replay_key> inserted;
+  for (uint64_t i = 0; i < n; ++i) {
+    const uint64_t r = splitmix64(i);
+    const uint32_t kind = r % 100;
+    if (kind < 50 || inserted.empty()) {
+      const replay_key key = (splitmix64(r) % 256) << 40 |
+        splitmix64(~r) >> 24;
+      inserted.push_back(key);
+      printf("i %llu\n", (unsigned long long) key);
+      continue;
+    }
+    const size_t at = splitmix64(r + 1) % inserted.size();
+    const replay_key key = inserted[at];
+    if (kind < 60) {
+      inserted[at] = inserted.back();
+      inserted.pop_back();
+      printf("e %llu\n", (unsigned long long) key);
+    } else if (kind < 95) {
+      printf("l %llu\n", (unsigned long long) (key + (r >> 63)));
+    } else {
+      printf("s %llu %llu\n", (unsigned long long) key,
+          (unsigned long long) (key + (uint64_t(1) << 32)));
+    }
+  }
+}
+
+// Returns the resident set size of the process in bytes.
+uint64_t resident_bytes()
+{
+  FILE* file = fopen("/proc/self/statm", "r");
+  if (file == 0)
+    return 0;
+  unsigned long long pages = 0, resident = 0;
+  if (fscanf(file, "%llu %llu", &pages, &resident) != 2)
+    resident = 0;
+  fclose(file);
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Samples the resident set size on a thread of its own, from start until
+// stop.
+class rss_monitor {
+  private:
+    uint32_t _interval_ms;
+    atomic<bool> _stop;
+    thread _sampler;
+    chrono::steady_clock::time_point _start;
+
+  public:
+    // The milliseconds since start and the resident bytes of each sample.
+    vector<pair<double, uint64_t> > samples;
+
+    explicit rss_monitor(uint32_t interval_ms)
+      : _interval_ms(interval_ms), _stop(false) {}
+
+    void start()
+    {
+      _start = chrono::steady_clock::now();
+      _sampler = thread(&rss_monitor::sample_loop, this);
+    }
+
+    void stop()
+    {
+      _stop = true;
+      _sampler.join();
+      record();
+    }
+
+    uint64_t peak() const
+    {
+      uint64_t most = 0;
+      for (size_t i = 0; i < samples.size(); ++i)
+        most = max(most, samples[i].second);
+      return most;
+    }
+
+  private:
+    void record() {
+      samples.push_back(make_pair(chrono::duration<double, milli>(
+              chrono::steady_clock::now() - _start).count(),
+            resident_bytes()));
+    }
+
+    void sample_loop()
+    {
+      while (!_stop) {
+        record();
+        this_thread::sleep_for(chrono::milliseconds(_interval_ms));
+      }
+    }
+};
+
+struct run_result {
+  string name;
+  string mode;
+  uint32_t threads;
+  uint64_t operations;
+  double seconds;
+  uint64_t size;
+
+  // Lookups that found their key, and keys visited by scans.
+  uint64_t hits;
+  uint64_t scanned;
+
+  // The sampled latencies in nanoseconds, sorted once the run is over.
+  vector<double> latencies;
+
+  uint64_t start_rss;
+  uint64_t peak_rss;
+  vector<pair<double, uint64_t> > rss;
+
+  // The throughput as a multiple of that of the fewest threads run in the
+  // same mode on the same operations.
+  double scaling;
+
+  // The number of repetitions; the median, least and greatest over them of
+  // the p99 latency and of the peak resident set size; the fewest latencies
+  // sampled by any of them, and whether that is enough to compare the p99
+  // with a baseline.
+  uint32_t repeats;
+  double p99_spread[3];
+  double peak_rss_spread[3];
+  size_t min_samples;
+  bool p99_gated;
+
+  double percentile(double p) const {
+    if (latencies.empty())
+      return 0;
+    return latencies[static_cast<size_t>((latencies.size() - 1) * p)];
+  }
+};
+
+// The part of a run replayed by one thread, and what it found.
+struct replay_thread {
+  vector<double> latencies;
+  uint64_t hits;
+  uint64_t scanned;
+
+  replay_thread() : hits(0), scanned(0) {}
+
+  // Applies each operation ops[i] that take(ops[i]) accepts, in order,
+  // timing one in SAMPLE_PERIOD of them.
+  template <class Take, class Apply>
+  void replay(const vector<operation>& ops, uint64_t count, Take take,
+      Apply apply)
+  {
+    uint64_t taken = 0;
+    for (uint64_t i = 0; i < count; ++i) {
+      if (!take(i, ops[i]))
+        continue;
+      if (taken++ % SAMPLE_PERIOD == 0) {
+        const chrono::steady_clock::time_point start =
+          chrono::steady_clock::now();
+        apply(ops[i], *this);
+        latencies.push_back(chrono::duration<double, nano>(
+              chrono::steady_clock::now() - start).count());
+      } else {
+        apply(ops[i], *this);
+      }
+    }
+  }
+};
+
+// Runs body(t) on each of threads threads while the resident set size is
+// sampled, and gathers what they found into result.
+template <class Body>
+void run_threads(uint32_t threads, uint32_t rss_interval_ms,
+    vector<replay_thread>& parts, Body body, run_result& result)
+{
+  parts.assign(threads, replay_thread());
+  rss_monitor monitor(rss_interval_ms);
+  result.start_rss = resident_bytes();
+  monitor.start();
+  const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  vector<thread> workers;
+  for (uint32_t t = 1; t < threads; ++t)
+    workers.push_back(thread(body, t));
+  body(0);
+  for (size_t t = 0; t < workers.size(); ++t)
+    workers[t].join();
+  result.seconds = chrono::duration<double>(
+      chrono::steady_clock::now() - start).count();
+  monitor.stop();
+  result.peak_rss = monitor.peak();
+  result.rss.swap(monitor.samples);
+
+  result.hits = result.scanned = 0;
+  for (uint32_t t = 0; t < threads; ++t) {
+    result.latencies.insert(result.latencies.end(),
+        parts[t].latencies.begin(), parts[t].latencies.end());
+    result.hits += parts[t].hits;
+    result.scanned += parts[t].scanned;
+  }
+  sort(result.latencies.begin(), result.latencies.end());
+}
+
+void run_single(const vector<operation>& ops, uint64_t count,
+    uint32_t rss_interval_ms, run_result& result)
+{
+  pma<replay_key> p;
+  vector<replay_thread> parts;
+  run_threads(1, rss_interval_ms, parts, [&](uint32_t) {
+    parts[0].replay(ops, count,
+        [](uint64_t, const operation&) { return true; },
+        [&](const operation& op, replay_thread& part) {
+      switch (op.type) {
+        case INSERT:
+          p.insert(op.key);
+          break;
+        case ERASE:
+          p.erase(op.key);
+          break;
+        case LOOKUP:
+          part.hits += p.contains(op.key);
+          break;
+        case SCAN:
+          for (pma<replay_key>::const_iterator it = p.lower_bound(op.key);
+               it != p.end() && *it < op.end; ++it)
+            part.scanned++;
+          break;
+      }
+    });
+  }, result);
+  result.size = p.size();
+}
+
+void run_readers(const vector<operation>& ops, uint64_t count,
+    uint32_t threads, uint32_t rss_interval_ms, run_result& result)
+{
+  // Thread 0 writes. Reader r of the others takes every read whose index
+  // among the reads is r modulo their number; the reads are counted up
+  // front so each reader can tell its own without a shared counter.
+  pma<replay_key> p;
+  p.enable_concurrent_readers();
+  const uint32_t readers = threads - 1;
+  vector<uint16_t> reader_of(count, 0);
+  uint64_t reads = 0;
+  for (uint64_t i = 0; i < count; ++i)
+    if (ops[i].type == LOOKUP || ops[i].type == SCAN)
+      reader_of[i] = 1 + reads++ % readers;
+  vector<replay_thread> parts;
+  run_threads(threads, rss_interval_ms, parts, [&](uint32_t t) {
+    parts[t].replay(ops, count,
+        [&](uint64_t i, const operation&) { return reader_of[i] == t; },
+        [&](const operation& op, replay_thread& part) {
+      replay_key key;
+      switch (op.type) {
+        case INSERT:
+          p.insert(op.key);
+          break;
+        case ERASE:
+          p.erase(op.key);
+          break;
+        case LOOKUP:
+          part.hits += p.read_predecessor(op.key + 1, key) && key == op.key;
+          break;
+        case SCAN:
+          p.read_range(op.key, op.end,
+              [&](const replay_key&, const pma_no_value&) {
+            part.scanned++;
+          });
+          break;
+      }
+    });
+  }, result);
+  result.size = p.size();
+}
+
+void run_sharded(const vector<operation>& ops, uint64_t count,
+    uint32_t threads, uint32_t rss_interval_ms, run_result& result)
+{
+  sharded_pma<replay_key> s;
+  s.enable_background_balancing();
+  vector<replay_thread> parts;
+  run_threads(threads, rss_interval_ms, parts, [&](uint32_t t) {
+    parts[t].replay(ops, count,
+        [&](uint64_t i, const operation&) { return i % threads == t; },
+        [&](const operation& op, replay_thread& part) {
+      replay_key key;
+      switch (op.type) {
+        case INSERT:
+          s.insert(op.key);
+          break;
+        case ERASE:
+          s.erase(op.key);
+          break;
+        case LOOKUP:
+          part.hits += s.predecessor(op.key + 1, key) && key == op.key;
+          break;
+        case SCAN:
+          s.read_range(op.key, op.end,
+              [&](const replay_key&, const pma_no_value&) {
+            part.scanned++;
+          });
+          break;
+      }
+    });
+  }, result);
+  result.size = s.size();
+}
+
+// Replays the run that result names, in its mode and with its number of
+// threads and operations.
+void replay_run(const vector<operation>& ops, uint32_t rss_interval_ms,
+    run_result& result)
+{
+  result.latencies.clear();
+  if (result.mode == "single")
+    run_single(ops, result.operations, rss_interval_ms, result);
+  else if (result.mode == "readers")
+    run_readers(ops, result.operations, result.threads, rss_interval_ms,
+        result);
+  else
+    run_sharded(ops, result.operations, result.threads, rss_interval_ms,
+        result);
+}
+
+// Writes or reads a value, or count elements of a vector, through a pipe.
+// Both return false once the pipe fails or runs dry.
+template <class T>
+bool send(int fd, const T* data, size_t count)
+{
+  const char* bytes = reinterpret_cast<const char*>(data);
+  for (size_t left = count * sizeof(T); left > 0; ) {
+    const ssize_t n = write(fd, bytes, left);
+    if (n <= 0)
+      return false;
+    bytes += n;
+    left -= n;
+  }
+  return true;
+}
+
+template <class T>
+bool receive(int fd, T* data, size_t count)
+{
+  char* bytes = reinterpret_cast<char*>(data);
+  for (size_t left = count * sizeof(T); left > 0; ) {
+    const ssize_t n = read(fd, bytes, left);
+    if (n <= 0)
+      return false;
+    bytes += n;
+    left -= n;
+  }
+  return true;
+}
+
+// Replays the run that result names in a child process, which hands back
+// what it measured through a pipe, so that the run starts from the resident
+// set of replay itself and not from the peak of the runs before it. Returns
+// false if the child fails.
+bool replay_in_child(const vector<operation>& ops, uint32_t rss_interval_ms,
+    run_result& result)
+{
+  int fds[2];
+  if (pipe(fds) != 0)
+    return false;
+  const pid_t child = fork();
+  if (child == 0) {
+    close(fds[0]);
+    replay_run(ops, rss_interval_ms, result);
+    const uint64_t lengths[] = { result.latencies.size(), result.rss.size() };
+    const bool sent = send(fds[1], &result.seconds, 1) &&
+      send(fds[1], &result.size, 1) && send(fds[1], &result.hits, 1) &&
+      send(fds[1], &result.scanned, 1) && send(fds[1], &result.start_rss, 1) &&
+      send(fds[1], &result.peak_rss, 1) && send(fds[1], lengths, 2) &&
+      send(fds[1], result.latencies.data(), lengths[0]) &&
+      send(fds[1], result.rss.data(), lengths[1]);
+    _exit(sent ? 0 : 1);
+  }
+  close(fds[1]);
+  uint64_t lengths[2];
+  bool received = child > 0 && receive(fds[0], &result.seconds, 1) &&
+    receive(fds[0], &result.size, 1) && receive(fds[0], &result.hits, 1) &&
+    receive(fds[0], &result.scanned, 1) &&
+    receive(fds[0], &result.start_rss, 1) &&
+    receive(fds[0], &result.peak_rss, 1) && receive(fds[0], lengths, 2);
+  if (received) {
+    result.latencies.resize(lengths[0]);
+    result.rss.resize(lengths[1]);
+    received = receive(fds[0], result.latencies.data(), lengths[0]) &&
+      receive(fds[0], result.rss.data(), lengths[1]);
+  }
+  close(fds[0]);
+  int status;
+  return child > 0 && waitpid(child, &status, 0) == child && received &&
+    WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// The figures kept of a measurement repeated several times: the median,
+// the upper one of the middle two if there is an even number of them, and
+// the least and the greatest.
+enum spread { MEDIAN, LEAST, GREATEST };
+const char* const SPREAD_NAMES[] = { "median", "least", "greatest" };
+
+// Fills figures with the spread of values, which must not be empty.
+void measure_spread(vector<double> values, double figures[3])
+{
+  sort(values.begin(), values.end());
+  figures[MEDIAN] = values[values.size() / 2];
+  figures[LEAST] = values.front();
+  figures[GREATEST] = values.back();
+}
+
+// Parses a comma-separated list of numbers.
+bool parse_list(const char* text, vector<uint64_t>& values)
+{
+  values.clear();
+  while (*text) {
+    char* end;
+    values.push_back(strtoull(text, &end, 10));
+    if (end == text || (*end != ',' && *end != 0))
+      return false;
+    text = *end ? end + 1 : end;
+  }
+  return !values.empty();
+}
+
+// Finds the number following "key": in the run of the given name in a
+// report written by write_report. Returns false if there is none.
+bool baseline_value(const string& report, const string& name,
+    const char* key, double& value)
+{
+  const size_t run = report.find("\"name\": \"" + name + "\"");
+  if (run == string::npos)
+    return false;
+  const size_t next = report.find("\"name\": ", run + 1);
+  const size_t at = report.find(string("\"") + key + "\": ", run);
+  if (at == string::npos || at > next)
+    return false;
+  value = strtod(report.c_str() + at + strlen(key) + 4, 0);
+  return true;
+}
+
+// Returns text as a JSON string, quotes included.
+string json_string(const char* text)
+{
+  string quoted = "\"";
+  for (; *text; ++text) {
+    if (*text == '"' || *text == '\\')
+      quoted += '\\';
+    if (static_cast<unsigned char>(*text) >= 0x20)
+      quoted += *text;
+  }
+  return quoted + "\"";
+}
+
+struct regression {
+  string name;
+  const char* metric;
+  double baseline;
+  double value;
+};
+
+void write_report(FILE* out, const char* trace, uint64_t operations,
+    const vector<run_result>& runs, const vector<regression>& regressions)
+{
+  fprintf(out, "{\n  \"trace\": %s,\n  \"operations\": %llu,\n"
+      "  \"runs\": [", json_string(trace).c_str(),
+      (unsigned long long) operations);
+  for (size_t r = 0; r < runs.size(); ++r) {
+    const run_result& run = runs[r];
+    fprintf(out, "%s\n    {\n", r ? "," : "");
+    fprintf(out, "      \"name\": \"%s\",\n", run.name.c_str());
+    fprintf(out, "      \"mode\": \"%s\",\n", run.mode.c_str());
+    fprintf(out, "      \"threads\": %u,\n", run.threads);
+    fprintf(out, "      \"operations\": %llu,\n",
+        (unsigned long long) run.operations);
+    fprintf(out, "      \"seconds\": %.6f,\n", run.seconds);
+    fprintf(out, "      \"ops_per_second\": %.1f,\n",
+        run.operations / run.seconds);
+    fprintf(out, "      \"scaling\": %.3f,\n", run.scaling);
+    fprintf(out, "      \"p50_ns\": %.0f,\n", run.percentile(0.50));
+    fprintf(out, "      \"p99_ns\": %.0f,\n", run.percentile(0.99));
+    fprintf(out, "      \"p999_ns\": %.0f,\n", run.percentile(0.999));
+    fprintf(out, "      \"max_ns\": %.0f,\n",
+        run.latencies.empty() ? 0.0 : run.latencies.back());
+    fprintf(out, "      \"final_size\": %llu,\n",
+        (unsigned long long) run.size);
+    fprintf(out, "      \"lookup_hits\": %llu,\n",
+        (unsigned long long) run.hits);
+    fprintf(out, "      \"scanned\": %llu,\n",
+        (unsigned long long) run.scanned);
+    fprintf(out, "      \"start_rss_bytes\": %llu,\n",
+        (unsigned long long) run.start_rss);
+    fprintf(out, "      \"peak_rss_bytes\": %llu,\n",
+        (unsigned long long) run.peak_rss);
+    fprintf(out, "      \"repeats\": %u,\n", run.repeats);
+    for (int k = 0; k < 3; ++k)
+      fprintf(out, "      \"%s_p99_ns\": %.0f,\n", SPREAD_NAMES[k],
+          run.p99_spread[k]);
+    for (int k = 0; k < 3; ++k)
+      fprintf(out, "      \"%s_peak_rss_bytes\": %.0f,\n", SPREAD_NAMES[k],
+          run.peak_rss_spread[k]);
+    fprintf(out, "      \"latency_samples\": %llu,\n",
+        (unsigned long long) run.min_samples);
+    fprintf(out, "      \"p99_gated\": %s,\n",
+        run.p99_gated ? "true" : "false");
+    fprintf(out, "      \"rss\": [");
+    for (size_t i = 0; i < run.rss.size(); ++i)
+      fprintf(out, "%s[%.1f, %llu]", i ? ", " : "", run.rss[i].first,
+          (unsigned long long) run.rss[i].second);
+    fprintf(out, "]\n    }");
+  }
+  fprintf(out, "\n  ],\n  \"regressions\": [");
+  for (size_t r = 0; r < regressions.size(); ++r)
+    fprintf(out, "%s\n    {\"name\": \"%s\", \"metric\": \"%s\", "
+        "\"baseline\": %.0f, \"value\": %.0f}", r ? "," : "",
+        regressions[r].name.c_str(), regressions[r].metric,
+        regressions[r].baseline, regressions[r].value);
+  fprintf(out, "%s]\n}\n", regressions.empty() ? "" : "\n  ");
+}
+
+int usage()
+{
+  fprintf(stderr,
+      "usage: replay --trace=FILE [--modes=single,readers,sharded]\n"
+      "              [--threads=1,2,4,8] [--sizes=N,...]\n"
+      "              [--rss-interval-ms=10] [--repeat=5] [--output=FILE]\n"
+      "              [--baseline=FILE [--tolerance=0.1]]\n"
+      "       replay --generate=N\n");
+  return 2;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+  const char* trace = 0;
+  const char* output = 0;
+  const char* baseline = 0;
+  string modes = "single,readers,sharded";
+  vector<uint64_t> threads(1, 1);
+  threads.push_back(2);
+  threads.push_back(4);
+  threads.push_back(8);
+  vector<uint64_t> sizes;
+  uint64_t rss_interval_ms = 10;
+  uint64_t repeat = 5;
+  double tolerance = 0.1;
+  for (int i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    const char* value = strchr(arg, '=');
+    if (strncmp(arg, "--", 2) != 0 || value == 0)
+      return usage();
+    const string option(arg + 2, value++);
+    if (option == "generate") {
+      generate_trace(strtoull(value, 0, 10));
+      return 0;
+    } else if (option == "trace") {
+      trace = value;
+    } else if (option == "output") {
+      output = value;
+    } else if (option == "baseline") {
+      baseline = value;
+    } else if (option == "modes") {
+      modes = value;
+    } else if (option == "threads") {
+      if (!parse_list(value, threads))
+        return usage();
+    } else if (option == "sizes") {
+      if (!parse_list(value, sizes))
+        return usage();
+    } else if (option == "rss-interval-ms") {
+      rss_interval_ms = strtoull(value, 0, 10);
+    } else if (option == "repeat") {
+      repeat = strtoull(value, 0, 10);
+      if (repeat == 0)
+        return usage();
+    } else if (option == "tolerance") {
+      tolerance = strtod(value, 0);
+    } else {
+      return usage();
+    }
+  }
+  if (trace == 0)
+    return usage();
+
+  vector<operation> ops;
+  if (!load_trace(trace, ops)) {
+    fprintf(stderr, "replay: cannot read %s\n", trace);
+    return 2;
+  }
+  if (sizes.empty())
+    sizes.push_back(ops.size());
+  sort(threads.begin(), threads.end());
+
+  string report;
+  if (baseline) {
+    FILE* file = fopen(baseline, "r");
+    if (file == 0) {
+      fprintf(stderr, "replay: cannot read %s\n", baseline);
+      return 2;
+    }
+    char buffer[65536];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+      report.append(buffer, n);
+    fclose(file);
+  }
+
+  vector<run_result> runs;
+  // The run whose throughput each one's scaling is taken against.
+  vector<size_t> scaling_base;
+  const char* all_modes[] = { "single", "readers", "sharded" };
+  for (size_t s = 0; s < sizes.size(); ++s) {
+    const uint64_t count = min<uint64_t>(sizes[s], ops.size());
+    for (int m = 0; m < 3; ++m) {
+      const string mode = all_modes[m];
+      if (("," + modes + ",").find("," + mode + ",") == string::npos)
+        continue;
+      const size_t base = runs.size();
+      for (size_t t = 0; t < threads.size(); ++t) {
+        // A single thread replays everything alone, however many are asked
+        // for, and readers needs a writer and a reader at least.
+        const uint32_t n = threads[t];
+        if ((mode == "single" && t > 0) || (mode == "readers" && n < 2) ||
+            n == 0)
+          continue;
+        run_result result;
+        result.mode = mode;
+        result.threads = mode == "single" ? 1 : n;
+        result.operations = count;
+        result.name = mode + "/threads:" + to_string(result.threads) +
+          "/ops:" + to_string(count);
+        result.repeats = repeat;
+        result.min_samples = SIZE_MAX;
+        runs.push_back(result);
+        scaling_base.push_back(base);
+      }
+    }
+  }
+
+  // Each pass replays every run once, so that the repetitions of a run are
+  // spread over the whole invocation and a burst of noise on the machine
+  // does not fall on all of them at once.
+  vector<vector<double> > p99s(runs.size()), peaks(runs.size());
+  for (uint64_t rep = 0; rep < repeat; ++rep) {
+    for (size_t r = 0; r < runs.size(); ++r) {
+      run_result& result = runs[r];
+      fprintf(stderr, "replay: %s, %llu of %llu\n", result.name.c_str(),
+          (unsigned long long) rep + 1, (unsigned long long) repeat);
+      if (!replay_in_child(ops, rss_interval_ms, result)) {
+        fprintf(stderr, "replay: %s failed\n", result.name.c_str());
+        return 2;
+      }
+      p99s[r].push_back(result.percentile(0.99));
+      peaks[r].push_back(result.peak_rss);
+      result.min_samples = min(result.min_samples, result.latencies.size());
+    }
+  }
+  for (size_t r = 0; r < runs.size(); ++r) {
+    measure_spread(p99s[r], runs[r].p99_spread);
+    measure_spread(peaks[r], runs[r].peak_rss_spread);
+    runs[r].p99_gated = runs[r].min_samples >= MIN_GATED_SAMPLES;
+    runs[r].scaling = runs[scaling_base[r]].seconds / runs[r].seconds;
+  }
+
+  vector<regression> regressions;
+  if (baseline) {
+    for (size_t r = 0; r < runs.size(); ++r) {
+      const double* values[] = { runs[r].p99_spread,
+        runs[r].peak_rss_spread };
+      const char* metrics[] = { "p99_ns", "peak_rss_bytes" };
+      for (int k = 0; k < 2; ++k) {
+        if (k == 0 && !runs[r].p99_gated)
+          continue;
+        const string median = string("median_") + metrics[k];
+        const string greatest = string("greatest_") + metrics[k];
+        double before, before_greatest;
+        if (baseline_value(report, runs[r].name, median.c_str(), before) &&
+            baseline_value(report, runs[r].name, greatest.c_str(),
+              before_greatest) &&
+            values[k][MEDIAN] > before * (1 + tolerance) &&
+            values[k][LEAST] > before_greatest) {
+          regression found = { runs[r].name, metrics[k], before,
+            values[k][MEDIAN] };
+          regressions.push_back(found);
+        }
+      }
+    }
+  }
+
+  FILE* out = output ? fopen(output, "w") : stdout;
+  if (out == 0) {
+    fprintf(stderr, "replay: cannot write %s\n", output);
+    return 2;
+  }
+  write_report(out, trace, ops.size(), runs, regressions);
+  if (output)
+    fclose(out);
+  for (size_t r = 0; r < regressions.size(); ++r)
+    fprintf(stderr, "replay: %s regressed in median %s: %.0f against %.0f\n",
+        regressions[r].name.c_str(), regressions[r].metric,
+        regressions[r].value, regressions[r].baseline);
+  return regressions.empty() ? 0 : 1;
+}
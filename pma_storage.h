@@ -0,0 +1,950 @@
+#ifndef PMA_STORAGE_H
+#define PMA_STORAGE_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+#include "buffer.h"
+#include "segment_kernels.h"
+
+/**
+ * PMA Storage
+ * The array positions of a packed-memory array, each able to hold one key
+ * and its value. Three layouts are offered:
+ *
+ *   aos_layout    Array of structs. Each slot holds a key followed by its
+ *                 value, so visiting an element touches a single cache
+ *                 line.
+ *   soa_layout    Struct of arrays. Keys and values live in separate
+ *                 arrays, so searching touches only keys.
+ *   delta_layout  Struct of arrays with the keys, which must be integers,
+ *                 compressed. Each run of 64 array positions, one word of
+ *                 the free index bitmap, holds the offset of every key from
+ *                 a base key of its own in a Delta, an unsigned integer
+ *                 narrower than the key. A key too far from the base for a
+ *                 Delta is kept whole among the exceptions of its run. The
+ *                 keys are read by value rather than by reference, and are
+ *                 unpacked a segment at a time for scans.
+ *
+ * Whether an array position is in use is tracked by the pma, not here. When
+ * the key and value types are trivially copyable, moving a range of slots
+ * is a single memmove, and the slots may be kept in memory owned by someone
+ * else, such as a mapped file. Such memory holds the slots of each layout
+ * the way it does in memory, taking bytes(capacity) bytes. Such slots are
+ * also packed together and spread out a bitmap word at a time by the
+ * vector kernels of segment_kernels.h.
+ *
+ * Owned slots start on a cache line, and line_positions() is the fewest
+ * array positions, a power of two, whose slots fill whole lines in every
+ * array of the layout. Segments of a multiple of that many positions then
+ * each start on a line of their own.
+ *
+ * A delta_layout keeps track of which of its slots hold a key, so that its
+ * bases fit the keys actually there: a key is taken to be gone once its
+ * slot is cleared or moved from. It rebases a run when a key stored there
+ * would not fit, choosing the base that fits the most keys of the run and
+ * leaving the rest as exceptions. Its slots live in memory of its own, and
+ * are never kept in a mapped file.
+ */
+struct aos_layout {};
+struct soa_layout {};
+
+template <class Delta = uint8_t>
+struct delta_layout {};
+
+/**
+ * The value type of a pma used as a set. It takes up no space in either
+ * layout.
+ */
+struct pma_no_value {};
+
+/**
+ * Moves count objects starting at base + from to base + to. The ranges may
+ * overlap.
+ */
+template <class T>
+inline void pma_move_range(T* base, uint32_t to, uint32_t from, uint32_t count)
+{
+  if (std::is_trivially_copyable<T>::value)
+    std::memmove(static_cast<void*>(base + to), base + from, count * sizeof(T));
+  else if (to < from)
+    std::move(base + from, base + from + count, base + to);
+  else
+    std::move_backward(base + from, base + from + count, base + to + count);
+}
+
+/**
+ * Moves the objects at base + from + i for the bits i set in mask, of the
+ * n <= 64 there, to consecutive objects starting at base + to, with to at or
+ * before from.
+ */
+template <class T>
+inline void pma_compress(T* base, uint32_t to, uint32_t from, uint32_t n,
+    uint64_t mask)
+{
+  if (std::is_trivially_copyable<T>::value) {
+    compress_elements(reinterpret_cast<char*>(base + to),
+        reinterpret_cast<const char*>(base + from), n, mask, sizeof(T));
+    return;
+  }
+  for (uint32_t i = 0; i < n; ++i)
+    if ((mask >> i) & 1) {
+      if (from + i != to)
+        base[to] = std::move(base[from + i]);
+      ++to;
+    }
+}
+
+/**
+ * Moves the popcount(mask) consecutive objects starting at base + from to
+ * base + to + i for the bits i set in mask, of the n <= 64 there, with from
+ * at or before to.
+ */
+template <class T>
+inline void pma_expand(T* base, uint32_t to, uint32_t n, uint32_t from,
+    uint64_t mask)
+{
+  if (std::is_trivially_copyable<T>::value) {
+    expand_elements(reinterpret_cast<char*>(base + to), n,
+        reinterpret_cast<const char*>(base + from), mask, sizeof(T));
+    return;
+  }
+  from += __builtin_popcountll(n < 64 ? mask & ((uint64_t(1) << n) - 1) :
+      mask);
+  for (uint32_t i = n; i-- > 0; )
+    if ((mask >> i) & 1 && --from != to + i)
+      base[to + i] = std::move(base[from]);
+}
+
+/**
+ * Returns the fewest objects of the given size, a power of two, that fill
+ * whole cache lines.
+ */
+inline uint32_t pma_line_positions(size_t size)
+{
+  const size_t low = size & (~size + 1);
+  return low < CACHE_LINE_SIZE ? CACHE_LINE_SIZE / low : 1;
+}
+
+/**
+ * Prefetches the cache lines holding the given number of bytes at data.
+ */
+inline void pma_prefetch(const void* data, size_t bytes)
+{
+  const char* first = static_cast<const char*>(data);
+  for (const char* line = first; line < first + bytes;
+       line += CACHE_LINE_SIZE)
+    __builtin_prefetch(line);
+}
+
+template <class Key, class Value, class Layout>
+class pma_storage;
+
+/**
+ * A slot of the array-of-structs layout. A value type with no members is
+ * inherited from rather than stored, so that it takes no space.
+ */
+template <class Key, class Value, bool = std::is_empty<Value>::value>
+struct pma_slot {
+  Key key;
+  Value val;
+  Value& value() { return val; }
+  const Value& value() const { return val; }
+};
+
+template <class Key, class Value>
+struct pma_slot<Key, Value, true> : Value {
+  Key key;
+  Value& value() { return *this; }
+  const Value& value() const { return *this; }
+};
+
+template <class Key, class Value>
+class pma_storage<Key, Value, aos_layout> {
+  private:
+    buffer<pma_slot<Key, Value> > _slots;
+
+  public:
+    typedef const pma_slot<Key, Value>* const_pointer;
+    typedef Key& key_reference;
+    typedef const Key& const_key_reference;
+
+    // Nothing, as slots are exposed in place; see data.
+    struct span_buffer {};
+
+    // Whether the keys of consecutive slots lie next to each other.
+    static const bool CONTIGUOUS_KEYS =
+      sizeof(pma_slot<Key, Value>) == sizeof(Key);
+
+    // Whether the slots may be kept in memory owned by someone else.
+    static const bool MAPPABLE = true;
+
+    uint32_t capacity() const { return _slots.size(); }
+    /** Changes the number of slots, releasing memory when shrinking. */
+    void resize(uint32_t capacity) {
+      _slots.resize(capacity);
+    }
+
+    /** Reserves address space to grow in place up to capacity slots. */
+    void reserve(uint32_t capacity) {
+      _slots.reserve(capacity);
+    }
+
+    /** Returns the slots the storage can hold in place, if reserved. */
+    uint32_t reserved() const { return _slots.reserved(); }
+
+    /** Returns the number of bytes that capacity slots take up. */
+    static size_t bytes(uint32_t capacity) {
+      return size_t(capacity) * sizeof(pma_slot<Key, Value>);
+    }
+
+    /** Returns the fewest positions whose slots fill whole cache lines. */
+    static uint32_t line_positions() {
+      return pma_line_positions(sizeof(pma_slot<Key, Value>));
+    }
+
+    /** Copies every slot out to memory. */
+    void copy_to(char* memory) const {
+      std::memcpy(memory, static_cast<const void*>(_slots.data()),
+          bytes(capacity()));
+    }
+
+    /**
+     * Sets the byte ranges [first, last) that slots [first_slot, last_slot)
+     * take up in memory laid out for capacity slots, and returns how many
+     * there are, at most two.
+     */
+    static uint32_t extents(uint32_t, uint32_t first_slot,
+        uint32_t last_slot, size_t* first, size_t* last) {
+      first[0] = bytes(first_slot);
+      last[0] = bytes(last_slot);
+      return 1;
+    }
+
+    /**
+     * Keeps capacity slots in memory from then on. Memory holds the slots
+     * as laid out for laid_out of them, and those below both counts are
+     * kept.
+     */
+    void attach(char* memory, uint32_t capacity, uint32_t) {
+      _slots.attach(reinterpret_cast<pma_slot<Key, Value>*>(memory),
+          capacity);
+    }
+
+    Key& key(uint32_t n) { return _slots[n].key; }
+    const Key& key(uint32_t n) const { return _slots[n].key; }
+    Value& value(uint32_t n) { return _slots[n].value(); }
+    const Value& value(uint32_t n) const { return _slots[n].value(); }
+
+    /** Returns a pointer to slot n. */
+    const_pointer data(uint32_t n) const { return &_slots[n]; }
+
+    /** Prefetches the count slots from n. */
+    void prefetch(uint32_t n, uint32_t count) const {
+      pma_prefetch(&_slots[n], bytes(count));
+    }
+    const_pointer data(uint32_t n, uint32_t, span_buffer&) const {
+      return &_slots[n];
+    }
+
+    /**
+     * Returns a pointer to the key of slot n, which with CONTIGUOUS_KEYS is
+     * followed by the keys of the next slots.
+     */
+    const Key* keys(uint32_t n, uint32_t, span_buffer&) const {
+      return &_slots[n].key;
+    }
+
+    /** Returns the bytes the slots take up. */
+    size_t memory() const { return bytes(capacity()); }
+
+    /** Stores key and value in slot n. */
+    void assign(uint32_t n, const Key& key, const Value& value) {
+      _slots[n].key = key;
+      _slots[n].value() = value;
+    }
+    void assign(uint32_t n, Key&& key, Value&& value) {
+      _slots[n].key = std::move(key);
+      _slots[n].value() = std::move(value);
+    }
+
+    /** Moves the contents of slot from into slot to. */
+    void move(uint32_t from, uint32_t to) {
+      _slots[to] = std::move(_slots[from]);
+    }
+
+    /** Moves count slots starting at from to start at to instead. */
+    void move_range(uint32_t to, uint32_t from, uint32_t count) {
+      pma_move_range(_slots.data(), to, from, count);
+    }
+
+    /**
+     * Packs the slots from + i for the bits i set in mask, of the n <= 64
+     * there, into consecutive slots starting at to, which is at or before
+     * from.
+     */
+    void compress(uint32_t to, uint32_t from, uint32_t n, uint64_t mask) {
+      pma_compress(_slots.data(), to, from, n, mask);
+    }
+
+    /**
+     * Spreads the popcount(mask) consecutive slots starting at from out to
+     * the slots to + i for the bits i set in mask, of the n <= 64 there,
+     * with from at or before to.
+     */
+    void expand(uint32_t to, uint32_t n, uint32_t from, uint64_t mask) {
+      pma_expand(_slots.data(), to, n, from, mask);
+    }
+
+    /** Resets slots [first, last) to default constructed keys and values. */
+    void clear(uint32_t first, uint32_t last) {
+      std::fill(_slots.data() + first, _slots.data() + last,
+          pma_slot<Key, Value>());
+    }
+};
+
+template <class Key, class Value>
+class pma_storage<Key, Value, soa_layout> {
+  private:
+    static const bool NO_VALUES = std::is_empty<Value>::value;
+
+    buffer<Key> _keys;
+
+    // Left empty when the value type has no members; _empty_value then
+    // stands in for every value.
+    buffer<Value> _values;
+    Value _empty_value;
+
+  public:
+    typedef const Key* const_pointer;
+    typedef Key& key_reference;
+    typedef const Key& const_key_reference;
+
+    // Nothing, as keys are exposed in place; see data.
+    struct span_buffer {};
+
+    // Whether the keys of consecutive slots lie next to each other.
+    static const bool CONTIGUOUS_KEYS = true;
+
+    // Whether the slots may be kept in memory owned by someone else.
+    static const bool MAPPABLE = true;
+
+    uint32_t capacity() const { return _keys.size(); }
+
+    /** Changes the number of slots, releasing memory when shrinking. */
+    void resize(uint32_t capacity) {
+      _keys.resize(capacity);
+      if (!NO_VALUES)
+        _values.resize(capacity);
+    }
+
+    /** Reserves address space to grow in place up to capacity slots. */
+    void reserve(uint32_t capacity) {
+      _keys.reserve(capacity);
+      if (!NO_VALUES)
+        _values.reserve(capacity);
+    }
+
+    /** Returns the slots the storage can hold in place, if reserved. */
+    uint32_t reserved() const { return _keys.reserved(); }
+
+    /**
+     * Returns the number of bytes that capacity slots take up: the keys,
+     * followed by the values.
+     */
+    static size_t bytes(uint32_t capacity) {
+      return size_t(capacity) * (sizeof(Key) + (NO_VALUES ? 0 : sizeof(Value)));
+    }
+
+    /**
+     * Returns the fewest positions whose keys fill whole cache lines, and
+     * whose values do too.
+     */
+    static uint32_t line_positions() {
+      const uint32_t keys = pma_line_positions(sizeof(Key));
+      const uint32_t values = NO_VALUES ? 1 : pma_line_positions(sizeof(Value));
+      return keys > values ? keys : values;
+    }
+
+    /** Copies every slot out to memory. */
+    void copy_to(char* memory) const {
+      const size_t keys = size_t(capacity()) * sizeof(Key);
+      std::memcpy(memory, static_cast<const void*>(_keys.data()), keys);
+      if (!NO_VALUES)
+        std::memcpy(memory + keys, static_cast<const void*>(_values.data()),
+            size_t(capacity()) * sizeof(Value));
+    }
+
+    /**
+     * Sets the byte ranges [first, last) that slots [first_slot, last_slot)
+     * take up in memory laid out for capacity slots, their keys and then
+     * their values, and returns how many there are.
+     */
+    static uint32_t extents(uint32_t capacity, uint32_t first_slot,
+        uint32_t last_slot, size_t* first, size_t* last) {
+      first[0] = size_t(first_slot) * sizeof(Key);
+      last[0] = size_t(last_slot) * sizeof(Key);
+      if (NO_VALUES)
+        return 1;
+      const size_t values = size_t(capacity) * sizeof(Key);
+      first[1] = values + size_t(first_slot) * sizeof(Value);
+      last[1] = values + size_t(last_slot) * sizeof(Value);
+      return 2;
+    }
+
+    /**
+     * Keeps capacity slots in memory from then on. Memory holds the slots
+     * as laid out for laid_out of them, and those below both counts are
+     * kept: the values are moved to where capacity slots put them.
+     */
+    void attach(char* memory, uint32_t capacity, uint32_t laid_out) {
+      Key* keys = reinterpret_cast<Key*>(memory);
+      _keys.attach(keys, capacity);
+      if (NO_VALUES)
+        return;
+      Value* values = reinterpret_cast<Value*>(keys + capacity);
+      if (capacity != laid_out)
+        std::memmove(static_cast<void*>(values), keys + laid_out,
+            size_t(std::min(capacity, laid_out)) * sizeof(Value));
+      _values.attach(values, capacity);
+    }
+
+    Key& key(uint32_t n) { return _keys[n]; }
+    const Key& key(uint32_t n) const { return _keys[n]; }
+    Value& value(uint32_t n) { return NO_VALUES ? _empty_value : _values[n]; }
+    const Value& value(uint32_t n) const {
+      return NO_VALUES ? _empty_value : _values[n];
+    }
+
+    /** Returns a pointer to the key of slot n. */
+    const_pointer data(uint32_t n) const { return &_keys[n]; }
+
+    /** Prefetches the keys of the count slots from n. */
+    void prefetch(uint32_t n, uint32_t count) const {
+      pma_prefetch(&_keys[n], size_t(count) * sizeof(Key));
+    }
+    const_pointer data(uint32_t n, uint32_t, span_buffer&) const {
+      return &_keys[n];
+    }
+
+    /** Returns a pointer to the keys from slot n. */
+    const Key* keys(uint32_t n, uint32_t, span_buffer&) const {
+      return &_keys[n];
+    }
+
+    /** Returns the bytes the slots take up. */
+    size_t memory() const { return bytes(capacity()); }
+
+    /** Stores key and value in slot n. */
+    void assign(uint32_t n, const Key& key, const Value& value) {
+      _keys[n] = key;
+      if (!NO_VALUES)
+        _values[n] = value;
+    }
+    void assign(uint32_t n, Key&& key, Value&& value) {
+      _keys[n] = std::move(key);
+      if (!NO_VALUES)
+        _values[n] = std::move(value);
+    }
+
+    /** Moves the contents of slot from into slot to. */
+    void move(uint32_t from, uint32_t to) {
+      _keys[to] = std::move(_keys[from]);
+      if (!NO_VALUES)
+        _values[to] = std::move(_values[from]);
+    }
+
+    /** Moves count slots starting at from to start at to instead. */
+    void move_range(uint32_t to, uint32_t from, uint32_t count) {
+      pma_move_range(_keys.data(), to, from, count);
+      if (!NO_VALUES)
+        pma_move_range(_values.data(), to, from, count);
+    }
+
+    /**
+     * Packs the slots from + i for the bits i set in mask, of the n <= 64
+     * there, into consecutive slots starting at to, which is at or before
+     * from.
+     */
+    void compress(uint32_t to, uint32_t from, uint32_t n, uint64_t mask) {
+      pma_compress(_keys.data(), to, from, n, mask);
+      if (!NO_VALUES)
+        pma_compress(_values.data(), to, from, n, mask);
+    }
+
+    /**
+     * Spreads the popcount(mask) consecutive slots starting at from out to
+     * the slots to + i for the bits i set in mask, of the n <= 64 there,
+     * with from at or before to.
+     */
+    void expand(uint32_t to, uint32_t n, uint32_t from, uint64_t mask) {
+      pma_expand(_keys.data(), to, n, from, mask);
+      if (!NO_VALUES)
+        pma_expand(_values.data(), to, n, from, mask);
+    }
+
+    /** Resets slots [first, last) to default constructed keys and values. */
+    void clear(uint32_t first, uint32_t last) {
+      std::fill(_keys.data() + first, _keys.data() + last, Key());
+      if (!NO_VALUES)
+        std::fill(_values.data() + first, _values.data() + last, Value());
+    }
+};
+
+template <class Key, class Value, class Delta>
+class pma_storage<Key, Value, delta_layout<Delta> > {
+  private:
+    static_assert(std::is_integral<Key>::value &&
+        std::is_unsigned<Delta>::value && sizeof(Delta) < sizeof(Key),
+        "delta_layout needs integer keys and a narrower unsigned Delta");
+
+    static const bool NO_VALUES = std::is_empty<Value>::value;
+
+    // Keys are offset from their bases in unsigned arithmetic, which wraps.
+    typedef typename std::make_unsigned<Key>::type Unsigned;
+
+    // The array positions sharing a base.
+    static const uint32_t RUN = 64;
+
+    // The delta of a slot whose key is kept among the exceptions. Every
+    // other key is less than EXCEPTION past the base of its run.
+    static const Delta EXCEPTION = static_cast<Delta>(~Delta(0));
+
+    // The offset of each key from the base of its run.
+    buffer<Delta> _deltas;
+
+    // The base of each run, and a mask of the slots there holding a key.
+    buffer<Key> _bases;
+    buffer<uint64_t> _live;
+
+    // The keys that do not fit a Delta: for each run that has held one, a
+    // flat block of RUN keys by position within the run, or null. An entry
+    // means something only while the delta of its slot is EXCEPTION. A run
+    // is written by one thread at a time, the one holding its window lock,
+    // while readers copy its slots without a lock under the version of
+    // their segment. So a block is published with a release store, stays
+    // where it is, and is only freed by resize, which runs with every
+    // reader shut out.
+    buffer<Key*> _exceptions;
+    uint32_t _exception_blocks;
+
+    // Left empty when the value type has no members; _empty_value then
+    // stands in for every value.
+    buffer<Value> _values;
+    Value _empty_value;
+
+    static uint32_t runs(uint32_t capacity) {
+      return (capacity + RUN - 1) / RUN;
+    }
+
+    // Returns the bit of slot n in the mask of its run, and the bits of the
+    // count slots from first, which lie in one run.
+    static uint64_t bit(uint32_t n) { return uint64_t(1) << n % RUN; }
+    static uint64_t bits(uint32_t first, uint32_t count) {
+      return (count < 64 ? (uint64_t(1) << count) - 1 : ~uint64_t(0)) <<
+        first % RUN;
+    }
+
+    bool live(uint32_t n) const { return _live[n / RUN] & bit(n); }
+
+    // Returns the key of slot n, which holds an exception, or a default
+    // constructed one should a reader find its run without a block yet.
+    Key exception(uint32_t n) const {
+      const Key* block =
+        __atomic_load_n(&_exceptions[n / RUN], __ATOMIC_ACQUIRE);
+      return block ? block[n % RUN] : Key();
+    }
+
+    // Keeps key as the exception of slot n, giving its run a block first if
+    // it has none.
+    void set_exception(uint32_t n, const Key& key) {
+      const uint32_t run = n / RUN;
+      if (!_exceptions[run]) {
+        __atomic_store_n(&_exceptions[run], new Key[RUN](), __ATOMIC_RELEASE);
+        __atomic_fetch_add(&_exception_blocks, 1u, __ATOMIC_RELAXED);
+      }
+      _exceptions[run][n % RUN] = key;
+    }
+
+    // Returns whether a slot of the run in mask holds an exception, and how
+    // many do.
+    bool has_exceptions(uint32_t run, uint64_t mask) const {
+      for (mask &= _live[run]; mask; mask &= mask - 1)
+        if (_deltas[run * RUN + __builtin_ctzll(mask)] == EXCEPTION)
+          return true;
+      return false;
+    }
+    uint32_t count_exceptions(uint32_t run) const {
+      uint32_t count = 0;
+      for (uint64_t mask = _live[run]; mask; mask &= mask - 1)
+        count += _deltas[run * RUN + __builtin_ctzll(mask)] == EXCEPTION;
+      return count;
+    }
+
+    // Marks the slots [first, last) as holding no keys.
+    void forget(uint32_t first, uint32_t last) {
+      for (uint32_t n = first; n < last; ) {
+        const uint32_t run = n / RUN;
+        const uint32_t end = std::min(last, (run + 1) * RUN);
+        _live[run] &= ~bits(n, end - n);
+        n = end;
+      }
+    }
+
+    // Stores key in slot n. An empty run is based just under half a Delta
+    // below the key, so that keys either side of it fit. A key that does
+    // not fit rebases the run if no other key of the run is an exception,
+    // or if the exceptions are no fewer than the keys that fit and have
+    // just reached a power of two, which bounds the rebases of a run that
+    // does not compress. Otherwise the key is left an exception too.
+    void encode(uint32_t n, const Key& key) {
+      forget(n, n + 1);
+      const uint32_t run = n / RUN;
+      if (_live[run] == 0)
+        _bases[run] = static_cast<Key>(Unsigned(key) - EXCEPTION / 2);
+      const Unsigned delta = Unsigned(key) - Unsigned(_bases[run]);
+      const uint32_t exceptions =
+        delta < EXCEPTION ? 0 : count_exceptions(run);
+      if (delta < EXCEPTION) {
+        _deltas[n] = static_cast<Delta>(delta);
+      } else if (exceptions == 0 || ((exceptions & (exceptions - 1)) == 0 &&
+            2 * exceptions >= uint32_t(__builtin_popcountll(_live[run])))) {
+        rebase(n, key);
+        return;
+      } else {
+        set_exception(n, key);
+        _deltas[n] = EXCEPTION;
+      }
+      _live[run] |= bit(n);
+    }
+
+    // Stores key in slot n, whose run has another base, by rebasing the
+    // run on the span of its keys, key included, that is the most keys
+    // less than EXCEPTION apart, centred as for an empty run. The keys
+    // outside the span become exceptions.
+    void rebase(uint32_t n, const Key& key) {
+      const uint32_t run = n / RUN;
+      Key keys[RUN];
+      uint32_t slots[RUN];
+      uint32_t count = 0;
+      for (uint64_t m = _live[run]; m; m &= m - 1, ++count) {
+        slots[count] = run * RUN + __builtin_ctzll(m);
+        keys[count] = this->key(slots[count]);
+      }
+      slots[count] = n;
+      keys[count++] = key;
+
+      Key sorted[RUN];
+      std::copy(keys, keys + count, sorted);
+      std::sort(sorted, sorted + count);
+      uint32_t first = 0;
+      uint32_t most = 0;
+      for (uint32_t lo = 0, hi = 0; hi < count; ++hi) {
+        while (Unsigned(Unsigned(sorted[hi]) - Unsigned(sorted[lo])) >=
+            EXCEPTION)
+          ++lo;
+        if (hi - lo + 1 > most) {
+          first = lo;
+          most = hi - lo + 1;
+        }
+      }
+      const Unsigned span =
+        Unsigned(sorted[first + most - 1]) - Unsigned(sorted[first]);
+      _bases[run] = static_cast<Key>(Unsigned(sorted[first]) -
+          (EXCEPTION - 1 - span) / 2);
+
+      for (uint32_t i = 0; i < count; ++i) {
+        const Unsigned delta = Unsigned(keys[i]) - Unsigned(_bases[run]);
+        if (delta < EXCEPTION) {
+          _deltas[slots[i]] = static_cast<Delta>(delta);
+        } else {
+          set_exception(slots[i], keys[i]);
+          _deltas[slots[i]] = EXCEPTION;
+        }
+      }
+      _live[run] |= bit(n);
+    }
+
+    // Moves the key of slot from, if it holds one, into slot to. Within a
+    // run only the delta moves, or the exception.
+    void move_key(uint32_t from, uint32_t to) {
+      if (!live(from)) {
+        forget(to, to + 1);
+        return;
+      }
+      const uint32_t run = from / RUN;
+      if (run == to / RUN) {
+        forget(to, to + 1);
+        if (_deltas[from] == EXCEPTION)
+          set_exception(to, _exceptions[run][from % RUN]);
+        _deltas[to] = _deltas[from];
+        _live[run] = (_live[run] & ~bit(from)) | bit(to);
+        return;
+      }
+      const Key key = this->key(from);
+      forget(from, from + 1);
+      encode(to, key);
+    }
+
+    // Unpacks the keys of the count slots from n, which lie in one run, to
+    // keys.
+    void unpack(uint32_t n, uint32_t count, Key* keys) const {
+      const uint32_t run = n / RUN;
+      unpack_deltas(reinterpret_cast<Unsigned*>(keys), &_deltas[n], count,
+          Unsigned(_bases[run]));
+      for (uint64_t m = _live[run] & bits(n, count); m; m &= m - 1) {
+        const uint32_t i = run * RUN + __builtin_ctzll(m);
+        if (_deltas[i] == EXCEPTION)
+          keys[i - n] = exception(i);
+      }
+    }
+
+  public:
+    typedef const Key* const_pointer;
+    typedef Key key_reference;
+    typedef Key const_key_reference;
+
+    // The keys of a segment unpacked for a span; see data.
+    struct span_buffer {
+      Key keys[RUN];
+    };
+
+    // Whether the keys of consecutive slots lie next to each other, as
+    // they do once unpacked by keys.
+    static const bool CONTIGUOUS_KEYS = true;
+
+    // Whether the slots may be kept in memory owned by someone else.
+    static const bool MAPPABLE = false;
+
+    pma_storage() : _exception_blocks(0) {}
+
+    ~pma_storage() {
+      for (uint32_t run = 0; run < _exceptions.size(); ++run)
+        delete[] _exceptions[run];
+    }
+
+    uint32_t capacity() const { return _deltas.size(); }
+
+    /**
+     * Changes the number of slots, releasing memory when shrinking. No
+     * reader may be copying slots while this runs, so the exception blocks
+     * of runs left without exceptions are freed here as well.
+     */
+    void resize(uint32_t capacity) {
+      if (capacity < this->capacity())
+        forget(capacity, this->capacity());
+      for (uint32_t run = 0; run < _exceptions.size(); ++run) {
+        if (_exceptions[run] &&
+            (run >= runs(capacity) || count_exceptions(run) == 0)) {
+          delete[] _exceptions[run];
+          _exceptions[run] = 0;
+          _exception_blocks--;
+        }
+      }
+      _deltas.resize(capacity);
+      _bases.resize(runs(capacity));
+      _live.resize(runs(capacity));
+      _exceptions.resize(runs(capacity));
+      if (!NO_VALUES)
+        _values.resize(capacity);
+    }
+
+    /** Reserves address space to grow in place up to capacity slots. */
+    void reserve(uint32_t capacity) {
+      _deltas.reserve(capacity);
+      _bases.reserve(runs(capacity));
+      _live.reserve(runs(capacity));
+      _exceptions.reserve(runs(capacity));
+      if (!NO_VALUES)
+        _values.reserve(capacity);
+    }
+
+    /** Returns the slots the storage can hold in place, if reserved. */
+    uint32_t reserved() const { return _deltas.reserved(); }
+
+    /**
+     * Returns the number of bytes that capacity slots take up, leaving out
+     * the bases and masks of their runs: the deltas, followed by the
+     * values.
+     */
+    static size_t bytes(uint32_t capacity) {
+      return size_t(capacity) *
+        (sizeof(Delta) + (NO_VALUES ? 0 : sizeof(Value)));
+    }
+
+    /**
+     * Returns the fewest positions whose deltas fill whole cache lines, and
+     * whose values do too.
+     */
+    static uint32_t line_positions() {
+      const uint32_t deltas = pma_line_positions(sizeof(Delta));
+      const uint32_t values = NO_VALUES ? 1 : pma_line_positions(sizeof(Value));
+      return deltas > values ? deltas : values;
+    }
+
+    /**
+     * Returns the bytes the slots take up: the deltas and values, the bases,
+     * masks and exception blocks of the runs.
+     */
+    size_t memory() const {
+      return bytes(capacity()) +
+        size_t(_bases.size()) * (sizeof(Key) + sizeof(uint64_t) +
+            sizeof(Key*)) +
+        size_t(__atomic_load_n(&_exception_blocks, __ATOMIC_RELAXED)) * RUN *
+        sizeof(Key);
+    }
+
+    /** Never called, as the slots are not MAPPABLE. */
+    void copy_to(char*) const {}
+    void attach(char*, uint32_t, uint32_t) {}
+    static uint32_t extents(uint32_t, uint32_t, uint32_t, size_t*, size_t*) {
+      return 0;
+    }
+
+    Key key(uint32_t n) const {
+      const Delta delta = _deltas[n];
+      if (delta == EXCEPTION)
+        return exception(n);
+      return static_cast<Key>(Unsigned(_bases[n / RUN]) + delta);
+    }
+    Value& value(uint32_t n) { return NO_VALUES ? _empty_value : _values[n]; }
+    const Value& value(uint32_t n) const {
+      return NO_VALUES ? _empty_value : _values[n];
+    }
+
+    /**
+     * Unpacks the keys of the count slots of a segment from n into buffer,
+     * and returns a pointer to them. The keys of free slots are left
+     * unspecified.
+     */
+    const_pointer data(uint32_t n, uint32_t count, span_buffer& buffer)
+      const
+    {
+      unpack(n, count, buffer.keys);
+      return buffer.keys;
+    }
+    const Key* keys(uint32_t n, uint32_t count, span_buffer& buffer) const {
+      unpack(n, count, buffer.keys);
+      return buffer.keys;
+    }
+
+    /** Prefetches the deltas of the count slots from n and their base. */
+    void prefetch(uint32_t n, uint32_t count) const {
+      pma_prefetch(&_deltas[n], size_t(count) * sizeof(Delta));
+      __builtin_prefetch(&_bases[n / RUN]);
+    }
+
+    /** Stores key and value in slot n. */
+    void assign(uint32_t n, const Key& key, const Value& value) {
+      encode(n, key);
+      if (!NO_VALUES)
+        _values[n] = value;
+    }
+    void assign(uint32_t n, Key&& key, Value&& value) {
+      encode(n, key);
+      if (!NO_VALUES)
+        _values[n] = std::move(value);
+    }
+
+    /** Moves the contents of slot from into slot to. */
+    void move(uint32_t from, uint32_t to) {
+      if (from == to)
+        return;
+      move_key(from, to);
+      if (!NO_VALUES)
+        _values[to] = std::move(_values[from]);
+    }
+
+    /**
+     * Moves count slots starting at from to start at to instead. Within a
+     * run holding no exceptions the deltas move as they are.
+     */
+    void move_range(uint32_t to, uint32_t from, uint32_t count) {
+      if (!NO_VALUES)
+        pma_move_range(_values.data(), to, from, count);
+      if (count == 0 || to == from)
+        return;
+      const uint32_t lo = std::min(to, from);
+      const uint32_t hi = std::max(to, from) + count;
+      const uint32_t run = lo / RUN;
+      if ((hi - 1) / RUN == run && !has_exceptions(run, bits(lo, hi - lo))) {
+        pma_move_range(_deltas.data(), to, from, count);
+        const uint64_t moved = _live[run] & bits(from, count);
+        _live[run] = (_live[run] & ~bits(from, count) & ~bits(to, count)) |
+          (to > from ? moved << (to - from) : moved >> (from - to));
+      } else if (to < from) {
+        for (uint32_t i = 0; i < count; ++i)
+          move_key(from + i, to + i);
+      } else {
+        for (uint32_t i = count; i-- > 0; )
+          move_key(from + i, to + i);
+      }
+    }
+
+    /**
+     * Packs the slots from + i for the bits i set in mask, of the n <= 64
+     * there, into consecutive slots starting at to, which is at or before
+     * from.
+     */
+    void compress(uint32_t to, uint32_t from, uint32_t n, uint64_t mask) {
+      if (!NO_VALUES)
+        pma_compress(_values.data(), to, from, n, mask);
+      mask &= n < 64 ? (uint64_t(1) << n) - 1 : ~uint64_t(0);
+      if (mask == 0)
+        return;
+      const uint32_t run = to / RUN;
+      const uint64_t sources = mask << from % RUN;
+      if ((from + n - 1) / RUN == run && (_live[run] & sources) == sources &&
+          !has_exceptions(run, bits(to, from + n - to))) {
+        pma_compress(_deltas.data(), to, from, n, mask);
+        _live[run] = (_live[run] & ~sources) |
+          bits(to, __builtin_popcountll(mask));
+        return;
+      }
+      for (; mask; mask &= mask - 1, ++to)
+        if (from + __builtin_ctzll(mask) != to)
+          move_key(from + __builtin_ctzll(mask), to);
+    }
+
+    /**
+     * Spreads the popcount(mask) consecutive slots starting at from out to
+     * the slots to + i for the bits i set in mask, of the n <= 64 there,
+     * with from at or before to.
+     */
+    void expand(uint32_t to, uint32_t n, uint32_t from, uint64_t mask) {
+      if (!NO_VALUES)
+        pma_expand(_values.data(), to, n, from, mask);
+      mask &= n < 64 ? (uint64_t(1) << n) - 1 : ~uint64_t(0);
+      if (mask == 0)
+        return;
+      const uint32_t count = __builtin_popcountll(mask);
+      const uint32_t run = from / RUN;
+      if ((to + n - 1) / RUN == run &&
+          (_live[run] & bits(from, count)) == bits(from, count) &&
+          !has_exceptions(run, bits(from, to + n - from))) {
+        pma_expand(_deltas.data(), to, n, from, mask);
+        _live[run] = (_live[run] & ~bits(from, count)) | mask << to % RUN;
+        return;
+      }
+      for (uint32_t source = from + count; mask; ) {
+        const uint32_t i = 63 - __builtin_clzll(mask);
+        mask &= ~(uint64_t(1) << i);
+        if (--source != to + i)
+          move_key(source, to + i);
+      }
+    }
+
+    /** Resets slots [first, last) to hold no keys and default values. */
+    void clear(uint32_t first, uint32_t last) {
+      forget(first, last);
+      if (!NO_VALUES)
+        std::fill(_values.data() + first, _values.data() + last, Value());
+    }
+
+  private:
+    pma_storage(const pma_storage&);
+    pma_storage& operator=(const pma_storage&);
+};
+
+#endif // PMA_STORAGE_H
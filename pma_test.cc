@@ -1,20 +1,33 @@
 #include <iostream>
+#include <limits.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/wait.h>
 #include <cmath>
+#include <fstream>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
 #include <vector>
+#include "buffer.h"
 #include "pma.h"
+#include "sharded_pma.h"
 using namespace std;
 
-static void dump_stats(const pma& database)
+static void dump_stats(const pma<int>& database)
 {
-  cout << "Capacity: "  << database.capacity()            << endl;
-  cout << "Size: "      << database.size()                << endl;
-  cout << "SegSize: "   << database.segment_size()        << endl;
-  cout << "Segments: "  << database.number_of_segments()  << endl;
-  cout << "Height: "    << database.tree_height()         << endl;
+  const pma<int>::stats_t stats = database.stats();
+  cout << "Capacity: "  << stats.capacity      << endl;
+  cout << "Size: "      << stats.size          << endl;
+  cout << "SegSize: "   << stats.segment_size  << endl;
+  cout << "Segments: "  << stats.segments      << endl;
+  cout << "Height: "    << stats.height        << endl;
 }
 
-static void dump_pma_contents(const pma& database)
+static void dump_pma_contents(const pma<int>& database)
 {
   cout << "pma:  [";
   for (uint32_t i = 0; i < database.capacity(); ++i)
@@ -22,7 +35,7 @@ static void dump_pma_contents(const pma& database)
   cout << "]" << endl;
 }
 
-static void dump_pma_free_index_bitmap(const pma& database)
+static void dump_pma_free_index_bitmap(const pma<int>& database)
 {
   cout << "free: [";
   for (uint32_t i = 0; i < database.capacity(); ++i) {
@@ -32,17 +45,983 @@ static void dump_pma_free_index_bitmap(const pma& database)
   cout << "]" << endl;
 }
 
-static void dump_upper_density_thresholds(const pma& database)
+static void dump_elements(const pma<int>& database)
 {
-  cout << "UDTs : \n";
-  for (int i = 0; i <= database.tree_height(); ++i)
-    cout << database.upper_density_threshold(i) << endl;
+  cout << "elements: ";
+  for (pma<int>::const_iterator it = database.begin(); it != database.end();
+       ++it)
+    cout << *it << " ";
   cout << endl;
 }
 
-int main(int argc, char *argv[]) 
+static void dump_range(const pma<int>& database, int lo, int hi)
 {
-  pma database;
+  cout << "range [" << lo << ", " << hi << "): ";
+  pma<int>::span_range spans = database.range(lo, hi);
+  for (pma<int>::span_iterator it = spans.begin(); it != spans.end(); ++it) {
+    const pma<int>::segment_span span = *it;
+    for (uint32_t i = 0; i < database.segment_size(); ++i)
+      if (span.mask >> i & 1)
+        cout << span.data[i].key << " ";
+  }
+  cout << endl;
+}
+
+static void dump_concurrent_reads(const pma<int>& database, int lo, int hi)
+{
+  cout << "read_range [" << lo << ", " << hi << "): ";
+  database.read_range(lo, hi, [](const int& key, const pma_no_value&) {
+    cout << key << " ";
+  });
+  int key;
+  if (database.read_predecessor(hi, key))
+    cout << "read_predecessor(" << hi << "): " << key;
+  cout << endl;
+}
+
+typedef pma<int, pma_no_value, less<int>, aos_layout, stats_policy<> >
+  stats_pma;
+
+// Returns the height of the window that inserting (delta 1) or erasing
+// (delta -1) an element of segment must rebalance, by the count thresholds,
+// 0 if none, or tree_height() + 1 if the array must grow or shrink.
+static int expected_rebalance(const stats_pma& database, uint32_t segment,
+    int delta)
+{
+  const uint32_t count = database.window_count(segment, 0) + delta;
+  if (delta > 0 ? count < database.upper_count(0) :
+      count >= database.lower_count(0))
+    return 0;
+  for (int h = 1; h <= database.tree_height(); ++h) {
+    const uint32_t window = segment - segment % database.window_capacity(h);
+    const uint32_t n = database.window_count(window, h) + delta;
+    if (delta > 0 ? n < database.upper_count(h) : n >= database.lower_count(h))
+      return h;
+  }
+  return database.tree_height() + 1;
+}
+
+// Returns whether a pma holds exactly the keys of reference, in order.
+template <class PMA>
+static bool same_keys(const PMA& database, const set<int>& reference)
+{
+  if (database.size() != reference.size())
+    return false;
+  set<int>::const_iterator expected = reference.begin();
+  for (typename PMA::const_iterator it = database.begin();
+       it != database.end(); ++it, ++expected)
+    if (expected == reference.end() || *it != *expected)
+      return false;
+  return expected == reference.end();
+}
+
+// Returns whether find, contains, lower_bound, upper_bound and
+// lookup_many agree with reference on keys present and absent in it, and
+// on keys below the smallest and above the largest.
+template <class PMA>
+static bool lookups_agree(const PMA& database, const set<int>& reference)
+{
+  vector<int> probes;
+  probes.push_back(-1000);
+  probes.push_back(100000);
+  if (!reference.empty()) {
+    probes.push_back(*reference.begin() - 1);
+    probes.push_back(*reference.rbegin() + 1);
+  }
+  int n = 0;
+  for (set<int>::const_iterator it = reference.begin();
+       it != reference.end(); ++it)
+    if (n++ % 7 == 0) {
+      probes.push_back(*it - 1);
+      probes.push_back(*it);
+      probes.push_back(*it + 1);
+    }
+
+  vector<uint32_t> positions(probes.size());
+  database.lookup_many(probes.data(), probes.size(), positions.data());
+  bool ok = true;
+  for (size_t i = 0; i < probes.size(); ++i) {
+    const int x = probes[i];
+    const bool present = reference.count(x) > 0;
+    const typename PMA::const_iterator found = database.find(x);
+    ok &= database.contains(x) == present;
+    ok &= present ? found != database.end() && *found == x :
+      found == database.end();
+    ok &= present ? positions[i] == found.index() :
+      positions[i] == database.capacity();
+    const set<int>::const_iterator lower = reference.lower_bound(x);
+    const set<int>::const_iterator upper = reference.upper_bound(x);
+    const typename PMA::const_iterator lower_found = database.lower_bound(x);
+    const typename PMA::const_iterator upper_found = database.upper_bound(x);
+    ok &= lower == reference.end() ? lower_found == database.end() :
+      lower_found != database.end() && *lower_found == *lower;
+    ok &= upper == reference.end() ? upper_found == database.end() :
+      upper_found != database.end() && *upper_found == *upper;
+  }
+  return ok;
+}
+
+// Runs random inserts and erases against a pma and a std::set: mostly
+// inserts, then mostly erases, then mostly inserts again. After each one,
+// checks that the pma rebalanced the window, grew or shrank exactly as its
+// thresholds call for, and every so often that both hold the same keys and
+// answer lookups alike. Inserts into a full segment, which rebalance
+// before placing the new element as well, are only checked to have
+// rebalanced something. A pma with values, whose keys are not searched
+// with the vector kernels, takes the same inserts and erases and is looked
+// up alongside. Returns whether every check held.
+static bool differential_check()
+{
+  stats_pma database;
+  pma<int, uint64_t> valued;
+  set<int> reference;
+  uint64_t seed = 1;
+  uint32_t operations = 0;
+  uint64_t fired = 0;
+  bool ok = true;
+  for (int phase = 0; phase < 3; ++phase) {
+    for (int i = 0; i < 4000 && ok; ++i, ++operations) {
+      seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+      int x = (seed >> 33) % 4096;
+      const bool inserting = (seed >> 20) % 8 < (phase == 1 ? 1u : 6u);
+
+      // Erases in the second phase take the next key present, so that the
+      // array empties out and shrinks.
+      if (!inserting && phase == 1 && reference.lower_bound(x) !=
+          reference.end())
+        x = *reference.lower_bound(x);
+
+      // The segment an insert of x goes to holds its predecessor, if any.
+      uint32_t segment = 0;
+      const uint32_t pred = database.predecessor(inserting ? x : x + 1);
+      if (pred != database.capacity())
+        segment = pred - pred % database.segment_size();
+      const bool present = reference.count(x) > 0;
+      const bool full =
+        database.window_count(segment, 0) == database.segment_size();
+      const int height = inserting == present ? 0 :
+        expected_rebalance(database, segment, inserting ? 1 : -1);
+      const bool can_shrink = database.capacity() / stats_pma::SCALE_FACTOR >=
+        uint32_t(stats_pma::INITIAL_CAPACITY);
+
+      const stats_pma::stats_t before = database.stats();
+      if (inserting) {
+        ok &= database.insert(x) != present;
+        valued.insert(x, x);
+        reference.insert(x);
+      } else {
+        ok &= database.erase(x) == present;
+        valued.erase(x);
+        reference.erase(x);
+      }
+      const stats_pma::stats_t after = database.stats();
+      const uint64_t rebalances = after.rebalances - before.rebalances;
+      const uint64_t resizes = after.resizes - before.resizes +
+        after.shrinks - before.shrinks;
+      fired += rebalances + resizes;
+      if (inserting && full)
+        ok &= rebalances + resizes > 0;
+      else if (height == 0)
+        ok &= rebalances + resizes == 0;
+      else if (height > before.height)
+        ok &= rebalances == 0 && resizes == (inserting || can_shrink);
+      else
+        ok &= rebalances == 1 && resizes == 0 &&
+          after.rebalance_heights[height] ==
+          before.rebalance_heights[height] + 1;
+      ok &= database.size() == reference.size();
+
+      if (operations % 500 == 0 || !ok) {
+        set<int>::const_iterator expected = reference.begin();
+        for (stats_pma::const_iterator it = database.begin();
+             it != database.end() && ok; ++it, ++expected)
+          ok &= expected != reference.end() && *it == *expected;
+        ok &= same_keys(valued, reference) &&
+          lookups_agree(database, reference) &&
+          lookups_agree(valued, reference);
+      }
+    }
+  }
+  cout << "differential: " << operations << " operations, " << fired
+       << " rebalances and resizes, " << (ok ? "ok" : "FAILED") << endl;
+  return ok;
+}
+
+// Runs random inserts and erases, then erases of the largest keys, then
+// ascending inserts past the old largest key, then erases of most keys, with
+// rebuilds advanced only a few moves per operation, and checks iteration and
+// lookups against a std::set while the rebuilds are still in flight. Returns
+// whether they all agreed, and some check ran with rebuilds pending.
+static bool incremental_rebuild_check()
+{
+  pma<int> database;
+  database.set_max_rebalance_moves(4);
+  set<int> reference;
+  uint64_t seed = 7;
+  uint32_t operations = 0;
+  uint32_t pending = 0;
+  bool ok = true;
+  for (int phase = 0; phase < 4 && ok; ++phase) {
+    for (int i = 0; i < 15000 && ok; ++i, ++operations) {
+      seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+      int x = (seed >> 33) % 40000;
+      bool inserting = (seed >> 20) % 4 != 0;
+      if (phase == 1) {
+        inserting = !inserting || reference.empty();
+        if (!inserting)
+          x = *reference.rbegin();
+      } else if (phase == 2) {
+        x = 40000 + i;
+        inserting = true;
+      } else if (phase == 3) {
+        inserting = (seed >> 20) % 8 == 0;
+        x %= 55000;
+      }
+      if (inserting)
+        ok &= database.insert(x) == reference.insert(x).second;
+      else
+        ok &= database.erase(x) == (reference.erase(x) > 0);
+      ok &= database.size() == reference.size();
+
+      if (operations % 97 == 0 || !ok) {
+        pending += database.pending_rebuilds() > 0;
+        set<int>::const_iterator expected = reference.begin();
+        for (pma<int>::const_iterator it = database.begin();
+             it != database.end() && ok; ++it, ++expected)
+          ok &= expected != reference.end() && *it == *expected;
+        ok &= expected == reference.end() &&
+          lookups_agree(database, reference);
+      }
+    }
+  }
+  ok &= pending > 0;
+  cout << "incremental rebuilds: " << operations << " operations, " << pending
+       << " checks mid-rebuild, " << (ok ? "ok" : "FAILED") << endl;
+  return ok;
+}
+
+// Runs random inserts and erases, mostly inserts, then mostly erases, then
+// mostly inserts again, against a pma of delta_layout and a std::set. Most
+// keys fall in a few clusters that compress into a byte each, but one in
+// four lies anywhere in a range of two billion, so that runs keep taking
+// keys that do not fit their base: those become exceptions, or rebase the
+// run. Every so often checks that both hold the same keys, with the values
+// inserted, answer lookups alike, and that the array has grown and shrunk.
+// Returns whether every check held.
+static bool delta_check()
+{
+  typedef pma<int, int, less<int>, delta_layout<> > delta_pma;
+  delta_pma database;
+  set<int> reference;
+  uint64_t seed = 11;
+  uint32_t operations = 0;
+  uint32_t most = 0;
+  uint32_t least_after_most = 0;
+  bool ok = true;
+  for (int phase = 0; phase < 3; ++phase) {
+    for (int i = 0; i < 20000 && ok; ++i, ++operations) {
+      seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+      int x = (seed >> 20) % 4 == 0 ?
+        int((seed >> 33) % (1u << 31)) - (1 << 30) :
+        int((seed >> 33) % 8) * (1 << 20) + int((seed >> 40) % 3000);
+      const bool inserting = (seed >> 10) % 8 < (phase == 1 ? 1u : 6u);
+      if (!inserting && reference.lower_bound(x) != reference.end())
+        x = *reference.lower_bound(x);
+      if (inserting)
+        ok &= database.insert(x, x ^ 0x5a5a) == reference.insert(x).second;
+      else
+        ok &= database.erase(x) == (reference.erase(x) > 0);
+      ok &= database.size() == reference.size();
+      if (database.capacity() > most) {
+        most = database.capacity();
+        least_after_most = most;
+      }
+      least_after_most = std::min(least_after_most, database.capacity());
+
+      if (operations % 250 == 0 || !ok) {
+        ok &= same_keys(database, reference) &&
+          lookups_agree(database, reference);
+        for (delta_pma::const_iterator it = database.begin();
+             it != database.end() && ok; ++it)
+          ok &= it.value() == (*it ^ 0x5a5a);
+      }
+    }
+  }
+  ok &= least_after_most < most;
+  cout << "delta layout: " << operations << " operations, capacity up to "
+       << most << " and back to " << least_after_most << ", "
+       << (ok ? "ok" : "FAILED") << endl;
+  return ok;
+}
+
+// Inserts keys in descending order, with values, into a pma of segments
+// of a fixed number of bytes. Every insert then lands in the first segment,
+// which with small segments in a tall tree once rebalanced the same window
+// forever. Returns whether every key was inserted, in order.
+template <class Segments>
+static bool descending_check(const char* name)
+{
+  typedef pma<int, uint64_t, less<int>, aos_layout, pma_policy<Segments> >
+    fixed_pma;
+  fixed_pma database;
+  const int count = 100000;
+  bool ok = true;
+  for (int i = count; i-- > 0 && ok; )
+    ok &= database.insert(i, uint64_t(i) * 3);
+  ok &= database.size() == uint32_t(count);
+  int expected = 0;
+  for (typename fixed_pma::const_iterator it = database.begin();
+       it != database.end() && ok; ++it, ++expected)
+    ok &= *it == expected && it.value() == uint64_t(expected) * 3;
+  ok &= expected == count;
+  cout << "descending " << name << ": " << count << " inserts, segments of "
+       << database.segment_size() << ", " << (ok ? "ok" : "FAILED") << endl;
+  return ok;
+}
+
+// Has four threads insert random keys at once, some of them the same, and
+// checks that each key went in exactly once and that the pma holds the same
+// keys as a std::set of everything inserted. With background set, the
+// inserts leave rebalancing to the background rebalancer, which is waited
+// out before the check. Returns whether it did.
+static bool concurrent_insert_check(bool background)
+{
+  const int threads = 4;
+  const int per_thread = 50000;
+  pma<int> database;
+  if (background)
+    database.enable_background_rebalancing();
+  else
+    database.enable_concurrent_inserts();
+  vector<vector<int> > keys(threads);
+  vector<uint32_t> inserted(threads, 0);
+  vector<thread> workers;
+  for (int t = 0; t < threads; ++t) {
+    uint64_t seed = t + 1;
+    for (int i = 0; i < per_thread; ++i) {
+      seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+      keys[t].push_back((seed >> 33) % (4 * per_thread));
+    }
+    workers.push_back(thread([&, t]() {
+      for (size_t i = 0; i < keys[t].size(); ++i)
+        inserted[t] += database.insert(keys[t][i]);
+    }));
+  }
+  set<int> reference;
+  uint32_t total = 0;
+  for (int t = 0; t < threads; ++t) {
+    workers[t].join();
+    reference.insert(keys[t].begin(), keys[t].end());
+    total += inserted[t];
+  }
+  if (background)
+    database.wait_for_rebalances();
+
+  bool ok = total == reference.size() && database.size() == reference.size();
+  set<int>::const_iterator expected = reference.begin();
+  for (pma<int>::const_iterator it = database.begin();
+       it != database.end() && ok; ++it, ++expected)
+    ok &= expected != reference.end() && *it == *expected;
+  cout << (background ? "background rebalancing: " : "concurrent inserts: ")
+       << threads << " threads, " << total << " keys, "
+       << (ok ? "ok" : "FAILED") << endl;
+  return ok;
+}
+
+// A random insert, or erase if the flag is clear, of a key below range.
+typedef pair<bool, int> random_op;
+
+// Returns count random ops, three in four of them inserts.
+static vector<random_op> random_ops(uint64_t seed, int count, int range)
+{
+  vector<random_op> ops;
+  for (int i = 0; i < count; ++i) {
+    seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+    ops.push_back(random_op((seed >> 20) % 4 != 0, (seed >> 33) % range));
+  }
+  return ops;
+}
+
+// Applies ops [first, last) to a pma, and to reference if given.
+static void apply_ops(pma<int>* database, set<int>* reference,
+    const vector<random_op>& ops, size_t first, size_t last)
+{
+  for (size_t i = first; i < last; ++i) {
+    if (ops[i].first) {
+      if (database)
+        database->insert(ops[i].second);
+      if (reference)
+        reference->insert(ops[i].second);
+    } else {
+      if (database)
+        database->erase(ops[i].second);
+      if (reference)
+        reference->erase(ops[i].second);
+    }
+  }
+}
+
+// Runs body on a pma in a child process that ends with _exit, so that the
+// pma is never destroyed and gets no chance to close its file cleanly, as
+// in a crash. Returns whether body returned true.
+template <class Body>
+static bool crash_after(Body body)
+{
+  const pid_t child = fork();
+  if (child == 0)
+    _exit(body(*new pma<int>) ? 0 : 1);
+  int status;
+  return child > 0 && waitpid(child, &status, 0) == child &&
+    WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Makes a directory of its own for the files of a check, and removes it
+// with whatever is left in it.
+static string make_scratch_dir()
+{
+  char path[] = "/tmp/pma_test_XXXXXX";
+  return mkdtemp(path) ? path : "";
+}
+
+// Copies the file at from over the file at to.
+static bool copy_file(const string& from, const string& to)
+{
+  ifstream in(from.c_str(), ios::binary);
+  ofstream out(to.c_str(), ios::binary | ios::trunc);
+  out << in.rdbuf();
+  return in && out;
+}
+
+static void remove_scratch_dir(const string& dir)
+{
+  if (DIR* listing = opendir(dir.c_str())) {
+    while (dirent* entry = readdir(listing))
+      if (entry->d_name[0] != '.')
+        unlink((dir + "/" + entry->d_name).c_str());
+    closedir(listing);
+  }
+  rmdir(dir.c_str());
+}
+
+// Keeps a pma in a file: writes it out, reopens it after a clean close,
+// then has a child process change it, sync it and exit without closing,
+// and reopens it again, which rebuilds the count tree and segment index
+// from the bitmap. Returns whether the keys came back each time.
+static bool mapped_file_check()
+{
+  const string dir = make_scratch_dir();
+  const string path = dir + "/pma";
+  const vector<random_op> ops = random_ops(3, 20000, 8192);
+  const size_t half = ops.size() / 2;
+  set<int> reference;
+  apply_ops(0, &reference, ops, 0, half);
+
+  bool ok = !dir.empty();
+  {
+    pma<int> database;
+    ok &= database.open(path.c_str());
+    apply_ops(&database, 0, ops, 0, half);
+  }
+  {
+    pma<int> reopened;
+    ok &= reopened.open(path.c_str()) && same_keys(reopened, reference);
+  }
+  ok &= crash_after([&](pma<int>& database) {
+    if (!database.open(path.c_str()))
+      return false;
+    apply_ops(&database, 0, ops, half, ops.size());
+    return database.sync();
+  });
+  apply_ops(0, &reference, ops, half, ops.size());
+  {
+    pma<int> reopened;
+    ok &= reopened.open(path.c_str()) && same_keys(reopened, reference);
+  }
+  remove_scratch_dir(dir);
+  cout << "mapped file: " << reference.size()
+       << " keys, reopened after a clean close and a crash, "
+       << (ok ? "ok" : "FAILED") << endl;
+  return ok;
+}
+
+// Has a child process open a logged pma, change it, checkpoint it, change
+// it some more, commit and exit without closing, then reopens it, which
+// replays the log after the checkpoint. Also reopens copies whose log has
+// a torn last record, or one with a bad checksum, which must come back
+// without the last change only. Returns whether all three did.
+static bool write_ahead_log_check()
+{
+  const string dir = make_scratch_dir();
+  const string path = dir + "/pma", log = dir + "/log";
+  const vector<random_op> ops = random_ops(7, 20000, 8192);
+  const size_t half = ops.size() / 2;
+
+  bool ok = !dir.empty() && crash_after([&](pma<int>& database) {
+    if (!database.open(path.c_str(), log.c_str()))
+      return false;
+    apply_ops(&database, 0, ops, 0, half);
+    if (!database.sync())
+      return false;
+    apply_ops(&database, 0, ops, half, ops.size());
+    return database.commit();
+  });
+
+  // Only inserts and erases that change the pma are logged, so the last
+  // record is the last op that does.
+  set<int> reference;
+  size_t last_change = 0;
+  for (size_t i = 0; i < ops.size(); ++i) {
+    const size_t before = reference.size();
+    apply_ops(0, &reference, ops, i, i + 1);
+    if (reference.size() != before)
+      last_change = i;
+  }
+  set<int> before_last;
+  apply_ops(0, &before_last, ops, 0, last_change);
+
+  // Reopening checkpoints and empties the log, so the damaged copies are
+  // made first.
+  const char* tails[] = { "torn", "corrupt" };
+  for (int i = 0; i < 2; ++i) {
+    const string copy = dir + "/" + tails[i];
+    ok &= copy_file(path, copy) && copy_file(log, copy + ".log");
+  }
+  {
+    pma<int> reopened;
+    ok &= reopened.open(path.c_str(), log.c_str()) &&
+      same_keys(reopened, reference);
+  }
+  for (int i = 0; i < 2; ++i) {
+    const string copy = dir + "/" + tails[i];
+    const string copy_log = copy + ".log";
+    fstream damaged(copy_log.c_str(), ios::in | ios::out | ios::binary);
+    damaged.seekg(-1, ios::end);
+    const char last = damaged.get();
+    const streamoff length = damaged.tellg();
+    if (i == 0) {
+      damaged.close();
+      ok &= truncate(copy_log.c_str(), length - 5) == 0;
+    } else {
+      damaged.seekp(-1, ios::end);
+      damaged.put(last ^ 1);
+      damaged.close();
+    }
+    pma<int> reopened;
+    ok &= reopened.open(copy.c_str(), copy_log.c_str()) &&
+      same_keys(reopened, before_last);
+  }
+  remove_scratch_dir(dir);
+  cout << "write-ahead log: " << reference.size()
+       << " keys, recovered after a crash and from a torn and a corrupt "
+       << "tail, " << (ok ? "ok" : "FAILED") << endl;
+  return ok;
+}
+
+// Inserts skewed keys, most of them ascending runs into a few hot spots,
+// with the ADAPTIVE algorithm, which leaves more room where inserts land.
+// After each insert that rebalances a window without resizing, checks
+// that every segment of the window but the one given the new key was left
+// below its upper count threshold, so that the next insert into it does
+// not rebalance it again, and every so often that the pma holds the same
+// keys as a std::set. Returns whether every check held.
+static bool adaptive_check()
+{
+  stats_pma database;
+  database.set_rebalance_algorithm(stats_pma::ADAPTIVE);
+  set<int> reference;
+  bool ok = true;
+  uint64_t seed = 13;
+  uint64_t checked = 0;
+  int hot[4] = { 0, 1 << 20, 2 << 20, 3 << 20 };
+  for (int i = 0; i < 40000 && ok; ++i) {
+    seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+    const int key = (seed >> 20) % 8 == 0 ? (seed >> 35) % (4 << 20) :
+      hot[(seed >> 33) % 4]++;
+    if ((seed >> 40) % 10 == 0) {
+      database.erase(key);
+      reference.erase(key);
+      continue;
+    }
+    const uint32_t pred = database.predecessor(key);
+    const uint32_t segment_size = database.segment_size();
+    const uint32_t segment = pred == database.capacity() ? 0 :
+      pred - pred % segment_size;
+    const stats_pma::stats_t before = database.stats();
+    database.insert(key);
+    reference.insert(key);
+    const stats_pma::stats_t after = database.stats();
+    if (after.rebalances != before.rebalances + 1 ||
+        after.resizes != before.resizes)
+      continue;
+    int height = 0;
+    while (after.rebalance_heights[height] ==
+           before.rebalance_heights[height])
+      ++height;
+    const uint32_t length = segment_size << height;
+    const uint32_t window = segment - segment % length;
+    const uint32_t at = database.predecessor(key + 1);
+    for (uint32_t seg = window; seg < window + length; seg += segment_size)
+      if (at < seg || at >= seg + segment_size)
+        ok &= database.window_count(seg, 0) < database.upper_count(0);
+    checked++;
+    if (i % 1000 == 0)
+      ok &= same_keys(database, reference);
+  }
+  ok &= same_keys(database, reference);
+  cout << "adaptive: " << reference.size() << " skewed keys, " << checked
+       << " rebalances checked, " << (ok ? "ok" : "FAILED") << endl;
+  return ok;
+}
+
+// Loads sorted keys with from_sorted, from random access keys, from a
+// forward range, and across a thread pool past PARALLEL_THRESHOLD, then
+// inserts and erases on top of each load. Returns whether every load and
+// every later change agrees with a std::set.
+static bool bulk_load_check()
+{
+  const vector<random_op> ops = random_ops(5, 20000, 1 << 17);
+  bool ok = true;
+  size_t loaded = 0;
+  for (int variant = 0; variant < 3; ++variant) {
+    set<int> reference;
+    for (int key = 0; key < (variant == 2 ? 100000 : 5000); ++key)
+      reference.insert(key * 3);
+    pma<int> database;
+    if (variant == 2)
+      database.set_rebalance_threads(4);
+    if (variant == 1) {
+      database.from_sorted(reference.begin(), reference.end());
+    } else {
+      const vector<int> keys(reference.begin(), reference.end());
+      database.from_sorted(keys.begin(), keys.end());
+    }
+    ok &= same_keys(database, reference);
+    apply_ops(&database, &reference, ops, 0, ops.size());
+    ok &= same_keys(database, reference);
+    loaded += reference.size();
+  }
+
+  // Densities out of range are clamped to the root's thresholds, so the
+  // load neither starts over the upper one nor grows without bound.
+  const double densities[] = { -1, 0, pma<int>::ROOT_UPPER_DENSITY, 1, 2 };
+  for (int d = 0; d < 5; ++d) {
+    set<int> reference;
+    for (int key = 0; key < 5000; ++key)
+      reference.insert(key);
+    const vector<int> sorted(reference.begin(), reference.end());
+    pma<int> database;
+    database.from_sorted(sorted.begin(), sorted.end(), densities[d]);
+    const double bound = densities[d] > 0 ? pma<int>::ROOT_UPPER_DENSITY :
+      pma<int>::ROOT_LOWER_DENSITY;
+    ok &= same_keys(database, reference) &&
+      database.size() < bound * database.capacity() &&
+      database.size() >= bound * database.capacity() / 2;
+    apply_ops(&database, &reference, ops, 0, ops.size());
+    ok &= same_keys(database, reference);
+  }
+  cout << "bulk load: vector, set and parallel loads, clamped densities, "
+       << loaded << " keys after random ops, " << (ok ? "ok" : "FAILED") << endl;
+  return ok;
+}
+
+// Inserts batches of random keys, duplicates within a batch and keys
+// already present among them, small batches that stay in their windows
+// and large ones that make the array grow, and checks each against a
+// std::set: the count returned and the contents. A batch that grows a
+// fresh pma must leave it at the capacity single inserts of the same keys
+// would. Returns whether all of it held.
+static bool batch_insert_check()
+{
+  bool ok = true;
+  pma<int> database;
+  set<int> reference;
+  uint64_t seed = 11;
+  for (int round = 0; round < 200; ++round) {
+    const int count = round % 10 == 9 ? 5000 : 1 + round % 40;
+    vector<int> batch;
+    for (int i = 0; i < count; ++i) {
+      seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+      batch.push_back((seed >> 33) % 50000);
+      if (i % 7 == 0)
+        batch.push_back(batch.back());
+    }
+    const size_t before = reference.size();
+    reference.insert(batch.begin(), batch.end());
+    ok &= database.insert_batch(batch.begin(), batch.end()) ==
+      reference.size() - before;
+    ok &= same_keys(database, reference);
+  }
+
+  vector<int> keys;
+  for (int key = 0; key < 20000; ++key)
+    keys.push_back(key * 7 % 20011);
+  pma<int> batched, single;
+  batched.insert_batch(keys.begin(), keys.end());
+  for (size_t i = 0; i < keys.size(); ++i)
+    single.insert(keys[i]);
+  ok &= batched.capacity() == single.capacity() &&
+    same_keys(batched, set<int>(keys.begin(), keys.end()));
+  cout << "batch inserts: " << reference.size() << " keys, grown to "
+       << batched.capacity() << " as single inserts, "
+       << (ok ? "ok" : "FAILED") << endl;
+  return ok;
+}
+
+// Returns whether a sharded pma holds the same keys as a std::set, by a
+// read of everything and of random ranges, which with several shards cross
+// from one to the next, and by predecessors of random keys.
+static bool sharded_agrees(const sharded_pma<int>& database,
+    const set<int>& reference, uint64_t seed, int range)
+{
+  bool ok = database.size() == reference.size();
+  vector<int> keys;
+  database.read_range(INT_MIN, INT_MAX,
+      [&](int key, pma_no_value) { keys.push_back(key); });
+  ok &= keys.size() == reference.size() &&
+    std::equal(keys.begin(), keys.end(), reference.begin());
+  for (int i = 0; i < 200 && ok; ++i) {
+    seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+    const int lo = (seed >> 33) % range;
+    const int hi = lo + (seed >> 12) % (range / 4);
+    keys.clear();
+    database.read_range(lo, hi,
+        [&](int key, pma_no_value) { keys.push_back(key); });
+    ok &= std::equal(keys.begin(), keys.end(), reference.lower_bound(lo),
+        reference.lower_bound(hi)) &&
+      keys.size() == size_t(std::distance(reference.lower_bound(lo),
+            reference.lower_bound(hi)));
+    int key;
+    const bool found = database.predecessor(lo, key);
+    set<int>::const_iterator expected = reference.lower_bound(lo);
+    ok &= found == (expected != reference.begin()) &&
+      (!found || key == *--expected);
+  }
+  return ok;
+}
+
+// Has four threads insert and erase keys of their own in a sharded pma with
+// a split size small enough for splits to fire as it grows, while the
+// background balancer runs, and then erase the lower keys so that the
+// emptied shards merge. After each round the keys are checked against a
+// std::set of the keys each thread left in, and the shards for balance.
+// Returns whether they agreed and were balanced, and shards were split,
+// merged and built afresh as inserts raced in.
+static bool sharded_check()
+{
+  const int threads = 4;
+  const int range = 400000;
+  sharded_pma<int> database(4);
+  database.set_min_split_size(1000);
+  database.enable_background_balancing();
+  vector<set<int> > kept(threads);
+  bool ok = true;
+  uint32_t grown_shards = 0;
+  uint64_t splits = 0;
+  for (int round = 0; round < 2 && ok; ++round) {
+    vector<uint32_t> failed(threads, 0);
+    vector<thread> workers;
+    for (int t = 0; t < threads; ++t) {
+      workers.push_back(thread([&, t]() {
+        if (round == 1) {
+          // Erase every key below three quarters of the range.
+          while (!kept[t].empty() && *kept[t].begin() < range / 4 * 3) {
+            failed[t] += !database.erase(*kept[t].begin());
+            kept[t].erase(kept[t].begin());
+          }
+          return;
+        }
+        uint64_t seed = t + 1;
+        for (int i = 0; i < 30000; ++i) {
+          seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+          const int x = (seed >> 33) % (range / threads) * threads + t;
+          if ((seed >> 20) % 4 != 0)
+            failed[t] += database.insert(x) != kept[t].insert(x).second;
+          else
+            failed[t] += database.erase(x) != (kept[t].erase(x) > 0);
+        }
+      }));
+    }
+    for (int t = 0; t < threads; ++t) {
+      workers[t].join();
+      ok &= failed[t] == 0;
+    }
+    database.balance();
+
+    set<int> reference;
+    for (int t = 0; t < threads; ++t)
+      reference.insert(kept[t].begin(), kept[t].end());
+    ok &= sharded_agrees(database, reference, round + 1, range);
+
+    // Balanced, no shard is past the split size, and no two neighbours
+    // together are down to the merge size.
+    const uint32_t shards = database.shards();
+    const uint64_t split_size = std::max<uint64_t>(
+        2 * database.size() / database.target_shards(),
+        database.min_split_size());
+    const uint64_t merge_size =
+      database.size() / (2 * database.target_shards());
+    for (uint32_t i = 0; i < shards; ++i)
+      ok &= database.shard_size(i) <= split_size && (i + 1 == shards ||
+          database.shard_size(i) + database.shard_size(i + 1) > merge_size);
+    if (round == 0) {
+      grown_shards = shards;
+      splits = database.reshards();
+      ok &= shards > 1 && splits > 0;
+    } else {
+      ok &= database.reshards() > splits;
+    }
+  }
+  ok &= database.rebuilt_reshards() > 0;
+  cout << "sharded: " << grown_shards << " shards after inserts, "
+       << database.reshards() << " splits and merges, "
+       << database.rebuilt_reshards() << " built afresh, "
+       << (ok ? "ok" : "FAILED") << endl;
+  return ok;
+}
+
+// Runs the same random inserts, and then a run of ascending ones that
+// rebalances ever larger windows, on a pma with four rebalancing threads
+// and on one with a single thread, under each rebalancing algorithm that
+// runs in parallel, then bulk loads both. Windows and arrays reach past
+// PARALLEL_THRESHOLD, so rebalances, spreads and resizes run in parallel
+// on the first, which must lay out every element where the second does,
+// and hold the same keys as a std::set. Returns whether they agreed, and
+// parallel rebalances and resizes ran.
+static bool parallel_check()
+{
+  const stats_pma::rebalance_algorithm_t algorithms[] =
+    { stats_pma::ONE_PHASE, stats_pma::ADAPTIVE };
+  uint64_t parallel_rebalances = 0;
+  uint32_t capacity = 0;
+  bool ok = true;
+  for (int a = 0; a < 2 && ok; ++a) {
+    stats_pma database;
+    stats_pma serial;
+    database.set_rebalance_threads(4);
+    database.set_rebalance_algorithm(algorithms[a]);
+    serial.set_rebalance_algorithm(algorithms[a]);
+    set<int> reference;
+    uint64_t seed = 3;
+    for (int i = 0; i < 250000 && ok; ++i) {
+      seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+      const int x = i < 150000 ? int((seed >> 33) % (1u << 30)) :
+        (1 << 30) + i;
+      const stats_pma::stats_t before = database.stats();
+      ok &= database.insert(x) == reference.insert(x).second;
+      serial.insert(x);
+      const stats_pma::stats_t after = database.stats();
+      if (after.rebalances == before.rebalances ||
+          after.capacity != before.capacity)
+        continue;
+      for (int h = 0; h < stats_pma::STATS_BUCKETS; ++h)
+        if (after.rebalance_heights[h] != before.rebalance_heights[h] &&
+            database.window_capacity(h) >= stats_pma::PARALLEL_THRESHOLD)
+          parallel_rebalances++;
+    }
+    capacity = database.capacity();
+    ok &= same_keys(database, reference) &&
+      serial.capacity() == database.capacity();
+    for (set<int>::const_iterator it = reference.begin();
+         it != reference.end() && ok; ++it)
+      ok &= database.find(*it).index() == serial.find(*it).index();
+
+    vector<int> keys(reference.begin(), reference.end());
+    database.from_sorted(keys.begin(), keys.end());
+    serial.from_sorted(keys.begin(), keys.end());
+    ok &= same_keys(database, reference);
+    for (size_t k = 0; k < keys.size() && ok; ++k)
+      ok &= database.find(keys[k]).index() == serial.find(keys[k]).index();
+  }
+  ok &= parallel_rebalances > 0 &&
+    capacity >= stats_pma::SCALE_FACTOR * stats_pma::SCALE_FACTOR *
+    stats_pma::PARALLEL_THRESHOLD;
+  cout << "parallel rebalancing: " << parallel_rebalances
+       << " rebalances past the threshold, grown to " << capacity << ", "
+       << (ok ? "ok" : "FAILED") << endl;
+  return ok;
+}
+
+// Reserves room for a pma to grow in place, and inserts random keys until
+// it has resized several times. After each resize checks that the slots
+// still start where they did, at the array position the first segment
+// span points back to, that the reservation is kept, and that the pma
+// holds the same keys as a std::set. Returns whether it did.
+static bool reserve_check()
+{
+  const uint32_t reserved = 1 << 20;
+  pma<int> database;
+  database.reserve_capacity(reserved);
+  set<int> reference;
+  const void* base = 0;
+  uint32_t capacity = database.capacity();
+  int resizes = 0;
+  uint64_t seed = 5;
+  bool ok = database.reserved_capacity() == reserved;
+  while (database.capacity() < reserved / 2 && ok) {
+    seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+    const int x = (seed >> 33) % (4 * reserved);
+    ok &= database.insert(x) == reference.insert(x).second;
+    const pma<int>::segment_span span =
+      *database.range(INT_MIN, INT_MAX).begin();
+    if (!base)
+      base = span.data - span.index;
+    if (database.capacity() == capacity)
+      continue;
+    capacity = database.capacity();
+    resizes++;
+    ok &= span.data - span.index == base &&
+      database.reserved_capacity() == reserved &&
+      same_keys(database, reference);
+  }
+  ok &= resizes >= 5;
+  cout << "reserved capacity: " << resizes << " resizes in place up to "
+       << database.capacity() << ", " << (ok ? "ok" : "FAILED") << endl;
+  return ok;
+}
+
+// Cuts a buffer of several huge pages down to a quarter and grows it back,
+// and checks that neither moved the elements, that those kept survived and
+// that those added again start out as the value given. Then does the same
+// with address space reserved, growing the buffer a huge page at a time
+// into it from a few elements. Returns whether they did.
+static bool buffer_check()
+{
+  const uint32_t size = 1 << 20;
+  buffer<uint64_t> words;
+  words.resize(size);
+  for (uint32_t i = 0; i < size; ++i)
+    words[i] = i * 3 + 1;
+  const uint64_t* data = words.data();
+  words.resize(size / 4);
+  bool ok = words.data() == data && words.size() == size / 4;
+  words.resize(size, 7);
+  ok &= words.data() == data && words.size() == size;
+  for (uint32_t i = 0; i < size && ok; ++i)
+    ok &= words[i] == (i < size / 4 ? i * 3 + 1 : 7);
+
+  buffer<uint64_t> reserved;
+  reserved.resize(16);
+  for (uint32_t i = 0; i < 16; ++i)
+    reserved[i] = i;
+  reserved.reserve(4 * size);
+  data = reserved.data();
+  ok &= reserved.reserved() == 4 * size;
+  for (uint32_t n = 16; n < 4 * size && ok; n *= 4) {
+    reserved.resize(4 * n, 7);
+    ok &= reserved.data() == data && reserved.size() == 4 * n;
+    for (uint32_t i = 0; i < 4 * n && ok; ++i)
+      ok &= reserved[i] == (i < n ? i : 7);
+    for (uint32_t i = n; i < 4 * n; ++i)
+      reserved[i] = i;
+  }
+  cout << "buffer: shrunk and grown in place, " << (ok ? "ok" : "FAILED")
+       << endl;
+  return ok;
+}
+
+int main()
+{
+  pma<int> database;
   dump_stats(database);
   dump_pma_contents(database);
   dump_pma_free_index_bitmap(database);
@@ -53,5 +1032,31 @@ int main(int argc, char *argv[])
     dump_pma_free_index_bitmap(database);
     cout << endl;
   }
-  return 0;
+
+  const int batch[] = { 9, 4, 7, 5, 8, 6, 3 };
+  database.insert_batch(batch, batch + sizeof(batch) / sizeof(batch[0]));
+  dump_pma_contents(database);
+  dump_pma_free_index_bitmap(database);
+  dump_elements(database);
+  dump_range(database, 2, 7);
+  database.enable_concurrent_readers();
+  dump_concurrent_reads(database, 2, 7);
+  cout << endl;
+  bool ok = differential_check();
+  ok &= incremental_rebuild_check();
+  ok &= delta_check();
+  ok &= adaptive_check();
+  ok &= descending_check<cache_line_segments>("cache_line_segments");
+  ok &= descending_check<page_segments>("page_segments");
+  ok &= concurrent_insert_check(false);
+  ok &= concurrent_insert_check(true);
+  ok &= mapped_file_check();
+  ok &= write_ahead_log_check();
+  ok &= bulk_load_check();
+  ok &= batch_insert_check();
+  ok &= sharded_check();
+  ok &= parallel_check();
+  ok &= reserve_check();
+  ok &= buffer_check();
+  return ok ? 0 : 1;
 }
@@ -0,0 +1,66 @@
+// segment_index.cc
+// Eytzinger and van Emde Boas ordered search trees over the segments of a
+// packed-memory array.
+
+#include <stdint.h>
+#include "segment_index.h"
+
+using namespace std;
+
+// Assigns slots to the nodes of the subtree rooted at node in sorted order,
+// so that an in-order walk of the tree visits slots 0, 1, 2, ...
+static void assign_in_order(uint32_t node, uint32_t slots, uint32_t& slot,
+    uint32_t* node_of_slot, uint32_t* slot_of_node)
+{
+  if (node > slots)
+    return;
+  assign_in_order(2 * node, slots, slot, node_of_slot, slot_of_node);
+  node_of_slot[slot] = node;
+  slot_of_node[node] = slot++;
+  assign_in_order(2 * node + 1, slots, slot, node_of_slot, slot_of_node);
+}
+
+void eytzinger_layout(uint32_t slots, uint32_t* node_of_slot,
+    uint32_t* slot_of_node)
+{
+  uint32_t slot = 0;
+  slot_of_node[0] = 0;
+  assign_in_order(1, slots, slot, node_of_slot, slot_of_node);
+}
+
+// Splits the subtree of the given height whose root is at depth root, and
+// then its top and bottom trees in turn.
+static void split(int root, int height, veb_shape& shape)
+{
+  if (height <= 1)
+    return;
+  const int top = height / 2;
+  const int depth = root + top;
+  shape.root_depth[depth] = root;
+  shape.top[depth] = (uint32_t(1) << top) - 1;
+  shape.bottom[depth] = (uint32_t(1) << (height - top)) - 1;
+  split(root, top, shape);
+  split(depth, height - top, shape);
+}
+
+void veb_split(int height, veb_shape& shape)
+{
+  for (int depth = 0; depth < MAX_INDEX_HEIGHT; ++depth) {
+    shape.root_depth[depth] = 0;
+    shape.top[depth] = 0;
+    shape.bottom[depth] = 0;
+  }
+  split(0, height, shape);
+}
+
+uint32_t veb_position(uint32_t node, const veb_shape& shape)
+{
+  // The bottom tree holding a node starts after the top tree of its split
+  // and the bottom trees to its left, which the low bits of the node count.
+  const int depth = 31 - __builtin_clz(node);
+  if (depth == 0)
+    return 1;
+  const int up = depth - shape.root_depth[depth];
+  return veb_position(node >> up, shape) + shape.top[depth] +
+    (node & shape.top[depth]) * shape.bottom[depth];
+}
@@ -0,0 +1,334 @@
+#ifndef SEGMENT_INDEX_H
+#define SEGMENT_INDEX_H
+
+#include <stdint.h>
+#include <type_traits>
+#include "buffer.h"
+
+/**
+ * Lays out a static search tree over the given number of sorted slots in
+ * Eytzinger order, filling in the node holding each of the slots and the
+ * slot held by each of the slots + 1 nodes. Nodes are numbered from 1.
+ */
+void eytzinger_layout(uint32_t slots, uint32_t* node_of_slot,
+    uint32_t* slot_of_node);
+
+/**
+ * The deepest a node of a segment index may be, counting the root as depth
+ * 0, plus one.
+ */
+static const int MAX_INDEX_HEIGHT = 32;
+
+/**
+ * The van Emde Boas layout of a complete binary tree of a given height: the
+ * tree is split halfway down into a top tree and the bottom trees hanging
+ * off it, the top tree is stored first and the bottom trees after it, left
+ * to right, each laid out the same way in turn. Every depth but the root's
+ * is where the bottom trees of exactly one such split start. For a node at
+ * depth d, root_depth[d] is the depth of the root of the tree being split,
+ * top[d] the number of nodes in its top tree, a power of two less one, and
+ * bottom[d] the number in each of its bottom trees. The entries for depth 0
+ * are all 0.
+ */
+struct veb_shape {
+  uint32_t root_depth[MAX_INDEX_HEIGHT];
+  uint32_t top[MAX_INDEX_HEIGHT];
+  uint32_t bottom[MAX_INDEX_HEIGHT];
+};
+
+/**
+ * Fills in the van Emde Boas layout of a complete binary tree of the given
+ * height, at most MAX_INDEX_HEIGHT.
+ */
+void veb_split(int height, veb_shape& shape);
+
+/**
+ * Returns the position, counting from 1, at which a van Emde Boas layout
+ * stores a node of a complete binary tree, the node numbered in
+ * breadth-first order from 1 at the root.
+ */
+uint32_t veb_position(uint32_t node, const veb_shape& shape);
+
+/**
+ * Tags selecting the order a segment_index stores its nodes in.
+ *   eytzinger_order  breadth-first, so a node is stored at its own number.
+ *   veb_order        van Emde Boas, so the nodes of any subtree of about
+ *                    the height of a cache line or page are stored
+ *                    together, whatever the size of either.
+ */
+struct eytzinger_order {};
+struct veb_order {};
+
+/**
+ * Segment Index
+ * A static search tree holding one separator key per segment of a pma. The
+ * separators are kept in sorted order by segment, in the nodes of an
+ * Eytzinger (breadth-first) tree: the root at node 1 and the children of
+ * node k at nodes 2k and 2k+1. A search descends the tree without branching
+ * on the comparisons.
+ *
+ * With eytzinger_order each node is stored at its own number, so the nodes
+ * near the root share a handful of cache lines and only the last few levels
+ * of a search miss in cache, but every level below those misses once. With
+ * veb_order the nodes are stored in van Emde Boas order instead, so that a
+ * search touches O(log_B n) blocks for blocks of any size B, at the price
+ * of working out where each node is on the way down and of room for a
+ * complete tree, up to twice the separators.
+ *
+ * The shape of the tree only depends on the number of segments, so it is
+ * built once per resize of the pma. Changing a separator afterwards is O(1).
+ * Searches may run while separators change, as concurrent inserts and
+ * readers of a pma do: separators that can be are read and written with
+ * relaxed atomic loads and stores, so a search sees each one either before
+ * or after a change and only its answer may be stale.
+ * The separators and the shape may also be kept in memory owned by someone
+ * else, such as a mapped file, and taken from there as they are.
+ */
+template <class Key, class Compare, class Order = eytzinger_order>
+class segment_index {
+  public:
+    // The searches upper_bound_many runs in step.
+    static const uint32_t BATCH = 16;
+
+  private:
+    // The separators, indexed by the position of their node. Index 0 is
+    // unused, as are the positions of the nodes a complete tree would add.
+    buffer<Key> _keys;
+
+    // The position of the node holding the separator of each segment.
+    buffer<uint32_t> _node_of_segment;
+
+    // The segment whose separator each node holds, by node number.
+    buffer<uint32_t> _segment_of_node;
+
+    // With veb_order, the layout of the tree.
+    veb_shape _veb;
+
+    // Whether the separators are loaded and stored atomically: they can be
+    // copied as they are, and without a lock.
+    static const bool ATOMIC_KEYS = std::is_trivially_copyable<Key>::value &&
+      __atomic_always_lock_free(sizeof(Key), 0);
+    typedef std::integral_constant<bool, ATOMIC_KEYS> atomic_keys;
+
+    // Returns the separator at the given position, with a relaxed atomic
+    // load if the separators allow.
+    Key load(uint32_t at, std::true_type) const {
+      Key key;
+      __atomic_load(&_keys[at], &key, __ATOMIC_RELAXED);
+      return key;
+    }
+    const Key& load(uint32_t at, std::false_type) const {
+      return _keys[at];
+    }
+
+    // Stores the separator at the given position, with a relaxed atomic
+    // store if the separators allow.
+    void store(uint32_t at, const Key& key, std::true_type) {
+      __atomic_store(&_keys[at], &key, __ATOMIC_RELAXED);
+    }
+    void store(uint32_t at, const Key& key, std::false_type) {
+      _keys[at] = key;
+    }
+
+    // Orders the separators.
+    Compare _compare;
+
+    // Returns the height of the complete tree holding the given number of
+    // segments.
+    static int height(uint32_t segments) {
+      return segments == 0 ? 0 : 32 - __builtin_clz(segments);
+    }
+
+    // Works out the layout of the tree for the given number of segments.
+    void lay_out(uint32_t, eytzinger_order) {}
+    void lay_out(uint32_t segments, veb_order) {
+      veb_split(height(segments), _veb);
+    }
+
+    // Stores the separator of each segment at the position of its node,
+    // given the node numbers in _node_of_segment.
+    void place(eytzinger_order) {}
+    void place(veb_order) {
+      for (uint32_t seg = 0; seg < segments(); ++seg)
+        _node_of_segment[seg] = veb_position(_node_of_segment[seg], _veb);
+    }
+
+    // Returns the position of the given node at the given depth, on the way
+    // down a search whose path holds the positions of the nodes above it,
+    // and adds the node to the path. The path starts with the root at 1.
+    uint32_t position(uint32_t node, int, uint32_t*, eytzinger_order) const {
+      return node;
+    }
+    uint32_t position(uint32_t node, int depth, uint32_t* path, veb_order)
+      const
+    {
+      const uint32_t top = _veb.top[depth];
+      path[depth] = path[_veb.root_depth[depth]] + top +
+        (node & top) * _veb.bottom[depth];
+      return path[depth];
+    }
+
+  public:
+    explicit segment_index(const Compare& compare = Compare())
+      : _compare(compare)
+    {
+    }
+
+    /**
+     * Lays out the tree for the given number of segments. Every separator is
+     * reset, so they all need to be set again afterwards.
+     */
+    void reset(uint32_t segments)
+    {
+      _keys.assign(key_slots(segments), Key());
+      _node_of_segment.assign(segments, 0);
+      _segment_of_node.assign(segments + 1, 0);
+      eytzinger_layout(segments, _node_of_segment.data(),
+          _segment_of_node.data());
+      lay_out(segments, Order());
+      place(Order());
+    }
+
+    /**
+     * Returns the number of separators, counting the unused ones, that a
+     * tree over the given number of segments takes.
+     */
+    static uint32_t key_slots(uint32_t segments) {
+      return std::is_same<Order, veb_order>::value ?
+        uint32_t(1) << height(segments) : segments + 1;
+    }
+
+    /**
+     * Returns the number of entries the shape of a tree over the given
+     * number of segments takes.
+     */
+    static uint32_t shape_size(uint32_t segments) {
+      return 2 * segments + 1;
+    }
+
+    /**
+     * Keeps the index over the given number of segments in memory owned by
+     * someone else from then on: the key_slots(segments) separators at
+     * keys, indexed by position, and the shape at shape. Both are taken as
+     * they are, so unless they hold an index already, reset must be called
+     * next.
+     */
+    void attach(Key* keys, uint32_t* shape, uint32_t segments)
+    {
+      _keys.attach(keys, key_slots(segments));
+      _node_of_segment.attach(shape, segments);
+      _segment_of_node.attach(shape + segments, segments + 1);
+      lay_out(segments, Order());
+    }
+
+    /**
+     * Copies attached separators and shape into memory of the index's own.
+     */
+    void detach()
+    {
+      _keys.resize(_keys.size());
+      _node_of_segment.resize(_node_of_segment.size());
+      _segment_of_node.resize(_segment_of_node.size());
+    }
+
+    /**
+     * Returns the number of segments in the index.
+     */
+    uint32_t segments() const {
+      return _node_of_segment.size();
+    }
+
+    /**
+     * Returns the separator of the given segment.
+     */
+    Key key(uint32_t segment) const {
+      return load(_node_of_segment[segment], atomic_keys());
+    }
+
+    /**
+     * Replaces the separator of the given segment. The separators must be
+     * sorted by segment whenever the index is searched.
+     */
+    void set_key(uint32_t segment, const Key& key) {
+      store(_node_of_segment[segment], key, atomic_keys());
+    }
+
+    /**
+     * Returns the number of segments whose separator is less than x.
+     */
+    uint32_t lower_bound(const Key& x) const
+    {
+      // Descend to a leaf, going right whenever the separator is less than
+      // x. The node of the first separator not less than x is what remains
+      // after undoing the trailing right turns and the final left turn.
+      const uint32_t n = segments();
+      uint32_t path[MAX_INDEX_HEIGHT];
+      path[0] = 1;
+      uint32_t k = 1;
+      for (int depth = 0; k <= n; ++depth)
+        k = 2 * k + _compare(load(position(k, depth, path, Order()),
+              atomic_keys()), x);
+      k >>= __builtin_ffs(~k);
+      return k == 0 ? n : _segment_of_node[k];
+    }
+
+    /**
+     * Returns the number of segments whose separator is not greater than x.
+     */
+    uint32_t upper_bound(const Key& x) const
+    {
+      const uint32_t n = segments();
+      uint32_t path[MAX_INDEX_HEIGHT];
+      path[0] = 1;
+      uint32_t k = 1;
+      for (int depth = 0; k <= n; ++depth)
+        k = 2 * k + !_compare(x, load(position(k, depth, path, Order()),
+              atomic_keys()));
+      k >>= __builtin_ffs(~k);
+      return k == 0 ? n : _segment_of_node[k];
+    }
+
+    /**
+     * Sets bounds[i] to upper_bound(xs[i]) for each of the count keys at xs.
+     * The searches of each group of BATCH keys descend in step, a level at
+     * a time, prefetching the nodes they visit next, so that their cache
+     * misses overlap rather than follow one another.
+     */
+    void upper_bound_many(const Key* xs, uint32_t count, uint32_t* bounds)
+      const
+    {
+      const uint32_t n = segments();
+      uint32_t path[BATCH][MAX_INDEX_HEIGHT];
+      uint32_t node[BATCH];
+      uint32_t at[BATCH];
+      for (uint32_t first = 0; first < count; first += BATCH) {
+        const uint32_t group = count - first < BATCH ? count - first : BATCH;
+        for (uint32_t i = 0; i < group; ++i) {
+          path[i][0] = 1;
+          node[i] = 1;
+          at[i] = position(1, 0, path[i], Order());
+        }
+        bool descending = n > 0;
+        for (int depth = 0; descending; ++depth) {
+          descending = false;
+          for (uint32_t i = 0; i < group; ++i) {
+            if (node[i] > n)
+              continue;
+            node[i] = 2 * node[i] +
+              !_compare(xs[first + i], load(at[i], atomic_keys()));
+            if (node[i] <= n) {
+              at[i] = position(node[i], depth + 1, path[i], Order());
+              __builtin_prefetch(&_keys[at[i]]);
+              descending = true;
+            }
+          }
+        }
+        for (uint32_t i = 0; i < group; ++i) {
+          const uint32_t k = node[i] >> __builtin_ffs(~node[i]);
+          bounds[first + i] = k == 0 ? n : _segment_of_node[k];
+        }
+      }
+    }
+};
+
+#endif // SEGMENT_INDEX_H
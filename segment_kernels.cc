@@ -0,0 +1,714 @@
+// segment_kernels.cc
+// Vector kernels for ranking, packing, spreading out and unpacking segment
+// elements.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "segment_kernels.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define AVX2_TARGET __attribute__((target("avx2,bmi2")))
+#define AVX512_TARGET __attribute__((target("avx512f,bmi2")))
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+using namespace std;
+
+// Each instruction set fills in the kernels it has, and takes the scalar
+// ones for the rest.
+struct kernel_table {
+  kernel_isa isa;
+  uint64_t (*greater_i32)(const int32_t*, uint32_t, int32_t);
+  uint64_t (*greater_u32)(const uint32_t*, uint32_t, uint32_t);
+  uint64_t (*greater_i64)(const int64_t*, uint32_t, int64_t);
+  uint64_t (*greater_u64)(const uint64_t*, uint32_t, uint64_t);
+  uint64_t (*greater_f32)(const float*, uint32_t, float);
+  uint64_t (*greater_f64)(const double*, uint32_t, double);
+  char* (*compress)(char*, const char*, uint32_t, uint64_t, size_t);
+  void (*expand)(char*, uint32_t, const char*, uint64_t, size_t);
+  void (*unpack_u8_u32)(uint32_t*, const uint8_t*, uint32_t, uint32_t);
+  void (*unpack_u16_u32)(uint32_t*, const uint16_t*, uint32_t, uint32_t);
+  void (*unpack_u8_u64)(uint64_t*, const uint8_t*, uint32_t, uint64_t);
+  void (*unpack_u16_u64)(uint64_t*, const uint16_t*, uint32_t, uint64_t);
+  void (*unpack_u32_u64)(uint64_t*, const uint32_t*, uint32_t, uint64_t);
+};
+
+// Returns the mask of the low n bits, for n <= 64.
+static inline uint64_t low_bits(uint32_t n)
+{
+  return n < 64 ? (uint64_t(1) << n) - 1 : ~uint64_t(0);
+}
+
+// SCALAR
+
+template <class T>
+static uint64_t scalar_greater(const T* keys, uint32_t n, T x)
+{
+  uint64_t mask = 0;
+  for (uint32_t i = 0; i < n; ++i)
+    mask |= uint64_t(x < keys[i]) << i;
+  return mask;
+}
+
+static char* scalar_compress(char* to, const char* from, uint32_t n,
+    uint64_t mask, size_t size)
+{
+  for (mask &= low_bits(n); mask; mask &= mask - 1) {
+    const char* element = from + __builtin_ctzll(mask) * size;
+    if (element != to)
+      memcpy(to, element, size);
+    to += size;
+  }
+  return to;
+}
+
+static void scalar_expand(char* to, uint32_t n, const char* from,
+    uint64_t mask, size_t size)
+{
+  mask &= low_bits(n);
+  from += __builtin_popcountll(mask) * size;
+  while (mask) {
+    const int i = 63 - __builtin_clzll(mask);
+    from -= size;
+    if (from != to + i * size)
+      memcpy(to + i * size, from, size);
+    mask &= ~(uint64_t(1) << i);
+  }
+}
+
+template <class T, class Delta>
+static void scalar_unpack(T* to, const Delta* deltas, uint32_t n, T base)
+{
+  for (uint32_t i = 0; i < n; ++i)
+    to[i] = base + deltas[i];
+}
+
+static const kernel_table SCALAR_TABLE = {
+  SCALAR_KERNELS,
+  scalar_greater<int32_t>, scalar_greater<uint32_t>,
+  scalar_greater<int64_t>, scalar_greater<uint64_t>,
+  scalar_greater<float>, scalar_greater<double>,
+  scalar_compress, scalar_expand,
+  scalar_unpack<uint32_t, uint8_t>, scalar_unpack<uint32_t, uint16_t>,
+  scalar_unpack<uint64_t, uint8_t>, scalar_unpack<uint64_t, uint16_t>,
+  scalar_unpack<uint64_t, uint32_t>
+};
+
+#if defined(__x86_64__)
+
+// The vector kernels move elements of 4, 8 or 16 bytes as 1, 2 or 4 lanes
+// of 32 bits, so an element mask is widened to a lane mask by repeating
+// every bit once per lane of the element.
+static inline uint32_t lanes_per_element(size_t size)
+{
+  return size == 4 || size == 8 || size == 16 ? size / 4 : 0;
+}
+
+AVX2_TARGET static inline uint32_t widen(uint32_t mask, uint32_t width)
+{
+  if (width == 1)
+    return mask;
+  if (width == 2)
+    return _pdep_u32(mask, 0x55555555) * 3;
+  return _pdep_u32(mask, 0x11111111) * 15;
+}
+
+// AVX2
+
+// Returns the 32-bit lanes whose bits are set in mask, all ones.
+AVX2_TARGET static inline __m256i avx2_lanes(uint32_t mask)
+{
+  const __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  return _mm256_cmpeq_epi32(
+      _mm256_and_si256(_mm256_set1_epi32(mask), bits), bits);
+}
+
+// Each greater kernel loads only the lanes below left, as the keys may end
+// anywhere, and compares them with x.
+AVX2_TARGET static inline uint32_t avx2_greater(const int32_t* keys,
+    uint32_t left, int32_t x)
+{
+  const __m256i lanes = avx2_lanes((1u << left) - 1);
+  const __m256i k = _mm256_maskload_epi32(keys, lanes);
+  const __m256i gt = _mm256_cmpgt_epi32(k, _mm256_set1_epi32(x));
+  return _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_and_si256(gt, lanes)));
+}
+
+AVX2_TARGET static inline uint32_t avx2_greater(const uint32_t* keys,
+    uint32_t left, uint32_t x)
+{
+  // Flipping the sign bits makes the signed compare an unsigned one.
+  const __m256i sign = _mm256_set1_epi32(INT32_MIN);
+  const __m256i lanes = avx2_lanes((1u << left) - 1);
+  const __m256i k = _mm256_xor_si256(_mm256_maskload_epi32(
+        reinterpret_cast<const int*>(keys), lanes), sign);
+  const __m256i gt = _mm256_cmpgt_epi32(k,
+      _mm256_xor_si256(_mm256_set1_epi32(x), sign));
+  return _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_and_si256(gt, lanes)));
+}
+
+AVX2_TARGET static inline uint32_t avx2_greater(const float* keys,
+    uint32_t left, float x)
+{
+  const __m256i lanes = avx2_lanes((1u << left) - 1);
+  const __m256 gt = _mm256_cmp_ps(_mm256_maskload_ps(keys, lanes),
+      _mm256_set1_ps(x), _CMP_GT_OQ);
+  return _mm256_movemask_ps(_mm256_and_ps(gt, _mm256_castsi256_ps(lanes)));
+}
+
+AVX2_TARGET static inline uint32_t avx2_greater(const int64_t* keys,
+    uint32_t left, int64_t x)
+{
+  const __m256i lanes = avx2_lanes(widen((1u << left) - 1, 2));
+  const __m256i k = _mm256_maskload_epi64(
+      reinterpret_cast<const long long*>(keys), lanes);
+  const __m256i gt = _mm256_cmpgt_epi64(k, _mm256_set1_epi64x(x));
+  return _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_and_si256(gt, lanes)));
+}
+
+AVX2_TARGET static inline uint32_t avx2_greater(const uint64_t* keys,
+    uint32_t left, uint64_t x)
+{
+  const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+  const __m256i lanes = avx2_lanes(widen((1u << left) - 1, 2));
+  const __m256i k = _mm256_xor_si256(_mm256_maskload_epi64(
+        reinterpret_cast<const long long*>(keys), lanes), sign);
+  const __m256i gt = _mm256_cmpgt_epi64(k,
+      _mm256_xor_si256(_mm256_set1_epi64x(x), sign));
+  return _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_and_si256(gt, lanes)));
+}
+
+AVX2_TARGET static inline uint32_t avx2_greater(const double* keys,
+    uint32_t left, double x)
+{
+  const __m256i lanes = avx2_lanes(widen((1u << left) - 1, 2));
+  const __m256d gt = _mm256_cmp_pd(_mm256_maskload_pd(keys, lanes),
+      _mm256_set1_pd(x), _CMP_GT_OQ);
+  return _mm256_movemask_pd(_mm256_and_pd(gt, _mm256_castsi256_pd(lanes)));
+}
+
+template <class T>
+AVX2_TARGET static uint64_t avx2_greater_mask(const T* keys, uint32_t n, T x)
+{
+  const uint32_t per = 32 / sizeof(T);
+  uint64_t mask = 0;
+  for (uint32_t i = 0; i < n; i += per)
+    mask |= uint64_t(avx2_greater(keys + i, n - i < per ? n - i : per, x))
+      << i;
+  return mask;
+}
+
+// The permutation that gathers the lanes set in mask into the low lanes,
+// or, with expand, scatters the low lanes out to the lanes set in mask.
+AVX2_TARGET static inline __m256i avx2_permutation(uint32_t mask,
+    bool expand)
+{
+  const uint64_t bytes = _pdep_u64(mask, 0x0101010101010101) * 0xff;
+  const uint64_t order = 0x0706050403020100;
+  const uint64_t index = expand ? _pdep_u64(order, bytes) :
+    _pext_u64(order, bytes);
+  return _mm256_cvtepu8_epi32(_mm_cvtsi64_si128(index));
+}
+
+AVX2_TARGET static char* avx2_compress(char* to, const char* from,
+    uint32_t n, uint64_t mask, size_t size)
+{
+  const uint32_t width = lanes_per_element(size);
+  if (width == 0)
+    return scalar_compress(to, from, n, mask, size);
+  const uint32_t per = 8 / width;
+  for (uint32_t i = 0; i < n; i += per) {
+    const uint32_t left = n - i < per ? n - i : per;
+    const uint32_t elements = (mask >> i) & ((1u << left) - 1);
+    if (!elements)
+      continue;
+    const uint32_t lanes = widen(elements, width);
+    const __m256i v = _mm256_maskload_epi32(
+        reinterpret_cast<const int*>(from + i * size), avx2_lanes(lanes));
+    const uint32_t count = __builtin_popcount(elements);
+    _mm256_maskstore_epi32(reinterpret_cast<int*>(to),
+        avx2_lanes((1u << count * width) - 1),
+        _mm256_permutevar8x32_epi32(v, avx2_permutation(lanes, false)));
+    to += count * size;
+  }
+  return to;
+}
+
+AVX2_TARGET static void avx2_expand(char* to, uint32_t n, const char* from,
+    uint64_t mask, size_t size)
+{
+  const uint32_t width = lanes_per_element(size);
+  if (width == 0 || n == 0) {
+    scalar_expand(to, n, from, mask, size);
+    return;
+  }
+  const uint32_t per = 8 / width;
+  from += __builtin_popcountll(mask & low_bits(n)) * size;
+  for (uint32_t i = (n - 1) / per * per; ; i -= per) {
+    const uint32_t left = n - i < per ? n - i : per;
+    const uint32_t elements = (mask >> i) & ((1u << left) - 1);
+    if (elements) {
+      const uint32_t count = __builtin_popcount(elements);
+      from -= count * size;
+      const __m256i v = _mm256_maskload_epi32(
+          reinterpret_cast<const int*>(from),
+          avx2_lanes((1u << count * width) - 1));
+      const uint32_t lanes = widen(elements, width);
+      _mm256_maskstore_epi32(reinterpret_cast<int*>(to + i * size),
+          avx2_lanes(lanes),
+          _mm256_permutevar8x32_epi32(v, avx2_permutation(lanes, true)));
+    }
+    if (i == 0)
+      break;
+  }
+}
+
+// Each widen kernel zero extends the deltas of one vector of keys.
+AVX2_TARGET static inline __m256i avx2_widen(const uint8_t* deltas,
+    uint32_t*)
+{
+  return _mm256_cvtepu8_epi32(_mm_loadl_epi64(
+        reinterpret_cast<const __m128i*>(deltas)));
+}
+
+AVX2_TARGET static inline __m256i avx2_widen(const uint16_t* deltas,
+    uint32_t*)
+{
+  return _mm256_cvtepu16_epi32(_mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(deltas)));
+}
+
+AVX2_TARGET static inline __m256i avx2_widen(const uint8_t* deltas,
+    uint64_t*)
+{
+  uint32_t four;
+  memcpy(&four, deltas, sizeof(four));
+  return _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(four));
+}
+
+AVX2_TARGET static inline __m256i avx2_widen(const uint16_t* deltas,
+    uint64_t*)
+{
+  return _mm256_cvtepu16_epi64(_mm_loadl_epi64(
+        reinterpret_cast<const __m128i*>(deltas)));
+}
+
+AVX2_TARGET static inline __m256i avx2_widen(const uint32_t* deltas,
+    uint64_t*)
+{
+  return _mm256_cvtepu32_epi64(_mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(deltas)));
+}
+
+AVX2_TARGET static inline __m256i avx2_add(__m256i v, uint32_t base)
+{
+  return _mm256_add_epi32(v, _mm256_set1_epi32(base));
+}
+
+AVX2_TARGET static inline __m256i avx2_add(__m256i v, uint64_t base)
+{
+  return _mm256_add_epi64(v, _mm256_set1_epi64x(base));
+}
+
+// The keys past the last whole vector are unpacked one at a time.
+template <class T, class Delta>
+AVX2_TARGET static void avx2_unpack(T* to, const Delta* deltas, uint32_t n,
+    T base)
+{
+  const uint32_t per = 32 / sizeof(T);
+  uint32_t i = 0;
+  for (; i + per <= n; i += per)
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(to + i),
+        avx2_add(avx2_widen(deltas + i, to), base));
+  scalar_unpack(to + i, deltas + i, n - i, base);
+}
+
+static const kernel_table AVX2_TABLE = {
+  AVX2_KERNELS,
+  avx2_greater_mask<int32_t>, avx2_greater_mask<uint32_t>,
+  avx2_greater_mask<int64_t>, avx2_greater_mask<uint64_t>,
+  avx2_greater_mask<float>, avx2_greater_mask<double>,
+  avx2_compress, avx2_expand,
+  avx2_unpack<uint32_t, uint8_t>, avx2_unpack<uint32_t, uint16_t>,
+  avx2_unpack<uint64_t, uint8_t>, avx2_unpack<uint64_t, uint16_t>,
+  avx2_unpack<uint64_t, uint32_t>
+};
+
+// AVX-512
+
+AVX512_TARGET static inline uint32_t avx512_greater(const int32_t* keys,
+    uint32_t lanes, int32_t x)
+{
+  return _mm512_mask_cmpgt_epi32_mask(lanes,
+      _mm512_maskz_loadu_epi32(lanes, keys), _mm512_set1_epi32(x));
+}
+
+AVX512_TARGET static inline uint32_t avx512_greater(const uint32_t* keys,
+    uint32_t lanes, uint32_t x)
+{
+  return _mm512_mask_cmpgt_epu32_mask(lanes,
+      _mm512_maskz_loadu_epi32(lanes, keys), _mm512_set1_epi32(x));
+}
+
+AVX512_TARGET static inline uint32_t avx512_greater(const float* keys,
+    uint32_t lanes, float x)
+{
+  return _mm512_mask_cmp_ps_mask(lanes, _mm512_maskz_loadu_ps(lanes, keys),
+      _mm512_set1_ps(x), _CMP_GT_OQ);
+}
+
+AVX512_TARGET static inline uint32_t avx512_greater(const int64_t* keys,
+    uint32_t lanes, int64_t x)
+{
+  return _mm512_mask_cmpgt_epi64_mask(lanes,
+      _mm512_maskz_loadu_epi64(lanes, keys), _mm512_set1_epi64(x));
+}
+
+AVX512_TARGET static inline uint32_t avx512_greater(const uint64_t* keys,
+    uint32_t lanes, uint64_t x)
+{
+  return _mm512_mask_cmpgt_epu64_mask(lanes,
+      _mm512_maskz_loadu_epi64(lanes, keys), _mm512_set1_epi64(x));
+}
+
+AVX512_TARGET static inline uint32_t avx512_greater(const double* keys,
+    uint32_t lanes, double x)
+{
+  return _mm512_mask_cmp_pd_mask(lanes, _mm512_maskz_loadu_pd(lanes, keys),
+      _mm512_set1_pd(x), _CMP_GT_OQ);
+}
+
+template <class T>
+AVX512_TARGET static uint64_t avx512_greater_mask(const T* keys, uint32_t n,
+    T x)
+{
+  const uint32_t per = 64 / sizeof(T);
+  uint64_t mask = 0;
+  for (uint32_t i = 0; i < n; i += per)
+    mask |= uint64_t(avx512_greater(keys + i,
+          (1u << (n - i < per ? n - i : per)) - 1, x)) << i;
+  return mask;
+}
+
+AVX512_TARGET static char* avx512_compress(char* to, const char* from,
+    uint32_t n, uint64_t mask, size_t size)
+{
+  const uint32_t width = lanes_per_element(size);
+  if (width == 0)
+    return scalar_compress(to, from, n, mask, size);
+  const uint32_t per = 16 / width;
+  for (uint32_t i = 0; i < n; i += per) {
+    const uint32_t left = n - i < per ? n - i : per;
+    const uint32_t elements = (mask >> i) & ((1u << left) - 1);
+    if (!elements)
+      continue;
+    const __mmask16 lanes = widen(elements, width);
+    const __m512i v = _mm512_maskz_loadu_epi32(lanes, from + i * size);
+    const uint32_t count = __builtin_popcount(elements);
+    _mm512_mask_storeu_epi32(to, (1u << count * width) - 1,
+        _mm512_maskz_compress_epi32(lanes, v));
+    to += count * size;
+  }
+  return to;
+}
+
+AVX512_TARGET static void avx512_expand(char* to, uint32_t n,
+    const char* from, uint64_t mask, size_t size)
+{
+  const uint32_t width = lanes_per_element(size);
+  if (width == 0 || n == 0) {
+    scalar_expand(to, n, from, mask, size);
+    return;
+  }
+  const uint32_t per = 16 / width;
+  from += __builtin_popcountll(mask & low_bits(n)) * size;
+  for (uint32_t i = (n - 1) / per * per; ; i -= per) {
+    const uint32_t left = n - i < per ? n - i : per;
+    const uint32_t elements = (mask >> i) & ((1u << left) - 1);
+    if (elements) {
+      const uint32_t count = __builtin_popcount(elements);
+      from -= count * size;
+      const __m512i v = _mm512_maskz_loadu_epi32((1u << count * width) - 1,
+          from);
+      const __mmask16 lanes = widen(elements, width);
+      _mm512_mask_storeu_epi32(to + i * size, lanes,
+          _mm512_maskz_expand_epi32(lanes, v));
+    }
+    if (i == 0)
+      break;
+  }
+}
+
+AVX512_TARGET static inline __m512i avx512_widen(const uint8_t* deltas,
+    uint32_t*)
+{
+  return _mm512_cvtepu8_epi32(_mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(deltas)));
+}
+
+AVX512_TARGET static inline __m512i avx512_widen(const uint16_t* deltas,
+    uint32_t*)
+{
+  return _mm512_cvtepu16_epi32(_mm256_loadu_si256(
+        reinterpret_cast<const __m256i*>(deltas)));
+}
+
+AVX512_TARGET static inline __m512i avx512_widen(const uint8_t* deltas,
+    uint64_t*)
+{
+  return _mm512_cvtepu8_epi64(_mm_loadl_epi64(
+        reinterpret_cast<const __m128i*>(deltas)));
+}
+
+AVX512_TARGET static inline __m512i avx512_widen(const uint16_t* deltas,
+    uint64_t*)
+{
+  return _mm512_cvtepu16_epi64(_mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(deltas)));
+}
+
+AVX512_TARGET static inline __m512i avx512_widen(const uint32_t* deltas,
+    uint64_t*)
+{
+  return _mm512_cvtepu32_epi64(_mm256_loadu_si256(
+        reinterpret_cast<const __m256i*>(deltas)));
+}
+
+AVX512_TARGET static inline __m512i avx512_add(__m512i v, uint32_t base)
+{
+  return _mm512_add_epi32(v, _mm512_set1_epi32(base));
+}
+
+AVX512_TARGET static inline __m512i avx512_add(__m512i v, uint64_t base)
+{
+  return _mm512_add_epi64(v, _mm512_set1_epi64(base));
+}
+
+template <class T, class Delta>
+AVX512_TARGET static void avx512_unpack(T* to, const Delta* deltas,
+    uint32_t n, T base)
+{
+  const uint32_t per = 64 / sizeof(T);
+  uint32_t i = 0;
+  for (; i + per <= n; i += per)
+    _mm512_storeu_si512(to + i, avx512_add(avx512_widen(deltas + i, to),
+          base));
+  avx2_unpack(to + i, deltas + i, n - i, base);
+}
+
+static const kernel_table AVX512_TABLE = {
+  AVX512_KERNELS,
+  avx512_greater_mask<int32_t>, avx512_greater_mask<uint32_t>,
+  avx512_greater_mask<int64_t>, avx512_greater_mask<uint64_t>,
+  avx512_greater_mask<float>, avx512_greater_mask<double>,
+  avx512_compress, avx512_expand,
+  avx512_unpack<uint32_t, uint8_t>, avx512_unpack<uint32_t, uint16_t>,
+  avx512_unpack<uint64_t, uint8_t>, avx512_unpack<uint64_t, uint16_t>,
+  avx512_unpack<uint64_t, uint32_t>
+};
+
+#elif defined(__aarch64__)
+
+// NEON
+
+// Each greater kernel compares four or two keys at a time, weighting each
+// lane by its bit and summing the lanes into a mask, and the keys past the
+// last whole vector one at a time.
+static uint64_t neon_greater_mask(const int32_t* keys, uint32_t n, int32_t x)
+{
+  const uint32x4_t bits = {1, 2, 4, 8};
+  const int32x4_t v = vdupq_n_s32(x);
+  uint64_t mask = 0;
+  uint32_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    mask |= uint64_t(vaddvq_u32(vandq_u32(vcgtq_s32(vld1q_s32(keys + i), v),
+            bits))) << i;
+  return i < n ? mask | scalar_greater(keys + i, n - i, x) << i : mask;
+}
+
+static uint64_t neon_greater_mask(const uint32_t* keys, uint32_t n,
+    uint32_t x)
+{
+  const uint32x4_t bits = {1, 2, 4, 8};
+  const uint32x4_t v = vdupq_n_u32(x);
+  uint64_t mask = 0;
+  uint32_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    mask |= uint64_t(vaddvq_u32(vandq_u32(vcgtq_u32(vld1q_u32(keys + i), v),
+            bits))) << i;
+  return i < n ? mask | scalar_greater(keys + i, n - i, x) << i : mask;
+}
+
+static uint64_t neon_greater_mask(const float* keys, uint32_t n, float x)
+{
+  const uint32x4_t bits = {1, 2, 4, 8};
+  const float32x4_t v = vdupq_n_f32(x);
+  uint64_t mask = 0;
+  uint32_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    mask |= uint64_t(vaddvq_u32(vandq_u32(vcgtq_f32(vld1q_f32(keys + i), v),
+            bits))) << i;
+  return i < n ? mask | scalar_greater(keys + i, n - i, x) << i : mask;
+}
+
+static uint64_t neon_greater_mask(const int64_t* keys, uint32_t n, int64_t x)
+{
+  const uint64x2_t bits = {1, 2};
+  const int64x2_t v = vdupq_n_s64(x);
+  uint64_t mask = 0;
+  uint32_t i = 0;
+  for (; i + 2 <= n; i += 2)
+    mask |= vaddvq_u64(vandq_u64(vcgtq_s64(vld1q_s64(keys + i), v), bits))
+      << i;
+  return i < n ? mask | scalar_greater(keys + i, n - i, x) << i : mask;
+}
+
+static uint64_t neon_greater_mask(const uint64_t* keys, uint32_t n,
+    uint64_t x)
+{
+  const uint64x2_t bits = {1, 2};
+  const uint64x2_t v = vdupq_n_u64(x);
+  uint64_t mask = 0;
+  uint32_t i = 0;
+  for (; i + 2 <= n; i += 2)
+    mask |= vaddvq_u64(vandq_u64(vcgtq_u64(vld1q_u64(keys + i), v), bits))
+      << i;
+  return i < n ? mask | scalar_greater(keys + i, n - i, x) << i : mask;
+}
+
+static uint64_t neon_greater_mask(const double* keys, uint32_t n, double x)
+{
+  const uint64x2_t bits = {1, 2};
+  const float64x2_t v = vdupq_n_f64(x);
+  uint64_t mask = 0;
+  uint32_t i = 0;
+  for (; i + 2 <= n; i += 2)
+    mask |= vaddvq_u64(vandq_u64(vcgtq_f64(vld1q_f64(keys + i), v), bits))
+      << i;
+  return i < n ? mask | scalar_greater(keys + i, n - i, x) << i : mask;
+}
+
+// NEON has no compress or expand, and the scalar loops already move one
+// element per set bit.
+static const kernel_table NEON_TABLE = {
+  NEON_KERNELS,
+  neon_greater_mask, neon_greater_mask, neon_greater_mask,
+  neon_greater_mask, neon_greater_mask, neon_greater_mask,
+  scalar_compress, scalar_expand,
+  scalar_unpack<uint32_t, uint8_t>, scalar_unpack<uint32_t, uint16_t>,
+  scalar_unpack<uint64_t, uint8_t>, scalar_unpack<uint64_t, uint16_t>,
+  scalar_unpack<uint64_t, uint32_t>
+};
+
+#endif
+
+// Returns the table of the widest instruction set up to isa the processor
+// offers.
+static const kernel_table* table_for(kernel_isa isa)
+{
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (isa >= AVX512_KERNELS && __builtin_cpu_supports("avx512f") &&
+      __builtin_cpu_supports("bmi2"))
+    return &AVX512_TABLE;
+  if (isa >= AVX2_KERNELS && __builtin_cpu_supports("avx2") &&
+      __builtin_cpu_supports("bmi2"))
+    return &AVX2_TABLE;
+#elif defined(__aarch64__)
+  if (isa >= NEON_KERNELS)
+    return &NEON_TABLE;
+#endif
+  return &SCALAR_TABLE;
+}
+
+static const kernel_table*& table()
+{
+  static const kernel_table* table = table_for(AVX512_KERNELS);
+  return table;
+}
+
+kernel_isa kernels()
+{
+  return table()->isa;
+}
+
+kernel_isa select_kernels(kernel_isa isa)
+{
+  table() = table_for(isa);
+  return table()->isa;
+}
+
+uint64_t greater_mask(const int32_t* keys, uint32_t n, int32_t x)
+{
+  return table()->greater_i32(keys, n, x);
+}
+
+uint64_t greater_mask(const uint32_t* keys, uint32_t n, uint32_t x)
+{
+  return table()->greater_u32(keys, n, x);
+}
+
+uint64_t greater_mask(const int64_t* keys, uint32_t n, int64_t x)
+{
+  return table()->greater_i64(keys, n, x);
+}
+
+uint64_t greater_mask(const uint64_t* keys, uint32_t n, uint64_t x)
+{
+  return table()->greater_u64(keys, n, x);
+}
+
+uint64_t greater_mask(const float* keys, uint32_t n, float x)
+{
+  return table()->greater_f32(keys, n, x);
+}
+
+uint64_t greater_mask(const double* keys, uint32_t n, double x)
+{
+  return table()->greater_f64(keys, n, x);
+}
+
+char* compress_elements(char* to, const char* from, uint32_t n, uint64_t mask,
+    size_t size)
+{
+  return table()->compress(to, from, n, mask, size);
+}
+
+void expand_elements(char* to, uint32_t n, const char* from, uint64_t mask,
+    size_t size)
+{
+  table()->expand(to, n, from, mask, size);
+}
+
+void unpack_deltas(uint32_t* to, const uint8_t* deltas, uint32_t n,
+    uint32_t base)
+{
+  table()->unpack_u8_u32(to, deltas, n, base);
+}
+
+void unpack_deltas(uint32_t* to, const uint16_t* deltas, uint32_t n,
+    uint32_t base)
+{
+  table()->unpack_u16_u32(to, deltas, n, base);
+}
+
+void unpack_deltas(uint64_t* to, const uint8_t* deltas, uint32_t n,
+    uint64_t base)
+{
+  table()->unpack_u8_u64(to, deltas, n, base);
+}
+
+void unpack_deltas(uint64_t* to, const uint16_t* deltas, uint32_t n,
+    uint64_t base)
+{
+  table()->unpack_u16_u64(to, deltas, n, base);
+}
+
+void unpack_deltas(uint64_t* to, const uint32_t* deltas, uint32_t n,
+    uint64_t base)
+{
+  table()->unpack_u32_u64(to, deltas, n, base);
+}
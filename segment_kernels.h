@@ -0,0 +1,121 @@
+#ifndef SEGMENT_KERNELS_H
+#define SEGMENT_KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <type_traits>
+
+/**
+ * Segment Kernels
+ * Vector kernels for the work a packed-memory array does within one word of
+ * its free index bitmap, i.e. on at most 64 array positions: ranking a key
+ * among the keys there, packing the elements there together, and spreading
+ * packed elements out over them. The widest instruction set the processor
+ * offers is picked on first use: AVX-512, AVX2 or NEON, or else plain
+ * scalar code. AVX-512 compresses and expands with vpcompressd and
+ * vpexpandd, AVX2 with a permutation computed from the mask, and NEON and
+ * scalar code one element at a time.
+ *
+ * The keys of a delta_layout segment are held as small offsets from a base,
+ * and unpacked a vector of keys at a time by zero extending the offsets and
+ * adding the base.
+ */
+enum kernel_isa {
+  SCALAR_KERNELS,
+  NEON_KERNELS,
+  AVX2_KERNELS,
+  AVX512_KERNELS
+};
+
+/**
+ * Returns the instruction set the kernels use.
+ */
+kernel_isa kernels();
+
+/**
+ * Makes the kernels use the widest instruction set up to isa that the
+ * processor offers, and returns it. Meant for tests and benchmarks; no
+ * kernel may be running meanwhile.
+ */
+kernel_isa select_kernels(kernel_isa isa);
+
+/**
+ * Returns a mask with bit i set if x < keys[i], for the n <= 64 keys at
+ * keys.
+ */
+uint64_t greater_mask(const int32_t* keys, uint32_t n, int32_t x);
+uint64_t greater_mask(const uint32_t* keys, uint32_t n, uint32_t x);
+uint64_t greater_mask(const int64_t* keys, uint32_t n, int64_t x);
+uint64_t greater_mask(const uint64_t* keys, uint32_t n, uint64_t x);
+uint64_t greater_mask(const float* keys, uint32_t n, float x);
+uint64_t greater_mask(const double* keys, uint32_t n, double x);
+
+/**
+ * Whether greater_mask ranks keys of type Key.
+ */
+template <class Key>
+struct vector_key {
+  static const bool value = std::is_arithmetic<Key>::value &&
+    !std::is_same<Key, bool>::value && (sizeof(Key) == 4 || sizeof(Key) == 8);
+};
+
+/**
+ * Calls the greater_mask for keys of the size and kind of Key, which must
+ * be a vector_key.
+ */
+template <class Key>
+inline uint64_t key_greater_mask(const Key* keys, uint32_t n, Key x)
+{
+  typedef typename std::conditional<std::is_floating_point<Key>::value,
+          typename std::conditional<sizeof(Key) == 4, float, double>::type,
+          typename std::conditional<std::is_signed<Key>::value,
+          typename std::conditional<sizeof(Key) == 4, int32_t, int64_t>::type,
+          typename std::conditional<sizeof(Key) == 4, uint32_t,
+          uint64_t>::type>::type>::type T;
+  return greater_mask(reinterpret_cast<const T*>(keys), n, static_cast<T>(x));
+}
+
+/**
+ * Moves the elements of size bytes at from whose bits are set in mask, of
+ * the n <= 64 there, to consecutive elements starting at to, keeping their
+ * order, and returns the end of them. Each element must land no further
+ * along than it started, as it does when to is at or before from.
+ */
+char* compress_elements(char* to, const char* from, uint32_t n, uint64_t mask,
+    size_t size);
+
+/**
+ * Moves the popcount(mask) consecutive elements of size bytes starting at
+ * from to the elements whose bits are set in mask, of the n <= 64 starting
+ * at to, keeping their order. Each element must land no further back than
+ * it started, as it does when from is at or before to.
+ */
+void expand_elements(char* to, uint32_t n, const char* from, uint64_t mask,
+    size_t size);
+
+/**
+ * Sets to[i] to base + deltas[i], wrapping around, for the n <= 64 deltas
+ * at deltas.
+ */
+void unpack_deltas(uint32_t* to, const uint8_t* deltas, uint32_t n,
+    uint32_t base);
+void unpack_deltas(uint32_t* to, const uint16_t* deltas, uint32_t n,
+    uint32_t base);
+void unpack_deltas(uint64_t* to, const uint8_t* deltas, uint32_t n,
+    uint64_t base);
+void unpack_deltas(uint64_t* to, const uint16_t* deltas, uint32_t n,
+    uint64_t base);
+void unpack_deltas(uint64_t* to, const uint32_t* deltas, uint32_t n,
+    uint64_t base);
+
+/**
+ * Unpacks keys of the other sizes, one at a time.
+ */
+template <class T, class Delta>
+inline void unpack_deltas(T* to, const Delta* deltas, uint32_t n, T base)
+{
+  for (uint32_t i = 0; i < n; ++i)
+    to[i] = static_cast<T>(base + deltas[i]);
+}
+
+#endif // SEGMENT_KERNELS_H
@@ -0,0 +1,114 @@
+// seqlock.cc
+// Per-segment sequence counters and reader epochs for lock-free readers.
+
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+#include "seqlock.h"
+
+using namespace std;
+
+segment_versions::segment_versions()
+  : _size(0)
+{
+}
+
+void segment_versions::reset(uint32_t segments)
+{
+  _versions.reset(new atomic<uint32_t>[segments]);
+  for (uint32_t seg = 0; seg < segments; ++seg)
+    _versions[seg].store(0, memory_order_relaxed);
+  _size = segments;
+}
+
+void segment_versions::begin_write(uint32_t first, uint32_t last)
+{
+  // The fence keeps the writes to the segments from being seen ahead of
+  // their odd versions.
+  for (uint32_t seg = first; seg < last; ++seg)
+    _versions[seg].store(_versions[seg].load(memory_order_relaxed) + 1,
+        memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+}
+
+void segment_versions::end_write(uint32_t first, uint32_t last)
+{
+  for (uint32_t seg = first; seg < last; ++seg)
+    _versions[seg].store(_versions[seg].load(memory_order_relaxed) + 1,
+        memory_order_release);
+}
+
+uint32_t segment_versions::read_begin(uint32_t segment) const
+{
+  for (;;) {
+    const uint32_t version = _versions[segment].load(memory_order_acquire);
+    if (version % 2 == 0)
+      return version;
+    this_thread::yield();
+  }
+}
+
+bool segment_versions::unchanged(uint32_t segment, uint32_t version) const
+{
+  // The fence keeps the reads of the segment from being seen after the
+  // version is checked.
+  atomic_thread_fence(memory_order_acquire);
+  return _versions[segment].load(memory_order_relaxed) == version;
+}
+
+reader_epoch::reader_epoch()
+  : _epoch(2)
+{
+  for (uint32_t slot = 0; slot < MAX_READERS; ++slot)
+    _slots[slot].epoch.store(0, memory_order_relaxed);
+}
+
+uint32_t reader_epoch::enter()
+{
+  // Start looking for a free slot at one of our own, so that readers on
+  // different threads rarely try the same slot.
+  static atomic<uint32_t> next_thread(0);
+  thread_local const uint32_t first_slot =
+    next_thread.fetch_add(1, memory_order_relaxed) % MAX_READERS;
+
+  for (uint32_t n = 0; ; ++n) {
+    const uint64_t epoch = _epoch.load(memory_order_seq_cst);
+    if (epoch % 2 != 0) {
+      this_thread::yield();
+      continue;
+    }
+    reader_slot& slot = _slots[(first_slot + n) % MAX_READERS];
+    uint64_t expected = 0;
+    if (!slot.epoch.compare_exchange_strong(expected, epoch,
+          memory_order_seq_cst)) {
+      if (n % MAX_READERS == MAX_READERS - 1)
+        this_thread::yield();
+      continue;
+    }
+
+    // A resize that began after the epoch was read may have checked this
+    // slot before it was claimed, so give it back and wait the resize out.
+    if (_epoch.load(memory_order_seq_cst) == epoch)
+      return (first_slot + n) % MAX_READERS;
+    slot.epoch.store(0, memory_order_release);
+  }
+}
+
+void reader_epoch::leave(uint32_t slot)
+{
+  _slots[slot].epoch.store(0, memory_order_release);
+}
+
+void reader_epoch::begin_exclusive()
+{
+  _epoch.fetch_add(1, memory_order_seq_cst);
+  for (uint32_t slot = 0; slot < MAX_READERS; ++slot) {
+    while (_slots[slot].epoch.load(memory_order_seq_cst) != 0)
+      this_thread::yield();
+  }
+}
+
+void reader_epoch::end_exclusive()
+{
+  _epoch.fetch_add(1, memory_order_release);
+}
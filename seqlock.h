@@ -0,0 +1,151 @@
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+
+/**
+ * Segment Versions
+ * One sequence counter per segment of a pma, letting readers copy a segment
+ * without locking while a single writer changes it. A version is even while
+ * its segment is stable and odd while the writer is in the middle of
+ * changing it. A reader notes the version, copies the segment, and keeps the
+ * copy only if the version is still the one it noted; otherwise it copies
+ * again.
+ *
+ * The copy itself races with the writer, so the keys and values it reads
+ * must be trivially copyable: a torn copy is thrown away, but a copy
+ * constructor that followed a torn pointer would not be.
+ */
+class segment_versions {
+  private:
+    // The counters, one per segment.
+    std::unique_ptr<std::atomic<uint32_t>[]> _versions;
+
+    // The number of segments.
+    uint32_t _size;
+
+  public:
+    segment_versions();
+
+    /**
+     * Allocates a counter for each of the given number of segments. Readers
+     * may not be copying any segment while this runs.
+     */
+    void reset(uint32_t segments);
+
+    /**
+     * Returns the number of segments.
+     */
+    uint32_t size() const {
+      return _size;
+    }
+
+    /**
+     * Marks segments [first, last) as being written. Each call is paired
+     * with a call to end_write over the same segments, and the pairs may not
+     * overlap.
+     */
+    void begin_write(uint32_t first, uint32_t last);
+
+    /**
+     * Marks segments [first, last) as stable again.
+     */
+    void end_write(uint32_t first, uint32_t last);
+
+    /**
+     * Returns the current version of a segment, waiting until the segment is
+     * stable.
+     */
+    uint32_t read_begin(uint32_t segment) const;
+
+    /**
+     * Returns whether a segment is still at the version that read_begin
+     * returned, in which case everything read from it in between is a
+     * consistent copy.
+     */
+    bool unchanged(uint32_t segment, uint32_t version) const;
+};
+
+/**
+ * Reader Epoch
+ * Keeps readers out of the buffers of a pma while a resize replaces them.
+ * Every reader holds a slot for as long as it reads, recording the epoch it
+ * entered in. The writer makes the epoch odd before a resize, waits until
+ * every slot is empty, and makes the epoch even again once the new buffers
+ * are in place. Readers arriving in between wait for the even epoch rather
+ * than take a lock, so a reader never touches a freed buffer and the writer
+ * only ever waits for reads already under way.
+ */
+class reader_epoch {
+  public:
+    // The number of readers that may be reading at once. Further readers
+    // wait for a slot.
+    static const uint32_t MAX_READERS = 64;
+
+    /**
+     * Holds a reader slot for the lifetime of the guard.
+     */
+    class guard {
+      private:
+        reader_epoch& _epoch;
+        uint32_t _slot;
+
+      public:
+        explicit guard(reader_epoch& epoch)
+          : _epoch(epoch), _slot(epoch.enter())
+        {
+        }
+
+        ~guard() {
+          _epoch.leave(_slot);
+        }
+
+      private:
+        guard(const guard&);
+        guard& operator=(const guard&);
+    };
+
+  private:
+    // A slot holds the epoch its reader entered in, or zero when free. Each
+    // sits on its own cache line so that readers do not contend.
+    struct alignas(64) reader_slot {
+      std::atomic<uint64_t> epoch;
+    };
+
+    reader_slot _slots[MAX_READERS];
+
+    // Even while readers may enter, odd while a resize is under way. It
+    // starts at two so that no epoch is ever zero.
+    std::atomic<uint64_t> _epoch;
+
+  public:
+    reader_epoch();
+
+    /**
+     * Claims a slot for a reader, waiting out any resize under way.
+     */
+    uint32_t enter();
+
+    /**
+     * Releases the slot of a reader.
+     */
+    void leave(uint32_t slot);
+
+    /**
+     * Shuts readers out, waiting until every reader has left.
+     */
+    void begin_exclusive();
+
+    /**
+     * Lets readers back in.
+     */
+    void end_exclusive();
+
+  private:
+    reader_epoch(const reader_epoch&);
+    reader_epoch& operator=(const reader_epoch&);
+};
+
+#endif // SEQLOCK_H
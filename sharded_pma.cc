@@ -0,0 +1,10 @@
+// sharded_pma.cc
+// Range-partitioned packed-memory array across NUMA nodes.
+//
+// The member definitions live in sharded_pma.tcc. The common instantiations
+// are compiled here once so that other translation units need not repeat
+// them.
+
+#include "sharded_pma.h"
+
+template class sharded_pma<int>;
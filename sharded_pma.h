@@ -0,0 +1,277 @@
+#ifndef SHARDED_PMA_H
+#define SHARDED_PMA_H
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
+#include "aligned_memory.h"
+#include "pma.h"
+
+/**
+ * Sharded PMA
+ * A sorted set, or map, range-partitioned across independent pmas called
+ * shards. Shard i holds the keys in [bound i, bound i+1), and a lookup or
+ * insert is routed to its shard by a binary search over the bounds. Each
+ * shard has a lock of its own, so threads working on different shards run
+ * in parallel, and a resize only ever covers one shard. Each shard is also
+ * placed on a NUMA node, the one holding the fewest elements when the
+ * shard was made, so that the shards together draw on the memory bandwidth
+ * of every socket; see numa_scope.
+ *
+ * The shards are kept at around target_shards() of even size. One that
+ * grows past twice its share, and min_split_size(), is split at its median,
+ * and two neighbours that together hold less than half a share are merged.
+ * Either way the new shards are built aside from the elements of the old
+ * ones, with only those locked, and then swapped in under a brief lock of
+ * the whole router. The shards are balanced by the inserting or erasing
+ * thread that found them out of balance, or with background balancing
+ * enabled, by a thread of their own.
+ *
+ * Elements are as in pma: keys of type Key ordered by Compare, each with a
+ * value of type Value. Every public member may be called from any number
+ * of threads at once.
+ */
+template <class Key, class Value = pma_no_value,
+          class Compare = std::less<Key>, class Layout = aos_layout,
+          class Policy = pma_policy<> >
+class sharded_pma {
+  public:
+    typedef pma<Key, Value, Compare, Layout, Policy> shard_type;
+
+    // The shards kept per NUMA node unless told otherwise.
+    static const uint32_t SHARDS_PER_NODE = 4;
+
+    // Shards holding fewer elements than this are never split, unless set
+    // otherwise; see set_min_split_size.
+    static const uint64_t MIN_SPLIT_SIZE = 1 << 16;
+
+  private:
+    struct shard {
+      shard(const Compare& compare, int n)
+        : data(compare), node(n), changes(0), count(0) {}
+
+      shard_type data;
+
+      // The NUMA node the shard's arrays are placed on.
+      int node;
+
+      // Guards data and changes.
+      std::mutex mutex;
+
+      // Bumped by every insert or erase, so a split or merge built from an
+      // earlier copy of the elements can tell it is out of date.
+      uint64_t changes;
+
+      // The number of elements, readable without the lock.
+      std::atomic<uint64_t> count;
+    };
+
+    // The shards in key order, and the smallest key each but the first may
+    // hold. Both change only under an exclusive lock of _router_mutex, and
+    // only by the thread holding _balance_mutex.
+    std::vector<std::unique_ptr<shard> > _shards;
+    std::vector<Key> _bounds;
+    mutable std::shared_mutex _router_mutex;
+
+    // Held by the thread balancing the shards.
+    std::mutex _balance_mutex;
+
+    // The number of elements in all shards.
+    std::atomic<uint64_t> _size;
+
+    uint32_t _target_shards;
+    uint64_t _min_split_size;
+    Compare _compare;
+
+    // The splits and merges carried out, and how many of them were built
+    // afresh under the exclusive lock.
+    std::atomic<uint64_t> _reshards;
+    std::atomic<uint64_t> _rebuilt_reshards;
+
+    // The background balancer, if enabled, and what wakes it.
+    std::atomic<bool> _background;
+    std::thread _balancer;
+    std::mutex _wake_mutex;
+    std::condition_variable _wake;
+    bool _unbalanced;
+    bool _stop;
+
+  public:
+    /**
+     * Starts out with one empty shard, and keeps target_shards of them once
+     * there are enough elements, or SHARDS_PER_NODE per NUMA node if
+     * target_shards is 0.
+     */
+    explicit sharded_pma(uint32_t target_shards = 0,
+        const Compare& compare = Compare());
+
+    /**
+     * Stops the background balancer, if any.
+     */
+    ~sharded_pma();
+
+    /**
+     * Inserts x with the given value into its shard. Returns false, with
+     * nothing changed, if x is there already.
+     */
+    bool insert(const Key& x, const Value& value = Value());
+
+    /**
+     * Erases x from its shard. Returns false if x is not there.
+     */
+    bool erase(const Key& x);
+
+    /**
+     * Sets key to the largest key less than x and returns true, or returns
+     * false if there is none.
+     */
+    bool predecessor(const Key& x, Key& key) const;
+
+    /**
+     * Calls visit(key, value) for each element in [lo, hi), in order. Each
+     * shard is locked while it is visited, so visit must not call back into
+     * the sharded_pma.
+     */
+    template <class Visitor>
+    void read_range(const Key& lo, const Key& hi, Visitor visit) const;
+
+    /**
+     * Returns the number of elements.
+     */
+    uint64_t size() const;
+
+    /**
+     * Returns the number of shards.
+     */
+    uint32_t shards() const;
+
+    /**
+     * Returns the number of shards kept at an even size.
+     */
+    uint32_t target_shards() const;
+
+    /**
+     * Returns the number of elements in the given shard and the NUMA node it
+     * is placed on.
+     */
+    uint64_t shard_size(uint32_t shard) const;
+    int shard_node(uint32_t shard) const;
+
+    /**
+     * Sets the number of elements a shard must hold before it is split,
+     * MIN_SPLIT_SIZE unless told otherwise. Call this before any other
+     * thread uses the sharded_pma.
+     */
+    void set_min_split_size(uint64_t size);
+    uint64_t min_split_size() const;
+
+    /**
+     * Returns the number of splits and merges carried out, and how many of
+     * them had to be built afresh under the exclusive lock because inserts
+     * or erases landed while they were built.
+     */
+    uint64_t reshards() const;
+    uint64_t rebuilt_reshards() const;
+
+    /**
+     * Splits and merges shards until none is out of balance.
+     */
+    void balance();
+
+    /**
+     * Leaves balancing to a thread of its own from now on, so inserts and
+     * erases that put a shard out of balance return without waiting for it.
+     */
+    void enable_background_balancing();
+
+  private:
+    sharded_pma(const sharded_pma&);
+    sharded_pma& operator=(const sharded_pma&);
+
+    /**
+     * Returns the shard that holds or would hold x. The caller holds
+     * _router_mutex.
+     */
+    uint32_t route(const Key& x) const;
+
+    /**
+     * Returns the number of elements past which a shard is split, and at or
+     * under which two neighbouring shards together are merged.
+     */
+    uint64_t split_size() const;
+    uint64_t merge_size() const;
+
+    /**
+     * Returns whether the given shard is to be split, or merged with one of
+     * its neighbours. The caller holds _router_mutex.
+     */
+    bool out_of_balance(uint32_t shard) const;
+
+    /**
+     * Balances the shards, or wakes the balancer to, after an insert or
+     * erase has put one out of balance. Another thread already balancing
+     * them is left to it.
+     */
+    void wake_balancer();
+
+    /**
+     * Splits and merges shards until none is out of balance. The caller
+     * holds _balance_mutex.
+     */
+    void balance_shards();
+
+    /**
+     * Returns the NUMA node holding the fewest elements. The caller holds
+     * _router_mutex.
+     */
+    int emptiest_node() const;
+
+    /**
+     * Replaces shards [first, first + parts) by new_parts new shards holding
+     * the same elements in even parts. The first new shard stays on the
+     * node of the first old one, and the others go to the emptiest node.
+     * The caller holds _balance_mutex.
+     */
+    void reshard(uint32_t first, uint32_t parts, uint32_t new_parts);
+
+    /**
+     * Copies the elements of shards [first, last) into keys and values, in
+     * order, and returns their combined changes. The caller holds the locks
+     * of the shards or _router_mutex exclusively.
+     */
+    uint64_t collect(uint32_t first, uint32_t last, std::vector<Key>& keys,
+        std::vector<Value>& values) const;
+
+    /**
+     * Builds a shard on each of the given nodes, holding the elements of
+     * keys and values in even parts, with the values moved in. The bound of
+     * every part but the first, which is lowest, goes to bounds.
+     */
+    void build(std::vector<Key>& keys, std::vector<Value>& values,
+        const std::vector<int>& nodes, const Key& lowest,
+        std::vector<std::unique_ptr<shard> >& built,
+        std::vector<Key>& bounds) const;
+
+    /**
+     * The loop of the background balancer.
+     */
+    void balance_loop();
+};
+
+#define SHARDED_TEMPLATE \
+  template <class Key, class Value, class Compare, class Layout, class Policy>
+#define SHARDED_CLASS sharded_pma<Key, Value, Compare, Layout, Policy>
+#include "sharded_pma.tcc"
+#undef SHARDED_CLASS
+#undef SHARDED_TEMPLATE
+
+// Instantiated in sharded_pma.cc.
+extern template class sharded_pma<int>;
+
+#endif // SHARDED_PMA_H
@@ -0,0 +1,404 @@
+// sharded_pma.tcc
+// Member definitions of the sharded_pma class template, included by
+// sharded_pma.h.
+
+SHARDED_TEMPLATE
+SHARDED_CLASS::sharded_pma(uint32_t target_shards, const Compare& compare)
+  : _size(0),
+    _target_shards(target_shards ? target_shards :
+        SHARDS_PER_NODE * numa_nodes()),
+    _min_split_size(MIN_SPLIT_SIZE),
+    _compare(compare),
+    _reshards(0),
+    _rebuilt_reshards(0),
+    _background(false),
+    _unbalanced(false),
+    _stop(false)
+{
+  _shards.push_back(std::unique_ptr<shard>(new shard(compare, 0)));
+  _bounds.push_back(Key());
+}
+
+SHARDED_TEMPLATE
+SHARDED_CLASS::~sharded_pma()
+{
+  if (!_balancer.joinable())
+    return;
+  {
+    std::lock_guard<std::mutex> waking(_wake_mutex);
+    _stop = true;
+  }
+  _wake.notify_one();
+  _balancer.join();
+}
+
+SHARDED_TEMPLATE
+bool SHARDED_CLASS::insert(const Key& x, const Value& value)
+{
+  bool unbalanced;
+  {
+    std::shared_lock<std::shared_mutex> routing(_router_mutex);
+    const uint32_t index = route(x);
+    shard& s = *_shards[index];
+    {
+      // Whatever the shard allocates as it grows goes to its node.
+      std::lock_guard<std::mutex> lock(s.mutex);
+      numa_scope placing(s.node);
+      if (!s.data.insert(x, value))
+        return false;
+      s.changes++;
+      s.count.fetch_add(1, std::memory_order_relaxed);
+    }
+    _size.fetch_add(1, std::memory_order_relaxed);
+    unbalanced = out_of_balance(index);
+  }
+  if (unbalanced)
+    wake_balancer();
+  return true;
+}
+
+SHARDED_TEMPLATE
+bool SHARDED_CLASS::erase(const Key& x)
+{
+  bool unbalanced;
+  {
+    std::shared_lock<std::shared_mutex> routing(_router_mutex);
+    const uint32_t index = route(x);
+    shard& s = *_shards[index];
+    {
+      std::lock_guard<std::mutex> lock(s.mutex);
+      numa_scope placing(s.node);
+      if (!s.data.erase(x))
+        return false;
+      s.changes++;
+      s.count.fetch_sub(1, std::memory_order_relaxed);
+    }
+    _size.fetch_sub(1, std::memory_order_relaxed);
+    unbalanced = out_of_balance(index);
+  }
+  if (unbalanced)
+    wake_balancer();
+  return true;
+}
+
+SHARDED_TEMPLATE
+bool SHARDED_CLASS::predecessor(const Key& x, Key& key) const
+{
+  // The shards below that of x only hold smaller keys, so the first one
+  // with an answer, walking down, has the largest.
+  std::shared_lock<std::shared_mutex> routing(_router_mutex);
+  for (uint32_t i = route(x) + 1; i-- > 0; ) {
+    shard& s = *_shards[i];
+    std::lock_guard<std::mutex> lock(s.mutex);
+    const uint32_t index = s.data.predecessor(x);
+    if (index != s.data.capacity()) {
+      key = s.data[index];
+      return true;
+    }
+  }
+  return false;
+}
+
+SHARDED_TEMPLATE
+template <class Visitor>
+void SHARDED_CLASS::read_range(const Key& lo, const Key& hi,
+    Visitor visit) const
+{
+  std::shared_lock<std::shared_mutex> routing(_router_mutex);
+  const uint32_t first = route(lo);
+  for (uint32_t i = first; i < _shards.size(); ++i) {
+    if (i > first && !_compare(_bounds[i], hi))
+      return;
+    std::lock_guard<std::mutex> lock(_shards[i]->mutex);
+    const shard_type& data = _shards[i]->data;
+    typename shard_type::span_range spans = data.range(lo, hi);
+    for (typename shard_type::span_iterator it = spans.begin();
+         it != spans.end(); ++it) {
+      const typename shard_type::segment_span span = *it;
+      for (uint64_t bits = span.mask; bits; bits &= bits - 1) {
+        const uint32_t n = span.index + __builtin_ctzll(bits);
+        visit(data[n], data.value(n));
+      }
+    }
+  }
+}
+
+SHARDED_TEMPLATE
+uint64_t SHARDED_CLASS::size() const {
+  return _size.load(std::memory_order_relaxed);
+}
+
+SHARDED_TEMPLATE
+uint32_t SHARDED_CLASS::shards() const
+{
+  std::shared_lock<std::shared_mutex> routing(_router_mutex);
+  return _shards.size();
+}
+
+SHARDED_TEMPLATE
+uint32_t SHARDED_CLASS::target_shards() const {
+  return _target_shards;
+}
+
+SHARDED_TEMPLATE
+uint64_t SHARDED_CLASS::shard_size(uint32_t shard) const
+{
+  std::shared_lock<std::shared_mutex> routing(_router_mutex);
+  return _shards[shard]->count.load(std::memory_order_relaxed);
+}
+
+SHARDED_TEMPLATE
+int SHARDED_CLASS::shard_node(uint32_t shard) const
+{
+  std::shared_lock<std::shared_mutex> routing(_router_mutex);
+  return _shards[shard]->node;
+}
+
+SHARDED_TEMPLATE
+void SHARDED_CLASS::set_min_split_size(uint64_t size) {
+  _min_split_size = size;
+}
+
+SHARDED_TEMPLATE
+uint64_t SHARDED_CLASS::min_split_size() const {
+  return _min_split_size;
+}
+
+SHARDED_TEMPLATE
+uint64_t SHARDED_CLASS::reshards() const {
+  return _reshards.load(std::memory_order_relaxed);
+}
+
+SHARDED_TEMPLATE
+uint64_t SHARDED_CLASS::rebuilt_reshards() const {
+  return _rebuilt_reshards.load(std::memory_order_relaxed);
+}
+
+SHARDED_TEMPLATE
+void SHARDED_CLASS::balance()
+{
+  std::lock_guard<std::mutex> balancing(_balance_mutex);
+  balance_shards();
+}
+
+SHARDED_TEMPLATE
+void SHARDED_CLASS::enable_background_balancing()
+{
+  std::lock_guard<std::mutex> balancing(_balance_mutex);
+  if (_background)
+    return;
+  _balancer = std::thread(&sharded_pma::balance_loop, this);
+  _background = true;
+}
+
+SHARDED_TEMPLATE
+uint32_t SHARDED_CLASS::route(const Key& x) const
+{
+  // Shard 0 takes every key below the first bound, so it has none.
+  return std::upper_bound(_bounds.begin() + 1, _bounds.end(), x, _compare) -
+    (_bounds.begin() + 1);
+}
+
+SHARDED_TEMPLATE
+uint64_t SHARDED_CLASS::split_size() const
+{
+  const uint64_t least = _min_split_size;
+  const uint64_t share = 2 * size() / _target_shards;
+  return share > least ? share : least;
+}
+
+SHARDED_TEMPLATE
+uint64_t SHARDED_CLASS::merge_size() const {
+  return size() / (2 * _target_shards);
+}
+
+SHARDED_TEMPLATE
+bool SHARDED_CLASS::out_of_balance(uint32_t shard) const
+{
+  const uint64_t count = _shards[shard]->count.load(std::memory_order_relaxed);
+  if (count > split_size())
+    return true;
+  const uint64_t merge = merge_size();
+  return (shard > 0 && count + _shards[shard - 1]->count <= merge) ||
+    (shard + 1 < _shards.size() && count + _shards[shard + 1]->count <= merge);
+}
+
+SHARDED_TEMPLATE
+void SHARDED_CLASS::wake_balancer()
+{
+  if (_background) {
+    {
+      std::lock_guard<std::mutex> waking(_wake_mutex);
+      _unbalanced = true;
+    }
+    _wake.notify_one();
+    return;
+  }
+  std::unique_lock<std::mutex> balancing(_balance_mutex, std::try_to_lock);
+  if (balancing.owns_lock())
+    balance_shards();
+}
+
+SHARDED_TEMPLATE
+void SHARDED_CLASS::balance_shards()
+{
+  for (;;) {
+    // Split the largest shard if it is too large, or else merge the
+    // smallest pair of neighbours if they are too small.
+    uint32_t first = 0;
+    uint32_t parts = 0;
+    {
+      std::shared_lock<std::shared_mutex> routing(_router_mutex);
+      uint32_t largest = 0;
+      uint32_t smallest = 0;
+      uint64_t smallest_pair = UINT64_MAX;
+      for (uint32_t i = 0; i < _shards.size(); ++i) {
+        if (_shards[i]->count > _shards[largest]->count)
+          largest = i;
+        if (i + 1 < _shards.size() &&
+            _shards[i]->count + _shards[i + 1]->count < smallest_pair) {
+          smallest = i;
+          smallest_pair = _shards[i]->count + _shards[i + 1]->count;
+        }
+      }
+      if (_shards[largest]->count > split_size()) {
+        first = largest;
+        parts = 1;
+      } else if (smallest_pair <= merge_size()) {
+        first = smallest;
+        parts = 2;
+      }
+    }
+    if (parts == 0)
+      return;
+    reshard(first, parts, parts == 1 ? 2 : 1);
+  }
+}
+
+SHARDED_TEMPLATE
+int SHARDED_CLASS::emptiest_node() const
+{
+  std::vector<uint64_t> counts(numa_nodes(), 0);
+  for (uint32_t i = 0; i < _shards.size(); ++i)
+    counts[_shards[i]->node] += _shards[i]->count;
+  return std::min_element(counts.begin(), counts.end()) - counts.begin();
+}
+
+SHARDED_TEMPLATE
+void SHARDED_CLASS::reshard(uint32_t first, uint32_t parts,
+    uint32_t new_parts)
+{
+  // Copy the elements out with only the old shards locked, and build the
+  // new ones from the copy with nothing locked.
+  std::vector<Key> keys;
+  std::vector<Value> values;
+  std::vector<int> nodes(new_parts);
+  uint64_t changes;
+  Key lowest;
+  {
+    std::shared_lock<std::shared_mutex> routing(_router_mutex);
+    std::vector<std::unique_lock<std::mutex> > locks;
+    for (uint32_t i = first; i < first + parts; ++i)
+      locks.push_back(std::unique_lock<std::mutex>(_shards[i]->mutex));
+    changes = collect(first, first + parts, keys, values);
+    lowest = _bounds[first];
+    nodes[0] = _shards[first]->node;
+    for (uint32_t k = 1; k < new_parts; ++k)
+      nodes[k] = emptiest_node();
+  }
+  std::vector<std::unique_ptr<shard> > built;
+  std::vector<Key> bounds;
+  build(keys, values, nodes, lowest, built, bounds);
+
+  // Inserts and erases that landed meanwhile mean building afresh, now
+  // with the router locked, which at worst stalls every caller for as long
+  // as a resize of one shard would have.
+  std::vector<std::unique_ptr<shard> > old;
+  {
+    std::unique_lock<std::shared_mutex> routing(_router_mutex);
+    uint64_t now = 0;
+    for (uint32_t i = first; i < first + parts; ++i)
+      now += _shards[i]->changes;
+    if (now != changes) {
+      keys.clear();
+      values.clear();
+      built.clear();
+      bounds.clear();
+      collect(first, first + parts, keys, values);
+      build(keys, values, nodes, lowest, built, bounds);
+      _rebuilt_reshards.fetch_add(1, std::memory_order_relaxed);
+    }
+    _reshards.fetch_add(1, std::memory_order_relaxed);
+    for (uint32_t i = first; i < first + parts; ++i)
+      old.push_back(std::move(_shards[i]));
+    _shards.erase(_shards.begin() + first, _shards.begin() + first + parts);
+    _shards.insert(_shards.begin() + first,
+        std::make_move_iterator(built.begin()),
+        std::make_move_iterator(built.end()));
+    _bounds.erase(_bounds.begin() + first + 1,
+        _bounds.begin() + first + parts);
+    _bounds.insert(_bounds.begin() + first + 1, bounds.begin(), bounds.end());
+  }
+}
+
+SHARDED_TEMPLATE
+uint64_t SHARDED_CLASS::collect(uint32_t first, uint32_t last,
+    std::vector<Key>& keys, std::vector<Value>& values) const
+{
+  uint64_t changes = 0;
+  for (uint32_t i = first; i < last; ++i) {
+    const shard_type& data = _shards[i]->data;
+    for (typename shard_type::const_iterator it = data.begin();
+         it != data.end(); ++it) {
+      keys.push_back(*it);
+      values.push_back(it.value());
+    }
+    changes += _shards[i]->changes;
+  }
+  return changes;
+}
+
+SHARDED_TEMPLATE
+void SHARDED_CLASS::build(std::vector<Key>& keys, std::vector<Value>& values,
+    const std::vector<int>& nodes, const Key& lowest,
+    std::vector<std::unique_ptr<shard> >& built,
+    std::vector<Key>& bounds) const
+{
+  const size_t n = keys.size();
+  for (size_t k = 0; k < nodes.size(); ++k) {
+    const size_t first = n * k / nodes.size();
+    const size_t last = n * (k + 1) / nodes.size();
+    std::unique_ptr<shard> s(new shard(_compare, nodes[k]));
+    {
+      numa_scope placing(nodes[k]);
+      s->data.from_sorted(keys.begin() + first, keys.begin() + last);
+    }
+    typename std::vector<Value>::iterator value = values.begin() + first;
+    for (typename shard_type::const_iterator it = s->data.begin();
+         it != s->data.end(); ++it)
+      s->data.value(it.index()) = std::move(*value++);
+    s->count = last - first;
+    // An empty part, which only a build afresh can leave, gets the bound
+    // of the one before it and so never holds a key.
+    if (k > 0)
+      bounds.push_back(first < n ? keys[first] :
+          bounds.empty() ? lowest : bounds.back());
+    built.push_back(std::move(s));
+  }
+}
+
+SHARDED_TEMPLATE
+void SHARDED_CLASS::balance_loop()
+{
+  std::unique_lock<std::mutex> waking(_wake_mutex);
+  while (!_stop) {
+    if (!_unbalanced) {
+      _wake.wait(waking);
+      continue;
+    }
+    _unbalanced = false;
+    waking.unlock();
+    balance();
+    waking.lock();
+  }
+}
@@ -0,0 +1,91 @@
+// thread_pool.cc
+// A fixed pool of worker threads for parallel rebalances and resizes.
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "thread_pool.h"
+
+using namespace std;
+
+thread_pool::thread_pool(uint32_t threads)
+  : _task(0), _tasks(0), _generation(0), _busy(0), _stop(false), _next(0)
+{
+  for (uint32_t n = 1; n < threads; ++n)
+    _workers.push_back(thread(&thread_pool::work, this));
+}
+
+thread_pool::~thread_pool()
+{
+  {
+    lock_guard<mutex> lock(_mutex);
+    _stop = true;
+  }
+  _wake.notify_all();
+  for (size_t n = 0; n < _workers.size(); ++n)
+    _workers[n].join();
+}
+
+void thread_pool::run(uint32_t tasks, const function<void(uint32_t)>& task)
+{
+  unique_lock<mutex> running(_run_mutex, try_to_lock);
+  if (!running.owns_lock() || _workers.empty()) {
+    for (uint32_t n = 0; n < tasks; ++n)
+      task(n);
+    return;
+  }
+
+  {
+    lock_guard<mutex> lock(_mutex);
+    _task = &task;
+    _tasks = tasks;
+    _next.store(0, memory_order_relaxed);
+    _busy = _workers.size();
+    _generation++;
+  }
+  _wake.notify_all();
+  run_tasks(task, tasks);
+
+  // The job may only be dropped once no worker can still be reading it.
+  unique_lock<mutex> lock(_mutex);
+  while (_busy > 0)
+    _done.wait(lock);
+  _task = 0;
+}
+
+void thread_pool::work()
+{
+  uint64_t seen = 0;
+  for (;;) {
+    const function<void(uint32_t)>* task;
+    uint32_t tasks;
+    {
+      unique_lock<mutex> lock(_mutex);
+      while (!_stop && _generation == seen)
+        _wake.wait(lock);
+      if (_stop)
+        return;
+      seen = _generation;
+      task = _task;
+      tasks = _tasks;
+    }
+    run_tasks(*task, tasks);
+    {
+      lock_guard<mutex> lock(_mutex);
+      if (--_busy == 0)
+        _done.notify_one();
+    }
+  }
+}
+
+void thread_pool::run_tasks(const function<void(uint32_t)>& task,
+    uint32_t tasks)
+{
+  for (uint32_t n = _next.fetch_add(1, memory_order_relaxed); n < tasks;
+       n = _next.fetch_add(1, memory_order_relaxed))
+    task(n);
+}
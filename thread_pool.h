@@ -0,0 +1,91 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Thread Pool
+ * A fixed set of worker threads that split up a job of numbered tasks with
+ * the thread that hands it over. Tasks are claimed one at a time from a
+ * shared counter, so a thread that finishes its tasks early takes over the
+ * ones the others have not reached yet, and uneven tasks even out without
+ * any queue per thread.
+ */
+class thread_pool {
+  private:
+    std::vector<std::thread> _workers;
+
+    // Guards the fields below and wakes the workers for each job.
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::condition_variable _done;
+
+    // The job being run, if any, and the number of its tasks.
+    const std::function<void(uint32_t)>* _task;
+    uint32_t _tasks;
+
+    // Bumped for every job, so that a worker can tell a new one from the
+    // one it has just finished.
+    uint64_t _generation;
+
+    // The number of workers still running tasks of the current job.
+    uint32_t _busy;
+
+    // Set when the pool is destroyed.
+    bool _stop;
+
+    // The next task of the current job to be claimed.
+    std::atomic<uint32_t> _next;
+
+    // Held by the thread whose job is running.
+    std::mutex _run_mutex;
+
+  public:
+    /**
+     * Starts a pool in which jobs run on the given number of threads,
+     * counting the one that hands each job over.
+     */
+    explicit thread_pool(uint32_t threads);
+
+    /**
+     * Stops and joins the workers.
+     */
+    ~thread_pool();
+
+    /**
+     * Returns the number of threads a job runs on.
+     */
+    uint32_t size() const {
+      return _workers.size() + 1;
+    }
+
+    /**
+     * Calls task(n) for every n in [0, tasks), spread over the pool and the
+     * calling thread, and returns once every call has returned. If a job
+     * handed over by another thread is running already, the tasks all run
+     * on the calling thread instead.
+     */
+    void run(uint32_t tasks, const std::function<void(uint32_t)>& task);
+
+  private:
+    /**
+     * The loop of each worker.
+     */
+    void work();
+
+    /**
+     * Claims and runs the tasks of the current job until none are left.
+     */
+    void run_tasks(const std::function<void(uint32_t)>& task, uint32_t tasks);
+
+    thread_pool(const thread_pool&);
+    thread_pool& operator=(const thread_pool&);
+};
+
+#endif // THREAD_POOL_H
@@ -0,0 +1,55 @@
+// window_locks.cc
+// Spinlocks over the bitmap words of a pma, for concurrent inserts.
+
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+#include "window_locks.h"
+
+using namespace std;
+
+window_locks::window_locks()
+  : _size(0)
+{
+}
+
+void window_locks::reset(uint32_t capacity)
+{
+  _size = (capacity + LOCK_SPAN - 1) / LOCK_SPAN;
+  _locks.reset(new atomic<uint8_t>[_size]);
+  for (uint32_t n = 0; n < _size; ++n)
+    _locks[n].store(0, memory_order_relaxed);
+}
+
+void window_locks::lock(uint32_t first, uint32_t last)
+{
+  for (uint32_t n = first / LOCK_SPAN; n < (last - 1) / LOCK_SPAN + 1; ++n) {
+    // Spin on a plain load, so that waiting does not keep stealing the
+    // cache line from the holder.
+    while (_locks[n].exchange(1, memory_order_acquire) != 0) {
+      while (_locks[n].load(memory_order_relaxed) != 0)
+        this_thread::yield();
+    }
+  }
+}
+
+bool window_locks::try_lock(uint32_t first, uint32_t last)
+{
+  const uint32_t begin = first / LOCK_SPAN;
+  const uint32_t end = (last - 1) / LOCK_SPAN + 1;
+  for (uint32_t n = begin; n < end; ++n) {
+    if (_locks[n].load(memory_order_relaxed) != 0 ||
+        _locks[n].exchange(1, memory_order_acquire) != 0) {
+      while (n-- > begin)
+        _locks[n].store(0, memory_order_release);
+      return false;
+    }
+  }
+  return true;
+}
+
+void window_locks::unlock(uint32_t first, uint32_t last)
+{
+  for (uint32_t n = first / LOCK_SPAN; n < (last - 1) / LOCK_SPAN + 1; ++n)
+    _locks[n].store(0, memory_order_release);
+}
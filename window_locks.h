@@ -0,0 +1,72 @@
+#ifndef WINDOW_LOCKS_H
+#define WINDOW_LOCKS_H
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+
+/**
+ * Window Locks
+ * Spinlocks over the array positions of a pma, one for every run of
+ * LOCK_SPAN positions. A run is one word of the free index bitmap, so two
+ * threads holding different locks never write the same bitmap word, even
+ * when a word spans several segments. A window is locked by taking the lock
+ * of every run it covers.
+ *
+ * Waiting for a lock is only allowed while every lock already held lies to
+ * the left of it. A thread that needs a lock to the left of one it holds
+ * must either get it with try_lock or let go and take both in order, which
+ * keeps threads from waiting on each other in a cycle.
+ */
+class window_locks {
+  public:
+    // The number of array positions covered by each lock.
+    static const uint32_t LOCK_SPAN = 64;
+
+  private:
+    // The locks, nonzero while held.
+    std::unique_ptr<std::atomic<uint8_t>[]> _locks;
+
+    // The number of locks.
+    uint32_t _size;
+
+  public:
+    window_locks();
+
+    /**
+     * Allocates the locks for an array of the given capacity, all free. No
+     * lock may be held while this runs.
+     */
+    void reset(uint32_t capacity);
+
+    /**
+     * Returns the number of array positions locked together with any one
+     * of them in an array of the given capacity.
+     */
+    static uint32_t span(uint32_t capacity) {
+      return capacity < LOCK_SPAN ? capacity : LOCK_SPAN;
+    }
+
+    /**
+     * Locks array positions [first, last), from left to right, waiting as
+     * long as it takes.
+     */
+    void lock(uint32_t first, uint32_t last);
+
+    /**
+     * Locks array positions [first, last) if none of them is held already,
+     * and returns whether it did. Never waits.
+     */
+    bool try_lock(uint32_t first, uint32_t last);
+
+    /**
+     * Unlocks array positions [first, last).
+     */
+    void unlock(uint32_t first, uint32_t last);
+
+  private:
+    window_locks(const window_locks&);
+    window_locks& operator=(const window_locks&);
+};
+
+#endif // WINDOW_LOCKS_H
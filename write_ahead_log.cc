@@ -0,0 +1,205 @@
+// write_ahead_log.cc
+// An append-only log of checksummed records with group commit.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <vector>
+#include "write_ahead_log.h"
+
+using namespace std;
+
+namespace {
+
+// Reads or writes exactly length bytes at offset, unless the file ends
+// first or there is an error.
+bool read_fully(int fd, char* data, size_t length, uint64_t offset)
+{
+  while (length > 0) {
+    const ssize_t n = pread(fd, data, length, offset);
+    if (n <= 0)
+      return false;
+    data += n;
+    length -= n;
+    offset += n;
+  }
+  return true;
+}
+
+bool write_fully(int fd, const char* data, size_t length, uint64_t offset)
+{
+  while (length > 0) {
+    const ssize_t n = pwrite(fd, data, length, offset);
+    if (n < 0)
+      return false;
+    data += n;
+    length -= n;
+    offset += n;
+  }
+  return true;
+}
+
+}
+
+write_ahead_log::write_ahead_log()
+  : _fd(-1), _appended(0), _written(0), _durable(0), _writing(false),
+    _failed(false)
+{
+}
+
+write_ahead_log::~write_ahead_log()
+{
+  if (_fd >= 0)
+    ::close(_fd);
+}
+
+bool write_ahead_log::open(const char* path)
+{
+  if (_fd >= 0)
+    return false;
+  const int fd = ::open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    ::close(fd);
+    return false;
+  }
+
+  // Walk the records up to the first that is cut short or does not match
+  // its checksum, and drop it and everything after.
+  uint64_t end = 0;
+  vector<char> payload;
+  for (;;) {
+    uint32_t header[2];
+    if (end + sizeof(header) > uint64_t(st.st_size) ||
+        !read_fully(fd, reinterpret_cast<char*>(header), sizeof(header),
+          end))
+      break;
+    const uint32_t length = header[0] >> 8;
+    if (end + sizeof(header) + length > uint64_t(st.st_size))
+      break;
+    payload.resize(length);
+    if (!read_fully(fd, payload.data(), length, end + sizeof(header)) ||
+        checksum(header[0], payload.data(), length) != header[1])
+      break;
+    end += sizeof(header) + length;
+  }
+  if (end < uint64_t(st.st_size) &&
+      (ftruncate(fd, end) != 0 || fdatasync(fd) != 0)) {
+    ::close(fd);
+    return false;
+  }
+  _fd = fd;
+  _appended = _written = _durable = end;
+  return true;
+}
+
+bool write_ahead_log::read(const function<void(uint64_t, uint32_t,
+      const char*, uint32_t)>& visit) const
+{
+  vector<char> payload;
+  for (uint64_t lsn = 0; lsn < _durable; ) {
+    uint32_t header[2];
+    if (!read_fully(_fd, reinterpret_cast<char*>(header), sizeof(header),
+          lsn))
+      return false;
+    const uint32_t length = header[0] >> 8;
+    payload.resize(length);
+    if (!read_fully(_fd, payload.data(), length, lsn + sizeof(header)))
+      return false;
+    lsn += sizeof(header) + length;
+    visit(lsn, header[0] & 0xff, payload.data(), length);
+  }
+  return true;
+}
+
+uint64_t write_ahead_log::append(uint32_t type, const void* data,
+    uint32_t length)
+{
+  uint32_t header[2];
+  header[0] = length << 8 | (type & 0xff);
+  header[1] = checksum(header[0], static_cast<const char*>(data), length);
+  unique_lock<mutex> appending(_mutex);
+  const char* bytes = reinterpret_cast<const char*>(header);
+  _buffer.insert(_buffer.end(), bytes, bytes + sizeof(header));
+  bytes = static_cast<const char*>(data);
+  _buffer.insert(_buffer.end(), bytes, bytes + length);
+  _appended += sizeof(header) + length;
+  const uint64_t lsn = _appended;
+
+  // A full buffer is written out by whoever finds it so, unless a write is
+  // under way already; the next one takes it along.
+  if (_buffer.size() >= GROUP_BYTES && !_writing && !_failed)
+    write_out(appending, false);
+  return lsn;
+}
+
+uint64_t write_ahead_log::appended()
+{
+  lock_guard<mutex> appending(_mutex);
+  return _appended;
+}
+
+bool write_ahead_log::commit(uint64_t lsn)
+{
+  unique_lock<mutex> committing(_mutex);
+  while (_durable < lsn && !_failed) {
+    if (_writing)
+      _written_out.wait(committing);
+    else
+      write_out(committing, true);
+  }
+  return !_failed;
+}
+
+bool write_ahead_log::reset()
+{
+  lock_guard<mutex> resetting(_mutex);
+  _buffer.clear();
+  _appended = _written = _durable = 0;
+  _failed = ftruncate(_fd, 0) != 0 || fdatasync(_fd) != 0;
+  return !_failed;
+}
+
+bool write_ahead_log::write_out(unique_lock<mutex>& lock, bool durable)
+{
+  // Appends go on into a fresh buffer while this one is written, and every
+  // record in it lies before the LSN of any of them.
+  vector<char> pending;
+  pending.swap(_buffer);
+  const uint64_t offset = _written;
+  const uint64_t end = _appended;
+  _writing = true;
+  lock.unlock();
+  const bool written = write_fully(_fd, pending.data(), pending.size(),
+      offset) && (!durable || fdatasync(_fd) == 0);
+  lock.lock();
+  _writing = false;
+  if (written) {
+    _written = end;
+    if (durable)
+      _durable = end;
+  } else {
+    _failed = true;
+  }
+  _written_out.notify_all();
+  return written;
+}
+
+uint32_t write_ahead_log::checksum(uint32_t word, const char* data,
+    uint32_t length)
+{
+  // FNV-1a over the header word and then the payload.
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < 4; ++i)
+    hash = (hash ^ ((word >> (8 * i)) & 0xff)) * 16777619u;
+  for (uint32_t i = 0; i < length; ++i)
+    hash = (hash ^ uint8_t(data[i])) * 16777619u;
+  return hash;
+}
@@ -0,0 +1,123 @@
+#ifndef WRITE_AHEAD_LOG_H
+#define WRITE_AHEAD_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+/**
+ * Write-Ahead Log
+ * An append-only file of records, each a type and up to MAX_RECORD bytes
+ * of payload behind an 8 byte header holding both and a checksum. Appends
+ * are gathered in memory and written out together, so that any number of
+ * threads committing at once share one write and one fdatasync: the first
+ * to commit writes out everything appended so far, and the others wait for
+ * it and find their records already on disk. A position in the log, or
+ * LSN, is the byte offset just past a record.
+ *
+ * A crash may leave a torn record at the end of the log. Opening a log
+ * reads it through and drops everything from the first record whose
+ * checksum does not match.
+ */
+class write_ahead_log {
+  public:
+    // The largest payload of a record.
+    static const uint32_t MAX_RECORD = (1 << 24) - 1;
+
+    // Appends are written out, without waiting for them to reach the disk,
+    // once this many bytes have gathered in memory.
+    static const size_t GROUP_BYTES = 1 << 20;
+
+  private:
+    // The file descriptor, or -1 while no log is open.
+    int _fd;
+
+    // The records appended but not yet written out.
+    std::vector<char> _buffer;
+
+    // The end of the records appended, of those written out, and of those
+    // known to be on disk.
+    uint64_t _appended;
+    uint64_t _written;
+    uint64_t _durable;
+
+    // Whether a thread is writing out the buffer, and whether a write has
+    // failed, after which every commit fails.
+    bool _writing;
+    bool _failed;
+
+    // Guards everything above but _fd, and wakes threads waiting for a
+    // write to finish.
+    std::mutex _mutex;
+    std::condition_variable _written_out;
+
+  public:
+    write_ahead_log();
+
+    /**
+     * Closes the log. Records not yet written out are lost.
+     */
+    ~write_ahead_log();
+
+    /**
+     * Opens the log at path, creating it empty if there is none, and cuts
+     * off any torn record at its end. Returns false if it cannot be opened
+     * or read.
+     */
+    bool open(const char* path);
+
+    /**
+     * Calls visit(lsn, type, data, length) for each record of the log as it
+     * was opened, in order, with lsn the position just past it. Returns
+     * false on a read error.
+     */
+    bool read(const std::function<void(uint64_t, uint32_t, const char*,
+          uint32_t)>& visit) const;
+
+    /**
+     * Appends a record of the given type, holding length bytes from data,
+     * and returns its LSN. The record is only sure to survive a crash once
+     * it has been committed.
+     */
+    uint64_t append(uint32_t type, const void* data, uint32_t length);
+
+    /**
+     * Returns the LSN of the last record appended.
+     */
+    uint64_t appended();
+
+    /**
+     * Waits until every record up to lsn is on disk, writing out the
+     * records gathered so far and syncing them unless another thread
+     * already is. Returns false if a write has failed.
+     */
+    bool commit(uint64_t lsn);
+
+    /**
+     * Empties the log, on disk as well. No append or commit may run
+     * alongside. Returns false on a write error.
+     */
+    bool reset();
+
+  private:
+    write_ahead_log(const write_ahead_log&);
+    write_ahead_log& operator=(const write_ahead_log&);
+
+    /**
+     * Writes out the buffer, and syncs the log if durable is set. The
+     * caller holds lock on _mutex and finds no other write under way; the
+     * lock is let go while writing.
+     */
+    bool write_out(std::unique_lock<std::mutex>& lock, bool durable);
+
+    /**
+     * Returns the checksum of a record header word and its payload.
+     */
+    static uint32_t checksum(uint32_t word, const char* data,
+        uint32_t length);
+};
+
+#endif // WRITE_AHEAD_LOG_H